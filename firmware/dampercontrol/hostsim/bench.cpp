@@ -0,0 +1,2343 @@
+/*
+ *  Damper Control Firmware - Host Simulator
+ *
+ *  Microbenchmarks and end-to-end latencies of the firmware logic.
+ *  Every benchmark runs in its own process on freshly booted nodes
+ *  and prints one JSON object per line.
+ *
+ *  This software is made with love
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <vector>
+#include <map>
+#include <set>
+#include <string>
+#include <algorithm>
+#include "sim.h"
+#include "Arduino.h"
+#include "mbedtls/sha256.h"
+#include "../src/dampercontrol.h"
+
+static uint32_t bench_seed_ = 1;
+static uint32_t bench_scale_ = 1;
+static const char *bench_only_ = 0;
+
+static uint64_t wall_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//boot nodes 0..num-1 with pjon ids 1..num, installed dampers given per node
+static void boot_ladder(uint8_t num, const uint8_t *installed)
+{
+  sim_init(bench_seed_);
+  for (uint8_t i=0; i<num; i++)
+  {
+    sim_preset_eeprom(i, i+1, installed[i]);
+    sim_boot(i);
+  }
+  //let every node home its dampers, so the benchmarks start from a settled state
+  sim_run(2000000);
+}
+
+//console command, sent like the host does it (see sim_host_write)
+static void console_cmd(uint8_t idx, char cmd)
+{
+  sim_host_write(idx, &cmd, 1);
+}
+
+//origin 0 lets the receiving node stamp the command as its own
+static uint8_t msg_dampercmd(uint8_t *buf, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t fan, uint8_t origin = 0, uint8_t seq = 0, uint8_t room = 0)
+{
+  pjon_message_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MSG_DAMPERCMD;
+  msg.chaincast.reach = 0;
+  msg.chaincast.origin = origin;
+  msg.chaincast.seq = seq;
+  msg.chaincast.dampercmd.damper[0] = d0;
+  msg.chaincast.dampercmd.damper[1] = d1;
+  msg.chaincast.dampercmd.damper[2] = d2;
+  msg.chaincast.dampercmd.fan = fan;
+  msg.chaincast.dampercmd.room = room;
+  uint8_t len = sizeof(dampercmd_t)+4;
+  memcpy(buf, &msg, len);
+  return len;
+}
+
+static uint8_t msg_pressureinfo(uint8_t *buf, uint8_t sensorid, float pascal)
+{
+  pjon_message_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MSG_PRESSUREINFO;
+  msg.pressureinfo.sensorid = sensorid;
+  msg.pressureinfo.pascal = pascal;
+  msg.pressureinfo.celsius = 21.0;
+  uint8_t len = sizeof(pressureinfo_t)+1;
+  memcpy(buf, &msg, len);
+  return len;
+}
+
+static uint8_t msg_error(uint8_t *buf, uint8_t damperid)
+{
+  pjon_message_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MSG_ERROR;
+  msg.errorinfo.damperid = damperid;
+  msg.errorinfo.errortype = DAMPER_CONTROL_TIMEOUT;
+  uint8_t len = sizeof(errorinfo_t)+1;
+  memcpy(buf, &msg, len);
+  return len;
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+  if (v.empty())
+    return 0.0;
+  std::vector<double> s(v);
+  std::sort(s.begin(), s.end());
+  size_t i = (size_t) (p * (s.size() - 1) + 0.5);
+  return s[i];
+}
+
+///////// handle_serialdata ///////////
+
+//random mix of what arrives over usb: injected PJON frames, local damper commands and line noise
+static std::vector<uint8_t> gen_serial_stream(size_t bytes)
+{
+  std::vector<uint8_t> s;
+  uint8_t buf[sizeof(pjon_message_t)];
+  while (s.size() < bytes)
+  {
+    uint32_t r = sim_rand() % 100;
+    if (r < 60)
+    {
+      uint8_t len = msg_dampercmd(buf, sim_rand()%3, sim_rand()%3, sim_rand()%3, sim_rand()%2);
+      s.push_back('>');
+      s.push_back(2 + sim_rand()%4); //not to ourselves
+      s.push_back(len);
+      s.insert(s.end(), buf, buf+len);
+    } else if (r < 80) {
+      s.push_back("och"[sim_rand()%3]);
+    } else {
+      s.push_back('a' + sim_rand()%8); //not a command
+    }
+  }
+  return s;
+}
+
+//chunk 1: handle_serialdata char by char, otherwise handle_serialdata_bulk with chunks like task_usbserial reads them
+static void bench_serial_parser(void *varg)
+{
+  uint16_t chunk = *(uint16_t*) varg;
+  const uint8_t installed[] = {7};
+  boot_ladder(1, installed);
+  SimNode *n = sim_node(0);
+  sim_select(n);
+  std::vector<uint8_t> stream = gen_serial_stream(1<<16);
+  uint32_t rounds = 32 * bench_scale_;
+  uint64_t bytes = 0;
+  uint64_t t0 = wall_ns();
+  for (uint32_t r=0; r<rounds; r++)
+  {
+    for (size_t i=0; i<stream.size(); i+=chunk)
+    {
+      if (chunk == 1)
+        n->api.serialdata(stream[i]);
+      else
+        n->api.serialdata_bulk(&stream[i], std::min((size_t) chunk, stream.size() - i));
+      if ((i & 0x3F) < chunk)
+        sim_pjon_drop_outbox(0);
+    }
+    bytes += stream.size();
+  }
+  uint64_t dt = wall_ns() - t0;
+  printf("{\"bench\":\"serial_parser\",\"chunk\":%u,\"seed\":%u,\"bytes\":%llu,\"ns_per_byte\":%.2f,\"mbyte_per_s\":%.3f}\n",
+    chunk, bench_seed_, (unsigned long long) bytes, (double) dt / bytes, bytes * 1000.0 / dt);
+}
+
+///////// pjon_recv_handler -> pjon_postrecv_handle_msg ///////////
+
+struct RecvBenchArg {
+  const char *name;
+  uint8_t type;
+};
+
+static void bench_recv_frame(void *varg)
+{
+  RecvBenchArg *arg = (RecvBenchArg*) varg;
+  const uint8_t installed[] = {7};
+  boot_ladder(1, installed);
+  SimNode *n = sim_node(0);
+  sim_select(n);
+  uint8_t buf[sizeof(pjon_message_t)];
+  uint32_t frames = 200000 * bench_scale_;
+  uint64_t t0 = wall_ns();
+  for (uint32_t f=0; f<frames; f++)
+  {
+    uint8_t len = 0;
+    switch (arg->type)
+    {
+      case MSG_DAMPERCMD: len = msg_dampercmd(buf, f%3, (f/3)%3, 0, f&1, 2, f+1); break; //every frame a newer command
+      case MSG_PRESSUREINFO: len = msg_pressureinfo(buf, f%3, 10000.0 + f%100); break;
+      case MSG_ERROR: len = msg_error(buf, f%3); break;
+    }
+    n->api.pjon_recv_handler(1, buf, len);
+    n->api.pjon_postrecv_handle_msg();
+    if ((f & 0x7) == 0)
+      sim_pjon_drop_outbox(0);
+  }
+  uint64_t dt = wall_ns() - t0;
+  printf("{\"bench\":\"recv_frame\",\"type\":\"%s\",\"seed\":%u,\"frames\":%u,\"ns_per_frame\":%.1f}\n",
+    arg->name, bench_seed_, frames, (double) dt / frames);
+}
+
+///////// pjon_chaincast_recv_handler ///////////
+
+static void bench_chaincast_handler(void *)
+{
+  const uint8_t installed[] = {1};
+  boot_ladder(1, installed);
+  SimNode *n = sim_node(0);
+  sim_select(n);
+  pjon_message_t msg;
+  uint32_t calls = 200000 * bench_scale_;
+  uint64_t t0 = wall_ns();
+  for (uint32_t c=0; c<calls; c++)
+  {
+    msg_dampercmd((uint8_t*) &msg, c%3, (c/3)%3, (c/9)%3, c&1, 2, (c>>1)+1);
+    msg.chaincast.reach = (c & 1) ? 7 : 0; //alternate up and down pass of the same command
+    n->api.pjon_chaincast_recv_handler(1, &msg);
+    if ((c & 0x7) == 0)
+      sim_pjon_drop_outbox(0);
+  }
+  uint64_t dt = wall_ns() - t0;
+  printf("{\"bench\":\"chaincast_handler\",\"seed\":%u,\"calls\":%u,\"ns_per_call\":%.1f}\n",
+    bench_seed_, calls, (double) dt / calls);
+}
+
+//a ladder of N µC: damper0 at the bottom, damper1 in the middle, damper2 at the top
+static void ladder_installed(uint8_t num, uint8_t *installed)
+{
+  memset(installed, 0, num);
+  installed[0] |= _BV(0);
+  installed[num/2] |= _BV(1);
+  installed[num-1] |= _BV(2);
+}
+
+static uint8_t ladder_num_;
+static uint8_t ladder_installed_[SIM_MAX_NODES];
+
+//airflow: the fan on the top µC runs and every installed damper on the ladder has reached its target
+static bool ladder_airflow()
+{
+  if (sim_node(ladder_num_-1)->pin_level[SIM_PIN_FAN] != 0)
+    return false;
+  for (uint8_t i=0; i<ladder_num_; i++)
+    for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+      if ((ladder_installed_[i] & _BV(d)) && sim_node(i)->api.damper_states[d] != sim_node(i)->api.damper_target_states[d])
+        return false;
+  return true;
+}
+
+static bool ladder_fans_off()
+{
+  return sim_node(ladder_num_-1)->pin_level[SIM_PIN_FAN] != 0;
+}
+
+static void bench_chaincast_ladder(void *varg)
+{
+  uint8_t num = *(uint8_t*) varg;
+  ladder_installed(num, ladder_installed_);
+  boot_ladder(num, ladder_installed_);
+  ladder_num_ = num;
+
+  std::vector<double> latency_ms;
+  uint64_t frames = 0;
+  uint32_t cmds = 20 * bench_scale_;
+  uint64_t t0 = wall_ns();
+  for (uint32_t c=0; c<cmds; c++)
+  {
+    //open one damper, fan on, then everything closed again
+    const char open_cmd = '1' + c%3;
+    uint64_t frames0 = sim_bus_stats.frames;
+    uint64_t start = sim_now_us;
+    console_cmd(0, open_cmd);
+    if (sim_run_until(ladder_airflow, 10000000))
+      latency_ms.push_back((sim_now_us - start) / 1000.0);
+    sim_run(500000); //let the chaincast finish its way down
+    frames += sim_bus_stats.frames - frames0;
+    console_cmd(0, '0');
+    sim_run_until(ladder_fans_off, 10000000);
+    sim_run(2000000);
+  }
+  uint64_t dt = wall_ns() - t0;
+  printf("{\"bench\":\"chaincast_ladder\",\"nodes\":%u,\"seed\":%u,\"cmds\":%u,\"completed\":%zu,\"frames_per_cmd\":%.1f,"
+         "\"cmd_to_airflow_ms_p50\":%.1f,\"cmd_to_airflow_ms_max\":%.1f,\"wall_ms\":%.1f}\n",
+    num, bench_seed_, cmds, latency_ms.size(), (double) frames / cmds,
+    percentile(latency_ms, 0.5), percentile(latency_ms, 1.0), dt / 1e6);
+}
+
+///////// chaincasts under frame loss ///////////
+
+struct LossBenchArg {
+  uint8_t num;
+  double loss;
+  uint32_t outage_ms;
+  bool from_top; //the host is on the top µC, the command first goes down to the bottom one
+};
+
+//does a command still make it through the whole ladder if frames and acks get lost, and how long does it take
+//outage_ms: a random µC of the ladder (not the host's) stops listening for that long, at a random time while the command travels
+static void bench_chaincast_loss(void *varg)
+{
+  LossBenchArg *arg = (LossBenchArg*) varg;
+  uint8_t num = arg->num;
+  uint8_t host = (arg->from_top) ? num-1 : 0;
+  ladder_installed(num, ladder_installed_);
+  boot_ladder(num, ladder_installed_);
+  ladder_num_ = num;
+  sim_bus.frame_loss = arg->loss;
+
+  std::vector<double> latency_ms;
+  uint64_t frames = 0;
+  uint64_t connection_lost = sim_bus_stats.connection_lost;
+  uint32_t cmds = 50 * bench_scale_;
+  for (uint32_t c=0; c<cmds; c++)
+  {
+    const char open_cmd = '1' + c%3;
+    uint64_t frames0 = sim_bus_stats.frames;
+    uint64_t start = sim_now_us;
+    console_cmd(host, open_cmd);
+    if (arg->outage_ms)
+      sim_node((host + 1 + sim_rand() % (num-1)) % num)->deaf_until_us = start + sim_rand() % 50000 + arg->outage_ms * 1000ull;
+    if (sim_run_until(ladder_airflow, 10000000))
+      latency_ms.push_back((sim_now_us - start) / 1000.0);
+    sim_run(1000000);
+    frames += sim_bus_stats.frames - frames0;
+    console_cmd(host, '0');
+    sim_run_until(ladder_fans_off, 10000000);
+    sim_run(2000000);
+  }
+  printf("{\"bench\":\"chaincast_loss\",\"nodes\":%u,\"loss\":%.2f,\"outage_ms\":%u,\"from\":\"%s\",\"seed\":%u,\"cmds\":%u,\"delivered\":%.3f,\"frames_per_cmd\":%.1f,"
+         "\"connection_lost\":%llu,\"cmd_to_airflow_ms_p50\":%.1f,\"cmd_to_airflow_ms_p99\":%.1f,\"cmd_to_airflow_ms_max\":%.1f}\n",
+    num, arg->loss, arg->outage_ms, (arg->from_top) ? "top" : "bottom", bench_seed_, cmds, (double) latency_ms.size() / cmds, (double) frames / cmds,
+    (unsigned long long) (sim_bus_stats.connection_lost - connection_lost),
+    percentile(latency_ms, 0.5), percentile(latency_ms, 0.99), percentile(latency_ms, 1.0));
+}
+
+///////// concurrent chaincasts ///////////
+
+struct ConcurrentBenchArg {
+  uint8_t num;
+  double loss;
+};
+
+//the two rooms at both ends of the ladder open "their" damper at nearly the same time,
+//afterwards every µC has to agree on exactly one of the two commands
+//lost acks make PJON repeat frames, which shows in frames_per_trial
+static void bench_chaincast_concurrent(void *varg)
+{
+  ConcurrentBenchArg *arg = (ConcurrentBenchArg*) varg;
+  uint8_t num = arg->num;
+  ladder_installed(num, ladder_installed_);
+  boot_ladder(num, ladder_installed_);
+  ladder_num_ = num;
+  sim_bus.frame_loss = arg->loss;
+
+  SimNode *bottom = sim_node(0);
+  SimNode *top = sim_node(num-1);
+  uint32_t trials = 50 * bench_scale_;
+  uint32_t consistent = 0;
+  uint64_t frames = 0;
+  for (uint32_t t=0; t<trials; t++)
+  {
+    uint64_t frames0 = sim_bus_stats.frames;
+    console_cmd(0, '1'); //damper0 open, others closed
+    sim_run(sim_rand() % 40000);
+    console_cmd(num-1, '3'); //damper2 open, others closed
+    sim_run(3000000);
+    frames += sim_bus_stats.frames - frames0;
+    bool d0_open = bottom->api.damper_target_states[0] != DAMPER_CLOSED;
+    bool d2_open = top->api.damper_target_states[2] != DAMPER_CLOSED;
+    if (d0_open != d2_open)
+      consistent++;
+    console_cmd(0, '0');
+    sim_run_until(ladder_fans_off, 10000000);
+    sim_run(2000000);
+  }
+  printf("{\"bench\":\"chaincast_concurrent\",\"nodes\":%u,\"loss\":%.2f,\"seed\":%u,\"trials\":%u,\"consistent\":%u,\"frames_per_trial\":%.1f}\n",
+    num, arg->loss, bench_seed_, trials, consistent, (double) frames / trials);
+}
+
+///////// a µC joins or reboots ///////////
+
+struct RejoinBenchArg {
+  uint8_t num;
+  uint32_t cmds_before;
+};
+
+//the ladder has sent cmds_before commands when a µC without dampers boots with a fresh chaincast clock
+//(like one that rebooted) and right away opens damper1: how long until the ladder has airflow
+static void bench_chaincast_rejoin(void *varg)
+{
+  RejoinBenchArg *arg = (RejoinBenchArg*) varg;
+  uint8_t num = arg->num;
+  ladder_installed(num-1, ladder_installed_);
+  boot_ladder(num-1, ladder_installed_);
+  ladder_num_ = num-1;
+
+  for (uint32_t c=0; c<arg->cmds_before; c++)
+  {
+    console_cmd(0, '1' + c%3);
+    sim_run_until(ladder_airflow, 10000000);
+    sim_run(500000);
+    console_cmd(0, '0');
+    sim_run_until(ladder_fans_off, 10000000);
+    sim_run(500000);
+  }
+  sim_preset_eeprom(num-1, num, 0);
+  sim_boot(num-1);
+  sim_run(100000);
+  uint64_t start = sim_now_us;
+  console_cmd(num-1, '2');
+  bool delivered = sim_run_until(ladder_airflow, 15000000);
+  printf("{\"bench\":\"chaincast_rejoin\",\"nodes\":%u,\"cmds_before\":%u,\"seed\":%u,\"delivered\":%u,\"cmd_to_airflow_ms\":%.1f}\n",
+    num, arg->cmds_before, bench_seed_, delivered ? 1 : 0, (sim_now_us - start) / 1000.0);
+}
+
+///////// task_control_dampers ///////////
+
+struct TickBenchArg {
+  const char *name;
+  bool moving;
+  bool startstop;
+};
+
+static void bench_control_dampers(void *varg)
+{
+  TickBenchArg *arg = (TickBenchArg*) varg;
+  const uint8_t installed[] = {7};
+  boot_ladder(1, installed);
+  SimNode *n = sim_node(0);
+  sim_select(n);
+  uint32_t ticks = 2000000 * bench_scale_;
+  uint64_t writes0 = n->gpio_writes;
+  uint64_t t0 = wall_ns();
+  for (uint32_t t=0; t<ticks; t++)
+  {
+    if (arg->moving)
+    {
+      //keep all three motors running without ever reaching the target
+      for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+        n->api.damper_target_states[d] = n->api.damper_states[d] + 2;
+    }
+    if (arg->startstop && (t & 1) == 0)
+    {
+      //all three motors start on even ticks, reach the target and stop on odd ticks
+      for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+        n->api.damper_target_states[d] = n->api.damper_states[d] + 1;
+    }
+    n->api.task_control_dampers();
+  }
+  uint64_t dt = wall_ns() - t0;
+  printf("{\"bench\":\"control_dampers_tick\",\"dampers\":\"%s\",\"seed\":%u,\"ticks\":%u,\"ns_per_tick\":%.1f,\"gpio_writes_per_tick\":%.2f}\n",
+    arg->name, bench_seed_, ticks, (double) dt / ticks, (double) (n->gpio_writes - writes0) / ticks);
+}
+
+///////// endstop flashes ///////////
+
+struct FlashBenchArg {
+  uint32_t flash_us;
+};
+
+static bool dampers_stopped()
+{
+  SimNode *n = sim_node(0);
+  for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+    if (n->pin_level[SIM_PIN_DAMPER_0 + d] == HIGH)
+      return false;
+  return true;
+}
+
+//where the disk really is compared to where the firmware thinks it is, in ticks
+static uint8_t damper_offset(SimNode *n, uint8_t d)
+{
+  return (n->damper[d].angle + SIM_DAMPER_HALFTURN_TICKS - n->api.damper_states[d] % SIM_DAMPER_HALFTURN_TICKS) % SIM_DAMPER_HALFTURN_TICKS;
+}
+
+//open and close all dampers while external light flashes into the endstop lightbeams of turning disks
+//like the ceiling light in 2019-04-06_debugging.txt, every flash taken as endstop leaves a damper off its position.
+//endstop_pcnt tells whether the firmware counts the edges with PCNT units or in the pinchange interrupt (bench-pinchange)
+static void bench_endstop_flash(void *varg)
+{
+  FlashBenchArg *arg = (FlashBenchArg*) varg;
+  const uint8_t installed[] = {7};
+  boot_ladder(1, installed);
+  SimNode *n = sim_node(0);
+  uint8_t offset0[SIM_NUM_DAMPER];
+  for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+    offset0[d] = damper_offset(n, d);
+
+  uint32_t moves = 200 * bench_scale_;
+  uint32_t flashes = 0, misplaced = 0;
+  for (uint32_t m=0; m<moves; m++)
+  {
+    console_cmd(0, (m & 1) ? 'c' : 'o');
+    sim_run(2 * SIM_TICK_US);
+    while (!dampers_stopped())
+    {
+      uint8_t d = sim_rand() % SIM_NUM_DAMPER;
+      if (arg->flash_us && sim_rand() % 100 == 0 && n->pin_level[SIM_PIN_DAMPER_0 + d] == HIGH && n->damper[d].endstop_level == HIGH)
+      {
+        sim_select(n);
+        if (sim_set_input(n, SIM_PIN_ENDSTOP_0 + d, LOW))
+          n->api.pinchange_isr();
+        sim_run(arg->flash_us);
+        sim_select(n);
+        if (sim_set_input(n, SIM_PIN_ENDSTOP_0 + d, n->damper[d].endstop_level))
+          n->api.pinchange_isr();
+        flashes++;
+      }
+      sim_run(1000);
+    }
+    for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+    {
+      uint8_t diff = (damper_offset(n, d) + SIM_DAMPER_HALFTURN_TICKS - offset0[d]) % SIM_DAMPER_HALFTURN_TICKS;
+      if (diff > 1 && diff < SIM_DAMPER_HALFTURN_TICKS - 1)
+        misplaced++;
+    }
+  }
+  printf("{\"bench\":\"endstop_flash\",\"endstop_pcnt\":%u,\"flash_us\":%u,\"seed\":%u,\"moves\":%u,\"flashes\":%u,\"misplaced\":%u}\n",
+    n->pcnt[0].pin >= 0, arg->flash_us, bench_seed_, moves * SIM_NUM_DAMPER, flashes, misplaced);
+}
+
+///////// light sleep ///////////
+
+//supply current of the esp32 module, datasheet typicals: cpu at 80MHz with radio off, and light sleep
+#define BENCH_AWAKE_MA 40.0
+#define BENCH_LIGHT_SLEEP_MA 0.8
+
+static uint64_t asleep_us(uint8_t num)
+{
+  uint64_t us = 0;
+  for (uint8_t i=0; i<num; i++)
+  {
+    SimNode *n = sim_node(i);
+    us += n->asleep_us + ((n->asleep && n->wake_at_us == 0) ? sim_now_us - n->slept_at_us : 0);
+  }
+  return us;
+}
+
+struct IdleBenchArg {
+  uint8_t nodes;
+  bool host_sleeps;  //the µC the host talks to sleeps too ('Z1'), the others always do
+};
+
+static void bench_idle_sleep(void *varg)
+{
+  IdleBenchArg *arg = (IdleBenchArg*) varg;
+  uint8_t num = arg->nodes;
+  ladder_installed(num, ladder_installed_);
+  sim_init(bench_seed_);
+  for (uint8_t i=0; i<num; i++)
+  {
+    sim_preset_eeprom(i, i+1, ladder_installed_[i]);
+    sim_preset_idle_sleep(i, i > 0 || arg->host_sleeps);
+    sim_boot(i);
+  }
+  sim_run(2000000);
+  ladder_num_ = num;
+
+  //idle: nothing moves, no frames
+  uint64_t idle_us = 10000000ull * bench_scale_;
+  uint64_t slept0 = asleep_us(num);
+  sim_run(idle_us);
+  double asleep = (double) (asleep_us(num) - slept0) / (idle_us * num);
+
+  //commands that find the ladder asleep
+  std::vector<double> latency_ms;
+  uint32_t cmds = 10 * bench_scale_;
+  uint64_t retries0 = sim_bus_stats.retries, acked0 = sim_bus_stats.acked, ack_us0 = sim_bus_stats.ack_us_sum;
+  uint64_t lost0 = sim_node(0)->serial_lost;
+  for (uint32_t c=0; c<cmds; c++)
+  {
+    uint64_t start = sim_now_us;
+    console_cmd(0, '1' + c%3);
+    if (sim_run_until(ladder_airflow, 10000000))
+      latency_ms.push_back((sim_now_us - start) / 1000.0);
+    sim_run(500000);
+    console_cmd(0, '0');
+    sim_run_until(ladder_fans_off, 10000000);
+    sim_run(3000000);
+  }
+  uint64_t acked = sim_bus_stats.acked - acked0;
+  printf("{\"bench\":\"idle_sleep\",\"idle_sleep\":%u,\"host_sleeps\":%s,\"nodes\":%u,\"seed\":%u,\"asleep\":%.4f,\"est_ma\":%.2f,"
+         "\"cmds\":%u,\"completed\":%zu,\"cmd_to_airflow_ms_p50\":%.1f,\"cmd_to_airflow_ms_max\":%.1f,"
+         "\"console_bytes_lost\":%llu,\"retries_per_cmd\":%.1f,\"ack_ms_mean\":%.2f,\"ack_ms_max\":%.2f}\n",
+    IDLE_SLEEP, arg->host_sleeps ? "true" : "false", num, bench_seed_, asleep, BENCH_AWAKE_MA * (1.0 - asleep) + BENCH_LIGHT_SLEEP_MA * asleep,
+    cmds, latency_ms.size(), percentile(latency_ms, 0.5), percentile(latency_ms, 1.0),
+    (unsigned long long) (sim_node(0)->serial_lost - lost0), (double) (sim_bus_stats.retries - retries0) / cmds,
+    (acked) ? (sim_bus_stats.ack_us_sum - ack_us0) / 1000.0 / acked : 0.0, sim_bus_stats.ack_us_max / 1000.0);
+}
+
+///////// firmware update over PJON ///////////
+
+struct FwupdateBenchArg {
+  double loss;
+  uint32_t outage_ms; //the target stops listening for this long when a third of the image is through
+  double console_drop; //share of the chunks that lose a byte on their way over the console
+  uint8_t host_stop; //when a third of the image is through the host 1: goes away, 2: aborts the update
+};
+
+static std::vector<uint8_t> fwupdate_image_;
+static double fwupdate_console_drop_;
+static uint32_t fwupdate_console_drops_;
+static bool fwupdate_host_gone_;
+static bool fwupdate_ended_; //the bridge printed that it gave up or aborted
+
+//the host side of fwupdate.cpp: answer every U<index> line of the bridge with that chunk
+static void fwupdate_host_pump(SimNode *bridge)
+{
+  std::vector<uint8_t> &out = bridge->serial_out;
+  size_t pos = 0;
+  for (size_t eol; (eol = std::find(out.begin() + pos, out.end(), '\n') - out.begin()) < out.size(); pos = eol + 1)
+  {
+    unsigned index;
+    char line[64] = {0};
+    memcpy(line, out.data() + pos, std::min(eol - pos, sizeof(line) - 1));
+    if (strncmp(line, "fwupdate: ", 10) == 0 && (strstr(line, "giving up") || strstr(line, "aborted")))
+      fwupdate_ended_ = true;
+    if (fwupdate_host_gone_ || sscanf(line, "U%4X", &index) != 1)
+      continue;
+    uint8_t buf[1 + FWUPDATE_CHUNK_FRAME_LEN];
+    buf[0] = 'u';
+    buf[1] = 2 + FWUPDATE_CHUNK_LEN;
+    buf[2] = index & 0xFF;
+    buf[3] = index >> 8;
+    memset(buf + 4, 0xFF, FWUPDATE_CHUNK_LEN);
+    size_t offset = (size_t) index * FWUPDATE_CHUNK_LEN;
+    if (offset < fwupdate_image_.size())
+      memcpy(buf + 4, fwupdate_image_.data() + offset, std::min((size_t) FWUPDATE_CHUNK_LEN, fwupdate_image_.size() - offset));
+    uint32_t crc = fwupdate_crc32(buf + 1, sizeof(buf) - 5);
+    memcpy(buf + sizeof(buf) - 4, &crc, 4);
+    size_t len = sizeof(buf);
+    if (fwupdate_console_drop_ > 0.0 && sim_rand_unit() < fwupdate_console_drop_)
+    {
+      size_t drop = sim_rand() % len;
+      memmove(buf + drop, buf + drop + 1, len - drop - 1);
+      len--;
+      fwupdate_console_drops_++;
+    }
+    sim_host_write(bridge->idx, (const char*) buf, len);
+  }
+  out.erase(out.begin(), out.begin() + pos);
+}
+
+//time on the wire per byte, with the strategy the firmware was built for (see sim_bus_byte_us)
+static double bench_byte_us()
+{
+  uint32_t baud = sim_node(0)->pjon->uart_baud;
+  return (baud) ? 1e7 / baud : sim_bus.byte_us;
+}
+
+//the host tells the bridge (µC 0) to update µC 1 with a random image of size bytes
+static void fwupdate_start(uint32_t size)
+{
+  SimNode *bridge = sim_node(0);
+  //random image, but with the magic byte esp_ota_end looks for
+  fwupdate_image_.resize(size);
+  for (size_t i=0; i<fwupdate_image_.size(); i++)
+    fwupdate_image_[i] = sim_rand();
+  fwupdate_image_[0] = 0xE9;
+  uint8_t cmd[1 + 1 + 4 + FWUPDATE_HASH_LEN] = {'U', 2};
+  memcpy(cmd + 2, &size, 4);
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, fwupdate_image_.data(), size);
+  mbedtls_sha256_finish(&sha, cmd + 6);
+
+  bridge->capture_output = true;
+  bridge->serial_out.clear();
+  sim_host_write(0, (const char*) cmd, sizeof(cmd));
+}
+
+static bool fwupdate_image_ok(SimNode *target)
+{
+  uint32_t size = fwupdate_image_.size();
+  return target->restarts > 0 && target->boot_partition == 1 && target->ota_written == size
+    && memcmp(target->ota_flash.data(), fwupdate_image_.data(), size) == 0;
+}
+
+static void bench_fwupdate(void *varg)
+{
+  FwupdateBenchArg *arg = (FwupdateBenchArg*) varg;
+  uint8_t installed[2] = {0x07, 0x07};
+  boot_ladder(2, installed);
+  sim_bus.frame_loss = arg->loss;
+  SimNode *bridge = sim_node(0), *target = sim_node(1);
+  fwupdate_console_drop_ = arg->console_drop;
+  fwupdate_console_drops_ = 0;
+  fwupdate_host_gone_ = false;
+  fwupdate_ended_ = false;
+
+  uint32_t size = 65536 * bench_scale_;
+  uint64_t frames0 = sim_bus_stats.frames, lost0 = sim_bus_stats.lost;
+  uint64_t start = sim_now_us;
+  fwupdate_start(size);
+  bool outage_done = arg->outage_ms == 0;
+  uint64_t stop_us = 0;
+  //about 1.5kB/s on a SoftwareBitBang bus, leave room for a lot of loss
+  uint64_t max_us = (uint64_t) size * 20000 + 60000000;
+  while (target->restarts == 0 && !fwupdate_ended_ && sim_now_us - start < max_us)
+  {
+    sim_run(1000);
+    fwupdate_host_pump(bridge);
+    if (!outage_done && target->ota_written >= size / 3)
+    {
+      target->deaf_until_us = sim_now_us + arg->outage_ms * 1000ull;
+      outage_done = true;
+    }
+    if (arg->host_stop && !stop_us && target->ota_written >= size / 3)
+    {
+      stop_us = sim_now_us;
+      fwupdate_host_gone_ = true;
+      if (arg->host_stop == 2)
+      {
+        char cans[FWUPDATE_ABORT_LEN];
+        memset(cans, FWUPDATE_ABORT_CHAR, sizeof(cans));
+        sim_host_write(0, cans, sizeof(cans));
+      }
+    }
+  }
+  double secs = (sim_now_us - start) / 1e6;
+  double stopped_s = (stop_us) ? (sim_now_us - stop_us) / 1e6 : 0.0;
+  //a garbled chunk must not turn into console commands, damper targets would move or the bridge restart
+  bool bridge_quiet = bridge->restarts == 0;
+  for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+    bridge_quiet = bridge_quiet && bridge->api.damper_target_states[d] == 0;
+  //once the bridge is done with the update, the console takes commands again
+  bool console_back = false;
+  if (fwupdate_ended_)
+  {
+    console_cmd(0, 'o');
+    sim_run(100000);
+    console_back = bridge->api.damper_target_states[0] != 0;
+  }
+  bool done = target->restarts > 0;
+  bool image_ok = fwupdate_image_ok(target);
+  //a chunk frame on the wire: payload plus PJON overhead, nothing else on the bus
+  double bus_max = FWUPDATE_CHUNK_LEN * 1e6 / ((sizeof(fwupdatechunk_t) + 1 + sim_bus.overhead_bytes) * bench_byte_us());
+  static const char *host_stops[] = {"none", "gone", "abort"};
+  printf("{\"bench\":\"fwupdate\",\"loss\":%.2f,\"outage_ms\":%u,\"console_drop\":%.2f,\"host_stop\":\"%s\",\"seed\":%u,\"bytes\":%u,"
+         "\"done\":%s,\"image_ok\":%s,\"console_drops\":%u,\"bridge_quiet\":%s,\"stopped_after_s\":%.1f,\"console_back\":%s,"
+         "\"virtual_s\":%.1f,\"bytes_per_s\":%.0f,\"of_bus_max\":%.2f,\"frames\":%llu,\"lost\":%llu}\n",
+    arg->loss, arg->outage_ms, arg->console_drop, host_stops[arg->host_stop], bench_seed_, size, done?"true":"false", image_ok?"true":"false",
+    fwupdate_console_drops_, bridge_quiet?"true":"false", stopped_s,
+    (!arg->host_stop || console_back) ? "true" : "false",
+    secs, (done) ? size / secs : 0.0, (done) ? size / secs / bus_max : 0.0,
+    (unsigned long long) (sim_bus_stats.frames - frames0), (unsigned long long) (sim_bus_stats.lost - lost0));
+}
+
+///////// site config deltas ///////////
+
+struct ConfigBenchArg {
+  uint8_t num;
+  double loss;
+};
+
+//the host side of Site Config in settings.cpp: the site config of every µC, its version and hash
+static std::vector<nodeconfig_t> config_site_;
+static uint16_t config_version_site_;
+static uint32_t config_hash_site_;
+static preset_t config_presets_[PRESETS_NUM];
+static uint64_t config_deltas_;
+
+static uint32_t config_site_hash()
+{
+  //FNV-1a over version and table, any hash will do as long as it is never CONFIG_HASH_ANY
+  uint32_t h = 2166136261u;
+  const uint8_t *v = (const uint8_t*) &config_version_site_;
+  for (size_t i=0; i<sizeof(config_version_site_); i++)
+    h = (h ^ v[i]) * 16777619u;
+  const uint8_t *t = (const uint8_t*) config_site_.data();
+  for (size_t i=0; i<config_site_.size() * sizeof(nodeconfig_t); i++)
+    h = (h ^ t[i]) * 16777619u;
+  return (h == CONFIG_HASH_ANY) ? 1 : h;
+}
+
+//chaincast one delta from the bridge and collect the reports of the µC up to top,
+//returns the pjon ids of those that are not on the new version
+static std::vector<uint8_t> config_send_delta(uint32_t base_hash, const std::vector<configchange_t> &changes, uint8_t top)
+{
+  pjon_message_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MSG_CONFIGDELTA;
+  msg.chaincast.configdelta.version = config_version_site_;
+  msg.chaincast.configdelta.base_hash = base_hash;
+  msg.chaincast.configdelta.hash = config_hash_site_;
+  msg.chaincast.configdelta.top = top;
+  msg.chaincast.configdelta.count = changes.size();
+  memcpy(msg.chaincast.configdelta.changes, changes.data(), changes.size() * sizeof(configchange_t));
+  char buf[3 + sizeof(pjon_message_t)] = {'>', 1, (char) (sizeof(configdelta_t)+4)};
+  memcpy(buf + 3, &msg, sizeof(configdelta_t)+4);
+  SimNode *bridge = sim_node(0);
+  bridge->serial_out.clear();
+  sim_host_write(0, buf, 3 + sizeof(configdelta_t)+4);
+  config_deltas_++;
+
+  std::vector<bool> reported(top + 1, false);
+  std::vector<uint8_t> behind;
+  uint64_t deadline = sim_now_us + 10000000;
+  uint8_t num_reported = 0;
+  while (num_reported < top && sim_now_us < deadline)
+  {
+    sim_run(1000);
+    //reports are printed by the bridge like every frame it gets: <IDLLPAYLOAD
+    std::vector<uint8_t> &out = bridge->serial_out;
+    size_t pos = 0;
+    for (size_t eol; (eol = std::find(out.begin() + pos, out.end(), '\n') - out.begin()) < out.size(); pos = eol + 1)
+    {
+      unsigned id, len, type, b;
+      if (sscanf((const char*) out.data() + pos, "<%2x%2x%2x", &id, &len, &type) != 3
+          || type != MSG_CONFIGREPORT || len != sizeof(configreport_t)+1)
+        continue;
+      configreport_t r;
+      for (size_t i=0; i<sizeof(r); i++)
+      {
+        sscanf((const char*) out.data() + pos + 7 + 2*i, "%2x", &b);
+        ((uint8_t*) &r)[i] = b;
+      }
+      if (r.pjon_id == 0 || r.pjon_id > top || reported[r.pjon_id])
+        continue;
+      reported[r.pjon_id] = true;
+      num_reported++;
+      //the µC hashes what it has, so this also finds one that changed without a new version
+      if (r.hash != config_node_hash(&config_site_[r.pjon_id-1], config_presets_) || r.version != config_version_site_)
+        behind.push_back(r.pjon_id);
+    }
+    out.erase(out.begin(), out.begin() + pos);
+  }
+  for (uint8_t id=1; id<=top; id++)
+    if (!reported[id])
+      behind.push_back(id);
+  return behind;
+}
+
+//set every field of one µC, whatever it has now
+static std::vector<configchange_t> config_full_changes(uint8_t pjon_id)
+{
+  std::vector<configchange_t> changes;
+  for (uint8_t f=0; f<sizeof(nodeconfig_t); f++)
+    changes.push_back(configchange_t{pjon_id, f, ((uint8_t*) &config_site_[pjon_id-1])[f]});
+  return changes;
+}
+
+//move the site to a new config: deltas of up to CONFIGDELTA_MAX_CHANGES, one version each,
+//then resync the µC that did not follow until all are on the last version. Returns false if that failed
+static bool config_push(const std::vector<nodeconfig_t> &next)
+{
+  uint8_t top = next.size();
+  std::vector<configchange_t> changes;
+  for (uint8_t id=1; id<=top; id++)
+    for (uint8_t f=0; f<sizeof(nodeconfig_t); f++)
+      if (((const uint8_t*) &next[id-1])[f] != ((uint8_t*) &config_site_[id-1])[f])
+        changes.push_back(configchange_t{id, f, ((const uint8_t*) &next[id-1])[f]});
+
+  std::vector<uint8_t> behind;
+  if (config_hash_site_ == CONFIG_HASH_ANY)
+  {
+    //no site config yet, every µC gets all its fields
+    config_site_ = next;
+    config_version_site_++;
+    config_hash_site_ = config_site_hash();
+    for (uint8_t id=1; id<=top; id++)
+      behind.push_back(id);
+    changes.clear();
+  }
+  for (size_t c=0; c<changes.size(); c+=CONFIGDELTA_MAX_CHANGES)
+  {
+    std::vector<configchange_t> part(changes.begin() + c, changes.begin() + std::min(changes.size(), c + CONFIGDELTA_MAX_CHANGES));
+    for (const configchange_t &ch : part)
+      ((uint8_t*) &config_site_[ch.pjon_id-1])[ch.field] = ch.value;
+    uint32_t base_hash = config_hash_site_;
+    config_version_site_++;
+    config_hash_site_ = config_site_hash();
+    behind = config_send_delta(base_hash, part, top);
+  }
+  for (uint32_t round=0; round<10 && !behind.empty(); round++)
+  {
+    std::vector<uint8_t> again;
+    for (uint8_t id : behind)
+    {
+      std::vector<uint8_t> b = config_send_delta(CONFIG_HASH_ANY, config_full_changes(id), top);
+      if (std::find(b.begin(), b.end(), id) != b.end())
+        again.push_back(id);
+    }
+    behind = again;
+  }
+  return behind.empty();
+}
+
+static bool config_nodes_match()
+{
+  for (uint8_t i=0; i<config_site_.size(); i++)
+    for (uint8_t d=0; d<NUM_DAMPER; d++)
+      if (sim_node(i)->api.damper_open_pos[d] != config_site_[i].damper_open_pos[d])
+        return false;
+  return true;
+}
+
+static void bench_config_delta(void *varg)
+{
+  ConfigBenchArg *arg = (ConfigBenchArg*) varg;
+  ladder_installed(arg->num, ladder_installed_);
+  boot_ladder(arg->num, ladder_installed_);
+  ladder_num_ = arg->num;
+  sim_bus.frame_loss = arg->loss;
+  sim_node(0)->capture_output = true;
+
+  //what the µC were set up with by hand: no site config yet
+  config_site_.assign(arg->num, nodeconfig_t{0, {80, 80, 80}, 0});
+  for (uint8_t i=0; i<arg->num; i++)
+    config_site_[i].installed = ladder_installed_[i];
+  config_version_site_ = 0;
+  config_hash_site_ = CONFIG_HASH_ANY;
+  presets_fill_defaults(config_presets_);
+
+  struct Step {
+    const char *name;
+    bool ok;
+    uint64_t deltas, frames;
+    double ms;
+  } steps[4];
+  std::vector<nodeconfig_t> next;
+  for (uint8_t s=0; s<4; s++)
+  {
+    next = config_site_;
+    if (s == 0)
+    {
+      //first site config, the µC were set up by hand
+      steps[s].name = "initial";
+      for (nodeconfig_t &c : next)
+        c.sensor_destination_id = 1;
+    } else if (s == 1) {
+      //site wide change: a new open position for damper 0 everywhere
+      steps[s].name = "sitewide";
+      for (nodeconfig_t &c : next)
+        c.damper_open_pos[0] = 90;
+    } else if (s == 2) {
+      //one µC got its installed dampers set by hand before the next change
+      steps[s].name = "handset";
+      const char handset[2] = {'I', (char) ('0' + ladder_installed_[arg->num / 2])};
+      sim_host_write(arg->num / 2, handset, sizeof(handset));
+      sim_run(100000);
+      for (nodeconfig_t &c : next)
+        c.damper_open_pos[1] = 70;
+    } else {
+      //one µC lost an open position but kept its version, only its report tells
+      steps[s].name = "drifted";
+      sim_node(arg->num / 2)->api.damper_open_pos[2] = 60;
+      for (nodeconfig_t &c : next)
+        c.sensor_destination_id = 0;
+    }
+    uint64_t frames0 = sim_bus_stats.frames, deltas0 = config_deltas_;
+    uint64_t start = sim_now_us;
+    steps[s].ok = config_push(next) && config_nodes_match();
+    steps[s].ms = (sim_now_us - start) / 1000.0;
+    steps[s].frames = sim_bus_stats.frames - frames0;
+    steps[s].deltas = config_deltas_ - deltas0;
+    sim_run(2000000);
+  }
+  printf("{\"bench\":\"config_delta\",\"nodes\":%u,\"loss\":%.2f,\"seed\":%u", arg->num, arg->loss, bench_seed_);
+  for (uint8_t s=0; s<4; s++)
+    printf(",\"%s\":{\"ok\":%s,\"deltas\":%llu,\"frames\":%llu,\"ms\":%.1f}", steps[s].name, steps[s].ok?"true":"false",
+      (unsigned long long) steps[s].deltas, (unsigned long long) steps[s].frames, steps[s].ms);
+  printf("}\n");
+}
+
+///////// pressure history ///////////
+
+struct HistorySlot {
+  bool valid;
+  int32_t min, avg, max;
+};
+
+static uint64_t history_frames_, history_slots_, history_data_bytes_;
+
+static uint32_t history_get_varint(const uint8_t *buf, uint8_t len, uint8_t *pos)
+{
+  uint32_t v = 0;
+  for (uint8_t shift=0; *pos < len; shift+=7)
+  {
+    uint8_t b = buf[(*pos)++];
+    v |= (uint32_t) (b & 0x7F) << shift;
+    if (!(b & 0x80))
+      break;
+  }
+  return v;
+}
+
+//the host side of history.cpp: ask µC toid through the bridge, decode the blocks until the empty one
+static std::map<uint32_t, HistorySlot> history_query(uint8_t toid, uint8_t sensorid, uint8_t tier, uint32_t from, uint16_t count)
+{
+  pjon_message_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MSG_HISTORY_REQUEST;
+  msg.historyrequest.reply_to = 1;
+  msg.historyrequest.sensorid = sensorid;
+  msg.historyrequest.tier = tier;
+  msg.historyrequest.from = from;
+  msg.historyrequest.count = count;
+  char buf[3 + sizeof(historyrequest_t)+1] = {'>', (char) toid, (char) (sizeof(historyrequest_t)+1)};
+  memcpy(buf + 3, &msg, sizeof(historyrequest_t)+1);
+  SimNode *bridge = sim_node(0);
+  bridge->capture_output = true;
+  bridge->serial_out.clear();
+  sim_host_write(0, buf, sizeof(buf));
+
+  std::map<uint32_t, HistorySlot> slots;
+  uint64_t deadline = sim_now_us + 120000000;
+  bool done = false;
+  while (!done && sim_now_us < deadline)
+  {
+    sim_run(1000);
+    std::vector<uint8_t> &out = bridge->serial_out;
+    size_t pos = 0;
+    for (size_t eol; (eol = std::find(out.begin() + pos, out.end(), '\n') - out.begin()) < out.size(); pos = eol + 1)
+    {
+      unsigned id, len, type, b;
+      if (sscanf((const char*) out.data() + pos, "<%2x%2x%2x", &id, &len, &type) != 3
+          || type != MSG_HISTORY_BLOCK || len != sizeof(historyblock_t)+1)
+        continue;
+      historyblock_t blk;
+      for (size_t i=0; i<sizeof(blk); i++)
+      {
+        sscanf((const char*) out.data() + pos + 7 + 2*i, "%2x", &b);
+        ((uint8_t*) &blk)[i] = b;
+      }
+      history_frames_++;
+      if (blk.count == 0)
+      {
+        done = true;
+        break;
+      }
+      history_data_bytes_ += blk.len;
+      history_slots_ += blk.count;
+      int32_t prev = 0;
+      uint8_t p = 0;
+      for (uint32_t i=0; i<blk.count; i++)
+      {
+        HistorySlot slot = {false, 0, 0, 0};
+        uint32_t u = history_get_varint(blk.data, blk.len, &p);
+        if (!(u & 1))
+        {
+          u >>= 1;
+          slot.valid = true;
+          slot.avg = prev + (int32_t) ((u >> 1) ^ -(u & 1));
+          slot.min = slot.max = slot.avg;
+          prev = slot.avg;
+          if (tier != HISTORY_RAW)
+          {
+            slot.min = slot.avg - (int32_t) history_get_varint(blk.data, blk.len, &p);
+            slot.max = slot.avg + (int32_t) history_get_varint(blk.data, blk.len, &p);
+          }
+        }
+        slots[blk.first + i] = slot;
+      }
+    }
+    out.erase(out.begin(), out.begin() + pos);
+  }
+  return slots;
+}
+
+//a µC with a pressure sensor runs for two hours, then the host, which missed all of it,
+//backfills the last 10 minutes of raw seconds and everything of the minute and quarter hour tiers.
+//The sensor is the only thing that changes, once a second, so every raw slot holds exactly one value
+static void bench_history(void *varg)
+{
+  (void) varg;
+  ladder_installed(2, ladder_installed_);
+  boot_ladder(2, ladder_installed_);
+  ladder_num_ = 2;
+  SimNode *n = sim_node(1);
+
+  //pressure in 0.1Pa: a slow random walk with a step every 10 minutes when dampers move, and the sensor gone for a minute
+  uint32_t first_s = sim_now_us / 1000000 + 1;
+  uint32_t secs = 7200 * bench_scale_;
+  std::map<uint32_t, int32_t> truth;
+  int32_t v = 980000;
+  sim_run((uint64_t) first_s * 1000000 - sim_now_us);
+  for (uint32_t s=first_s; s<first_s+secs; s++)
+  {
+    v += (int32_t) (sim_rand() % 7) - 3;
+    if (s % 600 == 0)
+      v += (sim_rand() % 2) ? 400 : -400;
+    bool gone = (s - first_s) >= 4000 && (s - first_s) < 4060;
+    n->sensor_installed[0] = !gone;
+    n->sensor_pascal[0] = v / 10.0f;
+    if (!gone)
+      truth[s] = v;
+    sim_run(1000000);
+  }
+  uint32_t now_s = sim_now_us / 1000000;
+
+  struct Query {
+    const char *name;
+    uint8_t tier;
+    uint32_t period_s, from;
+    uint16_t count;
+  } queries[] = {
+    {"raw_10min", HISTORY_RAW, 1, now_s - 600, 600},
+    {"minute_all", HISTORY_MINUTE, 60, 0, 0},
+    {"quarter_all", HISTORY_QUARTER, 900, 0, 0},
+  };
+  printf("{\"bench\":\"history\",\"seed\":%u,\"history_s\":%u", bench_seed_, secs);
+  for (const Query &q : queries)
+  {
+    history_frames_ = history_slots_ = history_data_bytes_ = 0;
+    uint64_t frames0 = sim_bus_stats.frames, start = sim_now_us;
+    std::map<uint32_t, HistorySlot> slots = history_query(2, 0, q.tier, q.from, q.count);
+    double ms = (sim_now_us - start) / 1000.0;
+    //compare with the seconds each slot covers: min and max exact, avg within rounding of the reading counts
+    uint32_t exact = 0, valid = 0;
+    double avg_err_max = 0.0;
+    for (auto &it : slots)
+    {
+      int32_t mn = INT32_MAX, mx = INT32_MIN;
+      double sum = 0.0;
+      uint32_t num = 0;
+      for (uint32_t s=it.first*q.period_s; s<(it.first+1)*q.period_s; s++)
+      {
+        auto t = truth.find(s);
+        if (t == truth.end())
+          continue;
+        mn = std::min(mn, t->second);
+        mx = std::max(mx, t->second);
+        sum += t->second;
+        num++;
+      }
+      if (!it.second.valid)
+      {
+        exact += (num == 0);
+        continue;
+      }
+      valid++;
+      avg_err_max = std::max(avg_err_max, fabs(it.second.avg - sum / num) / 10.0);
+      exact += (num > 0 && it.second.min == mn && it.second.max == mx);
+    }
+    size_t plain = slots.size() * sizeof(int32_t) * ((q.tier == HISTORY_RAW) ? 1 : 3);
+    printf(",\"%s\":{\"slots\":%zu,\"valid\":%u,\"exact\":%u,\"avg_err_pa\":%.2f,\"bytes_per_slot\":%.2f,\"of_plain\":%.2f,"
+           "\"blocks\":%llu,\"frames\":%llu,\"ms\":%.1f}",
+      q.name, slots.size(), valid, exact, avg_err_max, (double) history_data_bytes_ / std::max<size_t>(1, slots.size()),
+      (double) history_data_bytes_ / std::max<size_t>(1, plain), (unsigned long long) history_frames_,
+      (unsigned long long) (sim_bus_stats.frames - frames0), ms);
+  }
+
+  //a command while the µC backfills: the blocks leave room for it
+  std::vector<double> latency_ms;
+  for (uint8_t backfill=0; backfill<2; backfill++)
+  {
+    if (backfill)
+    {
+      uint8_t buf[3 + sizeof(historyrequest_t)+1] = {'>', 2, sizeof(historyrequest_t)+1, MSG_HISTORY_REQUEST, 1, 0, HISTORY_RAW};
+      sim_host_write(0, (const char*) buf, sizeof(buf)); //from 0, count 0: all of it
+      sim_run(200000);
+    }
+    uint64_t start = sim_now_us;
+    console_cmd(0, '7');
+    latency_ms.push_back(sim_run_until(ladder_airflow, 20000000) ? (sim_now_us - start) / 1000.0 : -1.0);
+    console_cmd(0, '0');
+    sim_run_until(ladder_fans_off, 20000000);
+    sim_run(60000000);
+  }
+  printf(",\"cmd_to_airflow_ms\":%.1f,\"cmd_to_airflow_ms_backfilling\":%.1f}\n", latency_ms[0], latency_ms[1]);
+}
+
+///////// time sync ///////////
+
+struct TimesyncBenchArg {
+  double loss;
+  int32_t skew_ppm; //every node's crystal is off by up to this much
+};
+
+//what the master's micros() reads right now, without the blocking send it may be in
+static uint32_t timesync_master_us(SimNode *m)
+{
+  return (uint32_t) (m->clock_offset_us + sim_now_us + (int64_t) sim_now_us * m->clock_ppm / 1000000);
+}
+
+static void bench_timesync(void *varg)
+{
+  TimesyncBenchArg *arg = (TimesyncBenchArg*) varg;
+  uint8_t num = sim_num_nodes();
+  ladder_installed(num, ladder_installed_);
+  sim_init(bench_seed_);
+  for (uint8_t i=0; i<num; i++)
+  {
+    SimNode *n = sim_node(i);
+    //clocks start anywhere, some of them wrap around during the run
+    n->clock_offset_us = sim_rand();
+    n->clock_ppm = (arg->skew_ppm) ? (int32_t) (sim_rand() % (2 * arg->skew_ppm + 1)) - arg->skew_ppm : 0;
+    sim_preset_eeprom(i, i+1, ladder_installed_[i]);
+    sim_boot(i);
+  }
+  sim_bus.frame_loss = arg->loss;
+  //the estimate needs a few beacons to settle
+  sim_run(120000000);
+
+  std::vector<double> err_us;
+  uint64_t samples = 0, unsynced = 0;
+  uint64_t frames0 = sim_bus_stats.frames, slept0 = asleep_us(num);
+  uint64_t run_us = 600000000ull * bench_scale_;
+  uint64_t end = sim_now_us + run_us;
+  while (sim_now_us < end)
+  {
+    sim_run(100000 + sim_rand() % 1000);
+    uint32_t master_us = timesync_master_us(sim_node(0));
+    for (uint8_t i=1; i<num; i++)
+    {
+      SimNode *n = sim_node(i);
+      sim_select(n);
+      uint32_t bus_us = n->api.bus_us();
+      samples++;
+      if (bus_us == 0)
+        unsynced++;
+      else
+        err_us.push_back(abs((int32_t) (bus_us - master_us)));
+    }
+  }
+  printf("{\"bench\":\"timesync\",\"nodes\":%u,\"loss\":%.2f,\"skew_ppm\":%d,\"seed\":%u,\"samples\":%llu,\"unsynced\":%llu,"
+         "\"err_us_p50\":%.0f,\"err_us_p99\":%.0f,\"err_us_max\":%.0f,\"frames_per_min\":%.1f,\"asleep\":%.4f}\n",
+    num, arg->loss, arg->skew_ppm, bench_seed_, (unsigned long long) samples, (unsigned long long) unsynced,
+    percentile(err_us, 0.5), percentile(err_us, 0.99), percentile(err_us, 1.0),
+    (sim_bus_stats.frames - frames0) * 60e6 / run_us, (double) (asleep_us(num) - slept0) / (run_us * num));
+}
+
+///////// link stats ///////////
+
+struct LinkBenchArg {
+  uint8_t degraded; // index of the µC with the bad cable, 0: none
+  double link_loss;
+};
+
+//what a reporter knows about one peer: the chaincast hops it sent there
+struct LinkSum {
+  uint32_t sent, retries, lost, heard, acks, slow;
+  uint16_t rtt_hist[LINKSTATS_RTT_BUCKETS];
+};
+
+//a link is bad if this many of a hundred hops needed a retry of some kind
+#define LINKBENCH_BAD_PERCENT 5
+
+static uint64_t linkstats_frames_;
+
+//the host side of linkstats.cpp: ask µC toid through the bridge, keep what it says about every peer
+static void linkstats_query(uint8_t toid, std::map<std::pair<uint8_t, uint8_t>, LinkSum> &links)
+{
+  pjon_message_t msg;
+  msg.type = MSG_LINKSTATS_REQUEST;
+  msg.linkstatsrequest.reply_to = 1;
+  msg.linkstatsrequest.peer = 0;
+  char buf[3 + sizeof(linkstatsrequest_t)+1] = {'>', (char) toid, (char) (sizeof(linkstatsrequest_t)+1)};
+  memcpy(buf + 3, &msg, sizeof(linkstatsrequest_t)+1);
+  SimNode *bridge = sim_node(0);
+  bridge->capture_output = true;
+  bridge->serial_out.clear();
+  sim_host_write(0, buf, sizeof(buf));
+  sim_run(3000000);
+
+  std::vector<uint8_t> &out = bridge->serial_out;
+  size_t pos = 0;
+  for (size_t eol; (eol = std::find(out.begin() + pos, out.end(), '\n') - out.begin()) < out.size(); pos = eol + 1)
+  {
+    unsigned id, len, type, b;
+    if (sscanf((const char*) out.data() + pos, "<%2x%2x%2x", &id, &len, &type) != 3
+        || type != MSG_LINKSTATS || len != sizeof(linkstats_t)+1)
+      continue;
+    linkstats_t ls;
+    for (size_t i=0; i<sizeof(ls); i++)
+    {
+      sscanf((const char*) out.data() + pos + 7 + 2*i, "%2x", &b);
+      ((uint8_t*) &ls)[i] = b;
+    }
+    linkstats_frames_++;
+    //a frame whose ack got lost arrives twice, the copies are the same
+    LinkSum &sum = links[std::make_pair(ls.pjon_id, ls.peer)];
+    sum.sent = ls.sent;
+    sum.retries = ls.retries;
+    sum.lost = ls.lost;
+    sum.heard = ls.heard;
+    memcpy(sum.rtt_hist, ls.rtt_hist, sizeof(sum.rtt_hist));
+  }
+  out.clear();
+}
+
+//how long a hop takes depends on the bus (SoftwareBitBang or a uart) and the loop, not on the link:
+//an ack in a slower bucket than the one most acks of the whole ladder are in means PJON had to try again
+static void linkstats_count_slow(std::map<std::pair<uint8_t, uint8_t>, LinkSum> &links)
+{
+  uint32_t ladder_hist[LINKSTATS_RTT_BUCKETS] = {0};
+  for (std::map<std::pair<uint8_t, uint8_t>, LinkSum>::iterator it = links.begin(); it != links.end(); ++it)
+    for (uint8_t k=0; k<LINKSTATS_RTT_BUCKETS; k++)
+      ladder_hist[k] += it->second.rtt_hist[k];
+  uint8_t usual = std::max_element(ladder_hist, ladder_hist + LINKSTATS_RTT_BUCKETS) - ladder_hist;
+  for (std::map<std::pair<uint8_t, uint8_t>, LinkSum>::iterator it = links.begin(); it != links.end(); ++it)
+  {
+    LinkSum &sum = it->second;
+    sum.acks = sum.slow = 0;
+    for (uint8_t k=0; k<LINKSTATS_RTT_BUCKETS; k++)
+    {
+      sum.acks += sum.rtt_hist[k];
+      if (k > usual)
+        sum.slow += sum.rtt_hist[k];
+    }
+  }
+}
+
+//share of the hops on a link that needed a retry of some kind
+static double linkstats_trouble(const LinkSum &sum)
+{
+  uint32_t hops = sum.acks + sum.lost;
+  return (hops) ? (double) (sum.slow + sum.retries + sum.lost) / hops : 0.0;
+}
+
+static bool linkstats_bad(const LinkSum &sum)
+{
+  uint32_t hops = sum.acks + sum.lost;
+  return hops && (sum.slow + sum.retries + sum.lost) * 100 >= hops * LINKBENCH_BAD_PERCENT;
+}
+
+//one µC of a 4 node ladder sits on a bad cable, commands still get through thanks to the retries.
+//Can the host tell which one it is from the link stats of all µC?
+//A bad cable spoils every link of its µC, whichever end reports it, so the host blames the µC with the most bad links.
+static void bench_linkstats(void *varg)
+{
+  LinkBenchArg *arg = (LinkBenchArg*) varg;
+  uint8_t num = 4;
+  ladder_installed(num, ladder_installed_);
+  boot_ladder(num, ladder_installed_);
+  ladder_num_ = num;
+  if (arg->degraded)
+    sim_node(arg->degraded)->link_loss = arg->link_loss;
+
+  uint32_t cmds = 30 * bench_scale_, completed = 0;
+  for (uint32_t c=0; c<cmds; c++)
+  {
+    console_cmd(0, '1' + c%3);
+    completed += sim_run_until(ladder_airflow, 10000000);
+    sim_run(1000000);
+    console_cmd(0, '0');
+    sim_run_until(ladder_fans_off, 10000000);
+    sim_run(2000000);
+  }
+
+  std::map<std::pair<uint8_t, uint8_t>, LinkSum> links;
+  uint64_t frames0 = sim_bus_stats.frames;
+  for (uint8_t i=0; i<num; i++)
+    linkstats_query(i+1, links);
+  uint64_t query_frames = sim_bus_stats.frames - frames0;
+  linkstats_count_slow(links);
+
+  uint32_t bad_links[256] = {0};
+  double trouble[256] = {0};
+  uint32_t slow_total = 0, acks_total = 0;
+  std::string out;
+  for (std::map<std::pair<uint8_t, uint8_t>, LinkSum>::iterator it = links.begin(); it != links.end(); ++it)
+  {
+    const LinkSum &sum = it->second;
+    if (!sum.sent)
+      continue;
+    bool bad = linkstats_bad(sum);
+    if (bad)
+    {
+      bad_links[it->first.first]++;
+      bad_links[it->first.second]++;
+    }
+    trouble[it->first.first] += linkstats_trouble(sum);
+    trouble[it->first.second] += linkstats_trouble(sum);
+    slow_total += sum.slow;
+    acks_total += sum.acks;
+    char buf[160];
+    snprintf(buf, sizeof(buf), "%s{\"from\":%u,\"to\":%u,\"sent\":%u,\"retries\":%u,\"lost\":%u,\"slow\":%u,\"bad\":%d}",
+      out.empty() ? "" : ",", it->first.first, it->first.second, sum.sent, sum.retries, sum.lost, sum.slow, bad);
+    out += buf;
+  }
+  //no culprit unless one µC has more bad links than all others,
+  //of two with as many the one whose links together needed more retries
+  uint8_t worst = 0;
+  bool unique = false;
+  for (uint16_t id=1; id<256; id++)
+  {
+    if (bad_links[id] > bad_links[worst] || (bad_links[id] && bad_links[id] == bad_links[worst] && trouble[id] > trouble[worst]))
+    {
+      unique = bad_links[id] > bad_links[worst] || trouble[id] > trouble[worst] * 1.1;
+      worst = id;
+    } else if (bad_links[id] && bad_links[id] == bad_links[worst] && trouble[id] * 1.1 >= trouble[worst]) {
+      unique = false;
+    }
+  }
+  if (!unique)
+    worst = 0;
+  uint8_t degraded_id = (arg->degraded) ? arg->degraded + 1 : 0;
+  printf("{\"bench\":\"linkstats\",\"nodes\":%u,\"degraded_peer\":%u,\"link_loss\":%.2f,\"seed\":%u,\"cmds\":%u,\"completed\":%u,"
+         "\"slow_acks\":%.3f,\"blamed\":%u,\"found\":%s,\"query_frames\":%llu,\"stats_frames\":%llu,\"links\":[%s]}\n",
+    num, degraded_id, arg->link_loss, bench_seed_, cmds, completed,
+    (acks_total) ? (double) slow_total / acks_total : 0.0, worst, (worst == degraded_id) ? "true" : "false",
+    (unsigned long long) query_frames, (unsigned long long) linkstats_frames_, out.c_str());
+}
+
+///////// outbox priorities ///////////
+
+struct OutboxBenchArg {
+  uint32_t telemetry_hz; // extra MSG_PRESSUREINFO per µC and second
+};
+
+static uint32_t outbox_telemetry_hz_;
+static uint64_t outbox_telemetry_due_us_;
+static uint64_t outbox_telemetry_queued_;
+
+//every µC of the ladder sends pressure info at outbox_telemetry_hz_ on top of its usual rate
+static void outbox_telemetry_pump()
+{
+  if (!outbox_telemetry_hz_)
+    return;
+  while (outbox_telemetry_due_us_ <= sim_now_us)
+  {
+    for (uint8_t i=0; i<ladder_num_; i++)
+    {
+      SimNode *n = sim_node(i);
+      sim_select(n);
+      n->api.send_pressure(0);
+      outbox_telemetry_queued_++;
+    }
+    outbox_telemetry_due_us_ += 1000000 / outbox_telemetry_hz_;
+  }
+}
+
+static bool outbox_airflow()
+{
+  outbox_telemetry_pump();
+  return ladder_airflow();
+}
+
+static bool outbox_fans_off()
+{
+  outbox_telemetry_pump();
+  return ladder_fans_off();
+}
+
+static void outbox_run(uint64_t us)
+{
+  uint64_t end = sim_now_us + us;
+  while (sim_now_us < end)
+  {
+    outbox_telemetry_pump();
+    sim_run(std::min((uint64_t) 5000, end - sim_now_us));
+  }
+}
+
+//every µC floods the bus with pressure telemetry while the host sends damper commands:
+//does the command latency stay where it is without telemetry, and how much of the telemetry makes it
+static void bench_outbox(void *varg)
+{
+  OutboxBenchArg *arg = (OutboxBenchArg*) varg;
+  uint8_t num = 4;
+  ladder_installed(num, ladder_installed_);
+  boot_ladder(num, ladder_installed_);
+  ladder_num_ = num;
+  outbox_telemetry_hz_ = arg->telemetry_hz;
+  outbox_telemetry_due_us_ = sim_now_us;
+  outbox_telemetry_queued_ = 0;
+
+  std::vector<double> latency_ms;
+  uint32_t cmds = 30 * bench_scale_, stuck = 0;
+  uint64_t frames0 = sim_bus_stats.frames, t0 = sim_now_us;
+  uint64_t telemetry0 = sim_bus_stats.frames_by_type[MSG_PRESSUREINFO];
+  for (uint32_t c=0; c<cmds; c++)
+  {
+    uint64_t start = sim_now_us;
+    console_cmd(0, '1' + c%3);
+    //a lost '0' command left the fans running, that is no airflow we caused
+    if (ladder_fans_off() && sim_run_until(outbox_airflow, 10000000))
+      latency_ms.push_back((sim_now_us - start) / 1000.0);
+    outbox_run(1000000);
+    console_cmd(0, '0');
+    if (!sim_run_until(outbox_fans_off, 10000000))
+      stuck++;
+    outbox_run(2000000);
+  }
+  double run_s = (sim_now_us - t0) / 1e6;
+  printf("{\"bench\":\"outbox\",\"nodes\":%u,\"telemetry_hz\":%u,\"seed\":%u,\"cmds\":%u,\"completed\":%zu,\"fans_stuck\":%u,"
+         "\"cmd_to_airflow_ms_p50\":%.1f,\"cmd_to_airflow_ms_p99\":%.1f,\"cmd_to_airflow_ms_max\":%.1f,"
+         "\"telemetry_queued\":%llu,\"telemetry_sent\":%llu,\"frames_per_s\":%.1f}\n",
+    num, arg->telemetry_hz, bench_seed_, cmds, latency_ms.size(), stuck,
+    percentile(latency_ms, 0.5), percentile(latency_ms, 0.99), percentile(latency_ms, 1.0),
+    (unsigned long long) outbox_telemetry_queued_, (unsigned long long) (sim_bus_stats.frames_by_type[MSG_PRESSUREINFO] - telemetry0),
+    (sim_bus_stats.frames - frames0) / run_s);
+}
+
+///////// receive window ///////////
+
+struct RxWindowBenchArg {
+  uint16_t fixed_us; // 0: adaptive
+  uint32_t loop_busy_us;
+};
+
+//PJON only hears frames that start while the µC is inside receive(), the rest of the loop takes loop_busy_us:
+//command latency, frames the µC did not hear and the share of time left to the loop, with a fixed and the adaptive window
+static void bench_rx_window(void *varg)
+{
+  RxWindowBenchArg *arg = (RxWindowBenchArg*) varg;
+  uint8_t num = 4;
+  ladder_installed(num, ladder_installed_);
+  sim_bus.listen_windows = true;
+  sim_init(bench_seed_);
+  for (uint8_t i=0; i<num; i++)
+  {
+    sim_preset_eeprom(i, i+1, ladder_installed_[i]);
+    sim_boot(i);
+    sim_node(i)->loop_busy_us = arg->loop_busy_us;
+    *sim_node(i)->api.pjon_rx_fixed_us = arg->fixed_us;
+  }
+  sim_run(2000000);
+  ladder_num_ = num;
+
+  std::vector<double> latency_ms;
+  uint32_t cmds = 30 * bench_scale_;
+  uint64_t t0 = sim_now_us, listen0 = 0, missed0 = 0;
+  uint64_t retries0 = sim_bus_stats.retries, lost0 = sim_bus_stats.connection_lost;
+  for (uint8_t i=0; i<num; i++)
+  {
+    listen0 += sim_node(i)->listen_us;
+    missed0 += sim_node(i)->missed_frames;
+  }
+  for (uint32_t c=0; c<cmds; c++)
+  {
+    uint64_t start = sim_now_us;
+    console_cmd(0, '1' + c%3);
+    if (ladder_fans_off() && sim_run_until(ladder_airflow, 10000000))
+      latency_ms.push_back((sim_now_us - start) / 1000.0);
+    sim_run(1000000);
+    console_cmd(0, '0');
+    sim_run_until(ladder_fans_off, 10000000);
+    sim_run(2000000);
+  }
+  uint64_t listen = 0, missed = 0;
+  for (uint8_t i=0; i<num; i++)
+  {
+    listen += sim_node(i)->listen_us;
+    missed += sim_node(i)->missed_frames;
+  }
+  double node_us = (double) (sim_now_us - t0) * num;
+  printf("{\"bench\":\"rx_window\",\"nodes\":%u,\"window_us\":\"%s\",\"loop_busy_us\":%u,\"seed\":%u,\"cmds\":%u,\"completed\":%zu,"
+         "\"cmd_to_airflow_ms_p50\":%.1f,\"cmd_to_airflow_ms_p99\":%.1f,\"missed_frames\":%llu,\"pjon_retries\":%llu,\"connection_lost\":%llu,"
+         "\"listening\":%.3f}\n",
+    num, (arg->fixed_us) ? std::to_string(arg->fixed_us).c_str() : "adaptive", arg->loop_busy_us, bench_seed_, cmds, latency_ms.size(),
+    percentile(latency_ms, 0.5), percentile(latency_ms, 0.99), (unsigned long long) (missed - missed0),
+    (unsigned long long) (sim_bus_stats.retries - retries0), (unsigned long long) (sim_bus_stats.connection_lost - lost0),
+    (listen - listen0) / node_us);
+}
+
+///////// receive burst ///////////
+
+struct RxBurstBenchArg {
+  uint32_t loop_busy_us; //of the bottom µC, the others take 300us
+  uint8_t per_sender; //frames every other µC queues for the bottom one at once
+};
+
+//count the MSG_PRESSUREINFO the µC on idx printed, which it only does once it handled the frame
+static uint64_t rx_burst_handled(uint8_t idx)
+{
+  std::vector<uint8_t> &out = sim_node(idx)->serial_out;
+  uint64_t handled = 0;
+  size_t pos = 0;
+  for (size_t eol; (eol = std::find(out.begin() + pos, out.end(), '\n') - out.begin()) < out.size(); pos = eol + 1)
+  {
+    unsigned id, len, type;
+    if (sscanf((const char*) out.data() + pos, "<%2x%2x%2x", &id, &len, &type) == 3 && type == MSG_PRESSUREINFO)
+      handled++;
+  }
+  out.clear();
+  return handled;
+}
+
+//every other µC sends its pressure info to the bottom one at the same time, so frames come in faster than
+//one per loop: every frame receive() took (and PJON acked) has to come out of the receive buffer, none may be overwritten before
+static void bench_rx_burst(void *varg)
+{
+  RxBurstBenchArg *arg = (RxBurstBenchArg*) varg;
+  uint8_t num = 5;
+  ladder_installed(num, ladder_installed_);
+  sim_bus.listen_windows = true;
+  sim_init(bench_seed_);
+  for (uint8_t i=0; i<num; i++)
+  {
+    sim_preset_eeprom(i, i+1, ladder_installed_[i]);
+    sim_node(i)->eeprom[4 + SIM_NUM_DAMPER] = 1;
+    sim_boot(i);
+    sim_node(i)->loop_busy_us = (i == 0) ? arg->loop_busy_us : 300;
+  }
+  sim_run(2000000);
+  SimNode *bottom = sim_node(0);
+  bottom->capture_output = true;
+  bottom->serial_out.clear();
+  uint64_t received0 = bottom->received_by_type[MSG_PRESSUREINFO];
+
+  uint32_t bursts = 20 * bench_scale_;
+  uint64_t handled = 0, queued = 0;
+  for (uint32_t b=0; b<bursts; b++)
+  {
+    for (uint8_t i=1; i<num; i++)
+    {
+      SimNode *n = sim_node(i);
+      sim_select(n);
+      for (uint8_t f=0; f<arg->per_sender; f++, queued++)
+        n->api.send_pressure(f % SIM_NUM_DAMPER);
+    }
+    sim_run(1000000);
+    handled += rx_burst_handled(0);
+  }
+  uint64_t received = bottom->received_by_type[MSG_PRESSUREINFO] - received0;
+  printf("{\"bench\":\"rx_burst\",\"nodes\":%u,\"loop_busy_us\":%u,\"per_sender\":%u,\"seed\":%u,\"bursts\":%u,"
+         "\"queued\":%llu,\"received\":%llu,\"handled\":%llu,\"lost\":%lld}\n",
+    num, arg->loop_busy_us, arg->per_sender, bench_seed_, bursts, (unsigned long long) queued,
+    (unsigned long long) received, (unsigned long long) handled, (long long) (received - handled));
+}
+
+///////// room interlock ///////////
+
+struct InterlockBenchArg {
+  uint8_t room_open; // room of the host on the bottom µC, which opens damper0
+  uint8_t room_close; // room of the host on the top µC, which closes everything
+  bool preset_close; // with PRESET_OFF instead of a MSG_DAMPERCMD
+};
+
+//a host sends a damper command through the µC on its serial port, like ventilationinterface does
+static void interlock_send(uint8_t idx, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t fan, uint8_t room)
+{
+  uint8_t buf[3 + sizeof(pjon_message_t)] = {'>', 1};
+  buf[2] = msg_dampercmd(buf + 3, d0, d1, d2, fan, 0, 0, room);
+  sim_host_write(idx, (const char*) buf, 3 + buf[2]);
+}
+
+static void preset_send(uint8_t idx, uint8_t preset, uint8_t room)
+{
+  pjon_message_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MSG_PRESETCMD;
+  msg.chaincast.presetcmd.preset = preset;
+  msg.chaincast.presetcmd.room = room;
+  uint8_t buf[3 + sizeof(pjon_message_t)] = {'>', 1, sizeof(presetcmd_t)+4};
+  memcpy(buf + 3, &msg, buf[2]);
+  sim_host_write(idx, (const char*) buf, 3 + buf[2]);
+}
+
+//count the MSG_ERROR INTERLOCK_REJECTED the µC on idx printed for its host
+static uint32_t interlock_reports(uint8_t idx)
+{
+  std::vector<uint8_t> &out = sim_node(idx)->serial_out;
+  uint32_t reports = 0;
+  size_t pos = 0;
+  for (size_t eol; (eol = std::find(out.begin() + pos, out.end(), '\n') - out.begin()) < out.size(); pos = eol + 1)
+  {
+    unsigned id, len, type, damperid, errortype;
+    if (sscanf((const char*) out.data() + pos, "<%2x%2x%2x%2x%2x", &id, &len, &type, &damperid, &errortype) == 5
+        && type == MSG_ERROR && errortype == INTERLOCK_REJECTED)
+      reports++;
+  }
+  out.clear();
+  return reports;
+}
+
+//the host in one room opens damper0, then the host in another room asks for everything closed and the fan off.
+//With different rooms the µC of damper0 has to keep it open and the fan on, and tell the second host why,
+//the room that opened it can still close it. Without rooms (0) or from the same room the close goes through.
+static void bench_interlock(void *varg)
+{
+  InterlockBenchArg *arg = (InterlockBenchArg*) varg;
+  uint8_t num = 4;
+  ladder_installed(num, ladder_installed_);
+  boot_ladder(num, ladder_installed_);
+  ladder_num_ = num;
+  SimNode *bottom = sim_node(0);
+  SimNode *top = sim_node(num-1);
+  top->capture_output = true;
+
+  uint32_t trials = 20 * bench_scale_;
+  uint32_t opened = 0, kept_open = 0, closed = 0, reports = 0, owner_closed = 0;
+  for (uint32_t t=0; t<trials; t++)
+  {
+    interlock_send(0, DAMPER_OPEN, DAMPER_CLOSED, DAMPER_CLOSED, FAN_ON, arg->room_open);
+    if (!sim_run_until(ladder_airflow, 10000000))
+      continue;
+    opened++;
+    sim_run(1000000);
+    top->serial_out.clear();
+    if (arg->preset_close)
+      preset_send(num-1, PRESET_OFF, arg->room_close);
+    else
+      interlock_send(num-1, DAMPER_CLOSED, DAMPER_CLOSED, DAMPER_CLOSED, FAN_OFF, arg->room_close);
+    sim_run(3000000);
+    reports += interlock_reports(num-1);
+    if (bottom->api.damper_target_states[0] != 0 && !ladder_fans_off())
+      kept_open++;
+    else if (bottom->api.damper_target_states[0] == 0 && ladder_fans_off())
+      closed++;
+    //whoever opened it closes it again
+    interlock_send(0, DAMPER_CLOSED, DAMPER_CLOSED, DAMPER_CLOSED, FAN_OFF, arg->room_open);
+    owner_closed += sim_run_until(ladder_fans_off, 10000000) && bottom->api.damper_target_states[0] == 0;
+    sim_run(2000000);
+  }
+  printf("{\"bench\":\"interlock\",\"nodes\":%u,\"room_open\":%u,\"room_close\":%u,\"close\":\"%s\",\"seed\":%u,\"trials\":%u,\"opened\":%u,"
+         "\"kept_open\":%u,\"closed\":%u,\"reports\":%u,\"owner_closed\":%u}\n",
+    num, arg->room_open, arg->room_close, (arg->preset_close) ? "preset" : "dampercmd", bench_seed_, trials, opened, kept_open, closed, reports, owner_closed);
+}
+
+///////// presets ///////////
+
+struct PresetBenchArg {
+  bool preset; // MSG_PRESETCMD instead of MSG_DAMPERCMD
+  uint16_t duration_s; // of the presets, 0: the host closes again
+};
+
+//the host opens one damper after the other and closes everything again, with full damper commands or presets:
+//bus bytes and airtime per command and command to airflow latency.
+//With a duration, the µC on the host's serial port ends the preset by itself
+static void bench_presets(void *varg)
+{
+  PresetBenchArg *arg = (PresetBenchArg*) varg;
+  uint8_t num = 4;
+  ladder_installed(num, ladder_installed_);
+  boot_ladder(num, ladder_installed_);
+  ladder_num_ = num;
+
+  if (arg->duration_s)
+  {
+    //a new table entry for every µC, presets 1..3 end by themselves
+    for (uint8_t p=1; p<=3; p++)
+    {
+      pjon_message_t msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.type = MSG_PRESETSET;
+      msg.chaincast.presetset.preset = p;
+      msg.chaincast.presetset.top = num;
+      for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+        msg.chaincast.presetset.entry.damper[d] = (d == p-1) ? DAMPER_OPEN : DAMPER_CLOSED;
+      msg.chaincast.presetset.entry.fan = FAN_ON;
+      msg.chaincast.presetset.entry.duration_s = arg->duration_s;
+      uint8_t buf[3 + sizeof(pjon_message_t)] = {'>', 1, sizeof(presetset_t)+4};
+      memcpy(buf + 3, &msg, buf[2]);
+      sim_host_write(0, (const char*) buf, 3 + buf[2]);
+      sim_run(2000000);
+    }
+  }
+
+  std::vector<double> latency_ms, ended_ms;
+  uint32_t cmds = 20 * bench_scale_;
+  uint64_t bytes = 0, busy_us = 0, frames = 0;
+  for (uint32_t c=0; c<cmds; c++)
+  {
+    uint64_t bytes0 = sim_bus_stats.bytes, busy0 = sim_bus_stats.busy_us, frames0 = sim_bus_stats.frames;
+    uint64_t start = sim_now_us;
+    if (arg->preset)
+      preset_send(0, 1 + c%3, 0);
+    else
+      interlock_send(0, (c%3 == 0), (c%3 == 1), (c%3 == 2), FAN_ON, 0);
+    if (sim_run_until(ladder_airflow, 10000000))
+      latency_ms.push_back((sim_now_us - start) / 1000.0);
+    sim_run(1000000);
+    bytes += sim_bus_stats.bytes - bytes0;
+    busy_us += sim_bus_stats.busy_us - busy0;
+    frames += sim_bus_stats.frames - frames0;
+    if (arg->duration_s)
+    {
+      if (sim_run_until(ladder_fans_off, (uint64_t) arg->duration_s * 2000000))
+        ended_ms.push_back((sim_now_us - start) / 1000.0);
+    } else {
+      if (arg->preset)
+        preset_send(0, PRESET_OFF, 0);
+      else
+        interlock_send(0, DAMPER_CLOSED, DAMPER_CLOSED, DAMPER_CLOSED, FAN_OFF, 0);
+      sim_run_until(ladder_fans_off, 10000000);
+    }
+    sim_run(2000000);
+  }
+  printf("{\"bench\":\"presets\",\"nodes\":%u,\"cmd\":\"%s\",\"duration_s\":%u,\"seed\":%u,\"cmds\":%u,\"completed\":%zu,"
+         "\"frames_per_cmd\":%.1f,\"bytes_per_cmd\":%.1f,\"busy_ms_per_cmd\":%.2f,\"cmd_to_airflow_ms_p50\":%.1f,\"ended\":%zu,\"ended_after_ms_p50\":%.1f}\n",
+    num, (arg->preset) ? "preset" : "dampercmd", arg->duration_s, bench_seed_, cmds, latency_ms.size(),
+    (double) frames / cmds, (double) bytes / cmds, busy_us / 1000.0 / cmds, percentile(latency_ms, 0.5),
+    ended_ms.size(), percentile(ended_ms, 0.5));
+}
+
+///////// pressure signatures ///////////
+
+struct PressureSigBenchArg {
+  const char *fault; // "none", "blocked_closed", "blocked_part" (stops a quarter of the way open), "stuck_closing"
+  double loss;
+};
+
+//the duct behind a damper: the fan on the top µC builds up pressure against a closed damper,
+//less of it once air flows through. The fan takes a while to spin up and down
+#define PSIG_AMBIENT_PA 98000.0
+#define PSIG_CLOSED_PA 60.0
+#define PSIG_OPEN_PA 25.0
+#define PSIG_FAN_TAU_US 200000.0
+#define PSIG_NOISE_PA 0.3
+#define PSIG_STEP_US 10000
+
+static double psig_fan_level_;
+static std::set<std::tuple<uint8_t, uint8_t, uint8_t, uint32_t>> psig_errors_seen_;
+static std::vector<std::pair<uint64_t, uint8_t>> psig_errors_; // time and errortype, once per error
+static bool psig_at_target_;
+static uint64_t psig_at_target_us_;
+
+static void psig_on_delivery(uint8_t from, uint8_t to, const uint8_t *data, size_t length)
+{
+  (void) to;
+  if (length < sizeof(errorinfo_t)+1 || data[0] != MSG_ERROR)
+    return;
+  const errorinfo_t *e = (const errorinfo_t*) (data + 1);
+  //a broadcast reaches every µC, count it once
+  if (psig_errors_seen_.insert(std::make_tuple(from, e->damperid, e->errortype, e->bus_us)).second)
+    psig_errors_.push_back(std::make_pair(sim_now_us, e->errortype));
+}
+
+//how far the disk lets air through: closed in the endstop slot, open at 80 ticks, closing again behind it
+static double psig_openness(uint16_t angle)
+{
+  if (angle <= 80)
+    return angle / 80.0;
+  return (SIM_DAMPER_HALFTURN_TICKS - angle) / (double) (SIM_DAMPER_HALFTURN_TICKS - 80);
+}
+
+static void psig_run(uint64_t us)
+{
+  for (uint64_t t=0; t<us; t+=PSIG_STEP_US)
+  {
+    sim_run(PSIG_STEP_US);
+    bool fan = sim_node(ladder_num_-1)->pin_level[SIM_PIN_FAN] == 0;
+    //when the bottom µC's damper0 thinks it got there, which it does as well when it is stuck
+    bool at_target = sim_node(0)->api.damper_states[0] == sim_node(0)->api.damper_target_states[0];
+    if (at_target && !psig_at_target_)
+      psig_at_target_us_ = sim_now_us;
+    psig_at_target_ = at_target;
+    psig_fan_level_ += ((fan ? 1.0 : 0.0) - psig_fan_level_) * (1.0 - exp(-PSIG_STEP_US / PSIG_FAN_TAU_US));
+    for (uint8_t i=0; i<ladder_num_; i++)
+    {
+      SimNode *n = sim_node(i);
+      for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+      {
+        if (!n->sensor_installed[d])
+          continue;
+        double duct = PSIG_CLOSED_PA + (PSIG_OPEN_PA - PSIG_CLOSED_PA) * psig_openness(n->damper[d].angle);
+        n->sensor_pascal[d] = PSIG_AMBIENT_PA + psig_fan_level_ * duct + (sim_rand_unit() - 0.5) * 2 * PSIG_NOISE_PA;
+      }
+    }
+  }
+}
+
+static bool psig_run_until(bool (*cond)(), uint64_t max_us)
+{
+  for (uint64_t t=0; t<max_us; t+=PSIG_STEP_US)
+  {
+    if (cond())
+      return true;
+    psig_run(PSIG_STEP_US);
+  }
+  return cond();
+}
+
+static size_t psig_count(uint8_t errortype, size_t from)
+{
+  size_t n = 0;
+  for (size_t i=from; i<psig_errors_.size(); i++)
+    n += psig_errors_[i].second == errortype;
+  return n;
+}
+
+//host commands on the bottom µC: open, close, repeat
+static void psig_cycle(uint8_t d0, uint8_t d1, uint8_t d2)
+{
+  interlock_send(0, d0, d1, d2, FAN_ON, 0);
+  psig_run_until(ladder_airflow, 10000000);
+  psig_run(2000000);
+  interlock_send(0, DAMPER_CLOSED, DAMPER_CLOSED, DAMPER_CLOSED, FAN_OFF, 0);
+  psig_run_until(ladder_fans_off, 10000000);
+  psig_run(3000000);
+}
+
+//every damper has a pressure sensor. The ladder learns the signatures in a few open/close cycles, then damper0 gets
+//stuck: blocked closed while it opens, a quarter of the way open, or open while it closes (which the endstop timeout
+//catches, the fan is off). How long after the µC thinks the damper got to its target does it report it, and does
+//anything else get reported
+static void bench_pressuresig(void *varg)
+{
+  PressureSigBenchArg *arg = (PressureSigBenchArg*) varg;
+  uint8_t num = 4;
+  ladder_installed(num, ladder_installed_);
+  ladder_num_ = num;
+  //as boot_ladder(), but the sensors have to be there when the µC looks for them
+  sim_init(bench_seed_);
+  for (uint8_t i=0; i<num; i++)
+  {
+    for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+    {
+      sim_node(i)->sensor_installed[d] = ladder_installed_[i] & _BV(d);
+      sim_node(i)->sensor_pascal[d] = PSIG_AMBIENT_PA;
+    }
+    sim_preset_eeprom(i, i+1, ladder_installed_[i]);
+    //errors go to the top µC: a broadcast is not repeated and gets lost on µC that sleep, which they do with the fan off
+    sim_node(i)->eeprom[4 + SIM_NUM_DAMPER] = (i == num-1) ? 1 : num;
+    sim_boot(i);
+  }
+  sim_run(2000000);
+  sim_bus.frame_loss = arg->loss;
+  psig_fan_level_ = 0.0;
+  psig_at_target_ = true;
+  psig_errors_seen_.clear();
+  psig_errors_.clear();
+  sim_on_delivery = psig_on_delivery;
+  psig_run(1000000);
+
+  const uint8_t learn[][3] = {{DAMPER_OPEN, DAMPER_CLOSED, DAMPER_CLOSED}, {DAMPER_CLOSED, DAMPER_OPEN, DAMPER_CLOSED},
+                              {DAMPER_CLOSED, DAMPER_CLOSED, DAMPER_OPEN}, {DAMPER_HALFOPEN, DAMPER_HALFOPEN, DAMPER_HALFOPEN},
+                              {DAMPER_OPEN, DAMPER_OPEN, DAMPER_OPEN}};
+  for (uint8_t r=0; r<2; r++)
+    for (size_t c=0; c<sizeof(learn)/sizeof(learn[0]); c++)
+      psig_cycle(learn[c][0], learn[c][1], learn[c][2]);
+  size_t learned_errors = psig_errors_.size();
+
+  SimNode *bottom = sim_node(0);
+  std::vector<double> from_target_ms, from_cmd_ms;
+  uint32_t trials = 10 * bench_scale_, detected = 0, healthy_runs = 0;
+  for (uint32_t t=0; t<trials; t++)
+  {
+    size_t errors0 = psig_errors_.size();
+    uint64_t start = sim_now_us;
+    uint8_t expect = DAMPER_PRESSURE_MISMATCH;
+    if (strcmp(arg->fault, "none") == 0)
+    {
+      //random commands, nothing should be reported
+      const uint8_t *c = learn[sim_rand() % (sizeof(learn)/sizeof(learn[0]))];
+      psig_cycle(c[0], c[1], c[2]);
+      healthy_runs++;
+      continue;
+    }
+    if (strcmp(arg->fault, "stuck_closing") == 0)
+    {
+      interlock_send(0, DAMPER_OPEN, DAMPER_CLOSED, DAMPER_CLOSED, FAN_ON, 0);
+      psig_run_until(ladder_airflow, 10000000);
+      psig_run(2000000);
+      bottom->damper[0].stuck = true;
+      start = sim_now_us;
+      interlock_send(0, DAMPER_CLOSED, DAMPER_CLOSED, DAMPER_CLOSED, FAN_OFF, 0);
+      expect = DAMPER_CONTROL_TIMEOUT;
+    }
+    else
+    {
+      if (strcmp(arg->fault, "blocked_closed") == 0)
+        bottom->damper[0].stuck = true;
+      interlock_send(0, DAMPER_OPEN, DAMPER_CLOSED, DAMPER_CLOSED, FAN_ON, 0);
+      if (strcmp(arg->fault, "blocked_part") == 0)
+      {
+        psig_run_until([]() { return sim_node(0)->damper[0].angle >= 20 && sim_node(0)->damper[0].angle < 80; }, 10000000);
+        bottom->damper[0].stuck = true;
+      }
+    }
+    psig_at_target_us_ = 0;
+    uint64_t until = sim_now_us + 10000000;
+    while (sim_now_us < until && psig_count(expect, errors0) == 0)
+      psig_run(PSIG_STEP_US);
+    for (size_t i=errors0; i<psig_errors_.size(); i++)
+    {
+      if (psig_errors_[i].second != expect)
+        continue;
+      detected++;
+      from_cmd_ms.push_back((psig_errors_[i].first - start) / 1000.0);
+      //a damper that times out gets to its target (0) only with the error
+      if (expect == DAMPER_PRESSURE_MISMATCH && psig_at_target_us_)
+        from_target_ms.push_back((psig_errors_[i].first - psig_at_target_us_) / 1000.0);
+      break;
+    }
+    //free it, close, and one good run so the mismatch is cleared before the next trial
+    bottom->damper[0].stuck = false;
+    interlock_send(0, DAMPER_CLOSED, DAMPER_CLOSED, DAMPER_CLOSED, FAN_OFF, 0);
+    psig_run_until(ladder_fans_off, 10000000);
+    psig_run(5000000);
+    psig_cycle(DAMPER_OPEN, DAMPER_CLOSED, DAMPER_CLOSED);
+  }
+  //errors other than the one expected, and all of them on healthy runs
+  size_t mismatch = psig_count(DAMPER_PRESSURE_MISMATCH, learned_errors), timeout = psig_count(DAMPER_CONTROL_TIMEOUT, learned_errors);
+  size_t spurious_reports = (strcmp(arg->fault, "none") == 0) ? mismatch + timeout
+    : (strcmp(arg->fault, "stuck_closing") == 0) ? mismatch : mismatch - detected + timeout;
+  printf("{\"bench\":\"pressuresig\",\"nodes\":%u,\"fault\":\"%s\",\"loss\":%.2f,\"seed\":%u,\"trials\":%u,\"healthy_runs\":%u,"
+         "\"learning_reports\":%zu,\"detected\":%u,\"from_target_ms_p50\":%.0f,\"from_target_ms_max\":%.0f,\"from_cmd_ms_p50\":%.0f,\"spurious_reports\":%zu}\n",
+    num, arg->fault, arg->loss, bench_seed_, trials, healthy_runs, learned_errors, detected,
+    percentile(from_target_ms, 0.5), percentile(from_target_ms, 1.0), percentile(from_cmd_ms, 0.5), spurious_reports);
+  sim_on_delivery = 0;
+}
+
+///////// PJON strategy ///////////
+
+struct StrategyBenchArg {
+  const char *scenario; // "commands": command latency on a ladder, "fwupdate": an image from µC 1 to µC 2
+  uint32_t loop_busy_us;
+  bool pty;  // ThroughSerial frames go through a pty pair (sim_bus.uart_pty), build/bench-uart only
+};
+
+//the same scenario in build/bench (SoftwareBitBang) and build/bench-uart (ThroughSerial over a uart), with µC that
+//only hear what PJON lets them hear and a loop that is busy loop_busy_us otherwise:
+//line rate, command latency or update throughput, and the share of the time the µC spend inside PJON
+static void bench_pjon_strategy(void *varg)
+{
+  StrategyBenchArg *arg = (StrategyBenchArg*) varg;
+  bool commands = strcmp(arg->scenario, "commands") == 0;
+  uint8_t num = (commands) ? 4 : 2;
+  ladder_installed(num, ladder_installed_);
+  sim_bus.listen_windows = true;
+  sim_bus.uart_pty = arg->pty;
+  sim_init(bench_seed_);
+  for (uint8_t i=0; i<num; i++)
+  {
+    sim_preset_eeprom(i, i+1, ladder_installed_[i]);
+    sim_boot(i);
+    sim_node(i)->loop_busy_us = arg->loop_busy_us;
+  }
+  bool uart = sim_node(0)->pjon->uart_baud != 0;
+  if (arg->pty && !uart)
+    return; //SoftwareBitBang has no uart frames to put through a pty
+  sim_run(2000000);
+  ladder_num_ = num;
+
+  uint64_t t0 = sim_now_us, pjon0 = 0, missed0 = 0;
+  uint64_t retries0 = sim_bus_stats.retries, lost0 = sim_bus_stats.connection_lost;
+  for (uint8_t i=0; i<num; i++)
+  {
+    pjon0 += sim_node(i)->listen_us + sim_node(i)->pjon_xfer_us;
+    missed0 += sim_node(i)->missed_frames;
+  }
+  std::vector<double> latency_ms;
+  uint32_t cmds = 30 * bench_scale_;
+  uint32_t size = 16384 * bench_scale_;
+  bool image_ok = false;
+  double bytes_per_s = 0.0;
+  if (commands)
+  {
+    for (uint32_t c=0; c<cmds; c++)
+    {
+      uint64_t start = sim_now_us;
+      console_cmd(0, '1' + c%3);
+      if (ladder_fans_off() && sim_run_until(ladder_airflow, 10000000))
+        latency_ms.push_back((sim_now_us - start) / 1000.0);
+      sim_run(1000000);
+      console_cmd(0, '0');
+      sim_run_until(ladder_fans_off, 10000000);
+      sim_run(2000000);
+    }
+  }
+  else
+  {
+    SimNode *bridge = sim_node(0), *target = sim_node(1);
+    fwupdate_start(size);
+    uint64_t max_us = (uint64_t) size * 20000 + 60000000;
+    while (target->restarts == 0 && sim_now_us - t0 < max_us)
+    {
+      sim_run(1000);
+      fwupdate_host_pump(bridge);
+    }
+    image_ok = fwupdate_image_ok(target);
+    if (image_ok)
+      bytes_per_s = size / ((sim_now_us - t0) / 1e6);
+  }
+  uint64_t pjon = 0, missed = 0;
+  for (uint8_t i=0; i<num; i++)
+  {
+    pjon += sim_node(i)->listen_us + sim_node(i)->pjon_xfer_us;
+    missed += sim_node(i)->missed_frames;
+  }
+  double node_us = (double) (sim_now_us - t0) * num;
+  printf("{\"bench\":\"pjon_strategy\",\"strategy\":\"%s\",\"scenario\":\"%s\",\"carrier\":\"%s\",\"nodes\":%u,\"loop_busy_us\":%u,\"seed\":%u,"
+         "\"line_kbit_s\":%.1f,",
+    (uart) ? "uart" : "swbb", arg->scenario, (arg->pty) ? "pty" : "sim", num, arg->loop_busy_us, bench_seed_, 8000.0 / bench_byte_us());
+  if (commands)
+    printf("\"cmds\":%u,\"completed\":%zu,\"cmd_to_airflow_ms_p50\":%.1f,\"cmd_to_airflow_ms_p99\":%.1f,",
+      cmds, latency_ms.size(), percentile(latency_ms, 0.5), percentile(latency_ms, 0.99));
+  else
+    printf("\"bytes\":%u,\"image_ok\":%s,\"bytes_per_s\":%.0f,", size, image_ok?"true":"false", bytes_per_s);
+  printf("\"missed_frames\":%llu,\"pjon_retries\":%llu,\"connection_lost\":%llu,\"in_pjon\":%.3f,\"pty_bytes\":%llu,\"pty_errors\":%llu}\n",
+    (unsigned long long) (missed - missed0), (unsigned long long) (sim_bus_stats.retries - retries0),
+    (unsigned long long) (sim_bus_stats.connection_lost - lost0), (pjon - pjon0) / node_us,
+    (unsigned long long) sim_bus_stats.pty_bytes, (unsigned long long) sim_bus_stats.pty_errors);
+}
+
+///////// id assignment ///////////
+
+static bool idassign_done_ = false;
+static bool idassign_success_ = false;
+static uint8_t idassign_nodes_ = 0;
+
+static void idassign_done(uint8_t num_nodes, bool success)
+{
+  idassign_done_ = true;
+  idassign_success_ = success;
+  idassign_nodes_ = num_nodes;
+}
+
+static bool idassign_finished()
+{
+  return idassign_done_;
+}
+
+struct IdassignBenchArg {
+  uint8_t num;
+  uint8_t fresh; // this many µC are fresh boards still at NOT_ASSIGNED, whose acquire_id() fails
+  uint8_t dup;   // this many µC share the id of another
+  uint8_t at_one; // this many µC have id 1, like the master
+};
+
+static void bench_idassign(void *varg)
+{
+  IdassignBenchArg *arg = (IdassignBenchArg*) varg;
+  uint8_t num = arg->num;
+  sim_init(bench_seed_);
+  sim_bus.acquire_id_fails = arg->fresh > 0;
+  //the master already has id 1, everybody else some random unique id, or not
+  sim_preset_eeprom(0, 1, 0);
+  uint8_t used[256] = {0};
+  used[0] = used[1] = used[255] = 1;
+  uint8_t last = 0;
+  for (uint8_t i=1; i<num; i++)
+  {
+    uint8_t id;
+    if (i <= arg->at_one)
+      id = 1;
+    else if (i <= arg->at_one + arg->fresh)
+      id = PJON_ID_NOT_ASSIGNED;
+    else if (i <= arg->at_one + arg->fresh + arg->dup && last)
+      id = last;
+    else
+      do { id = 2 + sim_rand() % 60; } while (used[id]);
+    used[id] = 1;
+    if (id != 1)
+      last = id;
+    sim_preset_eeprom(i, id, 0);
+  }
+  for (uint8_t i=0; i<num; i++)
+    sim_boot(i);
+  sim_run(100000);
+  sim_select(sim_node(0));
+  sim_node(0)->api.set_idassign_callback(idassign_done);
+  uint64_t start = sim_now_us;
+  console_cmd(0, 'm');
+  sim_run_until(idassign_finished, 60000000);
+  double ms = (sim_now_us - start) / 1000.0;
+
+  //read back: ids have to be 1..num without gap
+  bool sequential = true;
+  uint8_t seen[256] = {0};
+  for (uint8_t i=0; i<num; i++)
+    seen[sim_pjon_id(i)]++;
+  for (uint8_t id=1; id<=num; id++)
+    sequential &= seen[id] == 1;
+  printf("{\"bench\":\"idassign\",\"nodes\":%u,\"fresh\":%u,\"dup\":%u,\"at_one\":%u,\"seed\":%u,\"done\":%s,\"verified\":%s,\"found\":%u,\"sequential\":%s,\"virtual_ms\":%.1f,\"frames\":%llu}\n",
+    num, arg->fresh, arg->dup, arg->at_one, bench_seed_, idassign_done_?"true":"false", idassign_success_?"true":"false", idassign_nodes_,
+    sequential?"true":"false", ms, (unsigned long long) sim_bus_stats.frames);
+}
+
+///////// main ///////////
+
+static bool selected(const char *name)
+{
+  return !bench_only_ || strcmp(bench_only_, name) == 0;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-s seed] [-x scale] [-b benchmark]\n", argv0);
+  fprintf(stderr, "benchmarks: serial_parser recv_frame chaincast_handler chaincast_ladder chaincast_loss chaincast_concurrent chaincast_rejoin control_dampers_tick endstop_flash idle_sleep fwupdate config_delta history timesync linkstats outbox rx_window rx_burst interlock presets pressuresig pjon_strategy idassign\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "s:x:b:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 's': bench_seed_ = strtoul(optarg, 0, 0); break;
+      case 'x': bench_scale_ = strtoul(optarg, 0, 0); break;
+      case 'b': bench_only_ = optarg; break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (bench_scale_ == 0)
+    bench_scale_ = 1;
+
+  if (selected("serial_parser"))
+  {
+    uint16_t chunks[] = {1, SERIAL_MAX_BYTES_PER_LOOP};
+    for (size_t i=0; i<sizeof(chunks)/sizeof(chunks[0]); i++)
+      sim_run_isolated(bench_serial_parser, &chunks[i]);
+  }
+  if (selected("recv_frame"))
+  {
+    RecvBenchArg args[] = {{"dampercmd", MSG_DAMPERCMD}, {"pressureinfo", MSG_PRESSUREINFO}, {"error", MSG_ERROR}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_recv_frame, &args[i]);
+  }
+  if (selected("chaincast_handler"))
+    sim_run_isolated(bench_chaincast_handler, 0);
+  if (selected("chaincast_ladder"))
+  {
+    for (uint8_t num=2; num<=sim_num_nodes(); num++)
+      sim_run_isolated(bench_chaincast_ladder, &num);
+  }
+  if (selected("chaincast_loss"))
+  {
+    LossBenchArg args[] = {{4, 0.0, 0, false}, {4, 0.1, 0, false}, {4, 0.2, 0, false}, {4, 0.3, 0, false}, {4, 0.4, 0, false},
+                           {4, 0.0, 400, false}, {4, 0.2, 400, false}, {4, 0.0, 1000, false},
+                           {4, 0.3, 0, true}, {4, 0.0, 1000, true}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_chaincast_loss, &args[i]);
+  }
+  if (selected("chaincast_concurrent"))
+  {
+    const double losses[] = {0.0, 0.2};
+    for (size_t l=0; l<sizeof(losses)/sizeof(losses[0]); l++)
+      for (uint8_t num=2; num<=sim_num_nodes(); num++)
+      {
+        ConcurrentBenchArg arg = {num, losses[l]};
+        sim_run_isolated(bench_chaincast_concurrent, &arg);
+      }
+  }
+  if (selected("chaincast_rejoin"))
+  {
+    RejoinBenchArg args[] = {{4, 4}, {4, 60}, {6, 4}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_chaincast_rejoin, &args[i]);
+  }
+  if (selected("control_dampers_tick"))
+  {
+    TickBenchArg args[] = {{"idle", false, false}, {"moving", true, false}, {"startstop", false, true}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_control_dampers, &args[i]);
+  }
+  if (selected("endstop_flash"))
+  {
+    FlashBenchArg args[] = {{0}, {500}, {2000}, {6000}, {12000}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_endstop_flash, &args[i]);
+  }
+  if (selected("idle_sleep"))
+  {
+    IdleBenchArg args[] = {{2, false}, {sim_num_nodes(), false}, {sim_num_nodes(), true}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_idle_sleep, &args[i]);
+  }
+  if (selected("fwupdate"))
+  {
+    FwupdateBenchArg args[] = {{0.0, 0, 0.0, 0}, {0.1, 0, 0.0, 0}, {0.2, 0, 0.0, 0}, {0.0, 5000, 0.0, 0}, {0.1, 30000, 0.0, 0},
+                               {0.0, 0, 0.05, 0}, {0.0, 0, 0.0, 1}, {0.1, 0, 0.0, 1}, {0.0, 0, 0.0, 2}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_fwupdate, &args[i]);
+  }
+  if (selected("config_delta"))
+  {
+    ConfigBenchArg args[] = {{2, 0.0}, {6, 0.0}, {6, 0.1}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_config_delta, &args[i]);
+  }
+  if (selected("history"))
+    sim_run_isolated(bench_history, 0);
+  if (selected("timesync"))
+  {
+    TimesyncBenchArg args[] = {{0.0, 0}, {0.0, 50}, {0.1, 50}, {0.3, 50}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_timesync, &args[i]);
+  }
+  if (selected("linkstats"))
+  {
+    LinkBenchArg args[] = {{0, 0.0}, {2, 0.1}, {2, 0.2}, {2, 0.35}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_linkstats, &args[i]);
+  }
+  if (selected("outbox"))
+  {
+    OutboxBenchArg args[] = {{0}, {10}, {40}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_outbox, &args[i]);
+  }
+  if (selected("rx_window"))
+  {
+    RxWindowBenchArg args[] = {{64, 300}, {5000, 300}, {0, 300}, {64, 2000}, {5000, 2000}, {0, 2000}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_rx_window, &args[i]);
+  }
+  if (selected("rx_burst"))
+  {
+    RxBurstBenchArg args[] = {{300, 1}, {300, 2}, {20000, 1}, {20000, 2}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_rx_burst, &args[i]);
+  }
+  if (selected("interlock"))
+  {
+    InterlockBenchArg args[] = {{0, 0, false}, {1, 1, false}, {1, 2, false}, {0, 2, false}, {1, 2, true}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_interlock, &args[i]);
+  }
+  if (selected("presets"))
+  {
+    PresetBenchArg args[] = {{false, 0}, {true, 0}, {true, 5}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_presets, &args[i]);
+  }
+  if (selected("pressuresig"))
+  {
+    PressureSigBenchArg args[] = {{"none", 0.0}, {"none", 0.1}, {"blocked_closed", 0.0}, {"blocked_part", 0.0},
+                                  {"blocked_closed", 0.1}, {"stuck_closing", 0.0}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_pressuresig, &args[i]);
+  }
+  if (selected("pjon_strategy"))
+  {
+    StrategyBenchArg args[] = {{"commands", 300, false}, {"commands", 2000, false}, {"fwupdate", 300, false},
+                               {"fwupdate", 2000, false}, {"commands", 2000, true}, {"fwupdate", 2000, true}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_pjon_strategy, &args[i]);
+  }
+  if (selected("idassign"))
+  {
+    for (uint8_t num=2; num<=sim_num_nodes(); num++)
+    {
+      IdassignBenchArg arg = {num, 0, 0, 0};
+      sim_run_isolated(bench_idassign, &arg);
+    }
+    IdassignBenchArg args[] = {{3, 2, 0, 0}, {sim_num_nodes(), 2, 0, 0}, {sim_num_nodes(), 0, 2, 0}, {sim_num_nodes(), 2, 1, 0},
+                               {2, 0, 0, 1}, {sim_num_nodes(), 0, 0, 1}, {sim_num_nodes(), 1, 1, 2}};
+    for (size_t i=0; i<sizeof(args)/sizeof(args[0]); i++)
+      sim_run_isolated(bench_idassign, &args[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,1090 @@
+/*
+ *  Damper Control Firmware - Host Tool
+ *
+ *  Talks to the console of a µC (a serial port, or a pty of ptysim) like the host does:
+ *  encodes PJON msgs as '>' injections and decodes the '<' lines the µC prints,
+ *  for every pjon_msg_type_t, straight from the structs in dampercontrol.h.
+ *  Streams the msgs of a script at a fixed rate and records what comes back as CSV or binary,
+ *  which makes it a load generator and recorder for the bus.
+ *  Updates the firmware of a µC on the bus through the one on the port (see fwupdate.cpp).
+ *  Writes the config deltas from one site config to the next (see Site Config in settings.cpp).
+ *
+ *  This software is made with love
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../src/dampercontrol.h"
+#include "shim/mbedtls/sha256.h"
+
+//fields of a msg, numbers are read and written through get/set so bitfields and packed members work alike
+enum tool_field_kind_t {FIELD_UINT, FIELD_FLOAT, FIELD_BYTES};
+
+struct ToolField {
+  const char *name;
+  tool_field_kind_t kind;
+  double (*get)(pjon_message_t *m);
+  void (*set)(pjon_message_t *m, double v);
+  uint8_t *(*bytes)(pjon_message_t *m);  // FIELD_BYTES, printed and parsed as hex
+  size_t len;
+};
+
+#define F_UINT(name, member) {name, FIELD_UINT, \
+  [](pjon_message_t *m) -> double { return m->member; }, \
+  [](pjon_message_t *m, double v) { m->member = (uint32_t) v; }, 0, 0}
+#define F_FLOAT(name, member) {name, FIELD_FLOAT, \
+  [](pjon_message_t *m) -> double { return m->member; }, \
+  [](pjon_message_t *m, double v) { m->member = (float) v; }, 0, 0}
+#define F_BYTES(name, member) {name, FIELD_BYTES, 0, 0, \
+  [](pjon_message_t *m) -> uint8_t* { return m->member; }, sizeof(((pjon_message_t*) 0)->member)}
+#define F_CHAINCAST F_UINT("reach", chaincast.reach), F_UINT("origin", chaincast.origin), F_UINT("seq", chaincast.seq)
+#define F_CONFIGCHANGE(i) F_UINT("id" #i, chaincast.configdelta.changes[i].pjon_id), \
+  F_UINT("field" #i, chaincast.configdelta.changes[i].field), F_UINT("value" #i, chaincast.configdelta.changes[i].value)
+
+#define TOOL_MAX_FIELDS 32
+
+struct ToolMsg {
+  uint8_t type;
+  const char *name;
+  uint8_t length; // as pjon_type_to_msg_length in comm.cpp
+  ToolField fields[TOOL_MAX_FIELDS]; // up to the first without a name
+};
+
+static const ToolMsg tool_msgs_[] = {
+  {MSG_DAMPERCMD, "dampercmd", sizeof(dampercmd_t)+4, {F_CHAINCAST,
+    F_UINT("damper0", chaincast.dampercmd.damper[0]), F_UINT("damper1", chaincast.dampercmd.damper[1]),
+    F_UINT("damper2", chaincast.dampercmd.damper[2]), F_UINT("fan", chaincast.dampercmd.fan),
+    F_UINT("fanlamina", chaincast.dampercmd.fanlamina), F_UINT("room", chaincast.dampercmd.room)}},
+  {MSG_PRESSUREINFO, "pressureinfo", sizeof(pressureinfo_t)+1, {
+    F_UINT("sensorid", pressureinfo.sensorid), F_FLOAT("celsius", pressureinfo.celsius),
+    F_FLOAT("pascal", pressureinfo.pascal), F_UINT("bus_us", pressureinfo.bus_us)}},
+  {MSG_ERROR, "error", sizeof(errorinfo_t)+1, {
+    F_UINT("damperid", errorinfo.damperid), F_UINT("errortype", errorinfo.errortype), F_UINT("bus_us", errorinfo.bus_us)}},
+  {MSG_UPDATESETTINGS, "updatesettings", sizeof(updatesettings_t)+4, {F_CHAINCAST,
+    F_UINT("open_pos0", chaincast.updatesettings.damper_open_pos[0]),
+    F_UINT("open_pos1", chaincast.updatesettings.damper_open_pos[1]),
+    F_UINT("open_pos2", chaincast.updatesettings.damper_open_pos[2])}},
+  {MSG_PJONID_DOAUTO, "pjonid_doauto", 1, {}},
+  {MSG_PJONID_QUESTION, "pjonid_question", 1, {}},
+  {MSG_PJONID_INFO, "pjonid_info", sizeof(pjonidsetting_t)+1, {F_UINT("pjon_id", pjonidsetting.pjon_id), F_UINT("nonce", pjonidsetting.nonce)}},
+  {MSG_PJONID_SET, "pjonid_set", sizeof(pjonidsetting_t)+1, {F_UINT("pjon_id", pjonidsetting.pjon_id), F_UINT("nonce", pjonidsetting.nonce)}},
+  {MSG_STATUSREQUEST, "statusrequest", sizeof(statusrequest_t)+1, {F_UINT("reply_to", statusrequest.reply_to)}},
+  {MSG_STATUS, "status", sizeof(statusinfo_t)+1, {
+    F_UINT("pjon_id", statusinfo.pjon_id),
+    F_UINT("pos0", statusinfo.damper_pos[0]), F_UINT("pos1", statusinfo.damper_pos[1]), F_UINT("pos2", statusinfo.damper_pos[2]),
+    F_UINT("target0", statusinfo.damper_target[0]), F_UINT("target1", statusinfo.damper_target[1]),
+    F_UINT("target2", statusinfo.damper_target[2]), F_UINT("installed", statusinfo.installed),
+    F_UINT("endstops", statusinfo.endstops), F_UINT("fan", statusinfo.fan), F_UINT("errors", statusinfo.errors),
+    F_FLOAT("pascal0", statusinfo.pascal[0]), F_FLOAT("pascal1", statusinfo.pascal[1]), F_FLOAT("pascal2", statusinfo.pascal[2]),
+    F_UINT("uptime_s", statusinfo.uptime_s), F_UINT("chaincast_clock", statusinfo.chaincast_clock)}},
+  {MSG_EVENT, "event", sizeof(eventinfo_t)+1, {
+    F_UINT("pjon_id", eventinfo.pjon_id), F_UINT("seq", eventinfo.seq), F_UINT("event", eventinfo.event),
+    F_UINT("subject", eventinfo.subject), F_UINT("value", eventinfo.value), F_UINT("bus_us", eventinfo.bus_us)}},
+  {MSG_CHAINCAST_ACK, "chaincast_ack", sizeof(chaincastack_t)+1, {
+    F_UINT("type", chaincastack.type), F_UINT("origin", chaincastack.origin), F_UINT("seq", chaincastack.seq),
+    F_UINT("down", chaincastack.down)}},
+  {MSG_FWUPDATE_BEGIN, "fwupdate_begin", sizeof(fwupdatebegin_t)+1, {
+    F_UINT("session", fwupdatebegin.session), F_UINT("reply_to", fwupdatebegin.reply_to),
+    F_UINT("size", fwupdatebegin.size), F_BYTES("sha256", fwupdatebegin.sha256)}},
+  {MSG_FWUPDATE_CHUNK, "fwupdate_chunk", sizeof(fwupdatechunk_t)+1, {
+    F_UINT("session", fwupdatechunk.session), F_UINT("index", fwupdatechunk.index), F_BYTES("data", fwupdatechunk.data)}},
+  {MSG_FWUPDATE_ACK, "fwupdate_ack", sizeof(fwupdateack_t)+1, {
+    F_UINT("pjon_id", fwupdateack.pjon_id), F_UINT("session", fwupdateack.session), F_UINT("next", fwupdateack.next),
+    F_UINT("status", fwupdateack.status)}},
+  {MSG_CONFIGDELTA, "configdelta", sizeof(configdelta_t)+4, {F_CHAINCAST,
+    F_UINT("version", chaincast.configdelta.version), F_UINT("base_hash", chaincast.configdelta.base_hash),
+    F_UINT("hash", chaincast.configdelta.hash), F_UINT("top", chaincast.configdelta.top),
+    F_UINT("count", chaincast.configdelta.count),
+    F_CONFIGCHANGE(0), F_CONFIGCHANGE(1), F_CONFIGCHANGE(2), F_CONFIGCHANGE(3), F_CONFIGCHANGE(4), F_CONFIGCHANGE(5),
+    F_CONFIGCHANGE(6)}},
+  {MSG_CONFIGREPORT, "configreport", sizeof(configreport_t)+1, {
+    F_UINT("pjon_id", configreport.pjon_id), F_UINT("status", configreport.status), F_UINT("version", configreport.version),
+    F_UINT("hash", configreport.hash)}},
+  {MSG_HISTORY_REQUEST, "history_request", sizeof(historyrequest_t)+1, {
+    F_UINT("reply_to", historyrequest.reply_to), F_UINT("sensorid", historyrequest.sensorid),
+    F_UINT("tier", historyrequest.tier), F_UINT("from", historyrequest.from), F_UINT("count", historyrequest.count)}},
+  {MSG_HISTORY_BLOCK, "history_block", sizeof(historyblock_t)+1, {
+    F_UINT("pjon_id", historyblock.pjon_id), F_UINT("sensorid", historyblock.sensorid), F_UINT("tier", historyblock.tier),
+    F_UINT("first", historyblock.first), F_UINT("count", historyblock.count), F_UINT("len", historyblock.len),
+    F_BYTES("data", historyblock.data)}},
+  {MSG_TIMESYNC, "timesync", sizeof(timesync_t)+1, {
+    F_UINT("epoch", timesync.epoch), F_UINT("seq", timesync.seq), F_UINT("prev_end_us", timesync.prev_end_us)}},
+  {MSG_LINKSTATS_REQUEST, "linkstats_request", sizeof(linkstatsrequest_t)+1, {
+    F_UINT("reply_to", linkstatsrequest.reply_to), F_UINT("peer", linkstatsrequest.peer)}},
+  {MSG_LINKSTATS, "linkstats", sizeof(linkstats_t)+1, {
+    F_UINT("pjon_id", linkstats.pjon_id), F_UINT("peer", linkstats.peer), F_UINT("sent", linkstats.sent),
+    F_UINT("full", linkstats.full), F_UINT("lost", linkstats.lost), F_UINT("retries", linkstats.retries),
+    F_UINT("heard", linkstats.heard), F_UINT("last_heard_s", linkstats.last_heard_s),
+    F_UINT("rtt0", linkstats.rtt_hist[0]), F_UINT("rtt1", linkstats.rtt_hist[1]), F_UINT("rtt2", linkstats.rtt_hist[2]),
+    F_UINT("rtt3", linkstats.rtt_hist[3]), F_UINT("rtt4", linkstats.rtt_hist[4]), F_UINT("rtt5", linkstats.rtt_hist[5]),
+    F_UINT("rtt6", linkstats.rtt_hist[6]), F_UINT("rtt7", linkstats.rtt_hist[7])}},
+  {MSG_PRESETCMD, "presetcmd", sizeof(presetcmd_t)+4, {F_CHAINCAST,
+    F_UINT("preset", chaincast.presetcmd.preset), F_UINT("room", chaincast.presetcmd.room)}},
+  {MSG_PRESETSET, "presetset", sizeof(presetset_t)+4, {F_CHAINCAST,
+    F_UINT("preset", chaincast.presetset.preset), F_UINT("top", chaincast.presetset.top),
+    F_UINT("damper0", chaincast.presetset.entry.damper[0]), F_UINT("damper1", chaincast.presetset.entry.damper[1]),
+    F_UINT("damper2", chaincast.presetset.entry.damper[2]), F_UINT("fan", chaincast.presetset.entry.fan),
+    F_UINT("fanlamina", chaincast.presetset.entry.fanlamina), F_UINT("duration_s", chaincast.presetset.entry.duration_s)}},
+};
+
+#define TOOL_NUM_MSGS (sizeof(tool_msgs_) / sizeof(tool_msgs_[0]))
+static_assert(TOOL_NUM_MSGS == MSG_PRESETSET + 1, "every pjon_msg_type_t needs an entry in tool_msgs_, in order");
+
+//the PJON destination of an injected msg, "to=" in a script line
+#define TOOL_DEFAULT_TO 1
+//binary capture: per frame t_ms:4 to:1 length:1 payload, little endian
+#define TOOL_BIN_HEADER_LEN 6
+//waking the µC from light sleep (see Idle Sleep in the README): it stays awake for IDLE_AWAKE_MS after console bytes,
+//otherwise '\n' goes first and the frames wait for CONSOLE_AWAKE_LINE, which only comes once nothing arrived
+//for IDLE_CONSOLE_QUIET_MS, what arrives before is dropped.
+//'\n' goes again after TOOL_WAKE_WAIT_US, after TOOL_WAKE_TRIES the frames go anyway (firmware without the awake line)
+#define TOOL_WAKE_WAIT_US 20000
+#define TOOL_WAKE_TRIES 3
+#define TOOL_AWAKE_US 400000
+
+static const ToolMsg *tool_msg_by_type(uint8_t type)
+{
+  return (type < TOOL_NUM_MSGS) ? &tool_msgs_[type] : 0;
+}
+
+static const ToolMsg *tool_msg_by_name(const char *name)
+{
+  for (size_t t=0; t<TOOL_NUM_MSGS; t++)
+    if (strcmp(tool_msgs_[t].name, name) == 0)
+      return &tool_msgs_[t];
+  return 0;
+}
+
+static bool tool_parse_hex(const char *s, uint8_t *out, size_t len)
+{
+  if (strlen(s) != 2 * len)
+    return false;
+  for (size_t i=0; i<len; i++)
+  {
+    unsigned v;
+    if (sscanf(s + 2*i, "%2x", &v) != 1)
+      return false;
+    out[i] = v;
+  }
+  return true;
+}
+
+///////// Encoding ///////////
+
+//"presetcmd to=1 preset=3 room=2": fields not given are 0, returns the length of the msg, 0 on errors
+static uint8_t tool_encode(const char *line, uint8_t *to, pjon_message_t *msg)
+{
+  char buf[512];
+  snprintf(buf, sizeof(buf), "%s", line);
+  char *save = 0;
+  char *tok = strtok_r(buf, " \t\r\n", &save);
+  const ToolMsg *tm = (tok) ? tool_msg_by_name(tok) : 0;
+  if (!tm)
+  {
+    fprintf(stderr, "dampertool: unknown msg '%s'\n", tok ? tok : "");
+    return 0;
+  }
+  memset(msg, 0, sizeof(*msg));
+  msg->type = tm->type;
+  *to = TOOL_DEFAULT_TO;
+  while ((tok = strtok_r(0, " \t\r\n", &save)) != 0)
+  {
+    char *eq = strchr(tok, '=');
+    if (!eq)
+    {
+      fprintf(stderr, "dampertool: %s: expected field=value, got '%s'\n", tm->name, tok);
+      return 0;
+    }
+    *eq = 0;
+    const char *value = eq + 1;
+    if (strcmp(tok, "to") == 0)
+    {
+      *to = strtoul(value, 0, 0);
+      continue;
+    }
+    const ToolField *f = tm->fields;
+    while (f->name && strcmp(f->name, tok) != 0)
+      f++;
+    if (!f->name)
+    {
+      fprintf(stderr, "dampertool: %s has no field '%s'\n", tm->name, tok);
+      return 0;
+    }
+    if (f->kind == FIELD_BYTES)
+    {
+      if (!tool_parse_hex(value, f->bytes(msg), f->len))
+      {
+        fprintf(stderr, "dampertool: %s.%s takes %zu bytes in hex\n", tm->name, f->name, f->len);
+        return 0;
+      }
+    }
+    else if (f->kind == FIELD_FLOAT)
+      f->set(msg, strtod(value, 0));
+    else
+      f->set(msg, strtoul(value, 0, 0));
+  }
+  return tm->length;
+}
+
+//what the host writes to the console: '>' to length payload, see tool_wake for waking the µC
+static size_t tool_injection(uint8_t to, const pjon_message_t *msg, uint8_t length, uint8_t *out)
+{
+  out[0] = '>';
+  out[1] = to;
+  out[2] = length;
+  memcpy(out + 3, msg, length);
+  return 3 + length;
+}
+
+///////// Decoding ///////////
+
+//"<IDLEN..." as printed by pjon_printf_msg, returns false if the line is something else
+static bool tool_decode_line(const char *line, uint8_t *to, uint8_t *length, pjon_message_t *msg)
+{
+  if (line[0] != '<')
+    return false;
+  uint8_t head[2];
+  if (!tool_parse_hex(std::string(line + 1, 4).c_str(), head, 2) || head[1] == 0 || head[1] > sizeof(*msg))
+    return false;
+  const char *hex = line + 5;
+  size_t n = strcspn(hex, "\r\n");
+  memset(msg, 0, sizeof(*msg));
+  if (n != 2u * head[1] || !tool_parse_hex(std::string(hex, n).c_str(), (uint8_t*) msg, head[1]))
+    return false;
+  *to = head[0];
+  *length = head[1];
+  return true;
+}
+
+//sep ' ': "event to=1 pjon_id=3 seq=7 ..", sep ',': the values only, in the order of tool_msgs_
+static void tool_print_msg(FILE *out, uint8_t to, uint8_t length, pjon_message_t *msg, char sep)
+{
+  const ToolMsg *tm = tool_msg_by_type(msg->type);
+  bool names = sep == ' ';
+  if (!tm)
+  {
+    fprintf(out, "type%u%c%s%u", msg->type, sep, names ? "to=" : "", to);
+    for (uint8_t i=1; i<length; i++)
+      fprintf(out, "%s%02x", (i == 1) ? (names ? " raw=" : ",") : "", ((uint8_t*) msg)[i]);
+    fprintf(out, "\n");
+    return;
+  }
+  fprintf(out, "%s%c%s%u", tm->name, sep, names ? "to=" : "", to);
+  if (length < tm->length)
+    fprintf(out, "%c%s%u", sep, names ? "short=" : "", length);
+  for (const ToolField *f = tm->fields; f->name; f++)
+  {
+    fprintf(out, "%c", sep);
+    if (names)
+      fprintf(out, "%s=", f->name);
+    if (f->kind == FIELD_BYTES)
+    {
+      uint8_t *b = f->bytes(msg);
+      for (size_t i=0; i<f->len; i++)
+        fprintf(out, "%02x", b[i]);
+    }
+    else if (f->kind == FIELD_FLOAT)
+      fprintf(out, "%g", f->get(msg));
+    else
+      fprintf(out, "%lu", (unsigned long) f->get(msg));
+  }
+  fprintf(out, "\n");
+}
+
+static void tool_list_msgs()
+{
+  for (size_t t=0; t<TOOL_NUM_MSGS; t++)
+  {
+    const ToolMsg *tm = &tool_msgs_[t];
+    printf("%2u %-18s %2u bytes:", tm->type, tm->name, tm->length);
+    for (const ToolField *f = tm->fields; f->name; f++)
+      printf(" %s", f->name);
+    printf("\n");
+  }
+}
+
+///////// Capture ///////////
+
+enum tool_capture_format_t {CAPTURE_TEXT, CAPTURE_CSV, CAPTURE_BIN};
+
+struct ToolCapture {
+  FILE *out;
+  tool_capture_format_t format;
+  uint64_t frames;
+  uint64_t by_type[TOOL_NUM_MSGS + 1]; // the last one counts unknown types
+};
+
+static void tool_capture_open(ToolCapture *c, const char *path)
+{
+  memset(c, 0, sizeof(*c));
+  c->out = stdout;
+  c->format = CAPTURE_TEXT;
+  if (!path)
+    return;
+  size_t n = strlen(path);
+  c->format = (n > 4 && strcmp(path + n - 4, ".csv") == 0) ? CAPTURE_CSV : CAPTURE_BIN;
+  c->out = fopen(path, (c->format == CAPTURE_BIN) ? "wb" : "w");
+  if (!c->out)
+  {
+    perror(path);
+    exit(2);
+  }
+  if (c->format == CAPTURE_CSV)
+    fprintf(c->out, "t_s,msg,to,fields (see dampertool -l)\n");
+}
+
+static void tool_capture_msg(ToolCapture *c, uint32_t t_ms, uint8_t to, uint8_t length, pjon_message_t *msg)
+{
+  c->frames++;
+  c->by_type[(msg->type < TOOL_NUM_MSGS) ? msg->type : TOOL_NUM_MSGS]++;
+  if (c->format == CAPTURE_BIN)
+  {
+    uint8_t head[TOOL_BIN_HEADER_LEN] = {(uint8_t) t_ms, (uint8_t) (t_ms >> 8), (uint8_t) (t_ms >> 16), (uint8_t) (t_ms >> 24), to, length};
+    fwrite(head, 1, sizeof(head), c->out);
+    fwrite(msg, 1, length, c->out);
+    return;
+  }
+  fprintf(c->out, "%u.%03u%c", t_ms / 1000, t_ms % 1000, (c->format == CAPTURE_CSV) ? ',' : ' ');
+  tool_print_msg(c->out, to, length, msg, (c->format == CAPTURE_CSV) ? ',' : ' ');
+}
+
+//a binary capture back to text or CSV
+static int tool_playback(const char *path, ToolCapture *c)
+{
+  FILE *in = fopen(path, "rb");
+  if (!in)
+  {
+    perror(path);
+    return 2;
+  }
+  uint8_t head[TOOL_BIN_HEADER_LEN];
+  pjon_message_t msg;
+  while (fread(head, 1, sizeof(head), in) == sizeof(head))
+  {
+    uint32_t t_ms = head[0] | head[1] << 8 | head[2] << 16 | (uint32_t) head[3] << 24;
+    memset(&msg, 0, sizeof(msg));
+    if (head[5] == 0 || head[5] > sizeof(msg) || fread(&msg, 1, head[5], in) != head[5])
+    {
+      fprintf(stderr, "%s: truncated after %lu frames\n", path, (unsigned long) c->frames);
+      fclose(in);
+      return 1;
+    }
+    tool_capture_msg(c, t_ms, head[4], head[5], &msg);
+  }
+  fclose(in);
+  return 0;
+}
+
+///////// Serial port ///////////
+
+static speed_t tool_baud(unsigned long baud)
+{
+  switch (baud)
+  {
+    case 9600: return B9600;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    default: return 0;
+  }
+}
+
+//raw 8N1, for a pty the speed is ignored
+static int tool_open_port(const char *path, unsigned long baud)
+{
+  int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+  {
+    perror(path);
+    return -1;
+  }
+  struct termios tio;
+  if (tcgetattr(fd, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetspeed(&tio, tool_baud(baud));
+    if (tcsetattr(fd, TCSANOW, &tio) != 0)
+      perror("tcsetattr");
+  }
+  return fd;
+}
+
+static bool tool_write_all(int fd, const uint8_t *buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t w = write(fd, buf, len);
+    if (w < 0 && errno == EAGAIN)
+    {
+      struct pollfd p = {fd, POLLOUT, 0};
+      poll(&p, 1, 100);
+      continue;
+    }
+    if (w <= 0)
+      return false;
+    buf += w;
+    len -= w;
+  }
+  return true;
+}
+
+static uint64_t tool_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+struct ToolWake {
+  uint64_t awake_us;  // our last write or the last CONSOLE_AWAKE_LINE, 0: none yet
+  uint64_t sent_us;   // of the last '\n'
+  uint8_t tries;      // '\n' sent since the µC may have gone to sleep
+};
+
+//1: the µC is awake, frames may go. 0: '\n' is (again) on its way, wait for CONSOLE_AWAKE_LINE. -1: write error
+static int tool_wake(int fd, ToolWake *w, uint64_t now)
+{
+  if (w->awake_us && now - w->awake_us < TOOL_AWAKE_US)
+  {
+    w->tries = 0;
+    return 1;
+  }
+  if (w->tries && now - w->sent_us < TOOL_WAKE_WAIT_US)
+    return 0;
+  if (w->tries == TOOL_WAKE_TRIES)
+  {
+    w->tries = 0;
+    w->awake_us = now;
+    return 1;
+  }
+  const uint8_t wake = '\n';
+  if (!tool_write_all(fd, &wake, 1))
+    return -1;
+  w->tries++;
+  w->sent_us = now;
+  return 0;
+}
+
+static volatile sig_atomic_t tool_stop_ = 0;
+
+static void tool_on_signal(int sig)
+{
+  (void) sig;
+  tool_stop_ = 1;
+}
+
+///////// Site Config ///////////
+
+//a site config file, see Site Config in the README: its version, the settings of each µC and the preset table
+struct ToolSite {
+  uint16_t version;
+  std::vector<nodeconfig_t> nodes; // pjon id 1 first
+  preset_t presets[PRESETS_NUM];
+};
+
+//the names of the nodeconfig_t fields in a site file, by config_field_t
+static const char *tool_site_fields_[] = {"installed", "open_pos0", "open_pos1", "open_pos2", "sensor_destination"};
+static_assert(sizeof(tool_site_fields_) / sizeof(tool_site_fields_[0]) == sizeof(nodeconfig_t), "every config_field_t needs a name");
+
+static bool tool_set_preset_field(preset_t *e, const char *name, unsigned long v)
+{
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+    if (strncmp(name, "damper", 6) == 0 && name[6] == '0' + d && name[7] == 0)
+    {
+      e->damper[d] = v;
+      return true;
+    }
+  if (strcmp(name, "fan") == 0)
+    e->fan = v;
+  else if (strcmp(name, "fanlamina") == 0)
+    e->fanlamina = v;
+  else if (strcmp(name, "duration_s") == 0)
+    e->duration_s = v;
+  else
+    return false;
+  return true;
+}
+
+//"version N", "node ID field=value ..", "preset P field=value ..", '#' starts a comment.
+//Fields not given are what the firmware starts with
+static bool tool_load_site(const char *path, ToolSite *site)
+{
+  FILE *in = fopen(path, "r");
+  if (!in)
+  {
+    perror(path);
+    return false;
+  }
+  site->version = 0;
+  site->nodes.clear();
+  presets_fill_defaults(site->presets);
+  char line[512];
+  unsigned lineno = 0;
+  bool ok = true;
+  while (fgets(line, sizeof(line), in))
+  {
+    lineno++;
+    line[strcspn(line, "#\r\n")] = 0;
+    char *save = 0;
+    char *kind = strtok_r(line, " \t", &save);
+    if (!kind)
+      continue;
+    char *id = strtok_r(0, " \t", &save);
+    unsigned long n = (id) ? strtoul(id, 0, 0) : 0;
+    bool is_node = strcmp(kind, "node") == 0 && n >= 1 && n < PJON_ID_NOT_ASSIGNED;
+    bool is_preset = strcmp(kind, "preset") == 0 && id && n < PRESETS_NUM && n != PRESET_OFF;
+    if (strcmp(kind, "version") == 0 && id)
+    {
+      site->version = n;
+      continue;
+    }
+    if (!is_node && !is_preset)
+    {
+      fprintf(stderr, "%s:%u: expected 'version N', 'node ID field=value ..' or 'preset P field=value ..' (P 1..%u)\n",
+        path, lineno, PRESETS_NUM - 1);
+      ok = false;
+      continue;
+    }
+    if (is_node && site->nodes.size() < n)
+      site->nodes.resize(n, nodeconfig_t{0, {80, 80, 80}, 0}); // as in settings.cpp
+    char *tok;
+    while ((tok = strtok_r(0, " \t", &save)) != 0)
+    {
+      char *eq = strchr(tok, '=');
+      bool known = false;
+      if (eq)
+      {
+        *eq = 0;
+        unsigned long v = strtoul(eq + 1, 0, 0);
+        for (uint8_t f=0; is_node && f<sizeof(nodeconfig_t); f++)
+          if (strcmp(tok, tool_site_fields_[f]) == 0)
+          {
+            ((uint8_t*) &site->nodes[n-1])[f] = v;
+            known = true;
+          }
+        if (is_preset)
+          known = tool_set_preset_field(&site->presets[n], tok, v);
+      }
+      if (!known)
+      {
+        fprintf(stderr, "%s:%u: %s has no field '%s'\n", path, lineno, kind, tok);
+        ok = false;
+      }
+    }
+  }
+  fclose(in);
+  if (ok && site->nodes.empty())
+  {
+    fprintf(stderr, "%s: no node\n", path);
+    ok = false;
+  }
+  return ok;
+}
+
+//the hash of a site config, FNV-1a over version and settings: any hash will do as long as it is never CONFIG_HASH_ANY
+static uint32_t tool_site_hash(const ToolSite *site)
+{
+  uint32_t h = 2166136261u;
+  h = config_hash_byte(h, site->version & 0xFF);
+  h = config_hash_byte(h, site->version >> 8);
+  for (const nodeconfig_t &c : site->nodes)
+    for (uint8_t f=0; f<sizeof(nodeconfig_t); f++)
+      h = config_hash_byte(h, ((const uint8_t*) &c)[f]);
+  return (h == CONFIG_HASH_ANY) ? 1 : h;
+}
+
+static void tool_print_delta(const ToolSite *site, uint32_t base_hash, const std::vector<configchange_t> &changes)
+{
+  pjon_message_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MSG_CONFIGDELTA;
+  msg.chaincast.configdelta.version = site->version;
+  msg.chaincast.configdelta.base_hash = base_hash;
+  msg.chaincast.configdelta.hash = tool_site_hash(site);
+  msg.chaincast.configdelta.top = site->nodes.size();
+  msg.chaincast.configdelta.count = changes.size();
+  memcpy(msg.chaincast.configdelta.changes, changes.data(), changes.size() * sizeof(configchange_t));
+  tool_print_msg(stdout, TOOL_DEFAULT_TO, tool_msg_by_type(MSG_CONFIGDELTA)->length, &msg, ' ');
+}
+
+static bool tool_preset_equal(const preset_t *a, const preset_t *b)
+{
+  return memcmp(a->damper, b->damper, NUM_DAMPER) == 0 && a->fan == b->fan && a->fanlamina == b->fanlamina
+    && a->duration_s == b->duration_s;
+}
+
+//print the script that takes the ladder from the site config in old_path (0: set up by hand) to the one in path:
+//the presets that changed first, so the reports to the deltas include them, then deltas of up to
+//CONFIGDELTA_MAX_CHANGES with a version each (the last one with the version of path), then what every µC reports to it
+static int tool_site_delta(const char *path, const char *old_path)
+{
+  ToolSite site, old;
+  if (!tool_load_site(path, &site) || (old_path && !tool_load_site(old_path, &old)))
+    return 2;
+  uint8_t top = site.nodes.size();
+  std::vector<std::vector<configchange_t>> deltas;
+  if (!old_path)
+  {
+    //whatever the µC have now, each one gets all its fields
+    for (uint8_t id=1; id<=top; id++)
+    {
+      deltas.push_back(std::vector<configchange_t>());
+      for (uint8_t f=0; f<sizeof(nodeconfig_t); f++)
+        deltas.back().push_back(configchange_t{id, f, ((uint8_t*) &site.nodes[id-1])[f]});
+    }
+  }
+  else
+  {
+    if (old.nodes.size() != top)
+    {
+      fprintf(stderr, "dampertool: %s has %u µC, %s %u, send the new ones all their fields (no -c)\n",
+        old_path, (unsigned) old.nodes.size(), path, top);
+      return 2;
+    }
+    std::vector<configchange_t> changes;
+    for (uint8_t id=1; id<=top; id++)
+      for (uint8_t f=0; f<sizeof(nodeconfig_t); f++)
+        if (((uint8_t*) &site.nodes[id-1])[f] != ((uint8_t*) &old.nodes[id-1])[f])
+          changes.push_back(configchange_t{id, f, ((uint8_t*) &site.nodes[id-1])[f]});
+    for (size_t c=0; c<changes.size(); c+=CONFIGDELTA_MAX_CHANGES)
+      deltas.push_back(std::vector<configchange_t>(changes.begin() + c,
+        changes.begin() + std::min(changes.size(), c + CONFIGDELTA_MAX_CHANGES)));
+    if ((deltas.empty()) ? site.version != old.version : site.version < old.version + deltas.size())
+    {
+      fprintf(stderr, "dampertool: %s needs version %u%s, one per delta\n", path,
+        (unsigned) (old.version + deltas.size()), (deltas.empty()) ? "" : " or later");
+      return 2;
+    }
+  }
+
+  printf("# %s -> %s\n", (old_path) ? old_path : "set up by hand", path);
+  for (uint8_t p=0; p<PRESETS_NUM; p++)
+  {
+    if (p == PRESET_OFF || (old_path && tool_preset_equal(&site.presets[p], &old.presets[p])))
+      continue; //the µC keep preset 0 as it is
+    pjon_message_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_PRESETSET;
+    msg.chaincast.presetset.preset = p;
+    msg.chaincast.presetset.top = top;
+    msg.chaincast.presetset.entry = site.presets[p];
+    tool_print_msg(stdout, TOOL_DEFAULT_TO, tool_msg_by_type(MSG_PRESETSET)->length, &msg, ' ');
+  }
+  ToolSite cur = (old_path) ? old : site;
+  for (size_t d=0; d<deltas.size(); d++)
+  {
+    //all fields of a µC go with base_hash CONFIG_HASH_ANY, whatever it has now
+    uint32_t base_hash = (old_path) ? tool_site_hash(&cur) : CONFIG_HASH_ANY;
+    for (const configchange_t &ch : deltas[d])
+      ((uint8_t*) &cur.nodes[ch.pjon_id-1])[ch.field] = ch.value;
+    cur.version = (!old_path || d + 1 == deltas.size()) ? site.version : cur.version + 1;
+    tool_print_delta(&cur, base_hash, deltas[d]);
+  }
+  printf("# site config v%u hash %08lx, the configreport of each µC:\n", site.version, (unsigned long) tool_site_hash(&site));
+  for (uint8_t id=1; id<=top; id++)
+    printf("#   pjon_id=%u version=%u hash=%lu\n", id, site.version, (unsigned long) config_node_hash(&site.nodes[id-1], site.presets));
+  return 0;
+}
+
+///////// Firmware update ///////////
+
+//chunk index of the image as the console takes it, see 'u' in handle_serialdata
+static size_t tool_fw_chunk(const std::vector<uint8_t> &image, uint16_t index, uint8_t *out)
+{
+  out[0] = 'u';
+  out[1] = 2 + FWUPDATE_CHUNK_LEN;
+  out[2] = index & 0xFF;
+  out[3] = index >> 8;
+  memset(out + 4, 0xFF, FWUPDATE_CHUNK_LEN);
+  size_t offset = (size_t) index * FWUPDATE_CHUNK_LEN;
+  if (offset < image.size())
+    memcpy(out + 4, image.data() + offset, std::min((size_t) FWUPDATE_CHUNK_LEN, image.size() - offset));
+  uint32_t crc = fwupdate_crc32(out + 1, 3 + FWUPDATE_CHUNK_LEN);
+  memcpy(out + 4 + FWUPDATE_CHUNK_LEN, &crc, 4);
+  return 1 + FWUPDATE_CHUNK_FRAME_LEN;
+}
+
+//the host side of fwupdate.cpp: have the µC on the port update pjon id to with the image,
+//answer every U<index> the bridge prints with that chunk, until it prints that the update is done or failed
+static int tool_fwupdate(int fd, const char *port, uint8_t to, const char *image_path, double run_s, bool verbose)
+{
+  FILE *in = fopen(image_path, "rb");
+  if (!in)
+  {
+    perror(image_path);
+    return 2;
+  }
+  std::vector<uint8_t> image;
+  uint8_t buf[4096];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), in)) > 0; )
+    image.insert(image.end(), buf, buf + n);
+  fclose(in);
+  uint32_t size = image.size();
+  uint8_t begin[1 + 1 + 4 + FWUPDATE_HASH_LEN] = {'U', to};
+  memcpy(begin + 2, &size, 4);
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  mbedtls_sha256_update(&sha, image.data(), size);
+  mbedtls_sha256_finish(&sha, begin + 6);
+  mbedtls_sha256_free(&sha);
+
+  uint64_t t0 = tool_now_us(), chunks = 0;
+  ToolWake wake = {0, 0, 0};
+  bool begun = false;
+  int result = -1; // 0: done, 1: failed
+  std::string line;
+  while (!tool_stop_ && result < 0)
+  {
+    uint64_t now = tool_now_us();
+    if (run_s > 0 && now - t0 >= (uint64_t) (run_s * 1e6))
+      break;
+    //while the update runs the µC stays awake, only the 'U' may have to wake it up
+    if (!begun)
+    {
+      int awake = tool_wake(fd, &wake, now);
+      if (awake < 0 || (awake > 0 && !tool_write_all(fd, begin, sizeof(begin))))
+      {
+        perror(port);
+        break;
+      }
+      begun = awake > 0;
+    }
+    struct pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, (begun) ? 100 : TOOL_WAKE_WAIT_US / 1000) <= 0)
+      continue;
+    ssize_t r = read(fd, buf, sizeof(buf));
+    if (r <= 0)
+    {
+      if (r < 0 && errno == EAGAIN)
+        continue;
+      fprintf(stderr, "dampertool: %s closed\n", port);
+      break;
+    }
+    for (ssize_t i=0; i<r && result < 0; i++)
+    {
+      if (buf[i] != '\n')
+      {
+        line += (char) buf[i];
+        continue;
+      }
+      line.erase(line.find_last_not_of('\r') + 1);
+      unsigned index;
+      if (line == CONSOLE_AWAKE_LINE)
+        wake.awake_us = tool_now_us();
+      else if (line.size() == 5 && sscanf(line.c_str(), "U%4X", &index) == 1)
+      {
+        uint8_t out[1 + FWUPDATE_CHUNK_FRAME_LEN];
+        if (!tool_write_all(fd, out, tool_fw_chunk(image, index, out)))
+        {
+          perror(port);
+          result = 1;
+        }
+        chunks++;
+      }
+      else if (line.compare(0, 10, "fwupdate: ") == 0)
+      {
+        fprintf(stderr, "%s\n", line.c_str());
+        if (line.find(" done") != std::string::npos)
+          result = 0;
+        else if (line.find("failed") != std::string::npos || line.find("giving up") != std::string::npos
+                 || line.find("aborted") != std::string::npos
+                 || line.find("can not") != std::string::npos || line.find("not supported") != std::string::npos)
+          result = 1;
+      }
+      else if (verbose)
+        fprintf(stderr, "%s\n", line.c_str());
+      line.clear();
+    }
+  }
+  //stopped or out of time: the bridge would take nothing but chunks until it gives up by itself
+  if (begun && result < 0)
+  {
+    uint8_t cans[FWUPDATE_ABORT_LEN];
+    memset(cans, FWUPDATE_ABORT_CHAR, sizeof(cans));
+    if (!tool_write_all(fd, cans, sizeof(cans)))
+      perror(port);
+  }
+  double wall_s = (tool_now_us() - t0) / 1e6;
+  fprintf(stderr, "{\"dampertool\":\"%s\",\"fwupdate\":%u,\"bytes\":%lu,\"chunks_sent\":%lu,\"wall_s\":%.1f,\"done\":%s}\n",
+    port, to, (unsigned long) size, (unsigned long) chunks, wall_s, (result == 0) ? "true" : "false");
+  return (result == 0) ? 0 : 1;
+}
+
+struct ToolScriptLine {
+  uint8_t to;
+  uint8_t length;
+  pjon_message_t msg;
+};
+
+//one msg per line as in tool_encode, '#' starts a comment
+static bool tool_load_script(const char *path, std::vector<ToolScriptLine> *script)
+{
+  FILE *in = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+  if (!in)
+  {
+    perror(path);
+    return false;
+  }
+  char line[512];
+  unsigned lineno = 0;
+  bool ok = true;
+  while (fgets(line, sizeof(line), in))
+  {
+    lineno++;
+    line[strcspn(line, "#\r\n")] = 0;
+    if (line[strspn(line, " \t")] == 0)
+      continue;
+    ToolScriptLine s;
+    s.length = tool_encode(line, &s.to, &s.msg);
+    if (s.length == 0)
+    {
+      fprintf(stderr, "%s:%u: not sent\n", path, lineno);
+      ok = false;
+      continue;
+    }
+    script->push_back(s);
+  }
+  if (in != stdin)
+    fclose(in);
+  return ok;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s -d port [-b baud] [-r script] [-R msgs_per_s] [-n repeat] [-w wait_s] [-T seconds] [-o capture.csv|.bin] [-v]\n"
+                  "       %s -d port [-b baud] -t to -F image.bin [-T seconds] [-v]   update the firmware of pjon id to\n"
+                  "       %s -C new.site [-c old.site]  print the deltas from old.site (or µC set up by hand) to new.site as a script\n"
+                  "       %s -e 'msg field=value ..'   print the injection bytes\n"
+                  "       %s -x '<IDLEN..'             decode a line the µC printed\n"
+                  "       %s -p capture.bin [-o capture.csv]\n"
+                  "       %s -l                        list msgs and fields\n", argv0, argv0, argv0, argv0, argv0, argv0, argv0);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *port = 0, *script_path = 0, *capture_path = 0, *playback_path = 0, *image_path = 0;
+  const char *site_path = 0, *old_site_path = 0;
+  unsigned long fw_to = 0;
+  unsigned long baud = SERIAL_BAUD;
+  double rate = 20, wait_s = 2, run_s = 0;
+  unsigned long repeat = 1;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:b:r:R:n:w:T:o:e:x:p:t:F:C:c:lvh")) != -1)
+  {
+    switch (opt)
+    {
+      case 'd': port = optarg; break;
+      case 'b': baud = strtoul(optarg, 0, 0); break;
+      case 'r': script_path = optarg; break;
+      case 'R': rate = atof(optarg); break;
+      case 'n': repeat = strtoul(optarg, 0, 0); break;
+      case 'w': wait_s = atof(optarg); break;
+      case 'T': run_s = atof(optarg); break;
+      case 'o': capture_path = optarg; break;
+      case 'p': playback_path = optarg; break;
+      case 't': fw_to = strtoul(optarg, 0, 0); break;
+      case 'F': image_path = optarg; break;
+      case 'C': site_path = optarg; break;
+      case 'c': old_site_path = optarg; break;
+      case 'v': verbose = true; break;
+      case 'l': tool_list_msgs(); return 0;
+      case 'e':
+      {
+        uint8_t to, out[3 + sizeof(pjon_message_t)];
+        pjon_message_t msg;
+        uint8_t length = tool_encode(optarg, &to, &msg);
+        if (length == 0)
+          return 2;
+        size_t n = tool_injection(to, &msg, length, out);
+        for (size_t i=0; i<n; i++)
+          printf("\\x%02x", out[i]);
+        printf("\n");
+        return 0;
+      }
+      case 'x':
+      {
+        uint8_t to, length;
+        pjon_message_t msg;
+        if (!tool_decode_line(optarg, &to, &length, &msg))
+        {
+          fprintf(stderr, "dampertool: not a msg line\n");
+          return 2;
+        }
+        tool_print_msg(stdout, to, length, &msg, ' ');
+        return 0;
+      }
+      default: usage(argv[0]); return 2;
+    }
+  }
+
+  if (site_path)
+    return tool_site_delta(site_path, old_site_path);
+  ToolCapture capture;
+  if (playback_path)
+  {
+    tool_capture_open(&capture, capture_path);
+    int rv = tool_playback(playback_path, &capture);
+    if (capture.out != stdout)
+      fclose(capture.out);
+    return rv;
+  }
+  if (!port || rate <= 0 || tool_baud(baud) == 0)
+  {
+    usage(argv[0]);
+    return 2;
+  }
+  if (image_path && (fw_to == 0 || fw_to >= PJON_ID_NOT_ASSIGNED))
+  {
+    fprintf(stderr, "-F needs -t with the pjon id of the µC to update\n");
+    return 2;
+  }
+  std::vector<ToolScriptLine> script;
+  if (script_path && !tool_load_script(script_path, &script))
+    return 2;
+  int fd = tool_open_port(port, baud);
+  if (fd < 0)
+    return 2;
+  if (image_path)
+  {
+    signal(SIGINT, tool_on_signal);
+    signal(SIGTERM, tool_on_signal);
+    int rv = tool_fwupdate(fd, port, fw_to, image_path, run_s, verbose);
+    close(fd);
+    return rv;
+  }
+  tool_capture_open(&capture, capture_path);
+  signal(SIGINT, tool_on_signal);
+  signal(SIGTERM, tool_on_signal);
+
+  uint64_t t0 = tool_now_us();
+  uint64_t interval_us = (uint64_t) (1e6 / rate);
+  uint64_t next_send_us = t0;
+  uint64_t sent = 0, sent_bytes = 0, lines = 0, late_us_max = 0;
+  ToolWake wake = {0, 0, 0};
+  //repeat 0: until stopped
+  uint64_t to_send = (repeat == 0) ? UINT64_MAX : (uint64_t) repeat * script.size();
+  uint64_t done_us = 0; // when the script was done, capturing goes on for wait_s
+  std::string line;
+  while (!tool_stop_)
+  {
+    uint64_t now = tool_now_us();
+    if (run_s > 0 && now - t0 >= (uint64_t) (run_s * 1e6))
+      break;
+    if (sent < to_send && !script.empty())
+    {
+      int awake = (now >= next_send_us) ? tool_wake(fd, &wake, now) : 0;
+      if (awake < 0)
+      {
+        perror(port);
+        tool_stop_ = 1;
+      }
+      while (awake > 0 && sent < to_send && now >= next_send_us)
+      {
+        ToolScriptLine *s = &script[sent % script.size()];
+        uint8_t out[3 + sizeof(pjon_message_t)];
+        size_t n = tool_injection(s->to, &s->msg, s->length, out);
+        if (!tool_write_all(fd, out, n))
+        {
+          perror(port);
+          tool_stop_ = 1;
+          break;
+        }
+        if (now - next_send_us > late_us_max)
+          late_us_max = now - next_send_us;
+        sent++;
+        sent_bytes += n;
+        next_send_us += interval_us;
+        wake.awake_us = now;
+      }
+      if (sent == to_send)
+        done_us = now;
+    }
+    else if (done_us == 0)
+      done_us = now;
+    if (script_path && done_us && run_s <= 0 && now - done_us >= (uint64_t) (wait_s * 1e6))
+      break;
+
+    int timeout_ms = 50;
+    if (sent < to_send && !script.empty())
+      timeout_ms = (next_send_us > now) ? (int) ((next_send_us - now + 999) / 1000) : (wake.tries) ? TOOL_WAKE_WAIT_US / 1000 : 0;
+    struct pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, timeout_ms) <= 0)
+      continue;
+    uint8_t buf[4096];
+    ssize_t r = read(fd, buf, sizeof(buf));
+    if (r <= 0)
+    {
+      if (r < 0 && errno == EAGAIN)
+        continue;
+      fprintf(stderr, "dampertool: %s closed\n", port);
+      break;
+    }
+    for (ssize_t i=0; i<r; i++)
+    {
+      if (buf[i] != '\n')
+      {
+        line += (char) buf[i];
+        continue;
+      }
+      uint8_t to, length;
+      pjon_message_t msg;
+      uint32_t t_ms = (tool_now_us() - t0) / 1000;
+      lines++;
+      if (line.compare(0, line.find_last_not_of('\r') + 1, CONSOLE_AWAKE_LINE) == 0)
+        wake.awake_us = tool_now_us();
+      else if (tool_decode_line(line.c_str(), &to, &length, &msg))
+        tool_capture_msg(&capture, t_ms, to, length, &msg);
+      else if (verbose)
+        fprintf(stderr, "%s\n", line.c_str());
+      line.clear();
+    }
+  }
+  close(fd);
+  if (capture.out != stdout)
+    fclose(capture.out);
+  else
+    fflush(stdout);
+
+  double wall_s = (tool_now_us() - t0) / 1e6;
+  double send_s = (done_us > t0) ? (done_us - t0) / 1e6 : wall_s;
+  fprintf(stderr, "{\"dampertool\":\"%s\",\"wall_s\":%.1f,\"sent\":%lu,\"sent_bytes\":%lu,\"msgs_per_s\":%.1f,\"late_ms_max\":%.1f,"
+    "\"lines\":%lu,\"frames\":%lu", port, wall_s, (unsigned long) sent, (unsigned long) sent_bytes,
+    (send_s > 0) ? sent / send_s : 0.0, late_us_max / 1000.0, (unsigned long) lines, (unsigned long) capture.frames);
+  for (size_t t=0; t<=TOOL_NUM_MSGS; t++)
+    if (capture.by_type[t])
+      fprintf(stderr, ",\"%s\":%lu", (t < TOOL_NUM_MSGS) ? tool_msgs_[t].name : "unknown", (unsigned long) capture.by_type[t]);
+  fprintf(stderr, "}\n");
+  return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ *  Damper Control Firmware - Host Simulator
+ *
+ *  One simulated µC: the firmware sources are compiled into their own namespace,
+ *  so every copy of node.cpp (built with a different SIM_NODE_IDX) gets its own set of globals.
+ *
+ *  This software is made with love
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//everything with an include guard has to be included here first,
+//so the includes inside the firmware sources below do not pull it into the node namespace
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <vector>
+#include "sim.h"
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "PJON.h"
+#include "driver/pcnt.h"
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "mbedtls/sha256.h"
+
+#ifndef SIM_NODE_IDX
+#error "compile with -DSIM_NODE_IDX=<n>"
+#endif
+
+#define SIM_CONCAT2(a,b) a##b
+#define SIM_CONCAT(a,b) SIM_CONCAT2(a,b)
+#define SIM_NODE_NS SIM_CONCAT(simnode, SIM_NODE_IDX)
+
+namespace SIM_NODE_NS {
+
+//console output of the firmware goes to the simulated node
+int printf(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  int rv = sim_node_vprintf(fmt, ap);
+  va_end(ap);
+  return rv;
+}
+
+#include "../src/settings.cpp"
+#include "../src/comm.cpp"
+#include "../src/main.cpp"
+#include "../src/capture.cpp"
+#include "../src/fwupdate.cpp"
+#include "../src/history.cpp"
+#include "../src/timesync.cpp"
+#include "../src/linkstats.cpp"
+#include "../src/presets.cpp"
+#include "../src/pressuresig.cpp"
+
+#ifndef BMPE280_ENABLED
+//pressure.cpp is only built with BMPE280_ENABLED, the simulator provides its own sensors
+void pressure_sensors_init()
+{
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+    sensor_installed_[d] = sim_cur->sensor_installed[d];
+}
+
+void task_check_pressure()
+{
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+    sensor_installed_[d] = sim_cur->sensor_installed[d];
+}
+
+float get_latest_pressure(uint8_t sensorid)
+{
+  return sim_cur->sensor_pascal[sensorid];
+}
+
+float get_latest_temperature(uint8_t sensorid)
+{
+  (void) sensorid;
+  return 21.0;
+}
+#endif
+
+static void sim_timer_isr() { sim_isr_TIMER3_COMPA_vect(); }
+#if ENDSTOP_PCNT
+//the endstop edges are counted by the simulated pcnt units, there is no pinchange interrupt
+static void sim_pinchange_isr() {}
+#else
+static void sim_pinchange_isr() { sim_isr_PCINT0_vect(); }
+#endif
+static void sim_serialdata(char c) { handle_serialdata(c); }
+static void sim_chaincast_recv(uint8_t toid, void *msg) { pjon_chaincast_recv_handler(toid, (pjon_message_t*) msg); }
+static void sim_control_dampers() { task_control_dampers(); }
+static uint32_t sim_bus_us() { return timesync_bus_us(micros()); }
+static void sim_send_pressure(uint8_t sensorid) { pjon_send_pressure_infomsg(sensorid, get_latest_pressure(sensorid), get_latest_temperature(sensorid), micros()); }
+
+struct SimRegistrar {
+  SimRegistrar()
+  {
+    SimNodeApi api;
+    api.setup = setup;
+    api.loop = loop;
+    api.timer_isr = sim_timer_isr;
+    api.pinchange_isr = sim_pinchange_isr;
+    api.serialdata = sim_serialdata;
+    api.serialdata_bulk = handle_serialdata_bulk;
+    api.pjon_recv_handler = pjon_recv_handler;
+    api.pjon_postrecv_handle_msg = pjon_postrecv_handle_msg;
+    api.pjon_chaincast_recv_handler = sim_chaincast_recv;
+    api.task_control_dampers = sim_control_dampers;
+    api.set_idassign_callback = pjon_set_idassign_callback;
+    api.bus_us = sim_bus_us;
+    api.pjon_rx_fixed_us = &pjon_rx_fixed_us_;
+    api.send_pressure = sim_send_pressure;
+    api.damper_states = damper_states_;
+    api.damper_target_states = damper_target_states_;
+    api.damper_open_pos = damper_open_pos_;
+    api.fan_target_state = &fan_target_state_;
+    api.fanlamina_target_state = &fanlamina_target_state_;
+    sim_register_node(SIM_NODE_IDX, api);
+  }
+};
+
+static SimRegistrar sim_registrar_;
+
+}
@@ -0,0 +1,207 @@
+/*
+ *  Damper Control Firmware - Host Simulator
+ *
+ *  A simulated ladder of µC running in real time (or faster, -x), with the console of every µC on a pty.
+ *  Anything that talks to a µC over its serial port, dampertool or the Go ventilation interface,
+ *  can be pointed at one of the ptys instead. Every µC has pressure sensor 0 reporting to PJON id 1.
+ *
+ *  This software is made with love
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "sim.h"
+#include "Arduino.h"
+#include "../src/dampercontrol.h"
+
+//virtual time per step, console bytes go in and out between steps
+#define PTYSIM_STEP_US 1000
+//the pressure sensors get a new reading this often
+#define PTYSIM_PRESSURE_STEP_US 1000000
+
+struct PtySimConsole {
+  int master;
+  int slave;  //kept open, so the master does not see a hangup while no client is connected
+  char name[64];
+  uint64_t bytes_in, bytes_out, bytes_dropped;
+};
+
+static PtySimConsole ptysim_consoles_[SIM_MAX_NODES];
+static volatile sig_atomic_t ptysim_stop_ = 0;
+
+static void ptysim_on_signal(int sig)
+{
+  (void) sig;
+  ptysim_stop_ = 1;
+}
+
+static uint64_t wall_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static bool ptysim_open(PtySimConsole *c)
+{
+  memset(c, 0, sizeof(*c));
+  c->master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (c->master < 0 || grantpt(c->master) != 0 || unlockpt(c->master) != 0)
+    return false;
+  snprintf(c->name, sizeof(c->name), "%s", ptsname(c->master));
+  c->slave = open(c->name, O_RDWR | O_NOCTTY);
+  if (c->slave < 0)
+    return false;
+  //raw both ways, a '\n' or 0x03 in a PJON msg must not be touched by the line discipline
+  struct termios tio;
+  tcgetattr(c->slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(c->slave, TCSANOW, &tio);
+  fcntl(c->master, F_SETFL, fcntl(c->master, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+//what the host wrote goes to the uart of the node, what the node printed goes back.
+//Output nobody reads is dropped once the pty is full, like a uart with nothing connected
+static void ptysim_pump(uint8_t idx)
+{
+  PtySimConsole *c = &ptysim_consoles_[idx];
+  SimNode *n = sim_node(idx);
+  uint8_t buf[1024];
+  ssize_t r;
+  while ((r = read(c->master, buf, sizeof(buf))) > 0)
+  {
+    sim_serial_write(idx, (const char*) buf, r);
+    c->bytes_in += r;
+  }
+  size_t done = 0;
+  while (done < n->serial_out.size())
+  {
+    ssize_t w = write(c->master, n->serial_out.data() + done, n->serial_out.size() - done);
+    if (w <= 0)
+      break;
+    done += w;
+  }
+  c->bytes_out += done;
+  c->bytes_dropped += n->serial_out.size() - done;
+  n->serial_out.clear();
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-n nodes] [-x speed] [-l frame_loss] [-s seed] [-z] [-v]\n"
+                  "  -z: every µC light sleeps while idle ('Z1'), the first one too\n", argv0);
+}
+
+int main(int argc, char *argv[])
+{
+  uint8_t nodes = 4;
+  double speed = 1.0;
+  double frame_loss = 0.0;
+  uint32_t seed = 1;
+  bool verbose = false;
+  bool idle_sleep = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:x:l:s:zvh")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': nodes = atoi(optarg); break;
+      case 'x': speed = atof(optarg); break;
+      case 'l': frame_loss = atof(optarg); break;
+      case 's': seed = strtoul(optarg, 0, 0); break;
+      case 'z': idle_sleep = true; break;
+      case 'v': verbose = true; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if (nodes < 1 || nodes > sim_num_nodes() || speed <= 0)
+  {
+    fprintf(stderr, "ptysim: 1..%u nodes and a speed above 0\n", sim_num_nodes());
+    return 2;
+  }
+
+  //a damper on the bottom, middle and top µC, as in soak.cpp
+  uint8_t installed[SIM_MAX_NODES] = {0};
+  installed[0] |= _BV(0);
+  installed[nodes/2] |= _BV(1);
+  installed[nodes-1] |= _BV(2);
+  float pascal[SIM_MAX_NODES];
+  sim_init(seed);
+  sim_bus.frame_loss = frame_loss;
+  for (uint8_t i=0; i<nodes; i++)
+  {
+    if (!ptysim_open(&ptysim_consoles_[i]))
+    {
+      perror("ptysim: pty");
+      return 1;
+    }
+    SimNode *n = sim_node(i);
+    sim_preset_eeprom(i, i+1, installed[i]);
+    n->eeprom[4 + SIM_NUM_DAMPER] = 1; //sensor destination, see saveSettings2EEPROM()
+    sim_preset_idle_sleep(i, idle_sleep);
+    n->capture_output = true;
+    n->log_output = verbose;
+    n->sensor_installed[0] = true;
+    pascal[i] = 980.0f + i;
+    n->sensor_pascal[0] = pascal[i];
+    printf("ptysim: µC %u (PJON id %u) console on %s\n", i, i+1, ptysim_consoles_[i].name);
+  }
+  fflush(stdout);
+  for (uint8_t i=0; i<nodes; i++)
+    sim_boot(i);
+  signal(SIGINT, ptysim_on_signal);
+  signal(SIGTERM, ptysim_on_signal);
+
+  uint64_t t0 = wall_us(), v0 = sim_now_us;
+  uint64_t next_pressure_us = sim_now_us;
+  while (!ptysim_stop_)
+  {
+    for (uint8_t i=0; i<nodes; i++)
+      ptysim_pump(i);
+    if (sim_now_us >= next_pressure_us)
+    {
+      //a slow random walk, 0.1Pa steps
+      for (uint8_t i=0; i<nodes; i++)
+      {
+        pascal[i] += ((int) (sim_rand() % 3) - 1) * 0.1f;
+        sim_node(i)->sensor_pascal[0] = pascal[i];
+      }
+      next_pressure_us += PTYSIM_PRESSURE_STEP_US;
+    }
+    sim_run(PTYSIM_STEP_US);
+    uint64_t due_us = t0 + (uint64_t) ((sim_now_us - v0) / speed);
+    uint64_t now = wall_us();
+    if (due_us > now)
+      usleep(due_us - now);
+  }
+
+  double wall_s = (wall_us() - t0) / 1e6, virtual_s = (sim_now_us - v0) / 1e6;
+  printf("{\"ptysim\":\"ladder\",\"nodes\":%u,\"virtual_s\":%.1f,\"wall_s\":%.1f,\"frames\":%lu,\"pjon_lost\":%lu",
+    nodes, virtual_s, wall_s, (unsigned long) sim_bus_stats.frames, (unsigned long) sim_bus_stats.connection_lost);
+  for (uint8_t i=0; i<nodes; i++)
+    printf(",\"in%u\":%lu,\"out%u\":%lu,\"dropped%u\":%lu", i, (unsigned long) ptysim_consoles_[i].bytes_in,
+      i, (unsigned long) ptysim_consoles_[i].bytes_out, i, (unsigned long) ptysim_consoles_[i].bytes_dropped);
+  printf("}\n");
+  return 0;
+}
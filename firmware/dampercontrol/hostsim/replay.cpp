@@ -0,0 +1,339 @@
+/*
+ *  Damper Control Firmware - Host Simulator
+ *
+ *  Replay of a capture taken with 'C' on the serial console (see ../src/capture.cpp):
+ *  the recorded PJON frames and endstop levels are fed to a simulated node at their recorded times
+ *  and the motor and fan outputs it produces are compared to the recorded ones.
+ *  Runs in virtual time, so a capture of a whole day replays in seconds and always the same way.
+ *
+ *  This software is made with love
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <vector>
+#include "sim.h"
+#include "Arduino.h"
+#include "../src/dampercontrol.h"
+
+struct CaptureRecord {
+  uint8_t kind;
+  uint32_t ms;
+  std::vector<uint8_t> data;
+};
+
+struct OutputChange {
+  uint32_t ms;
+  uint8_t outputs;
+};
+
+static uint32_t replay_seed_ = 1;
+static bool replay_verbose_ = false;
+//an output may change this much earlier or later than recorded:
+//the capture has ms resolution and the replayed tick does not have the phase of the µC's timer
+static uint32_t replay_tolerance_ms_ = 3 * SIM_TICK_US / 1000;
+
+static uint64_t wall_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hexval(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+//a capture line is ~KKTTTTTTTTDD..DD, everything else in the log is ignored
+static bool parse_line(const char *line, CaptureRecord *r)
+{
+  const char *p = strchr(line, '~');
+  if (!p)
+    return false;
+  p++;
+  std::vector<uint8_t> bytes;
+  while (hexval(p[0]) >= 0 && hexval(p[1]) >= 0)
+  {
+    bytes.push_back((hexval(p[0]) << 4) | hexval(p[1]));
+    p += 2;
+  }
+  if (bytes.size() < 5)
+    return false;
+  r->kind = bytes[0];
+  r->ms = ((uint32_t) bytes[1] << 24) | ((uint32_t) bytes[2] << 16) | ((uint32_t) bytes[3] << 8) | bytes[4];
+  r->data.assign(bytes.begin() + 5, bytes.end());
+  return true;
+}
+
+static void set_endstops(SimNode *n, uint8_t levels)
+{
+  for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+    sim_set_input(n, SIM_PIN_ENDSTOP_0 + d, (levels & _BV(d)) ? HIGH : LOW);
+}
+
+static void parse_records(FILE *in, std::vector<CaptureRecord> &records)
+{
+  char line[1024];
+  while (fgets(line, sizeof(line), in))
+  {
+    CaptureRecord r;
+    if (parse_line(line, &r))
+      records.push_back(r);
+  }
+}
+
+static void run_until(uint64_t until_us)
+{
+  if (until_us > sim_now_us)
+    sim_run(until_us - sim_now_us);
+}
+
+static int replay(FILE *in, const char *name)
+{
+  std::vector<CaptureRecord> records;
+  parse_records(in, records);
+  size_t first = 0;
+  while (first < records.size() && records[first].kind != CAPTURE_START)
+    first++;
+  if (first == records.size() || records[first].data.size() < 2 + 2 * SIM_NUM_DAMPER)
+  {
+    fprintf(stderr, "%s: no capture start found\n", name);
+    return 2;
+  }
+  const CaptureRecord &start = records[first];
+
+  sim_init(replay_seed_);
+  SimNode *n = sim_node(0);
+  sim_preset_eeprom(0, start.data[0], start.data[1]);
+  n->endstops_external = true;
+  //initDamperStatesFromEEPROM looks at the endstops
+  for (size_t i=first+1; i<records.size() && records[i].kind != CAPTURE_START; i++)
+    if (records[i].kind == CAPTURE_ENDSTOPS && records[i].data.size() == 1)
+    {
+      set_endstops(n, records[i].data[0]);
+      break;
+    }
+  sim_boot(0);
+  memcpy(n->api.damper_states, &start.data[2], SIM_NUM_DAMPER);
+  memcpy(n->api.damper_open_pos, &start.data[2 + SIM_NUM_DAMPER], SIM_NUM_DAMPER);
+
+  //motors only change in the timer tick, so their recorded changes tell the phase of the µC's timer.
+  //the replayed ticks get the same phase, so frames and endstops arrive between the same two ticks as they did on the µC
+  uint32_t tick_ms = SIM_TICK_US / 1000;
+  uint32_t tick_phase_ms = start.ms % tick_ms;
+  uint8_t prev_outputs = 0xFF;
+  for (size_t i=first+1; i<records.size() && records[i].kind != CAPTURE_START; i++)
+    if (records[i].kind == CAPTURE_OUTPUTS && records[i].data.size() == 1)
+    {
+      if (prev_outputs != 0xFF && ((prev_outputs ^ records[i].data[0]) & 0x07))
+      {
+        tick_phase_ms = records[i].ms % tick_ms;
+        break;
+      }
+      prev_outputs = records[i].data[0];
+    }
+  uint64_t base_us = (sim_now_us / 1000 + 1) * 1000 + 2 * SIM_TICK_US;
+  uint32_t base_ms = start.ms;
+  n->next_tick_us = base_us - SIM_TICK_US + ((tick_phase_ms + tick_ms - base_ms % tick_ms) % tick_ms) * 1000;
+  //the ticks before base_us set the motors as they were at capture start
+  run_until(base_us);
+  //the replayed firmware captures its outputs the same way, that is what gets compared
+  n->capture_output = true;
+  sim_host_write(0, "C", 1);
+
+  std::vector<OutputChange> expected, observed;
+  uint32_t frames = 0, endstop_changes = 0, lost = 0;
+  uint64_t t0 = wall_ns();
+  size_t i;
+  for (i=first+1; i<records.size() && records[i].kind != CAPTURE_START; i++)
+  {
+    const CaptureRecord &r = records[i];
+    //endstops changed before a tick in the same ms, everything else comes from the loop after it
+    uint64_t at = base_us + (uint64_t) (uint32_t) (r.ms - base_ms) * 1000;
+    run_until((r.kind == CAPTURE_ENDSTOPS) ? at : at + sim_loop_cost_us);
+    sim_select(n);
+    switch (r.kind)
+    {
+      case CAPTURE_TARGETS:
+        if (r.data.size() < SIM_NUM_DAMPER + 2)
+          break;
+        memcpy(n->api.damper_target_states, &r.data[0], SIM_NUM_DAMPER);
+        *n->api.fan_target_state = r.data[SIM_NUM_DAMPER];
+        *n->api.fanlamina_target_state = r.data[SIM_NUM_DAMPER + 1];
+        break;
+      case CAPTURE_FRAME:
+        if (r.data.size() < 2 || r.data.size() < 2u + r.data[1])
+          break;
+        n->api.pjon_recv_handler(r.data[0], (uint8_t*) &r.data[2], r.data[1]);
+        frames++;
+        break;
+      case CAPTURE_ENDSTOPS:
+        if (r.data.size() < 1)
+          break;
+        set_endstops(n, r.data[0]);
+        n->api.pinchange_isr();
+        endstop_changes++;
+        break;
+      case CAPTURE_OUTPUTS:
+        if (r.data.size() >= 1)
+          expected.push_back(OutputChange{r.ms, r.data[0]});
+        break;
+      case CAPTURE_OVERFLOW:
+        if (r.data.size() >= 1)
+          lost += r.data[0];
+        break;
+    }
+  }
+  uint32_t end_ms = (i > first + 1) ? records[i-1].ms : base_ms;
+  run_until(base_us + (uint64_t) (uint32_t) (end_ms - base_ms + replay_tolerance_ms_) * 1000);
+  uint64_t dt = wall_ns() - t0;
+
+  std::vector<CaptureRecord> replayed;
+  FILE *out = fmemopen(n->serial_out.data(), n->serial_out.size(), "r");
+  parse_records(out, replayed);
+  fclose(out);
+  for (size_t j=0; j<replayed.size(); j++)
+    if (replayed[j].kind == CAPTURE_OUTPUTS && replayed[j].data.size() >= 1)
+      observed.push_back(OutputChange{(uint32_t) (base_ms + replayed[j].ms - base_us / 1000), replayed[j].data[0]});
+
+  //every recorded change has to show up in the replay, in order and close to its recorded time, and nothing else
+  size_t matched = 0, k = 0;
+  int64_t first_mismatch_ms = -1;
+  for (size_t e=0; e<expected.size(); e++)
+  {
+    size_t j = k;
+    while (j < observed.size() && observed[j].ms + replay_tolerance_ms_ < expected[e].ms)
+      j++;
+    while (j < observed.size() && observed[j].ms <= expected[e].ms + replay_tolerance_ms_ && observed[j].outputs != expected[e].outputs)
+      j++;
+    if (j < observed.size() && observed[j].ms <= expected[e].ms + replay_tolerance_ms_)
+    {
+      matched++;
+      k = j + 1;
+    } else {
+      if (first_mismatch_ms < 0)
+        first_mismatch_ms = expected[e].ms - base_ms;
+      if (replay_verbose_)
+        fprintf(stderr, "%s: outputs %02X at %u ms not replayed\n", name, expected[e].outputs, expected[e].ms - base_ms);
+    }
+  }
+  size_t unexpected = observed.size() - matched;
+  if (replay_verbose_)
+    for (size_t j=0; j<observed.size(); j++)
+      fprintf(stderr, "%s: replayed outputs %02X at %u ms\n", name, observed[j].outputs, observed[j].ms - base_ms);
+  bool pass = matched == expected.size() && unexpected == 0 && lost == 0;
+  double virtual_ms = (sim_now_us - base_us) / 1000.0;
+  printf("{\"replay\":\"%s\",\"records\":%zu,\"frames\":%u,\"endstop_changes\":%u,\"lost\":%u,\"expected_changes\":%zu,\"observed_changes\":%zu,\"matched\":%zu,\"first_mismatch_ms\":%lld,\"tolerance_ms\":%u,\"virtual_ms\":%.1f,\"wall_ms\":%.1f,\"speedup\":%.0f,\"pass\":%s}\n",
+    name, i - first, frames, endstop_changes, lost, expected.size(), observed.size(), matched, (long long) first_mismatch_ms,
+    replay_tolerance_ms_, virtual_ms, dt / 1e6, virtual_ms * 1e6 / (dt ? dt : 1), pass?"true":"false");
+  return pass ? 0 : 1;
+}
+
+//a node that gets random commands on its console, with capture on.
+//with flash_light, the endstop lightbeam now and then sees a short flash while a damper turns,
+//like the ceiling light in 2019-04-06_debugging.txt did.
+static void generate(uint32_t seconds, bool flash_light)
+{
+  static const char cmds[] = "01234567och";
+  sim_init(replay_seed_);
+  sim_preset_eeprom(0, 1, 0x07);
+  sim_boot(0);
+  SimNode *n = sim_node(0);
+  n->capture_output = true;
+  sim_run(2000000);
+  n->serial_out.clear();
+  sim_host_write(0, "C", 1);
+
+  uint64_t end = sim_now_us + (uint64_t) seconds * 1000000;
+  uint64_t next_cmd = sim_now_us;
+  while (sim_now_us < end)
+  {
+    if (sim_now_us >= next_cmd)
+    {
+      sim_host_write(0, &cmds[sim_rand() % (sizeof(cmds) - 1)], 1);
+      next_cmd = sim_now_us + 1000000 + sim_rand() % 3000000;
+    }
+    if (flash_light && sim_rand() % 20 == 0)
+    {
+      uint8_t d = sim_rand() % SIM_NUM_DAMPER;
+      if (n->pin_level[SIM_PIN_DAMPER_0 + d] == HIGH && n->damper[d].endstop_level == HIGH)
+      {
+        sim_select(n);
+        sim_set_input(n, SIM_PIN_ENDSTOP_0 + d, LOW);
+        n->api.pinchange_isr();
+        sim_run(2000);
+        sim_select(n);
+        sim_set_input(n, SIM_PIN_ENDSTOP_0 + d, n->damper[d].endstop_level);
+        n->api.pinchange_isr();
+      }
+    }
+    sim_run(100000);
+  }
+  sim_host_write(0, "C", 1);
+  sim_run(100000);
+  fwrite(n->serial_out.data(), 1, n->serial_out.size(), stdout);
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-s seed] [-t tolerance_ms] [-v] [capturefile]\n", argv0);
+  fprintf(stderr, "       %s -g seconds [-l] [-s seed]   generate a capture of a simulated node, -l: with ceiling light flashes\n", argv0);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  uint32_t generate_seconds = 0;
+  bool flash_light = false;
+  while ((opt = getopt(argc, argv, "s:t:g:lvh")) != -1)
+  {
+    switch (opt)
+    {
+      case 's': replay_seed_ = strtoul(optarg, 0, 0); break;
+      case 't': replay_tolerance_ms_ = strtoul(optarg, 0, 0); break;
+      case 'g': generate_seconds = strtoul(optarg, 0, 0); break;
+      case 'l': flash_light = true; break;
+      case 'v': replay_verbose_ = true; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if (generate_seconds)
+  {
+    generate(generate_seconds, flash_light);
+    return 0;
+  }
+  if (optind >= argc)
+    return replay(stdin, "-");
+  FILE *in = fopen(argv[optind], "r");
+  if (!in)
+  {
+    perror(argv[optind]);
+    return 2;
+  }
+  int rv = replay(in, argv[optind]);
+  fclose(in);
+  return rv;
+}
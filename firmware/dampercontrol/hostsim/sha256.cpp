@@ -0,0 +1,119 @@
+/*
+ *  Damper Control Firmware - Host Simulator
+ *
+ *  SHA-256 of mbedtls for the firmware in the simulator and for dampertool.
+ *
+ *  This software is made with love
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include "shim/mbedtls/sha256.h"
+
+static const uint32_t sim_sha256_k_[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t sim_ror(uint32_t x, uint8_t n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+static void sim_sha256_block(mbedtls_sha256_context *ctx, const unsigned char *p)
+{
+  uint32_t w[64], v[8];
+  for (uint8_t i=0; i<16; i++)
+    w[i] = (uint32_t) p[4*i] << 24 | (uint32_t) p[4*i+1] << 16 | (uint32_t) p[4*i+2] << 8 | p[4*i+3];
+  for (uint8_t i=16; i<64; i++)
+  {
+    uint32_t s0 = sim_ror(w[i-15], 7) ^ sim_ror(w[i-15], 18) ^ (w[i-15] >> 3);
+    uint32_t s1 = sim_ror(w[i-2], 17) ^ sim_ror(w[i-2], 19) ^ (w[i-2] >> 10);
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+  }
+  memcpy(v, ctx->state, sizeof(v));
+  for (uint8_t i=0; i<64; i++)
+  {
+    uint32_t t1 = v[7] + (sim_ror(v[4], 6) ^ sim_ror(v[4], 11) ^ sim_ror(v[4], 25)) + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sim_sha256_k_[i] + w[i];
+    uint32_t t2 = (sim_ror(v[0], 2) ^ sim_ror(v[0], 13) ^ sim_ror(v[0], 22)) + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+    memmove(v + 1, v, 7 * sizeof(uint32_t));
+    v[4] += t1;
+    v[0] = t1 + t2;
+  }
+  for (uint8_t i=0; i<8; i++)
+    ctx->state[i] += v[i];
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224)
+{
+  static const uint32_t h0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  if (is224)
+    return -1; //not needed
+  ctx->total[0] = ctx->total[1] = 0;
+  memcpy(ctx->state, h0, sizeof(h0));
+  ctx->is224 = 0;
+  return 0;
+}
+
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen)
+{
+  while (ilen > 0)
+  {
+    size_t fill = ctx->total[0] % 64;
+    size_t n = std::min(ilen, 64 - fill);
+    memcpy(ctx->buffer + fill, input, n);
+    ctx->total[0] += n;
+    if (ctx->total[0] < n)
+      ctx->total[1]++;
+    input += n;
+    ilen -= n;
+    if (fill + n == 64)
+      sim_sha256_block(ctx, ctx->buffer);
+  }
+  return 0;
+}
+
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char output[32])
+{
+  uint64_t bits = ((uint64_t) ctx->total[1] << 32 | ctx->total[0]) * 8;
+  unsigned char pad[72] = {0x80};
+  size_t fill = ctx->total[0] % 64;
+  size_t padlen = (fill < 56) ? 56 - fill : 120 - fill;
+  for (uint8_t i=0; i<8; i++)
+    pad[padlen + i] = bits >> (56 - 8*i);
+  mbedtls_sha256_update(ctx, pad, padlen + 8);
+  for (uint8_t i=0; i<8; i++)
+    for (uint8_t b=0; b<4; b++)
+      output[4*i+b] = ctx->state[i] >> (24 - 8*b);
+  return 0;
+}
@@ -0,0 +1,84 @@
+//Arduino API as far as the damper control firmware uses it, backed by the host simulator
+#ifndef HOSTSIM_ARDUINO_H
+#define HOSTSIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../sim.h"
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+//the esp32 names used in dampercontrol.h
+#define GPIO4 4
+#define GPIO17 17
+#define GPIO18 18
+#define GPIO19 19
+#define GPIO21 21
+#define GPIO22 22
+#define GPIO23 23
+#define GPIO25 25
+#define GPIO26 26
+#define GPIO27 27
+#define GPIO32 32
+#define GPIO33 33
+#define GPIO34 34
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+long random(long max);
+long random(long min, long max);
+//the simulator runs ISRs between loop() calls only, so there is nothing to mask
+inline void noInterrupts() {}
+inline void interrupts() {}
+//the simulated nodes have as much PSRAM as the host has memory
+inline void *ps_malloc(size_t size) { return malloc(size); }
+inline bool psramFound() { return true; }
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+int digitalRead(uint8_t pin);
+
+#define SERIAL_8N1 0x800001c
+
+//UART0 of the simulated node, the bytes written with sim_serial_write
+class HardwareSerial {
+public:
+  unsigned long baud = 0;
+  void setRxBufferSize(size_t size) { (void) size; }
+  void begin(unsigned long b, uint32_t config = SERIAL_8N1, int8_t rx = -1, int8_t tx = -1) { baud = b; (void) config; (void) rx; (void) tx; }
+  int available() { return sim_serial_available(); }
+  size_t readBytes(uint8_t *buf, size_t length) { return sim_serial_read(buf, length); }
+  void flush() {} //console output of the simulator is never pending
+};
+
+extern HardwareSerial Serial;
+//UART2, only ever handed to PJON's ThroughSerial, whose frames the simulated bus carries itself: only its baud rate counts
+extern HardwareSerial Serial2;
+
+//--- leftovers of the AVR version, not yet ported to esp32 ---
+
+extern uint8_t sim_avr_reg8_;
+extern uint16_t sim_avr_reg16_;
+#define MCUSR sim_avr_reg8_
+#define WDRF 3
+#define OCR3A sim_avr_reg16_
+#define ISR(vector) void sim_isr_##vector()
+inline void wdt_disable() {}
+inline void cpu_init() {}
+inline void led_init() {}
+inline void sei() {}
+inline void arduino_init() {}
+inline void reset2bootloader() {}
+
+#define FANLAMINA_RUN digitalWrite(SIM_PIN_FANLAMINA,LOW)
+#define FANLAMINA_STOP digitalWrite(SIM_PIN_FANLAMINA,HIGH)
+#define FANLAMINA_ISRUNNING (digitalRead(SIM_PIN_FANLAMINA) == LOW)
+
+#endif
@@ -0,0 +1,17 @@
+//esp32 EEPROM class backed by the eeprom array of the simulated node
+#ifndef HOSTSIM_EEPROM_H
+#define HOSTSIM_EEPROM_H
+
+#include "Arduino.h"
+
+class EEPROMClass {
+public:
+  bool begin(size_t size) { return size <= SIM_EEPROM_SIZE; }
+  uint8_t read(int address) { return sim_cur->eeprom[address]; }
+  void write(int address, uint8_t value) { sim_cur->eeprom[address] = value; }
+  bool commit() { return true; }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,53 @@
+//PJON API as used by comm.cpp, backed by the simulated bus in sim.cpp
+#ifndef HOSTSIM_PJON_H
+#define HOSTSIM_PJON_H
+
+#include "Arduino.h"
+
+#define NOT_ASSIGNED 255
+#define BROADCAST 0
+#define ACK 6
+#define NAK 21
+#define FAIL 0x100
+#define BUSY 666
+#define ACQUIRE_ID 63
+#define MAX_PACKETS 10
+
+#define CONNECTION_LOST 101
+#define PACKETS_BUFFER_FULL 102
+#define MEMORY_FULL 103
+#define CONTENT_TOO_LONG 104
+#define ID_ACQUISITION_FAIL 105
+
+struct SoftwareBitBang {
+  uint32_t uart_baud() { return 0; }
+};
+
+//over a uart and an RS485 transceiver, the simulated bus takes the baud rate from the uart
+struct ThroughSerial {
+  HardwareSerial *serial = 0;
+  void set_serial(HardwareSerial *s) { serial = s; }
+  void set_enable_RS485_pin(uint8_t pin) { (void) pin; }
+  uint32_t uart_baud() { return (serial) ? serial->baud : 0; }
+};
+
+template <typename Strategy>
+class PJON : public SimPjonPort {
+public:
+  Strategy strategy;
+  PJON() { node = 0; id = NOT_ASSIGNED; receiver = 0; error = 0; }
+  void set_error(void (*e)(uint8_t code, uint8_t data)) { error = e; }
+  void set_receiver(void (*r)(uint8_t id, uint8_t *payload, uint8_t length)) { receiver = r; }
+  void set_pin(uint8_t pin) { (void) pin; }
+  void begin() { port_begin(strategy.uart_baud()); }
+  void set_id(uint8_t i) { id = i; }
+  uint8_t device_id() { return id; }
+  void acquire_id() { port_acquire_id(); }
+  uint16_t send(uint8_t to, const char *payload, uint16_t length) { return port_send(to, payload, length); }
+  uint16_t send_packet(uint8_t to, const char *payload, uint16_t length) { return port_send_packet(to, payload, length); }
+  uint16_t update() { port_update(); return outbox.size(); }
+  uint16_t receive(uint32_t duration_us) { return port_receive(duration_us); }
+  uint16_t get_packets_count() { return outbox.size(); }
+};
+
+#endif
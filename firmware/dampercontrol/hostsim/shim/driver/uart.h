@@ -0,0 +1,12 @@
+//esp-idf uart driver, only the light sleep wakeup of UART0
+#ifndef HOSTSIM_DRIVER_UART_H
+#define HOSTSIM_DRIVER_UART_H
+
+#include "../Arduino.h"
+#include "../esp_err.h"
+
+typedef enum {UART_NUM_0, UART_NUM_1, UART_NUM_2, UART_NUM_MAX} uart_port_t;
+
+esp_err_t uart_set_wakeup_threshold(uart_port_t uart_num, int wakeup_threshold);
+
+#endif
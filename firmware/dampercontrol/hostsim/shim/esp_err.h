@@ -0,0 +1,9 @@
+//esp-idf error codes as far as the shimmed drivers return them
+#ifndef HOSTSIM_ESP_ERR_H
+#define HOSTSIM_ESP_ERR_H
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_ERR_INVALID_ARG 0x102
+
+#endif
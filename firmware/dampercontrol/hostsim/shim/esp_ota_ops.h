@@ -0,0 +1,32 @@
+//esp-idf ota api as used by fwupdate.cpp, backed by the flash of the simulated node.
+//Two ota partitions of SIM_OTA_PARTITION_SIZE, every flash sector erased makes the node deaf for SIM_FLASH_ERASE_US.
+#ifndef HOSTSIM_ESP_OTA_OPS_H
+#define HOSTSIM_ESP_OTA_OPS_H
+
+#include "Arduino.h"
+#include "esp_err.h"
+
+#define ESP_ERR_OTA_BASE 0x1500
+#define ESP_ERR_OTA_VALIDATE_FAILED (ESP_ERR_OTA_BASE + 0x03)
+#define ESP_ERR_INVALID_SIZE 0x104
+
+#define OTA_SIZE_UNKNOWN 0xffffffff
+#define OTA_WITH_SEQUENTIAL_WRITES 0xfffffffe
+
+typedef uint32_t esp_ota_handle_t;
+
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  const char *label;
+} esp_partition_t;
+
+const esp_partition_t *esp_ota_get_running_partition();
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from);
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle);
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size);
+esp_err_t esp_ota_end(esp_ota_handle_t handle);
+esp_err_t esp_ota_abort(esp_ota_handle_t handle);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition);
+
+#endif
@@ -0,0 +1,7 @@
+//esp_restart: the simulator can not boot the new image, the node is switched off instead (SimNode::restarts counts it)
+#ifndef HOSTSIM_ESP_SYSTEM_H
+#define HOSTSIM_ESP_SYSTEM_H
+
+void esp_restart();
+
+#endif
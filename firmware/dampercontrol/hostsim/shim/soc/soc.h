@@ -0,0 +1,13 @@
+//esp32 register access, the simulator knows the registers in soc/gpio_reg.h
+#ifndef HOSTSIM_SOC_SOC_H
+#define HOSTSIM_SOC_SOC_H
+
+#include <stdint.h>
+
+void sim_reg_write(uint32_t reg, uint32_t value);
+uint32_t sim_reg_read(uint32_t reg);
+
+#define REG_WRITE(reg, value) sim_reg_write((reg), (value))
+#define REG_READ(reg) sim_reg_read(reg)
+
+#endif
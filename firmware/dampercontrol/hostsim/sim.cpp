@@ -0,0 +1,1180 @@
+/*
+ *  Damper Control Firmware - Host Simulator
+ *
+ *  Virtual clock, simulated PJON bus, damper mechanics and the
+ *  Arduino/EEPROM functions the firmware calls.
+ *
+ *  This software is made with love
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include "sim.h"
+#include "shim/Arduino.h"
+#include "shim/EEPROM.h"
+#include "shim/PJON.h"
+#include "shim/driver/pcnt.h"
+#include "shim/soc/soc.h"
+#include "shim/soc/gpio_reg.h"
+#include "shim/esp_sleep.h"
+#include "shim/driver/gpio.h"
+#include "shim/driver/uart.h"
+#include "shim/esp_ota_ops.h"
+#include "shim/esp_system.h"
+
+#define SIM_PIN_UNSET 0xFF
+
+uint64_t sim_now_us = 0;
+uint32_t sim_loop_cost_us = 50;
+SimNode *sim_cur = 0;
+
+//SoftwareBitBang in mode 1 moves about 2kB/s
+SimBusParams sim_bus = {508, 6, 10, 1000, 0.0, false, false, false};
+void (*sim_on_delivery)(uint8_t from, uint8_t to, const uint8_t *data, size_t length) = 0;
+SimBusStats sim_bus_stats;
+
+uint8_t sim_avr_reg8_ = 0;
+uint16_t sim_avr_reg16_ = 0;
+EEPROMClass EEPROM;
+
+//nodes register from static constructors in node.cpp, so the table must exist before any of them runs
+static SimNode *sim_node_table()
+{
+  static SimNode nodes[SIM_MAX_NODES]{};
+  return nodes;
+}
+#define sim_nodes_ sim_node_table()
+static uint64_t sim_bus_busy_until_us_ = 0;
+static uint32_t sim_rng_ = 1;
+
+///////// Node table ///////////
+
+void sim_register_node(uint8_t idx, const SimNodeApi &api)
+{
+  if (idx >= SIM_MAX_NODES)
+    return;
+  sim_nodes_[idx].idx = idx;
+  sim_nodes_[idx].api = api;
+  sim_nodes_[idx].registered = true;
+}
+
+SimNode *sim_node(uint8_t idx)
+{
+  return &sim_nodes_[idx];
+}
+
+uint8_t sim_num_nodes()
+{
+  uint8_t n = 0;
+  while (n < SIM_MAX_NODES && sim_nodes_[n].registered)
+    n++;
+  return n;
+}
+
+void sim_select(SimNode *n)
+{
+  sim_cur = n;
+}
+
+uint32_t sim_rand()
+{
+  //xorshift32
+  sim_rng_ ^= sim_rng_ << 13;
+  sim_rng_ ^= sim_rng_ >> 17;
+  sim_rng_ ^= sim_rng_ << 5;
+  return sim_rng_;
+}
+
+double sim_rand_unit()
+{
+  return (sim_rand() >> 8) / (double) (1 << 24);
+}
+
+void sim_init(uint32_t seed)
+{
+  sim_now_us = 0;
+  sim_rng_ = (seed == 0) ? 1 : seed;
+  sim_bus_busy_until_us_ = 0;
+  memset(&sim_bus_stats, 0, sizeof(sim_bus_stats));
+  for (uint8_t i=0; i<SIM_MAX_NODES; i++)
+  {
+    SimNode *n = &sim_nodes_[i];
+    n->booted = false;
+    n->capture_output = false;
+    n->log_output = false;
+    n->pjon = 0;
+    n->next_tick_us = 0;
+    n->deaf_until_us = 0;
+    n->blocked_until_us = 0;
+    n->clock_offset_us = 0;
+    n->clock_ppm = 0;
+    n->link_loss = 0.0;
+    n->loop_busy_us = 0;
+    n->listen_from_us = 0;
+    n->listen_until_us = 0;
+    n->listen_us = 0;
+    n->missed_frames = 0;
+    memset(n->received_by_type, 0, sizeof(n->received_by_type));
+    n->pjon_xfer_us = 0;
+    n->endstops_external = false;
+    n->gpio_writes = 0;
+    n->asleep = false;
+    n->sleep_timer_us = 0;
+    n->wake_gpio = false;
+    n->wake_uart = false;
+    n->sleep_until_us = 0;
+    n->wake_at_us = 0;
+    n->wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+    n->slept_at_us = 0;
+    n->asleep_us = 0;
+    n->sleeps = 0;
+    n->ota_flash.clear();
+    n->ota_open = false;
+    n->ota_written = 0;
+    n->ota_erased = 0;
+    n->boot_partition = 0;
+    n->restarts = 0;
+    n->serial_in.clear();
+    n->serial_lost = 0;
+    n->host_wrote = false;
+    n->awake_lines = 0;
+    n->host_wrote_us = 0;
+    n->serial_out.clear();
+    memset(n->pin_mode, SIM_PIN_UNSET, sizeof(n->pin_mode));
+    memset(n->pin_level, 0, sizeof(n->pin_level));
+    memset(n->eeprom, 0xFF, sizeof(n->eeprom)); //erased flash
+    for (uint8_t u=0; u<SIM_NUM_PCNT; u++)
+    {
+      memset(&n->pcnt[u], 0, sizeof(n->pcnt[u]));
+      n->pcnt[u].pin = -1;
+    }
+    for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+    {
+      n->damper[d].angle = sim_rand() % SIM_DAMPER_HALFTURN_TICKS;
+      n->damper[d].endstop_level = (n->damper[d].angle < SIM_DAMPER_SLOT_TICKS) ? LOW : HIGH;
+      n->damper[d].stuck = false;
+      n->pin_level[SIM_PIN_ENDSTOP_0 + d] = n->damper[d].endstop_level;
+      n->sensor_installed[d] = false;
+      n->sensor_pascal[d] = 0.0;
+    }
+  }
+}
+
+void sim_preset_eeprom(uint8_t idx, uint8_t pjon_id, uint8_t installed_dampers)
+{
+  //same layout as saveSettings2EEPROM()
+  uint8_t *e = sim_nodes_[idx].eeprom;
+  memset(e, 0, 16);
+  e[0] = 2; //EEPROM_DATA_VERSION
+  e[1] = pjon_id;
+  e[2] = SIM_NUM_DAMPER;
+  for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+    e[3+d] = 80;
+  e[3+SIM_NUM_DAMPER] = installed_dampers;
+  //sensor destination, site config version and hash stay 0
+}
+
+void sim_preset_idle_sleep(uint8_t idx, bool on)
+{
+  //EEPROM_OPTIONS_POS of settings.cpp
+  uint8_t *e = sim_nodes_[idx].eeprom;
+  e[20] = 1; //EEPROM_OPTIONS_VERSION
+  e[21] = on;
+}
+
+void sim_boot(uint8_t idx)
+{
+  SimNode *n = &sim_nodes_[idx];
+  sim_select(n);
+  n->api.setup();
+  n->booted = true;
+  n->next_tick_us = sim_now_us + SIM_TICK_US;
+}
+
+void sim_serial_write(uint8_t idx, const char *data, size_t length)
+{
+  SimNode *n = &sim_nodes_[idx];
+  if (n->asleep && n->wake_at_us != 0)
+  {
+    n->serial_lost += length; //the uart is not clocked yet
+    return;
+  }
+  for (size_t i=0; i<length; i++)
+    n->serial_in.push_back((uint8_t) data[i]);
+}
+
+static SimNode *sim_host_waking_;
+static uint32_t sim_host_awake_lines_;
+
+static bool sim_host_is_awake()
+{
+  return sim_host_waking_->awake_lines != sim_host_awake_lines_;
+}
+
+//'\n' wakes the uart, the node answers it (or the wakeup) with SIM_AWAKE_LINE once it reads the console again,
+//a '\n' lost to a timer wakeup that has the node asleep again right after is sent again
+void sim_host_write(uint8_t idx, const char *data, size_t length)
+{
+  SimNode *n = &sim_nodes_[idx];
+  if (!n->host_wrote || sim_now_us - n->host_wrote_us >= SIM_HOST_AWAKE_US)
+  {
+    sim_host_waking_ = n;
+    sim_host_awake_lines_ = n->awake_lines;
+    for (uint8_t t=0; t<SIM_HOST_WAKE_TRIES && !sim_host_is_awake(); t++)
+    {
+      sim_serial_write(idx, "\n", 1);
+      sim_run_until(sim_host_is_awake, SIM_HOST_WAKE_WAIT_US);
+    }
+  }
+  sim_serial_write(idx, data, length);
+  n->host_wrote = true;
+  n->host_wrote_us = sim_now_us;
+}
+
+///////// Damper mechanics ///////////
+
+//move disks of running motors by one tick and raise pin change interrupts for endstops that toggled
+static void sim_tick_mechanics(SimNode *n)
+{
+  if (n->endstops_external)
+    return;
+  bool pinchange = false;
+  for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+  {
+    SimDamper *dm = &n->damper[d];
+    if (n->pin_level[SIM_PIN_DAMPER_0 + d] == HIGH && !dm->stuck)
+      dm->angle = (dm->angle + 1) % SIM_DAMPER_HALFTURN_TICKS;
+    uint8_t level = (dm->angle < SIM_DAMPER_SLOT_TICKS) ? LOW : HIGH;
+    if (level != dm->endstop_level)
+    {
+      dm->endstop_level = level;
+      pinchange |= sim_set_input(n, SIM_PIN_ENDSTOP_0 + d, level);
+    }
+  }
+  if (pinchange)
+    n->api.pinchange_isr();
+}
+
+///////// Light sleep ///////////
+
+static void sim_wake(SimNode *n, int cause)
+{
+  if (n->wake_at_us != 0)
+    return;
+  n->wakeup_cause = cause;
+  n->wake_at_us = sim_now_us + SIM_WAKE_LATENCY_US;
+  n->asleep_us += sim_now_us - n->slept_at_us; //the clocks are already running again while the node wakes up
+}
+
+//true while the node sleeps, the tick timer stops with the cpu clock and starts over on wakeup
+static bool sim_sleeping(SimNode *n)
+{
+  if (!n->asleep)
+    return false;
+  if (n->wake_uart && n->wake_at_us == 0 && !n->serial_in.empty())
+  {
+    //the uart counts the edges of the first byte, but does not receive it nor what follows while the node wakes up
+    n->serial_lost += n->serial_in.size();
+    n->serial_in.clear();
+    sim_wake(n, ESP_SLEEP_WAKEUP_UART);
+  }
+  if (n->sleep_timer_us != 0 && sim_now_us >= n->sleep_until_us)
+    sim_wake(n, ESP_SLEEP_WAKEUP_TIMER);
+  if (n->wake_at_us == 0 || sim_now_us < n->wake_at_us)
+    return true;
+  n->asleep = false;
+  n->next_tick_us = sim_now_us + SIM_TICK_US;
+  return false;
+}
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+  sim_cur->sleep_timer_us = time_in_us;
+  return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_gpio_wakeup()
+{
+  return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_uart_wakeup(int uart_num)
+{
+  if (uart_num != UART_NUM_0)
+    return ESP_ERR_INVALID_ARG;
+  sim_cur->wake_uart = true;
+  return ESP_OK;
+}
+
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+{
+  (void) intr_type;
+  if (gpio_num < 0 || gpio_num >= SIM_NUM_PINS)
+    return ESP_ERR_INVALID_ARG;
+  sim_cur->wake_gpio = true; //only the PJON line (its pin, or the uart rx with ThroughSerial) is ever used
+  return ESP_OK;
+}
+
+esp_err_t gpio_wakeup_disable(gpio_num_t gpio_num)
+{
+  if (gpio_num < 0 || gpio_num >= SIM_NUM_PINS)
+    return ESP_ERR_INVALID_ARG;
+  sim_cur->wake_gpio = false;
+  return ESP_OK;
+}
+
+esp_err_t uart_set_wakeup_threshold(uart_port_t uart_num, int wakeup_threshold)
+{
+  if (uart_num != UART_NUM_0 || wakeup_threshold < 3 || wakeup_threshold > 0x3FF)
+    return ESP_ERR_INVALID_ARG;
+  return ESP_OK;
+}
+
+//the firmware calls this at the end of loop(), so returning right away and skipping the following loops is the same as blocking
+esp_err_t esp_light_sleep_start()
+{
+  SimNode *n = sim_cur;
+  n->asleep = true;
+  n->sleeps++;
+  n->slept_at_us = sim_now_us;
+  n->sleep_until_us = sim_now_us + n->sleep_timer_us;
+  n->wake_at_us = 0;
+  n->wakeup_cause = ESP_SLEEP_WAKEUP_UNDEFINED;
+  return ESP_OK;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause()
+{
+  return (esp_sleep_wakeup_cause_t) sim_cur->wakeup_cause;
+}
+
+//when the first of the sleeping nodes wakes up, at most end
+static uint64_t sim_next_wakeup(uint64_t end)
+{
+  uint64_t wake = end;
+  for (uint8_t i=0; i<SIM_MAX_NODES; i++)
+  {
+    SimNode *n = &sim_nodes_[i];
+    if (!n->booted)
+      continue;
+    if (n->wake_at_us != 0)
+      wake = std::min(wake, n->wake_at_us);
+    else if (n->wake_uart && !n->serial_in.empty())
+      return sim_now_us;
+    else if (n->sleep_timer_us != 0)
+      wake = std::min(wake, n->sleep_until_us);
+  }
+  return wake;
+}
+
+void sim_run(uint64_t duration_us)
+{
+  uint64_t end = sim_now_us + duration_us;
+  while (sim_now_us < end)
+  {
+    bool awake = false;
+    for (uint8_t i=0; i<SIM_MAX_NODES; i++)
+    {
+      SimNode *n = &sim_nodes_[i];
+      if (!n->booted)
+        continue;
+      sim_select(n);
+      if (sim_sleeping(n))
+        continue;
+      awake = true;
+      while (n->next_tick_us <= sim_now_us)
+      {
+        sim_tick_mechanics(n);
+        n->api.timer_isr();
+        n->next_tick_us += SIM_TICK_US;
+      }
+      if (n->blocked_until_us > sim_now_us)
+        continue;
+      n->api.loop();
+      if (n->loop_busy_us)
+        n->blocked_until_us = std::max(n->blocked_until_us, sim_now_us) + n->loop_busy_us;
+    }
+    //nothing happens while all nodes sleep, skip the loops up to the first wakeup
+    uint64_t step = sim_loop_cost_us;
+    if (!awake)
+    {
+      uint64_t wake = sim_next_wakeup(end);
+      if (wake > sim_now_us + step)
+        step = (wake - sim_now_us + sim_loop_cost_us - 1) / sim_loop_cost_us * sim_loop_cost_us;
+    }
+    sim_now_us += step;
+  }
+}
+
+bool sim_run_until(bool (*cond)(), uint64_t max_us)
+{
+  uint64_t end = sim_now_us + max_us;
+  while (sim_now_us < end)
+  {
+    if (cond())
+      return true;
+    sim_run(sim_loop_cost_us);
+  }
+  return cond();
+}
+
+int sim_run_isolated(void (*fn)(void *arg), void *arg)
+{
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0)
+  {
+    fn(arg);
+    fflush(stdout);
+    _exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+///////// Firmware console ///////////
+
+int sim_node_vprintf(const char *fmt, va_list ap)
+{
+  //always format, the firmware pays for that on the µC too
+  char buf[256];
+  int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  if (len > (int) sizeof(buf) - 1)
+    len = sizeof(buf) - 1;
+  if (sim_cur && len == (int) sizeof(SIM_AWAKE_LINE "\r\n") - 1 && memcmp(buf, SIM_AWAKE_LINE "\r\n", len) == 0)
+    sim_cur->awake_lines++;
+  if (sim_cur && sim_cur->capture_output)
+    sim_cur->serial_out.insert(sim_cur->serial_out.end(), buf, buf + len);
+  if (sim_cur && sim_cur->log_output)
+    fprintf(stderr, "[%u %8.3f] %s", sim_cur->idx, sim_now_us / 1000.0, buf);
+  return len;
+}
+
+size_t sim_serial_read(uint8_t *buf, size_t length)
+{
+  if (length > sim_cur->serial_in.size())
+    length = sim_cur->serial_in.size();
+  std::copy(sim_cur->serial_in.begin(), sim_cur->serial_in.begin() + length, buf);
+  sim_cur->serial_in.erase(sim_cur->serial_in.begin(), sim_cur->serial_in.begin() + length);
+  return length;
+}
+
+int sim_serial_available()
+{
+  return sim_cur->serial_in.size();
+}
+
+HardwareSerial Serial;
+HardwareSerial Serial2;
+
+///////// Arduino ///////////
+
+//the clock of the running node, which is still inside a blocking send until blocked_until_us
+static uint64_t sim_local_us()
+{
+  if (!sim_cur)
+    return sim_now_us;
+  uint64_t t = std::max(sim_now_us, sim_cur->blocked_until_us);
+  return sim_cur->clock_offset_us + t + (int64_t) t * sim_cur->clock_ppm / 1000000;
+}
+
+uint32_t millis()
+{
+  return (uint32_t) (sim_local_us() / 1000);
+}
+
+uint32_t micros()
+{
+  return (uint32_t) sim_local_us();
+}
+
+void delay(uint32_t ms)
+{
+  sim_now_us += (uint64_t) ms * 1000;
+}
+
+void delayMicroseconds(uint32_t us)
+{
+  sim_now_us += us;
+}
+
+long random(long max)
+{
+  return (max > 0) ? (long) (sim_rand() % max) : 0;
+}
+
+long random(long min, long max)
+{
+  return min + random(max - min);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  sim_cur->pin_mode[pin] = mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t level)
+{
+  sim_cur->gpio_writes++;
+  if (sim_cur->pin_mode[pin] == INPUT)
+    return; //pullup, the level of an input is up to the simulation
+  sim_cur->pin_level[pin] = level;
+}
+
+int digitalRead(uint8_t pin)
+{
+  return sim_cur->pin_level[pin];
+}
+
+//the gpio output registers, writes to inputs are ignored like in digitalWrite
+static void sim_gpio_write_mask(uint8_t first_pin, uint32_t mask, uint8_t level)
+{
+  for (uint8_t b=0; b<32 && first_pin + b < SIM_NUM_PINS; b++)
+  {
+    if (!(mask & (1UL << b)))
+      continue;
+    uint8_t pin = first_pin + b;
+    if (sim_cur->pin_mode[pin] == INPUT)
+      continue;
+    sim_cur->pin_level[pin] = level;
+  }
+}
+
+static uint32_t sim_gpio_read_mask(uint8_t first_pin)
+{
+  uint32_t value = 0;
+  for (uint8_t b=0; b<32 && first_pin + b < SIM_NUM_PINS; b++)
+    if (sim_cur->pin_level[first_pin + b] == HIGH)
+      value |= 1UL << b;
+  return value;
+}
+
+void sim_reg_write(uint32_t reg, uint32_t value)
+{
+  sim_cur->gpio_writes++;
+  switch (reg)
+  {
+    case GPIO_OUT_W1TS_REG: sim_gpio_write_mask(0, value, HIGH); break;
+    case GPIO_OUT_W1TC_REG: sim_gpio_write_mask(0, value, LOW); break;
+    case GPIO_OUT1_W1TS_REG: sim_gpio_write_mask(32, value, HIGH); break;
+    case GPIO_OUT1_W1TC_REG: sim_gpio_write_mask(32, value, LOW); break;
+    case GPIO_OUT_REG:
+      sim_gpio_write_mask(0, value, HIGH);
+      sim_gpio_write_mask(0, ~value, LOW);
+      break;
+    case GPIO_OUT1_REG:
+      sim_gpio_write_mask(32, value, HIGH);
+      sim_gpio_write_mask(32, ~value, LOW);
+      break;
+    default:
+      fprintf(stderr, "sim: write to unknown register 0x%08x\n", reg);
+      abort();
+  }
+}
+
+uint32_t sim_reg_read(uint32_t reg)
+{
+  switch (reg)
+  {
+    case GPIO_OUT_REG:
+    case GPIO_IN_REG: return sim_gpio_read_mask(0);
+    case GPIO_OUT1_REG:
+    case GPIO_IN1_REG: return sim_gpio_read_mask(32);
+    default:
+      fprintf(stderr, "sim: read of unknown register 0x%08x\n", reg);
+      abort();
+  }
+}
+
+bool sim_set_input(SimNode *n, uint8_t pin, uint8_t level)
+{
+  if (n->pin_level[pin] == level)
+    return false;
+  n->pin_level[pin] = level;
+  for (uint8_t u=0; u<SIM_NUM_PCNT; u++)
+  {
+    SimPcntUnit *c = &n->pcnt[u];
+    if (c->pin != pin || !c->running)
+      continue;
+    uint8_t mode = (level == HIGH) ? c->pos_mode : c->neg_mode;
+    if (mode == PCNT_COUNT_INC)
+      c->count++;
+    else if (mode == PCNT_COUNT_DEC)
+      c->count--;
+    //the hardware starts over at 0 when a limit is reached
+    if ((c->h_lim != 0 && c->count >= c->h_lim) || (c->l_lim != 0 && c->count <= c->l_lim))
+      c->count = 0;
+  }
+  return true;
+}
+
+///////// PCNT ///////////
+
+esp_err_t pcnt_unit_config(const pcnt_config_t *cfg)
+{
+  if (cfg->unit < 0 || cfg->unit >= SIM_NUM_PCNT)
+    return ESP_ERR_INVALID_ARG;
+  SimPcntUnit *c = &sim_cur->pcnt[cfg->unit];
+  c->pin = cfg->pulse_gpio_num;
+  c->pos_mode = cfg->pos_mode;
+  c->neg_mode = cfg->neg_mode;
+  c->h_lim = cfg->counter_h_lim;
+  c->l_lim = cfg->counter_l_lim;
+  c->count = 0;
+  c->running = true;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_get_counter_value(pcnt_unit_t unit, int16_t *count)
+{
+  if (unit < 0 || unit >= SIM_NUM_PCNT)
+    return ESP_ERR_INVALID_ARG;
+  *count = sim_cur->pcnt[unit].count;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_counter_pause(pcnt_unit_t unit)
+{
+  if (unit < 0 || unit >= SIM_NUM_PCNT)
+    return ESP_ERR_INVALID_ARG;
+  sim_cur->pcnt[unit].running = false;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_counter_resume(pcnt_unit_t unit)
+{
+  if (unit < 0 || unit >= SIM_NUM_PCNT)
+    return ESP_ERR_INVALID_ARG;
+  sim_cur->pcnt[unit].running = true;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_counter_clear(pcnt_unit_t unit)
+{
+  if (unit < 0 || unit >= SIM_NUM_PCNT)
+    return ESP_ERR_INVALID_ARG;
+  sim_cur->pcnt[unit].count = 0;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_set_filter_value(pcnt_unit_t unit, uint16_t filter_val)
+{
+  if (unit < 0 || unit >= SIM_NUM_PCNT || filter_val > 1023)
+    return ESP_ERR_INVALID_ARG;
+  sim_cur->pcnt[unit].filter = filter_val;
+  return ESP_OK;
+}
+
+esp_err_t pcnt_filter_enable(pcnt_unit_t unit)
+{
+  if (unit < 0 || unit >= SIM_NUM_PCNT)
+    return ESP_ERR_INVALID_ARG;
+  return ESP_OK;
+}
+
+///////// OTA ///////////
+
+static const esp_partition_t sim_ota_partitions_[2] = {
+  {0x10000, SIM_OTA_PARTITION_SIZE, "app0"},
+  {0x10000 + SIM_OTA_PARTITION_SIZE, SIM_OTA_PARTITION_SIZE, "app1"},
+};
+
+//the cpu stalls while flash is erased, a PJON frame coming in meanwhile is lost
+static void sim_flash_erase(SimNode *n, uint32_t upto)
+{
+  while (n->ota_erased < upto)
+  {
+    n->ota_erased += SIM_FLASH_SECTOR_SIZE;
+    n->deaf_until_us = std::max(n->deaf_until_us, sim_now_us) + SIM_FLASH_ERASE_US;
+  }
+}
+
+const esp_partition_t *esp_ota_get_running_partition()
+{
+  return &sim_ota_partitions_[sim_cur->boot_partition];
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+  (void) start_from;
+  return &sim_ota_partitions_[1 - sim_cur->boot_partition];
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle)
+{
+  if (partition == esp_ota_get_running_partition())
+    return ESP_ERR_INVALID_ARG;
+  SimNode *n = sim_cur;
+  n->ota_flash.assign(partition->size, 0xFF);
+  n->ota_open = true;
+  n->ota_written = 0;
+  n->ota_erased = 0;
+  if (image_size == OTA_SIZE_UNKNOWN)
+    sim_flash_erase(n, partition->size);
+  else if (image_size != OTA_WITH_SEQUENTIAL_WRITES)
+    sim_flash_erase(n, image_size);
+  *out_handle = 1;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size)
+{
+  SimNode *n = sim_cur;
+  if (handle != 1 || !n->ota_open)
+    return ESP_ERR_INVALID_ARG;
+  if (n->ota_written + size > n->ota_flash.size())
+    return ESP_ERR_INVALID_SIZE;
+  sim_flash_erase(n, n->ota_written + size);
+  memcpy(n->ota_flash.data() + n->ota_written, data, size);
+  n->ota_written += size;
+  return ESP_OK;
+}
+
+//like esp-idf: an image has to start with the magic byte of the esp32 image header
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+  SimNode *n = sim_cur;
+  if (handle != 1 || !n->ota_open)
+    return ESP_ERR_INVALID_ARG;
+  n->ota_open = false;
+  if (n->ota_written == 0 || n->ota_flash[0] != 0xE9)
+    return ESP_ERR_OTA_VALIDATE_FAILED;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+  if (handle != 1 || !sim_cur->ota_open)
+    return ESP_ERR_INVALID_ARG;
+  sim_cur->ota_open = false;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+  for (uint8_t i=0; i<2; i++)
+    if (partition == &sim_ota_partitions_[i])
+    {
+      sim_cur->boot_partition = i;
+      return ESP_OK;
+    }
+  return ESP_ERR_INVALID_ARG;
+}
+
+void esp_restart()
+{
+  sim_cur->restarts++;
+  sim_cur->booted = false;
+}
+
+///////// PJON bus ///////////
+
+//ThroughSerial gives up waiting for the ack of a frame after this long
+#define SIM_TS_RESPONSE_TIMEOUT_US 10000
+//ThroughSerial framing
+#define SIM_TS_START 149
+#define SIM_TS_END 234
+#define SIM_TS_ESC 187
+#define SIM_TS_HEADER 0x06
+
+static int sim_pty_tx_ = -1, sim_pty_rx_ = -1;
+
+static SimPjonPort *sim_port_by_id(uint8_t id, SimPjonPort *except)
+{
+  for (uint8_t i=0; i<SIM_MAX_NODES; i++)
+  {
+    SimPjonPort *p = sim_nodes_[i].pjon;
+    if (sim_nodes_[i].booted && p && p != except && p->id == id)
+      return p;
+  }
+  return 0;
+}
+
+static bool sim_bus_lost(const SimNode *a, const SimNode *b)
+{
+  double loss = sim_bus.frame_loss;
+  if (a->link_loss > 0.0 || b->link_loss > 0.0)
+    loss = 1.0 - (1.0 - loss) * (1.0 - a->link_loss) * (1.0 - b->link_loss);
+  if (loss > 0.0 && sim_rand_unit() < loss)
+  {
+    sim_bus_stats.lost++;
+    return true;
+  }
+  return false;
+}
+
+//a sleeping node misses the frame, but its start on the line wakes it up
+static bool sim_bus_asleep(SimNode *n)
+{
+  if (!n->asleep)
+    return false;
+  if (n->wake_gpio)
+    sim_wake(n, ESP_SLEEP_WAKEUP_GPIO);
+  sim_bus_stats.lost++;
+  return true;
+}
+
+//with sim_bus.listen_windows: is n inside receive() as the frame starts? Then it receives the frame till its end.
+//The uart of ThroughSerial takes the frame in on its own
+static bool sim_bus_listening(SimNode *n, uint64_t airtime)
+{
+  if (!sim_bus.listen_windows || n->pjon->uart_baud)
+    return true;
+  if (n->listen_from_us > sim_now_us || n->listen_until_us <= sim_now_us)
+  {
+    n->missed_frames++;
+    sim_bus_stats.lost++;
+    return false;
+  }
+  //receive() returns after one frame
+  n->listen_us -= n->listen_until_us - sim_now_us;
+  n->listen_until_us = sim_now_us;
+  n->blocked_until_us = std::max(n->blocked_until_us, sim_now_us + airtime);
+  n->pjon_xfer_us += airtime;
+  return true;
+}
+
+//time on the wire per byte: a start bit, 8 data bits and a stop bit on the uart
+static uint32_t sim_bus_byte_us(const SimPjonPort *p)
+{
+  return (p->uart_baud) ? (10000000 + p->uart_baud / 2) / p->uart_baud : sim_bus.byte_us;
+}
+
+//the sending node is stuck in PJON until `until`
+static void sim_bus_block(SimNode *n, uint64_t until)
+{
+  uint64_t from = std::max(n->blocked_until_us, sim_now_us);
+  if (until <= from)
+    return;
+  n->pjon_xfer_us += until - from;
+  n->blocked_until_us = until;
+}
+
+//PJON's crc8
+static uint8_t sim_crc8(uint8_t b, uint8_t crc)
+{
+  for (uint8_t i=8; i; i--, b >>= 1)
+  {
+    uint8_t result = (crc ^ b) & 0x01;
+    crc >>= 1;
+    if (result)
+      crc ^= 0x97;
+  }
+  return crc;
+}
+
+static bool sim_pty_open()
+{
+  if (sim_pty_tx_ >= 0)
+    return true;
+  int m = posix_openpt(O_RDWR | O_NOCTTY);
+  if (m < 0 || grantpt(m) != 0 || unlockpt(m) != 0)
+    return false;
+  int s = open(ptsname(m), O_RDWR | O_NOCTTY);
+  if (s < 0)
+    return false;
+  //raw, the line discipline must not touch any byte of a frame
+  struct termios tio;
+  tcgetattr(s, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(s, TCSANOW, &tio);
+  sim_pty_tx_ = m;
+  sim_pty_rx_ = s;
+  return true;
+}
+
+//write a PJON packet (id, header, length, header crc, sender id, payload, crc) into the pty, framed and escaped
+//like ThroughSerial puts it on the RS485 line, and read it back at the other end.
+//Returns false if it did not come through intact, data is what came out
+static bool sim_pty_carry(uint8_t from, uint8_t to, std::vector<uint8_t> &data)
+{
+  if (!sim_pty_open() || data.size() + 6 > 0xFF)
+    return false;
+  std::vector<uint8_t> packet = {to, SIM_TS_HEADER, (uint8_t) (data.size() + 6)};
+  packet.push_back(sim_crc8(packet[2], sim_crc8(packet[1], sim_crc8(packet[0], 0))));
+  packet.push_back(from);
+  packet.insert(packet.end(), data.begin(), data.end());
+  uint8_t crc = 0;
+  for (uint8_t b : packet)
+    crc = sim_crc8(b, crc);
+  packet.push_back(crc);
+
+  std::vector<uint8_t> line = {SIM_TS_START};
+  for (uint8_t b : packet)
+  {
+    if (b == SIM_TS_START || b == SIM_TS_END || b == SIM_TS_ESC)
+    {
+      line.push_back(SIM_TS_ESC);
+      b ^= SIM_TS_ESC;
+    }
+    line.push_back(b);
+  }
+  line.push_back(SIM_TS_END);
+  if (write(sim_pty_tx_, line.data(), line.size()) != (ssize_t) line.size())
+    return false;
+  sim_bus_stats.pty_bytes += line.size();
+
+  std::vector<uint8_t> got;
+  bool esc = false, started = false;
+  while (true)
+  {
+    struct pollfd pfd = {sim_pty_rx_, POLLIN, 0};
+    uint8_t b;
+    if (poll(&pfd, 1, 1000) <= 0 || read(sim_pty_rx_, &b, 1) != 1)
+      return false;
+    if (!started)
+    {
+      started = (b == SIM_TS_START);
+      continue;
+    }
+    if (b == SIM_TS_END)
+      break;
+    if (esc)
+      b ^= SIM_TS_ESC;
+    else if (b == SIM_TS_ESC)
+    {
+      esc = true;
+      continue;
+    }
+    esc = false;
+    got.push_back(b);
+  }
+  if (got.size() < 6 || got[0] != to || got[2] != got.size()
+    || got[3] != sim_crc8(got[2], sim_crc8(got[1], sim_crc8(got[0], 0))) || got[4] != from)
+    return false;
+  crc = 0;
+  for (size_t i=0; i<got.size()-1; i++)
+    crc = sim_crc8(got[i], crc);
+  if (crc != got.back())
+    return false;
+  data.assign(got.begin() + 5, got.end() - 1);
+  return true;
+}
+
+uint8_t sim_pjon_id(uint8_t idx)
+{
+  return (sim_nodes_[idx].pjon) ? sim_nodes_[idx].pjon->id : NOT_ASSIGNED;
+}
+
+void sim_pjon_drop_outbox(uint8_t idx)
+{
+  if (sim_nodes_[idx].pjon)
+    sim_nodes_[idx].pjon->outbox.clear();
+}
+
+void SimPjonPort::port_begin(uint32_t baud)
+{
+  uart_baud = baud;
+  node = sim_cur;
+  sim_cur->pjon = this;
+}
+
+uint16_t SimPjonPort::port_send(uint8_t to, const char *payload, uint16_t length)
+{
+  if (outbox.size() >= MAX_PACKETS)
+  {
+    if (error)
+      error(PACKETS_BUFFER_FULL, MAX_PACKETS);
+    return FAIL;
+  }
+  SimPacket p;
+  p.to = to;
+  p.attempts = 0;
+  p.queued_us = sim_now_us;
+  p.next_attempt_us = sim_now_us;
+  p.data.assign((const uint8_t*) payload, (const uint8_t*) payload + length);
+  outbox.push_back(p);
+  return outbox.size() - 1;
+}
+
+//put one frame on the bus, which has to be free, returns true if it got acked (never for broadcasts).
+//With ThroughSerial the ack only comes once the receiver is back in receive(), *airtime includes that wait
+static bool sim_bus_transmit(SimPjonPort *src, uint8_t to, const std::vector<uint8_t> &payload, uint64_t *airtime)
+{
+  std::vector<uint8_t> data = payload;
+  bool mangled = false;
+  if (src->uart_baud && sim_bus.uart_pty && !sim_pty_carry(src->id, to, data))
+  {
+    sim_bus_stats.pty_errors++;
+    mangled = true;
+  }
+  *airtime = (uint64_t) (data.size() + sim_bus.overhead_bytes) * sim_bus_byte_us(src);
+  sim_bus_busy_until_us_ = sim_now_us + *airtime;
+  sim_bus_stats.frames++;
+  if (!data.empty() && data[0] < 32)
+    sim_bus_stats.frames_by_type[data[0]]++;
+  sim_bus_stats.bytes += data.size() + sim_bus.overhead_bytes;
+  sim_bus_stats.busy_us += *airtime;
+
+  SimFrame f;
+  f.from = src->id;
+  f.to = to;
+  f.ready_us = sim_now_us + *airtime;
+  f.data = data;
+
+  bool acked = false;
+  uint64_t ack_wait_us = 0;
+  for (uint8_t i=0; mangled == false && i<SIM_MAX_NODES; i++)
+  {
+    SimPjonPort *dst = sim_nodes_[i].pjon;
+    if (!sim_nodes_[i].booted || !dst || dst == src)
+      continue;
+    if (to != BROADCAST && dst->id != to)
+    {
+      //the line is shared, a frame to somebody else wakes a sleeping node just the same
+      if (sim_nodes_[i].asleep && sim_nodes_[i].wake_gpio)
+        sim_wake(&sim_nodes_[i], ESP_SLEEP_WAKEUP_GPIO);
+      continue;
+    }
+    if (to != BROADCAST && sim_nodes_[i].deaf_until_us > sim_now_us)
+    {
+      sim_bus_stats.lost++;
+      continue;
+    }
+    if (sim_bus_asleep(&sim_nodes_[i]))
+      continue;
+    if (!sim_bus_listening(&sim_nodes_[i], *airtime))
+      continue;
+    if (sim_bus_lost(src->node, &sim_nodes_[i]))
+      continue;
+    dst->inbox.push_back(f);
+    if (sim_on_delivery)
+      sim_on_delivery(src->id, dst->id, data.data(), data.size());
+    if (to == BROADCAST)
+      continue;
+    if (src->uart_baud && sim_bus.listen_windows && sim_nodes_[i].blocked_until_us > f.ready_us)
+    {
+      ack_wait_us = std::min(sim_nodes_[i].blocked_until_us - f.ready_us, (uint64_t) SIM_TS_RESPONSE_TIMEOUT_US);
+      if (ack_wait_us >= SIM_TS_RESPONSE_TIMEOUT_US)
+        continue;
+    }
+    //the frame made it, but the ack may still get lost, in which case PJON sends the frame again
+    if (!sim_bus_lost(src->node, &sim_nodes_[i]))
+      acked = true;
+  }
+  *airtime += ack_wait_us;
+  return acked;
+}
+
+//PJON::send_packet: one attempt right now, blocking until the frame (and its ack) are through
+uint16_t SimPjonPort::port_send_packet(uint8_t to, const char *payload, uint16_t length)
+{
+  if (sim_bus_busy_until_us_ > sim_now_us)
+    return BUSY;
+  std::vector<uint8_t> data((const uint8_t*) payload, (const uint8_t*) payload + length);
+  uint64_t airtime;
+  bool acked = sim_bus_transmit(this, to, data, &airtime);
+  sim_bus_block(node, sim_now_us + airtime);
+  return (acked || to == BROADCAST) ? ACK : FAIL;
+}
+
+//transmit at most one packet per call, if the bus is free
+void SimPjonPort::port_update()
+{
+  if (outbox.empty() || sim_bus_busy_until_us_ > sim_now_us || outbox.front().next_attempt_us > sim_now_us)
+    return;
+
+  SimPacket &p = outbox.front();
+  uint64_t airtime;
+  bool acked = sim_bus_transmit(this, p.to, p.data, &airtime);
+  if (sim_bus.listen_windows)
+    sim_bus_block(node, sim_now_us + airtime);
+  if (p.to == BROADCAST)
+  {
+    //broadcasts are not acknowledged and thus not repeated
+    outbox.pop_front();
+    return;
+  }
+
+  if (acked)
+  {
+    uint64_t ack_us = sim_now_us + airtime - p.queued_us;
+    sim_bus_stats.acked++;
+    sim_bus_stats.ack_us_sum += ack_us;
+    sim_bus_stats.ack_us_max = std::max(sim_bus_stats.ack_us_max, ack_us);
+    outbox.pop_front();
+    return;
+  }
+
+  p.attempts++;
+  if (p.attempts >= sim_bus.max_attempts)
+  {
+    uint8_t to = p.to;
+    outbox.pop_front();
+    sim_bus_stats.connection_lost++;
+    if (error)
+      error(CONNECTION_LOST, to);
+    return;
+  }
+  sim_bus_stats.retries++;
+  p.next_attempt_us = sim_now_us + airtime + (uint64_t) sim_bus.retry_base_us * p.attempts * p.attempts + sim_rand() % sim_bus.retry_base_us;
+}
+
+//frames that got through are handed over right away. With sim_bus.listen_windows and none there,
+//the node listens for duration_us (see sim_bus_listening), its loop does not run meanwhile.
+//The uart of ThroughSerial has buffered whatever came, there is nothing to wait for
+uint16_t SimPjonPort::port_receive(uint32_t duration_us)
+{
+  uint16_t rv = FAIL;
+  //like PJON, one frame per call
+  while (rv == FAIL && !inbox.empty() && inbox.front().ready_us <= sim_now_us)
+  {
+    SimFrame f = inbox.front();
+    inbox.pop_front();
+    //frames to other ids are ignored by PJON, except broadcasts
+    if (f.to != id && f.to != BROADCAST)
+      continue;
+    if (!f.data.empty() && f.data[0] < 32)
+      node->received_by_type[f.data[0]]++;
+    if (receiver)
+      receiver(f.to, f.data.data(), f.data.size());
+    rv = ACK;
+  }
+  if (rv == FAIL && sim_bus.listen_windows && !uart_baud)
+  {
+    node->listen_from_us = std::max(sim_now_us, node->blocked_until_us);
+    node->listen_until_us = node->listen_from_us + duration_us;
+    node->blocked_until_us = node->listen_until_us;
+    node->listen_us += duration_us;
+  }
+  return rv;
+}
+
+//like PJON: probe ids from 1 upwards and take the first nobody answers to
+void SimPjonPort::port_acquire_id()
+{
+  for (uint16_t i=1; i<NOT_ASSIGNED && !sim_bus.acquire_id_fails; i++)
+  {
+    if (!sim_port_by_id(i, this))
+    {
+      id = i;
+      return;
+    }
+  }
+  if (error)
+    error(ID_ACQUISITION_FAIL, 0);
+}
@@ -0,0 +1,277 @@
+/*
+ *  Damper Control Firmware - Host Simulator
+ *
+ *  Runs several copies of the unmodified firmware logic on the host,
+ *  connected by a simulated PJON bus and driven by a virtual clock.
+ *
+ *  This software is made with love
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HOSTSIM_SIM_H
+#define HOSTSIM_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <deque>
+#include <vector>
+
+//number of firmware copies linked into the simulator, set by the Makefile
+#ifndef SIM_MAX_NODES
+#define SIM_MAX_NODES 6
+#endif
+
+#define SIM_NUM_PINS 40
+#define SIM_EEPROM_SIZE 128
+#define SIM_NUM_DAMPER 3
+#define SIM_TICK_US 8000
+#define SIM_NUM_PCNT 8
+//ticks per half rotation of the damper disk, see damper time divisor in settings.cpp
+#define SIM_DAMPER_HALFTURN_TICKS 103
+//ticks the slot in the disk interrupts the lightbeam
+#define SIM_DAMPER_SLOT_TICKS 3
+//from the wakeup source firing to the first loop() after light sleep, console bytes arriving meanwhile are lost
+#define SIM_WAKE_LATENCY_US 1000
+//what hosts do before writing to the console, see sim_host_write: if the µC may sleep, which it does not
+//for IDLE_AWAKE_MS after console bytes, send '\n' and wait for SIM_AWAKE_LINE, this long and this often
+#define SIM_HOST_WAKE_WAIT_US 20000
+#define SIM_HOST_WAKE_TRIES 3
+#define SIM_HOST_AWAKE_US 400000
+//CONSOLE_AWAKE_LINE of dampercontrol.h
+#define SIM_AWAKE_LINE "awake"
+//ota partitions of the default esp32 partition table, and the time a 4kB flash sector takes to erase (datasheet typical)
+#define SIM_OTA_PARTITION_SIZE 0x140000
+#define SIM_FLASH_SECTOR_SIZE 4096
+#define SIM_FLASH_ERASE_US 45000
+
+//pins as wired in dampercontrol.h
+#define SIM_PIN_ENDSTOP_0 17
+#define SIM_PIN_DAMPER_0 21
+#define SIM_PIN_FAN 33
+//the laminaflow fan has no pin on the esp32 board yet
+#define SIM_PIN_FANLAMINA 36
+
+//entry points of one compiled copy of the firmware (see node.cpp)
+struct SimNodeApi {
+  void (*setup)();
+  void (*loop)();
+  void (*timer_isr)();      //ISR(TIMER3_COMPA_vect), the damper tick
+  void (*pinchange_isr)();  //ISR(PCINT0_vect), endstop pin change
+  void (*serialdata)(char c);
+  void (*serialdata_bulk)(const uint8_t *buf, uint16_t len);
+  void (*pjon_recv_handler)(uint8_t id, uint8_t *payload, uint8_t length);
+  void (*pjon_postrecv_handle_msg)();
+  void (*pjon_chaincast_recv_handler)(uint8_t toid, void *msg);
+  void (*task_control_dampers)();
+  void (*set_idassign_callback)(void (*cb)(uint8_t num_nodes, bool success));
+  uint32_t (*bus_us)();     //the node's idea of bus time now, 0: not synced
+  uint16_t *pjon_rx_fixed_us; //0: adaptive receive window
+  void (*send_pressure)(uint8_t sensorid); //one more MSG_PRESSUREINFO, like the loop sends every PRESSURE_INFO_INTERVAL_MS
+  uint8_t *damper_states;
+  uint8_t *damper_target_states;
+  uint8_t *damper_open_pos;
+  uint8_t *fan_target_state;
+  uint8_t *fanlamina_target_state;
+};
+
+//a disk with a slot every half rotation, the endstop lightbeam is interrupted while the slot passes
+struct SimDamper {
+  uint16_t angle;  //in ticks, SIM_DAMPER_HALFTURN_TICKS per half rotation
+  uint8_t endstop_level;
+  bool stuck;      //blocked: the motor runs, the disk does not turn
+};
+
+//esp32 pulse counter unit, see shim/driver/pcnt.h
+struct SimPcntUnit {
+  int pin;  //-1: not configured
+  bool running;
+  int16_t count;
+  int16_t h_lim;
+  int16_t l_lim;
+  uint8_t pos_mode;
+  uint8_t neg_mode;
+  uint16_t filter;
+};
+
+struct SimPjonPort;
+
+struct SimNode {
+  uint8_t idx;
+  bool registered;
+  bool booted;
+  SimNodeApi api;
+  uint8_t pin_mode[SIM_NUM_PINS];
+  uint8_t pin_level[SIM_NUM_PINS];
+  uint8_t eeprom[SIM_EEPROM_SIZE];
+  std::deque<uint8_t> serial_in;
+  uint64_t serial_lost;    //console bytes that arrived while the node slept or woke up
+  bool host_wrote;         //sim_host_write has written to the node, at host_wrote_us
+  uint64_t host_wrote_us;
+  uint32_t awake_lines;    //SIM_AWAKE_LINE printed, counted with or without capture_output
+  std::vector<uint8_t> serial_out;
+  bool capture_output;
+  bool log_output;
+  SimPjonPort *pjon;
+  SimDamper damper[SIM_NUM_DAMPER];
+  SimPcntUnit pcnt[SIM_NUM_PCNT];
+  uint64_t gpio_writes;  //digitalWrite calls and gpio register writes
+  bool sensor_installed[SIM_NUM_DAMPER];
+  float sensor_pascal[SIM_NUM_DAMPER];
+  uint64_t next_tick_us;
+  uint64_t deaf_until_us; //frames to this node get lost until then, e.g. while it is busy writing flash
+  uint64_t blocked_until_us; //the node is inside a blocking send (send_packet) until then, its loop does not run
+  //the node's crystal: millis()/micros() run clock_ppm fast and start at clock_offset_us, both 0 unless a bench sets them
+  uint64_t clock_offset_us;
+  int32_t clock_ppm;
+  double link_loss;       //frames and acks to or from this node get lost with this probability, on top of sim_bus.frame_loss
+  uint32_t loop_busy_us;  //each loop takes this much longer, for the work a real loop does besides PJON
+  //PJON receive() window, only with sim_bus.listen_windows
+  uint64_t listen_from_us;
+  uint64_t listen_until_us;
+  uint64_t listen_us;     //total time spent inside receive()
+  uint64_t missed_frames; //frames that started while the node was not listening
+  uint64_t received_by_type[32]; //frames receive() handed to the firmware, by msg type
+  uint64_t pjon_xfer_us;  //time the loop was stuck sending or receiving a frame (with sim_bus.listen_windows)
+  bool endstops_external;  //endstop pins are set by the caller (e.g. replay) instead of the damper mechanics
+  //light sleep, see shim/esp_sleep.h. Neither loop nor tick run while asleep, frames to the node get lost
+  bool asleep;
+  uint64_t sleep_timer_us;  //esp_sleep_enable_timer_wakeup, 0: off
+  bool wake_gpio;           //PJON pin wakes the node
+  bool wake_uart;           //UART0 wakes the node, the byte that does it and the bytes until it is awake are lost
+  uint64_t sleep_until_us;  //timer wakeup
+  uint64_t wake_at_us;      //a wakeup source fired, the loop runs again from here, 0: none yet
+  int wakeup_cause;         //esp_sleep_wakeup_cause_t
+  uint64_t slept_at_us;
+  uint64_t asleep_us;       //total time spent in light sleep, up to the wakeup source firing
+  uint64_t sleeps;
+  //ota partitions, see shim/esp_ota_ops.h
+  std::vector<uint8_t> ota_flash;  //the partition being written
+  bool ota_open;
+  uint32_t ota_written;
+  uint32_t ota_erased;     //bytes of the partition erased so far
+  uint8_t boot_partition;
+  uint32_t restarts;
+};
+
+//--- PJON bus model ---
+
+struct SimFrame {
+  uint8_t from;
+  uint8_t to;
+  uint64_t ready_us;
+  std::vector<uint8_t> data;
+};
+
+struct SimPacket {
+  uint8_t to;
+  uint8_t attempts;
+  uint64_t queued_us;
+  uint64_t next_attempt_us;
+  std::vector<uint8_t> data;
+};
+
+//one PJON instance, the PJON<Strategy> template in shim/PJON.h derives from this
+struct SimPjonPort {
+  SimNode *node;
+  uint8_t id;
+  uint32_t uart_baud;  //ThroughSerial over a uart at this speed, 0: SoftwareBitBang
+  void (*receiver)(uint8_t id, uint8_t *payload, uint8_t length);
+  void (*error)(uint8_t code, uint8_t data);
+  std::deque<SimPacket> outbox;
+  std::deque<SimFrame> inbox;
+
+  void port_begin(uint32_t baud);
+  uint16_t port_send(uint8_t to, const char *payload, uint16_t length);
+  uint16_t port_send_packet(uint8_t to, const char *payload, uint16_t length);
+  void port_update();
+  uint16_t port_receive(uint32_t duration_us);
+  void port_acquire_id();
+};
+
+struct SimBusParams {
+  uint32_t byte_us;          //time on the wire per byte with SoftwareBitBang, ThroughSerial takes 10 bits at its baud rate
+  uint32_t overhead_bytes;   //PJON header, crc and ack per frame
+  uint8_t max_attempts;      //PJON gives up after this many tries and reports CONNECTION_LOST
+  uint32_t retry_base_us;    //backoff is retry_base_us * attempts^2
+  double frame_loss;         //probability that a frame or its ack gets lost
+  bool listen_windows;       //a frame only gets through if it starts while its receiver is inside PJON receive(),
+                             //sending and receiving block the node like SoftwareBitBang does. With ThroughSerial the uart
+                             //receives while the node does something else, a sender waits for the ack
+  bool uart_pty;             //ThroughSerial frames go through a pty pair, escaped and framed like on the RS485 line
+  bool acquire_id_fails;     //acquire_id() never finds an id, a µC without one stays at NOT_ASSIGNED
+};
+
+struct SimBusStats {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t lost;
+  uint64_t retries;
+  uint64_t connection_lost;
+  uint64_t busy_us;
+  uint64_t acked;        //frames acked by their destination
+  uint64_t ack_us_sum;   //time from the first attempt to the ack, summed over all acked frames
+  uint64_t ack_us_max;
+  uint64_t frames_by_type[32]; //by msg type (first payload byte), the higher ones not counted
+  uint64_t pty_bytes;    //with sim_bus.uart_pty: bytes that went through the pty, start, end and escapes included
+  uint64_t pty_errors;   //frames that did not come out of the pty as they went in
+};
+
+extern uint64_t sim_now_us;
+extern uint32_t sim_loop_cost_us;
+extern SimNode *sim_cur;
+extern SimBusParams sim_bus;
+extern SimBusStats sim_bus_stats;
+//called for every frame that reaches a node, e.g. to follow a chaincast, 0: none
+extern void (*sim_on_delivery)(uint8_t from, uint8_t to, const uint8_t *data, size_t length);
+
+void sim_register_node(uint8_t idx, const SimNodeApi &api);
+void sim_init(uint32_t seed);
+SimNode *sim_node(uint8_t idx);
+uint8_t sim_num_nodes();
+void sim_select(SimNode *n);
+
+//EEPROM content is written before boot to give a node its id and installed dampers
+void sim_preset_eeprom(uint8_t idx, uint8_t pjon_id, uint8_t installed_dampers);
+//let the node light sleep while idle, as 'Z1' on its console would
+void sim_preset_idle_sleep(uint8_t idx, bool on);
+void sim_boot(uint8_t idx);
+//bytes arriving at the console uart right now
+void sim_serial_write(uint8_t idx, const char *data, size_t length);
+//write to the console like a host does, waking the node first if it may sleep. Runs the simulation while it waits
+void sim_host_write(uint8_t idx, const char *data, size_t length);
+//change the level of an input pin, counting the edge on the pcnt units watching it.
+//returns true if the level changed, the caller then runs the pinchange ISR
+bool sim_set_input(SimNode *n, uint8_t pin, uint8_t level);
+//run all booted nodes for duration_us of virtual time
+void sim_run(uint64_t duration_us);
+//run until cond() returns true or max_us have passed, returns true if cond was met
+bool sim_run_until(bool (*cond)(), uint64_t max_us);
+
+//deterministic random numbers for the simulator and the firmware
+uint32_t sim_rand();
+double sim_rand_unit();
+
+//run fn in a forked child, so every scenario starts with pristine firmware globals
+int sim_run_isolated(void (*fn)(void *arg), void *arg);
+
+//used by the shim and node.cpp
+int sim_node_vprintf(const char *fmt, va_list ap);
+size_t sim_serial_read(uint8_t *buf, size_t length);
+int sim_serial_available();
+uint8_t sim_pjon_id(uint8_t idx);
+void sim_pjon_drop_outbox(uint8_t idx);
+
+#endif
@@ -0,0 +1,420 @@
+/*
+ *  Damper Control Firmware - Host Simulator
+ *
+ *  Soak test: a whole installation (a ladder of µC, the panels of two rooms) runs for hours of virtual time.
+ *  The panels send random presets, light flashes into the endstop lightbeams and frames get lost,
+ *  and every command is timed until the fan does what it was told and all dampers are at their targets.
+ *  Prints one JSON line with the latency percentiles, so protocol and timing changes can be compared.
+ *
+ *  This software is made with love
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <vector>
+#include <algorithm>
+#include "sim.h"
+#include "Arduino.h"
+#include "../src/dampercontrol.h"
+
+//latencies are kept in 1ms buckets, longer ones only count towards max
+#define SOAK_HIST_MS 60000
+//a command that did not get there in this time is given up
+#define SOAK_TIMEOUT_US 60000000ull
+//light flash into an endstop lightbeam
+#define SOAK_FLASH_US 2000
+//coarser than the benches: 50us and 200us give the same latencies within 1ms, at four times the speed
+#define SOAK_LOOP_COST_US 200
+
+struct SoakParams {
+  uint8_t nodes;
+  double hours;          // virtual time, split between the jobs
+  double cmd_interval_s; // mean time between two panel commands, over both rooms
+  double frame_loss;
+  double flashes_per_hour; // per installed damper
+  uint32_t seed;
+  uint32_t jobs;
+};
+
+//what one job found, summed up by the parent
+struct SoakResult {
+  uint64_t virtual_us;
+  uint64_t cmds;
+  uint64_t superseded; // the next command came before this one got there
+  uint64_t timeouts;
+  uint64_t flashes;
+  uint64_t frames;
+  uint64_t bus_busy_us;
+  uint64_t pjon_lost;
+  uint64_t airflow_n, off_n;
+  uint64_t airflow_max_us, off_max_us;
+  uint32_t airflow_hist[SOAK_HIST_MS + 1];
+  uint32_t off_hist[SOAK_HIST_MS + 1];
+};
+
+static SoakParams soak_;
+static SoakResult soak_result_;
+
+//the command being timed
+static bool soak_pending_ = false;
+static uint8_t soak_panel_id_ = 0;  // pjon id of the µC the panel sent it to
+static bool soak_seq_known_ = false;
+static uint8_t soak_seq_ = 0;
+static uint8_t soak_last_seq_[256]; // of the previous command of each panel
+static bool soak_reached_top_ = false;
+static uint64_t soak_start_us_ = 0;
+static bool soak_open_ = false;      // a preset that switches the fan on
+
+static uint8_t soak_installed_[SIM_MAX_NODES];
+
+//the top µC runs the fan and is the last one to get a damper command on its way up
+static SimNode *soak_top()
+{
+  return sim_node(soak_.nodes - 1);
+}
+
+//watch the bus for our command: which seq it got from the panel's µC, and when the top µC turned it around
+static void soak_on_delivery(uint8_t from, uint8_t to, const uint8_t *data, size_t length)
+{
+  (void) to;
+  if (!soak_pending_ || length < 4 || (data[0] != MSG_DAMPERCMD && data[0] != MSG_PRESETCMD))
+    return;
+  const pjon_chaincast_t *cc = (const pjon_chaincast_t*) (data + 1);
+  if (cc->origin != soak_panel_id_)
+    return;
+  if (!soak_seq_known_)
+  {
+    if ((int8_t) (uint8_t) (cc->seq - soak_last_seq_[soak_panel_id_]) <= 0)
+      return; //an older command of the same panel
+    soak_seq_ = cc->seq;
+    soak_seq_known_ = true;
+  }
+  if (cc->seq == soak_seq_ && from == sim_pjon_id(soak_.nodes - 1) && (cc->reach & 7) == 7)
+    soak_reached_top_ = true;
+}
+
+//the fan does what the top µC was told and every damper is at its target
+static bool soak_done()
+{
+  if (!soak_reached_top_)
+    return false;
+  SimNode *top = soak_top();
+  if ((top->pin_level[SIM_PIN_FAN] == 0) != (*top->api.fan_target_state != 0))
+    return false;
+  for (uint8_t i=0; i<soak_.nodes; i++)
+    for (uint8_t d=0; d<SIM_NUM_DAMPER; d++)
+      if ((soak_installed_[i] & _BV(d)) && sim_node(i)->api.damper_states[d] != sim_node(i)->api.damper_target_states[d])
+        return false;
+  return true;
+}
+
+static void soak_record(uint64_t us)
+{
+  uint32_t *hist = (soak_open_) ? soak_result_.airflow_hist : soak_result_.off_hist;
+  uint64_t *n = (soak_open_) ? &soak_result_.airflow_n : &soak_result_.off_n;
+  uint64_t *max = (soak_open_) ? &soak_result_.airflow_max_us : &soak_result_.off_max_us;
+  uint64_t ms = us / 1000;
+  hist[(ms < SOAK_HIST_MS) ? ms : SOAK_HIST_MS]++;
+  (*n)++;
+  if (us > *max)
+    *max = us;
+}
+
+//room 1 has its panel on the bottom µC, room 2 on the top one
+static void soak_send_command()
+{
+  uint8_t room = 1 + sim_rand() % 2;
+  uint8_t idx = (room == 1) ? 0 : soak_.nodes - 1;
+  uint8_t preset = (sim_rand() % 10 < 7) ? 1 + sim_rand() % 7 : PRESET_OFF;
+  if (soak_pending_)
+    soak_result_.superseded++;
+  if (soak_seq_known_)
+    soak_last_seq_[soak_panel_id_] = soak_seq_;
+
+  pjon_message_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MSG_PRESETCMD;
+  msg.chaincast.presetcmd.preset = preset;
+  msg.chaincast.presetcmd.room = room;
+  uint8_t buf[3 + sizeof(pjon_message_t)] = {'>', 1, sizeof(presetcmd_t)+4};
+  memcpy(buf + 3, &msg, buf[2]);
+  sim_host_write(idx, (const char*) buf, 3 + buf[2]);
+
+  soak_result_.cmds++;
+  soak_pending_ = true;
+  soak_panel_id_ = sim_pjon_id(idx);
+  soak_seq_known_ = false;
+  soak_reached_top_ = false;
+  soak_start_us_ = sim_now_us;
+  soak_open_ = preset != PRESET_OFF;
+}
+
+//light from the ceiling into the lightbeam of a random installed damper
+static void soak_flash()
+{
+  uint8_t i, d;
+  do {
+    i = sim_rand() % soak_.nodes;
+    d = sim_rand() % SIM_NUM_DAMPER;
+  } while (!(soak_installed_[i] & _BV(d)));
+  SimNode *n = sim_node(i);
+  sim_select(n);
+  if (sim_set_input(n, SIM_PIN_ENDSTOP_0 + d, LOW))
+    n->api.pinchange_isr();
+  sim_run(SOAK_FLASH_US);
+  sim_select(n);
+  if (sim_set_input(n, SIM_PIN_ENDSTOP_0 + d, n->damper[d].endstop_level))
+    n->api.pinchange_isr();
+  soak_result_.flashes++;
+}
+
+static uint64_t soak_exp_us(double mean_s)
+{
+  return (uint64_t) (-log(1.0 - sim_rand_unit()) * mean_s * 1e6) + 1;
+}
+
+static void soak_job(uint32_t seed, uint64_t duration_us)
+{
+  memset(&soak_result_, 0, sizeof(soak_result_));
+  memset(soak_installed_, 0, sizeof(soak_installed_));
+  soak_installed_[0] |= _BV(0);
+  soak_installed_[soak_.nodes/2] |= _BV(1);
+  soak_installed_[soak_.nodes-1] |= _BV(2);
+  uint8_t num_installed = 3;
+
+  sim_init(seed);
+  sim_bus.frame_loss = soak_.frame_loss;
+  sim_on_delivery = soak_on_delivery;
+  for (uint8_t i=0; i<soak_.nodes; i++)
+  {
+    sim_preset_eeprom(i, i+1, soak_installed_[i]);
+    sim_boot(i);
+  }
+  sim_run(2000000);
+
+  uint64_t t0 = sim_now_us, end = sim_now_us + duration_us;
+  uint64_t frames0 = sim_bus_stats.frames, busy0 = sim_bus_stats.busy_us, lost0 = sim_bus_stats.connection_lost;
+  uint64_t next_cmd = sim_now_us + soak_exp_us(soak_.cmd_interval_s);
+  double flash_mean_s = (soak_.flashes_per_hour > 0) ? 3600.0 / (soak_.flashes_per_hour * num_installed) : 0;
+  uint64_t next_flash = (flash_mean_s > 0) ? sim_now_us + soak_exp_us(flash_mean_s) : UINT64_MAX;
+  while (sim_now_us < end)
+  {
+    uint64_t next = std::min(std::min(next_cmd, next_flash), end);
+    if (soak_pending_)
+    {
+      uint64_t give_up = soak_start_us_ + SOAK_TIMEOUT_US;
+      uint64_t until = std::min(next, give_up);
+      if (sim_run_until(soak_done, (until > sim_now_us) ? until - sim_now_us : 0))
+      {
+        soak_record(sim_now_us - soak_start_us_);
+        soak_pending_ = false;
+      } else if (sim_now_us >= give_up) {
+        soak_result_.timeouts++;
+        soak_pending_ = false;
+      }
+    }
+    if (sim_now_us < next)
+      sim_run(next - sim_now_us);
+    if (sim_now_us >= next_flash)
+    {
+      soak_flash();
+      next_flash = sim_now_us + soak_exp_us(flash_mean_s);
+    }
+    if (sim_now_us >= next_cmd && sim_now_us < end)
+    {
+      soak_send_command();
+      next_cmd = sim_now_us + soak_exp_us(soak_.cmd_interval_s);
+    }
+  }
+  soak_result_.virtual_us = sim_now_us - t0;
+  soak_result_.frames = sim_bus_stats.frames - frames0;
+  soak_result_.bus_busy_us = sim_bus_stats.busy_us - busy0;
+  soak_result_.pjon_lost = sim_bus_stats.connection_lost - lost0;
+}
+
+static void soak_merge(SoakResult *sum, const SoakResult *r)
+{
+  sum->virtual_us += r->virtual_us;
+  sum->cmds += r->cmds;
+  sum->superseded += r->superseded;
+  sum->timeouts += r->timeouts;
+  sum->flashes += r->flashes;
+  sum->frames += r->frames;
+  sum->bus_busy_us += r->bus_busy_us;
+  sum->pjon_lost += r->pjon_lost;
+  sum->airflow_n += r->airflow_n;
+  sum->off_n += r->off_n;
+  if (r->airflow_max_us > sum->airflow_max_us)
+    sum->airflow_max_us = r->airflow_max_us;
+  if (r->off_max_us > sum->off_max_us)
+    sum->off_max_us = r->off_max_us;
+  for (uint32_t ms=0; ms<=SOAK_HIST_MS; ms++)
+  {
+    sum->airflow_hist[ms] += r->airflow_hist[ms];
+    sum->off_hist[ms] += r->off_hist[ms];
+  }
+}
+
+//in ms, the bucket p of the samples are at or below
+static double soak_percentile(const uint32_t *hist, uint64_t n, double p)
+{
+  if (n == 0)
+    return 0.0;
+  uint64_t rank = (uint64_t) ceil(p * n), seen = 0;
+  if (rank == 0)
+    rank = 1;
+  for (uint32_t ms=0; ms<=SOAK_HIST_MS; ms++)
+  {
+    seen += hist[ms];
+    if (seen >= rank)
+      return ms + 1;
+  }
+  return SOAK_HIST_MS;
+}
+
+static uint64_t wall_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//every job runs in its own process with its own seed, the results come back through a pipe
+static bool soak_run_jobs(SoakResult *sum)
+{
+  uint64_t per_job_us = (uint64_t) (soak_.hours * 3600e6 / soak_.jobs);
+  std::vector<int> fds;
+  std::vector<pid_t> pids;
+  fflush(stdout);
+  fflush(stderr);
+  for (uint32_t j=0; j<soak_.jobs; j++)
+  {
+    int fd[2];
+    if (pipe(fd) != 0)
+      return false;
+    pid_t pid = fork();
+    if (pid < 0)
+      return false;
+    if (pid == 0)
+    {
+      close(fd[0]);
+      soak_job(soak_.seed + j, per_job_us);
+      const uint8_t *p = (const uint8_t*) &soak_result_;
+      for (size_t done = 0; done < sizeof(soak_result_); )
+      {
+        ssize_t w = write(fd[1], p + done, sizeof(soak_result_) - done);
+        if (w <= 0)
+          _exit(1);
+        done += w;
+      }
+      _exit(0);
+    }
+    close(fd[1]);
+    fds.push_back(fd[0]);
+    pids.push_back(pid);
+  }
+  bool ok = true;
+  SoakResult *r = new SoakResult;
+  for (size_t j=0; j<fds.size(); j++)
+  {
+    size_t done = 0;
+    while (done < sizeof(*r))
+    {
+      ssize_t n = read(fds[j], (uint8_t*) r + done, sizeof(*r) - done);
+      if (n <= 0)
+        break;
+      done += n;
+    }
+    close(fds[j]);
+    int status = 0;
+    waitpid(pids[j], &status, 0);
+    if (done != sizeof(*r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+      fprintf(stderr, "soak: job %zu failed\n", j);
+      ok = false;
+      continue;
+    }
+    soak_merge(sum, r);
+  }
+  delete r;
+  return ok;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-H hours] [-n nodes] [-i cmd_interval_s] [-l frame_loss] [-f flashes_per_hour] [-s seed] [-j jobs] [-c loop_cost_us]\n", argv0);
+}
+
+int main(int argc, char *argv[])
+{
+  soak_.nodes = 4;
+  soak_.hours = 24;
+  soak_.cmd_interval_s = 600;
+  soak_.frame_loss = 0.01;
+  soak_.flashes_per_hour = 1;
+  soak_.seed = 1;
+  soak_.jobs = 1;
+  sim_loop_cost_us = SOAK_LOOP_COST_US;
+  int opt;
+  while ((opt = getopt(argc, argv, "H:n:i:l:f:s:j:c:h")) != -1)
+  {
+    switch (opt)
+    {
+      case 'H': soak_.hours = atof(optarg); break;
+      case 'n': soak_.nodes = atoi(optarg); break;
+      case 'i': soak_.cmd_interval_s = atof(optarg); break;
+      case 'l': soak_.frame_loss = atof(optarg); break;
+      case 'f': soak_.flashes_per_hour = atof(optarg); break;
+      case 's': soak_.seed = strtoul(optarg, 0, 0); break;
+      case 'j': soak_.jobs = strtoul(optarg, 0, 0); break;
+      case 'c': sim_loop_cost_us = strtoul(optarg, 0, 0); break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if (soak_.nodes < 2 || soak_.nodes > sim_num_nodes() || soak_.jobs < 1 || soak_.hours <= 0 || soak_.cmd_interval_s <= 0)
+  {
+    fprintf(stderr, "soak: 2..%u nodes, at least one job and some hours and command interval\n", sim_num_nodes());
+    return 2;
+  }
+
+  SoakResult *sum = new SoakResult;
+  memset(sum, 0, sizeof(*sum));
+  uint64_t t0 = wall_ns();
+  bool ok = soak_run_jobs(sum);
+  double wall_s = (wall_ns() - t0) / 1e9;
+  double hours = sum->virtual_us / 3600e6;
+  printf("{\"soak\":\"ladder\",\"nodes\":%u,\"hours\":%.1f,\"cmd_interval_s\":%.0f,\"frame_loss\":%.3f,\"flashes_per_hour\":%.2f,"
+         "\"seed\":%u,\"jobs\":%u,\"cmds\":%llu,\"airflow\":%llu,\"off\":%llu,\"superseded\":%llu,\"timeouts\":%llu,\"flashes\":%llu,"
+         "\"cmd_to_airflow_ms_p50\":%.0f,\"cmd_to_airflow_ms_p99\":%.0f,\"cmd_to_airflow_ms_max\":%.1f,"
+         "\"cmd_to_off_ms_p50\":%.0f,\"cmd_to_off_ms_p99\":%.0f,\"cmd_to_off_ms_max\":%.1f,"
+         "\"frames_per_hour\":%.0f,\"bus_busy\":%.5f,\"pjon_lost\":%llu,\"wall_s\":%.1f,\"speedup\":%.0f}\n",
+    soak_.nodes, hours, soak_.cmd_interval_s, soak_.frame_loss, soak_.flashes_per_hour, soak_.seed, soak_.jobs,
+    (unsigned long long) sum->cmds, (unsigned long long) sum->airflow_n, (unsigned long long) sum->off_n,
+    (unsigned long long) sum->superseded, (unsigned long long) sum->timeouts, (unsigned long long) sum->flashes,
+    soak_percentile(sum->airflow_hist, sum->airflow_n, 0.5), soak_percentile(sum->airflow_hist, sum->airflow_n, 0.99),
+    sum->airflow_max_us / 1000.0,
+    soak_percentile(sum->off_hist, sum->off_n, 0.5), soak_percentile(sum->off_hist, sum->off_n, 0.99),
+    sum->off_max_us / 1000.0,
+    (hours > 0) ? sum->frames / hours : 0.0, (sum->virtual_us) ? (double) sum->bus_busy_us / sum->virtual_us : 0.0,
+    (unsigned long long) sum->pjon_lost, wall_s, (wall_s > 0) ? sum->virtual_us / 1e6 / wall_s : 0.0);
+  delete sum;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,210 @@
+/*
+ *  Damper Control Firmware - Serial Capture
+ *
+ *  Records frames, endstops and damper outputs on the console for hostsim/replay.
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "Arduino.h"
+#include "dampercontrol.h"
+
+///////// Capture ///////////////
+//records everything that goes into the damper logic (PJON frames, endstop levels)
+//and what comes out of it (motor and fan pins), so ../hostsim/replay can run it again.
+//
+//toggled with 'C' on the serial console, off after boot.
+//records are written to capture_buf_ from the ISRs and the loop and printed by task_capture as
+//  ~KKTTTTTTTTDD..DD\r\n
+//KK: capture_record_t, TTTTTTTT: millis() of the record, DD: record data, all in hex
+
+#define CAPTURE_BUF_LEN 1024
+//each record in capture_buf_ is: length of data, kind, millis (4 bytes), data
+#define CAPTURE_HDR_LEN 6
+#define CAPTURE_MAX_DATA_LEN (2 + sizeof(pjon_message_t))
+//printing is slow, don't hog the loop
+#define CAPTURE_MAX_RECORDS_PER_LOOP 4
+
+bool capture_enabled_ = false;
+uint8_t capture_buf_[CAPTURE_BUF_LEN];
+uint16_t capture_head_ = 0; //written by capture_push
+uint16_t capture_tail_ = 0; //read by task_capture
+//records that did not fit into capture_buf_, reported with CAPTURE_OVERFLOW
+uint8_t capture_lost_ = 0;
+//last levels recorded, 0xFF forces the next record
+uint8_t capture_endstops_ = 0xFF;
+uint8_t capture_outputs_ = 0xFF;
+
+static uint16_t capture_free()
+{
+  return (capture_tail_ + CAPTURE_BUF_LEN - capture_head_ - 1) % CAPTURE_BUF_LEN;
+}
+
+//may be called from ISR and loop, thus interrupts are off while the record is written
+static void capture_push(uint8_t kind, const uint8_t *data, uint8_t len)
+{
+  if (!capture_enabled_)
+    return;
+  uint8_t hdr[CAPTURE_HDR_LEN];
+  uint32_t now = millis();
+  hdr[0] = len;
+  hdr[1] = kind;
+  memcpy(hdr + 2, &now, 4);
+  noInterrupts();
+  if (capture_free() < CAPTURE_HDR_LEN + len)
+  {
+    if (capture_lost_ < 0xFF)
+      capture_lost_++;
+  } else {
+    for (uint8_t i=0; i<CAPTURE_HDR_LEN; i++)
+    {
+      capture_buf_[capture_head_] = hdr[i];
+      capture_head_ = (capture_head_ + 1) % CAPTURE_BUF_LEN;
+    }
+    for (uint8_t i=0; i<len; i++)
+    {
+      capture_buf_[capture_head_] = data[i];
+      capture_head_ = (capture_head_ + 1) % CAPTURE_BUF_LEN;
+    }
+  }
+  interrupts();
+}
+
+static void capture_print(uint8_t kind, uint32_t ms, const uint8_t *data, uint8_t len)
+{
+  char line[2 * (CAPTURE_HDR_LEN + CAPTURE_MAX_DATA_LEN) + 2];
+  int pos = snprintf(line, sizeof(line), "~%02X%08lX", kind, (unsigned long) ms);
+  for (uint8_t i=0; i<len && pos < (int) sizeof(line) - 2; i++)
+    pos += snprintf(line + pos, sizeof(line) - pos, "%02X", data[i]);
+  printf("%s\r\n", line);
+}
+
+void capture_targets()
+{
+  uint8_t data[NUM_DAMPER + 2];
+  memcpy(data, damper_target_states_, NUM_DAMPER);
+  data[NUM_DAMPER] = fan_target_state_;
+  data[NUM_DAMPER + 1] = fanlamina_target_state_;
+  capture_push(CAPTURE_TARGETS, data, sizeof(data));
+}
+
+void capture_frame(uint8_t toid, const uint8_t *payload, uint8_t length)
+{
+  if (!capture_enabled_)
+    return;
+  uint8_t data[CAPTURE_MAX_DATA_LEN];
+  if (length > sizeof(pjon_message_t))
+    length = sizeof(pjon_message_t);
+  data[0] = toid;
+  data[1] = length;
+  memcpy(data + 2, payload, length);
+  capture_push(CAPTURE_FRAME, data, 2 + length);
+}
+
+void capture_endstops()
+{
+  if (!capture_enabled_)
+    return;
+  uint8_t levels = 0;
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+    if (ENDSTOP_ISHIGH(d))
+      levels |= _BV(d);
+  if (levels == capture_endstops_)
+    return;
+  capture_endstops_ = levels;
+  capture_push(CAPTURE_ENDSTOPS, &levels, 1);
+}
+
+void capture_outputs()
+{
+  if (!capture_enabled_)
+    return;
+  uint8_t outputs = 0;
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+    if (DAMPER_ISRUNNING(d))
+      outputs |= _BV(d);
+  if (FAN_ISRUNNING)
+    outputs |= CAPTURE_OUTPUT_FAN;
+  if (FANLAMINA_ISRUNNING)
+    outputs |= CAPTURE_OUTPUT_FANLAMINA;
+  if (outputs == capture_outputs_)
+    return;
+  capture_outputs_ = outputs;
+  capture_push(CAPTURE_OUTPUTS, &outputs, 1);
+}
+
+//start with a snapshot of everything the replay needs to continue from here
+void capture_start()
+{
+  capture_head_ = 0;
+  capture_tail_ = 0;
+  capture_lost_ = 0;
+  capture_endstops_ = 0xFF;
+  capture_outputs_ = 0xFF;
+  capture_enabled_ = true;
+
+  uint8_t data[2 + 2 * NUM_DAMPER];
+  data[0] = pjon_device_id_;
+  data[1] = getInstalledDampersAsBitfield();
+  memcpy(data + 2, damper_states_, NUM_DAMPER);
+  memcpy(data + 2 + NUM_DAMPER, damper_open_pos_, NUM_DAMPER);
+  capture_push(CAPTURE_START, data, sizeof(data));
+  capture_targets();
+  capture_endstops();
+  capture_outputs();
+}
+
+void capture_toggle()
+{
+  if (capture_enabled_)
+  {
+    capture_enabled_ = false;
+    printf("capture off\r\n");
+  } else {
+    printf("capture on\r\n");
+    capture_start();
+  }
+}
+
+void task_capture()
+{
+  uint8_t rec[CAPTURE_HDR_LEN + CAPTURE_MAX_DATA_LEN];
+  for (uint8_t n=0; n<CAPTURE_MAX_RECORDS_PER_LOOP; n++)
+  {
+    noInterrupts();
+    if (capture_tail_ == capture_head_)
+    {
+      interrupts();
+      break;
+    }
+    uint8_t len = capture_buf_[capture_tail_];
+    for (uint8_t i=0; i<CAPTURE_HDR_LEN + len; i++)
+    {
+      rec[i] = capture_buf_[capture_tail_];
+      capture_tail_ = (capture_tail_ + 1) % CAPTURE_BUF_LEN;
+    }
+    interrupts();
+    uint32_t ms;
+    memcpy(&ms, rec + 2, 4);
+    capture_print(rec[1], ms, rec + CAPTURE_HDR_LEN, len);
+  }
+  if (capture_lost_ > 0 && capture_tail_ == capture_head_)
+  {
+    capture_print(CAPTURE_OVERFLOW, millis(), &capture_lost_, 1);
+    capture_lost_ = 0;
+  }
+}
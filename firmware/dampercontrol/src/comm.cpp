@@ -26,60 +26,212 @@
 #include "dampercontrol.h"
 
 
+#if PJON_STRATEGY == PJON_STRATEGY_UART
+PJON<ThroughSerial> pjonbus_;
+#else
 PJON<SoftwareBitBang> pjonbus_;
+#endif
 
 // --- PJON ID LIST ---
 
 #define PJON_ID_LIST_LEN 10
 uint8_t pjon_id_list_[PJON_ID_LIST_LEN];
+uint16_t pjon_id_nonce_[PJON_ID_LIST_LEN]; //nonce of the µC in pjon_id_list_, two µC may share an id
 uint8_t pjon_id_list_idx_ = 0;
 
+// --- PJON ID ASSIGNMENT ---
+
+//each µC answers a MSG_PJONID_QUESTION in its own slot of PJON_IDASSIGN_SLOT_MS, see pjon_idreply_slot()
+#define PJON_IDASSIGN_SLOT_MS 8
+#define PJON_IDASSIGN_SLOTS (2*PJON_ID_LIST_LEN)
+#define PJON_IDASSIGN_MAX_ROUNDS 4
+#define PJON_AUTOID_SETTLE_MS 200
+#define PJON_AUTOID_BACKOFF_MS 100
+#define PJON_AUTOID_MAX_ATTEMPTS 5
+
+uint8_t pjon_idreply_to_ = 0;
+uint32_t pjon_idreply_due_ = 0;
+uint16_t pjon_idnonce_ = 1; //drawn in pjon_init()
+bool pjon_autoid_pending_ = false;
+uint8_t pjon_autoid_attempt_ = 0;
+uint32_t pjon_autoid_due_ = 0;
+
+//MSG_EVENT frames wait here and leave at most one per PJON_EVENT_MIN_INTERVAL_MS,
+//so a flapping endstop or fan can not flood the bus
+#define PJON_EVENT_QUEUE_LEN 8
+#define PJON_EVENT_MIN_INTERVAL_MS 50
+eventinfo_t pjon_event_queue_[PJON_EVENT_QUEUE_LEN];
+uint8_t pjon_event_queue_len_ = 0;
+uint8_t pjon_event_seq_ = 0;
+uint32_t pjon_event_next_send_ = 0;
+
+//newest chaincast of each type, see Chaincasting below
+#define PJON_CHAINCAST_SEEN_LEN 4
+#define PJON_CHAINCAST_SEEN_TIMEOUT_MS 10000
+#define PJON_CHAINCAST_PASS_UP 1
+#define PJON_CHAINCAST_PASS_DOWN 2
+
+typedef struct {
+  uint8_t type; // 0xFF: unused
+  uint8_t origin;
+  uint8_t seq;
+  uint8_t passes; // PJON_CHAINCAST_PASS_* bits handled so far
+  uint32_t last_seen;
+} chaincast_seen_t;
+
+chaincast_seen_t pjon_chaincast_seen_[PJON_CHAINCAST_SEEN_LEN] = {{0xFF,0,0,0,0},{0xFF,0,0,0,0},{0xFF,0,0,0,0},{0xFF,0,0,0,0}};
+uint8_t pjon_chaincast_clock_ = 0; //highest seq we have seen or sent
+
+//after boot we don't know the clock, our first chaincast waits until a neighbour told us, see Chaincasting below
+#define PJON_CHAINCAST_CLOCK_WAIT_MS 300
+bool pjon_chaincast_clock_known_ = false;
+pjon_message_t pjon_chaincast_held_;
+uint8_t pjon_chaincast_held_dst_ = 0;
+uint8_t pjon_chaincast_held_len_ = 0; //0: nothing held
+uint32_t pjon_chaincast_held_since_ = 0;
+
+//chaincast frames we forwarded and that the next µC did not ack yet
+#define PJON_CHAINCAST_PENDING_LEN 2
+#define PJON_CHAINCAST_MAX_TRIES 4
+#define PJON_CHAINCAST_RTO_INIT_MS 200
+//no ack before this is no reason to send again: a hop takes the frame (some 8ms on the wire) and its ack (6ms),
+//each maybe behind another frame, and the loop of the receiver in between, up to a 5ms receive window
+//and a flash write (EEPROM.commit when a damper starts moving, a sector erase of some 40ms)
+#define PJON_CHAINCAST_RTO_MIN_MS 100
+#define PJON_CHAINCAST_RTO_MAX_MS 3000
+//the µC below and above us, and the bottom µC for chaincasts we start
+#define PJON_CHAINCAST_RTT_PEERS 3
+
+typedef struct {
+  uint8_t to; // 0: unused
+  uint8_t tries;
+  uint32_t sent_ms; // first transmission
+  uint32_t due; // next retransmission
+  pjon_message_t msg;
+} chaincast_pending_t;
+
+chaincast_pending_t pjon_chaincast_pending_[PJON_CHAINCAST_PENDING_LEN];
+
+//smoothed round trip time of the hops to one peer and its variance like TCP (RFC 6298),
+//scaled by 8 and 4 to stay integer. Each peer has its own, the one above may well be slower than the one below
+typedef struct {
+  uint8_t peer; // 0: unused
+  uint32_t srtt_x8; // 0: no sample yet
+  uint32_t rttvar_x4;
+  uint32_t rto;
+} chaincast_rtt_t;
+
+chaincast_rtt_t pjon_chaincast_rtt_[PJON_CHAINCAST_RTT_PEERS];
+uint8_t pjon_chaincast_rtt_next_ = 0; //the entry a new peer replaces once all are taken
+
+//frames on their way to PJON, see Outbox below
+#define PJON_PRIO_SAFETY 0
+#define PJON_PRIO_COMMAND 1
+#define PJON_PRIO_CONFIG 2
+#define PJON_PRIO_TELEMETRY 3
+#define PJON_PRIO_CLASSES 4
+#define PJON_OUTBOX_MAX_DEPTH 8
+//frames PJON may hold at a time, it sends them in the order it got them
+#define PJON_OUTBOX_HANDOFF 2
+
+typedef struct {
+  uint8_t to;
+  uint8_t length;
+  bool print; // show it on the console once it goes to PJON
+  pjon_message_t msg;
+} pjon_outframe_t;
+
+const uint8_t pjon_outbox_depth_[PJON_PRIO_CLASSES] = {4, 6, 4, 8};
+const char *const pjon_outbox_names_[PJON_PRIO_CLASSES] = {"safety", "command", "config", "telemetry"};
+pjon_outframe_t pjon_outbox_[PJON_PRIO_CLASSES][PJON_OUTBOX_MAX_DEPTH];
+uint8_t pjon_outbox_len_[PJON_PRIO_CLASSES] = {0, 0, 0, 0};
+uint32_t pjon_outbox_dropped_[PJON_PRIO_CLASSES] = {0, 0, 0, 0};
+
+//how long task_pjon listens, see Receive Window below
+#define PJON_RX_WINDOW_MIN_US 300
+#define PJON_RX_WINDOW_MAX_US 5000
+#define PJON_RX_MAX_FRAMES 4
+//the uart keeps what comes in while we are away, one look is enough
+#define PJON_UART_RX_WINDOW_US 0
+
+uint16_t pjon_rx_fixed_us_ = 0; //0: adapt the window, otherwise always listen this long (to compare, see bench -b rx_window)
+uint32_t pjon_rx_window_us_ = PJON_RX_WINDOW_MIN_US;
+uint32_t pjon_rx_ended_us_ = 0;
+uint32_t pjon_rx_away_us_ = 0; //smoothed time from the end of one receive() to the next
+uint32_t pjon_rx_windows_ = 0;
+uint32_t pjon_rx_frames_ = 0; //windows that got a frame
+uint64_t pjon_rx_listen_us_ = 0;
+
 #define PJON_MSGBUF_LEN 3
 uint8_t pjon_msgbuf_idx_ = 0;
+uint32_t pjon_msgbuf_dropped_ = 0; //frames that found the buffer full, PJON acked them all the same
 pjon_message_with_sender_t pjon_msgbuf_[PJON_MSGBUF_LEN];
 
 ///////// PJON List ///////////
-// These methods implement a list of PJON_ID_LIST_LEN bytes
+// These methods implement a list of PJON_ID_LIST_LEN µC, by id and nonce,
 // which implements 3 operations: clear, add, sort
 
 void pjoinidlist_clear()
 {
   for (uint8_t c=0; c < PJON_ID_LIST_LEN; c++)
+  {
     pjon_id_list_[c] = 0;
+    pjon_id_nonce_[c] = 0;
+  }
   pjon_id_list_idx_ = 0;
 }
 
-void pjoinidlist_add(uint8_t id)
+//add µC to list, return false if it is already in list or list is full
+bool pjoinidlist_add(uint8_t id, uint16_t nonce)
 {
-  if (pjon_id_list_idx_ < PJON_ID_LIST_LEN)
-    pjon_id_list_[pjon_id_list_idx_++] = id;
+  for (uint8_t c=0; c < pjon_id_list_idx_; c++)
+    if (pjon_id_list_[c] == id && pjon_id_nonce_[c] == nonce)
+      return false;
+  if (pjon_id_list_idx_ >= PJON_ID_LIST_LEN)
+    return false;
+  pjon_id_nonce_[pjon_id_list_idx_] = nonce;
+  pjon_id_list_[pjon_id_list_idx_++] = id;
+  return true;
 }
 
-int compare_uint8(const void *v1, const void *v2)
+//by id, µC sharing an id by nonce. Insertion sort, the list is short
+void pjoinidlist_sort()
 {
-  return (*((uint8_t*) v1) < *((uint8_t*) v2))? -1 : (*((uint8_t*) v1) > *((uint8_t*) v2))? 1 : 0;
+  for (uint8_t c=1; c < pjon_id_list_idx_; c++)
+  {
+    uint8_t id = pjon_id_list_[c];
+    uint16_t nonce = pjon_id_nonce_[c];
+    uint8_t d = c;
+    for (; d > 0 && (pjon_id_list_[d-1] > id || (pjon_id_list_[d-1] == id && pjon_id_nonce_[d-1] > nonce)); d--)
+    {
+      pjon_id_list_[d] = pjon_id_list_[d-1];
+      pjon_id_nonce_[d] = pjon_id_nonce_[d-1];
+    }
+    pjon_id_list_[d] = id;
+    pjon_id_nonce_[d] = nonce;
+  }
 }
 
-void pjoinidlist_sort()
+
+//true once millis() has passed timestamp t, works across millis() overflow
+bool pjon_time_reached(uint32_t t)
 {
-  qsort(pjon_id_list_, pjon_id_list_idx_, sizeof(uint8_t), compare_uint8);
+  return (int32_t) (millis() - t) >= 0;
 }
 
 
 ///////// PJON Callback Handler for Errors ///////////
 
+//lost frames and full buffers are counted per peer (see linkstats.cpp) instead of printed,
+//a full buffer is counted where send() returns FAIL, PJON does not tell us the destination here
 void pjon_error_handler(uint8_t code, uint8_t data)
 {
   if(code == CONNECTION_LOST) {
-    printf("Connection with device ID %d is lost.\r\n", data);
-  }
-  if(code == PACKETS_BUFFER_FULL) {
-    printf("Packet buffer is full, has now a length of %d\r\n", data);
-    printf("Possible wrong bus configuration!\r\n");
-    printf("higher MAX_PACKETS in PJON.h if necessary.\r\n");
+    linkstats_note_lost(data);
+    pjon_chaincast_hop_lost(data);
   }
   if(code == MEMORY_FULL) {
-    printf("Packet memory allocation failed. Memory is full.\r\n");
+    linkstats_note_memory_full();
   }
   if(code == CONTENT_TOO_LONG) {
     printf("Content is too long, length: %d\r\n", data);
@@ -99,10 +251,25 @@ void pjon_error_handler(uint8_t code, uint8_t data)
 // where pjon_postrecv_handle_msg can handle it later.
 void pjon_recv_handler(uint8_t id, uint8_t *payload, uint8_t length)
 {
-  if(length < 1 || length >= sizeof(pjon_message_t)) {
+  if(length < 1 || length > sizeof(pjon_message_t)) {
     //accepting no messages without a type or messages larger than pjon_message_t
     return;
   }
+  capture_frame(id, payload, length);
+  //the beacon is stamped as early as we get to see it,
+  //it asks nothing of us, so it does not keep us awake either
+  if (payload[0] == MSG_TIMESYNC)
+    timesync_note_rx();
+  else
+    idle_note_activity();
+
+  //pjon_receive() empties the buffer after every frame, so this only happens if somebody else fills it up.
+  //Overwriting the oldest frame would lose one that is already acked just the same, so keep it and count
+  if (pjon_msgbuf_[pjon_msgbuf_idx_].length != 0)
+  {
+    pjon_msgbuf_dropped_++;
+    return;
+  }
 
   //for some reason memcpy needs to come first, because otherwise if we would write the length first, it would get overwriten.
   //Not sure how this can be, but it suggest some kind of bug or memory corruption here. Though I'm obviously too blind
@@ -130,7 +297,7 @@ uint8_t pjon_type_to_msg_length(uint8_t type)
   switch(type)
   {
     case MSG_DAMPERCMD:
-      return sizeof(dampercmd_t)+2;
+      return sizeof(dampercmd_t)+4;
       break;
     case MSG_PRESSUREINFO:
       return sizeof(pressureinfo_t)+1;
@@ -139,7 +306,7 @@ uint8_t pjon_type_to_msg_length(uint8_t type)
       return sizeof(errorinfo_t)+1;
       break;
     case MSG_UPDATESETTINGS:
-      return sizeof(updatesettings_t)+2;
+      return sizeof(updatesettings_t)+4;
       break;
     case MSG_PJONID_DOAUTO:
     case MSG_PJONID_QUESTION:
@@ -147,6 +314,38 @@ uint8_t pjon_type_to_msg_length(uint8_t type)
     case MSG_PJONID_INFO:
     case MSG_PJONID_SET:
       return sizeof(pjonidsetting_t)+1;
+    case MSG_STATUSREQUEST:
+      return sizeof(statusrequest_t)+1;
+    case MSG_STATUS:
+      return sizeof(statusinfo_t)+1;
+    case MSG_CHAINCAST_ACK:
+      return sizeof(chaincastack_t)+1;
+    case MSG_EVENT:
+      return sizeof(eventinfo_t)+1;
+    case MSG_FWUPDATE_BEGIN:
+      return sizeof(fwupdatebegin_t)+1;
+    case MSG_FWUPDATE_CHUNK:
+      return sizeof(fwupdatechunk_t)+1;
+    case MSG_FWUPDATE_ACK:
+      return sizeof(fwupdateack_t)+1;
+    case MSG_CONFIGDELTA:
+      return sizeof(configdelta_t)+4;
+    case MSG_CONFIGREPORT:
+      return sizeof(configreport_t)+1;
+    case MSG_HISTORY_REQUEST:
+      return sizeof(historyrequest_t)+1;
+    case MSG_HISTORY_BLOCK:
+      return sizeof(historyblock_t)+1;
+    case MSG_TIMESYNC:
+      return sizeof(timesync_t)+1;
+    case MSG_LINKSTATS_REQUEST:
+      return sizeof(linkstatsrequest_t)+1;
+    case MSG_LINKSTATS:
+      return sizeof(linkstats_t)+1;
+    case MSG_PRESETCMD:
+      return sizeof(presetcmd_t)+4;
+    case MSG_PRESETSET:
+      return sizeof(presetset_t)+4;
     default:
       return 1;
       break;
@@ -162,25 +361,173 @@ void pjon_printf_msg(pjon_message_with_sender_t *bufferedmsg)
   printf("\r\n");
 }
 
+///////// Outbox ///////////
+//Every frame we send waits in the outbox class of its msg type until PJON has room for it:
+//  safety     errors
+//  command    damper commands and presets, chaincast acks, id assignment, status
+//  config     settings, site config, the preset table, firmware updates, requests for history and link stats
+//  telemetry  pressure info, events, history blocks, link stats
+//PJON sends its packets in the order it got them, and does not get more than PJON_OUTBOX_HANDOFF at a time,
+//the highest class first. So a damper command waits behind at most that many telemetry frames,
+//however much telemetry there is. A full telemetry class drops its oldest frame (newer readings count more),
+//the others refuse the new one. Either way the frame counts as full in the link stats of its destination.
+
+static uint8_t pjon_msg_priority(uint8_t type)
+{
+  switch(type)
+  {
+    case MSG_ERROR:
+      return PJON_PRIO_SAFETY;
+    case MSG_UPDATESETTINGS:
+    case MSG_PRESETSET:
+    case MSG_FWUPDATE_BEGIN:
+    case MSG_FWUPDATE_CHUNK:
+    case MSG_FWUPDATE_ACK:
+    case MSG_CONFIGDELTA:
+    case MSG_CONFIGREPORT:
+    case MSG_HISTORY_REQUEST:
+    case MSG_LINKSTATS_REQUEST:
+      return PJON_PRIO_CONFIG;
+    case MSG_PRESSUREINFO:
+    case MSG_EVENT:
+    case MSG_HISTORY_BLOCK:
+    case MSG_LINKSTATS:
+      return PJON_PRIO_TELEMETRY;
+    default:
+      return PJON_PRIO_COMMAND;
+  }
+}
+
+//hand frames to PJON while it has room, highest class first
+static void pjon_outbox_flush()
+{
+  for (uint8_t c=0; c<PJON_PRIO_CLASSES; c++)
+  {
+    while (pjon_outbox_len_[c] > 0)
+    {
+      if (pjonbus_.get_packets_count() >= PJON_OUTBOX_HANDOFF)
+        return;
+      pjon_outframe_t *f = &pjon_outbox_[c][0];
+      if (f->print)
+      {
+        printf(">%02x%02x", f->to, f->length);
+        for(uint16_t i = 0; i < f->length; ++i)
+          printf("%02x",((uint8_t*) &f->msg)[i]);
+        printf("\r\n");
+      }
+      linkstats_note_send(f->to, pjonbus_.send(f->to, (const char*) &f->msg, f->length) != FAIL);
+      pjon_outbox_len_[c]--;
+      memmove(&pjon_outbox_[c][0], &pjon_outbox_[c][1], pjon_outbox_len_[c]*sizeof(pjon_outframe_t));
+    }
+  }
+}
+
+static bool pjon_outbox_add(uint8_t to, const uint8_t *payload, uint8_t length, bool print)
+{
+  if (length < 1 || length > sizeof(pjon_message_t))
+    return false;
+  uint8_t c = pjon_msg_priority(payload[0]);
+  if (pjon_outbox_len_[c] >= pjon_outbox_depth_[c])
+  {
+    pjon_outbox_dropped_[c]++;
+    if (c != PJON_PRIO_TELEMETRY)
+    {
+      printf("outbox %s full, dropped msg %d for %d\r\n", pjon_outbox_names_[c], payload[0], to);
+      linkstats_note_send(to, false);
+      return false;
+    }
+    linkstats_note_send(pjon_outbox_[c][0].to, false);
+    pjon_outbox_len_[c]--;
+    memmove(&pjon_outbox_[c][0], &pjon_outbox_[c][1], pjon_outbox_len_[c]*sizeof(pjon_outframe_t));
+  }
+  pjon_outframe_t *f = &pjon_outbox_[c][pjon_outbox_len_[c]++];
+  f->to = to;
+  f->length = length;
+  f->print = print;
+  memcpy(&f->msg, payload, length);
+  pjon_outbox_flush();
+  return true;
+}
+
+void pjon_outbox_print_info()
+{
+  printf("Outbox:");
+  for (uint8_t c=0; c<PJON_PRIO_CLASSES; c++)
+    printf(" %s %u/%u (dropped %lu)", pjon_outbox_names_[c], pjon_outbox_len_[c], pjon_outbox_depth_[c], (unsigned long) pjon_outbox_dropped_[c]);
+  printf("\r\n");
+}
+
 //DEBUG: send a pjon msg while also printing it to tty
 void pjon_debug_send_msg(uint8_t id, const char *payload, uint8_t length)
 {
-  printf(">%02x%02x", id, length);
-  for(uint16_t i = 0; i < length; ++i)
-    printf("%02x",payload[i]);
-  printf("\r\n");
-  pjonbus_.send(id, payload, length);
+  pjon_outbox_add(id, (const uint8_t*) payload, length, true);
+}
+
+//frames of a bulk transfer (firmware chunks) are not printed, there are too many of them,
+//and are only queued while PJON has room left for a command or an ack and none of their class is waiting
+#define PJON_BULK_MAX_QUEUED 2
+bool pjon_send_bulk(uint8_t toid, pjon_message_t *msg)
+{
+  if (pjonbus_.get_packets_count() >= PJON_BULK_MAX_QUEUED || pjon_outbox_len_[pjon_msg_priority(msg->type)] > 0)
+    return false;
+  return pjon_outbox_add(toid, (const uint8_t*) msg, pjon_type_to_msg_length(msg->type), false);
+}
+
+//broadcast right away instead of queueing, returns once the frame is on the wire (true) or if the bus was busy (false)
+//for the time sync beacon, which has to know when exactly it went out
+bool pjon_broadcast_now(pjon_message_t *msg)
+{
+  return pjonbus_.send_packet(BROADCAST, (const char*) msg, pjon_type_to_msg_length(msg->type)) == ACK;
+}
+
+//print msg to tty as if we had just received it for toid, where the host can pick it up
+void pjon_print_msg(uint8_t toid, pjon_message_t *msg)
+{
+  pjon_message_with_sender_t bufferedmsg;
+  bufferedmsg.id = toid;
+  bufferedmsg.length = pjon_type_to_msg_length(msg->type);
+  memcpy(&bufferedmsg.msg, msg, bufferedmsg.length);
+  pjon_printf_msg(&bufferedmsg);
+}
+
+//a msg meant for ourselves can't go over the bus, so it is printed instead
+//(a broadcast is meant for us too, so it gets printed and sent)
+void pjon_reply_msg(uint8_t toid, pjon_message_t *msg)
+{
+  if (toid == pjonbus_.device_id() || toid == BROADCAST)
+  {
+    pjon_print_msg(toid, msg);
+    if (toid != BROADCAST)
+      return;
+  }
+  pjon_debug_send_msg(toid, (char*) msg, pjon_type_to_msg_length(msg->type));
 }
 
 //send a message to the pjon bus while
 //also sending it to ourselves
+//a chaincast without origin starts here, so it gets our id and the next seq
 void pjon_inject_msg(uint8_t dst, uint8_t length, uint8_t *payload)
 {
+  pjon_message_t *msg = (pjon_message_t*) payload;
+  if (pjon_is_chaincast_type(msg->type) && length == pjon_type_to_msg_length(msg->type) && msg->chaincast.origin == 0)
+  {
+    if (!pjon_chaincast_clock_known_ && pjon_chaincast_hold(dst, length, msg))
+      return;
+    msg->chaincast.origin = pjonbus_.device_id();
+    msg->chaincast.seq = ++pjon_chaincast_clock_;
+    if (msg->type == MSG_DAMPERCMD || msg->type == MSG_PRESETCMD)
+      preset_note_sent(msg);
+  }
   if (dst == 0 || pjonbus_.device_id() == dst)
     pjon_recv_handler(pjon_device_id_, payload, length);
   //hope we did not mangle the payload in recv_handler
   if (dst == 0 || pjonbus_.device_id() != dst)
-    pjonbus_.send(dst, (const char*) payload, length);
+  {
+    //started above the bottom µC: the first hop down to it gets acked and sent again like any other
+    if (pjon_outbox_add(dst, payload, length, false) && dst == 1 && msg->chaincast.origin == pjonbus_.device_id()
+        && pjon_is_chaincast_type(msg->type) && length == pjon_type_to_msg_length(msg->type))
+      pjon_chaincast_add_pending(dst, msg);
+  }
 }
 
 void pjon_inject_broadcast_msg(uint8_t length, uint8_t *payload)
@@ -205,10 +552,158 @@ void pjon_inject_broadcast_msg(uint8_t length, uint8_t *payload)
 //1. handles the message (pjon_chaincast_recv_handler) in the knowledge that all other µC have now seen the same msg
 //2. forwards the message to the next lower message id (descend ladder)
 //
+//Two rooms may start commands at the same time, so an older command may still travel the ladder
+//while a newer one is already on its way. Every chaincast thus carries origin and seq (a lamport clock:
+//the origin takes the highest seq it has seen + 1). The higher seq wins, on a tie the higher origin.
+//Each µC remembers the newest command of each type and which passes of it it already handled.
+//A superseded command or a repeated pass is dropped and not forwarded,
+//so the last writer wins on every µC and no bus hops are wasted on stale commands.
+//Entries are forgotten after PJON_CHAINCAST_SEEN_TIMEOUT_MS.
+//
+//A µC that rebooted has lost its clock, a command it stamped with seq 1 would be dropped as superseded
+//everywhere else. So until it has learned the clock from a chaincast passing by, it holds the command it wants
+//to start (pjon_chaincast_held_) and asks a neighbour for a MSG_STATUS, which carries that µC's clock.
+//If nobody answers within PJON_CHAINCAST_CLOCK_WAIT_MS we are alone on the bus and our own clock is as good as any.
+//
+//PJON gives up on a frame after a number of tries and a chaincast would just die there.
+//So every µC acks a chaincast frame to the µC it came from with MSG_CHAINCAST_ACK,
+//even if it drops the frame as a duplicate (the first ack might have been lost).
+//The forwarding µC keeps the frame in pjon_chaincast_pending_ and sends it again
+//after a timeout (RTO) that adapts to the measured round trip time of the hops to that µC, doubling with every try.
+//After PJON_CHAINCAST_MAX_TRIES it gives up and sends MSG_ERROR CHAINCAST_HOP_FAILED to the origin.
+//
 //This requires that µC have been give PJON device ids in sequential order
 //To ensure this is always the case, a method pjon_become_master_of_ids() was written.
 //Basically it talks to every µC on the bus and gives them new id's in sequential order.
+//(see ID Assignment below)
+
+
+bool pjon_is_chaincast_type(uint8_t type)
+{
+  return type == MSG_DAMPERCMD || type == MSG_UPDATESETTINGS || type == MSG_CONFIGDELTA
+    || type == MSG_PRESETCMD || type == MSG_PRESETSET;
+}
+
+//a preset is a damper command, of the two only the newest counts
+static uint8_t pjon_chaincast_seen_type(uint8_t type)
+{
+  return (type == MSG_PRESETCMD) ? MSG_DAMPERCMD : type;
+}
+
+//seq wraps around, so compare like TCP does: newer if less than half the range ahead
+int8_t pjon_chaincast_compare(uint8_t seq_a, uint8_t origin_a, uint8_t seq_b, uint8_t origin_b)
+{
+  int8_t diff = (int8_t) (uint8_t) (seq_a - seq_b);
+  if (diff != 0)
+    return (diff > 0) ? 1 : -1;
+  if (origin_a != origin_b)
+    return (origin_a > origin_b) ? 1 : -1;
+  return 0;
+}
+
+//take the clock of another µC (or of a chaincast) if it is ahead of ours, or if we don't have one yet
+void pjon_chaincast_learn_clock(uint8_t seq)
+{
+  if (!pjon_chaincast_clock_known_ || (int8_t) (uint8_t) (seq - pjon_chaincast_clock_) > 0)
+    pjon_chaincast_clock_ = seq;
+  pjon_chaincast_clock_known_ = true;
+}
+
+//keep a chaincast we want to start until we know the clock, return false if it has to go out right away
+//only one is held, a newer command of the same kind replaces it
+bool pjon_chaincast_hold(uint8_t dst, uint8_t length, pjon_message_t *msg)
+{
+  if (pjon_chaincast_held_len_ > 0 && pjon_chaincast_seen_type(pjon_chaincast_held_.type) != pjon_chaincast_seen_type(msg->type))
+  {
+    //two different commands waiting, stop waiting for the clock instead of dropping one
+    pjon_chaincast_clock_known_ = true;
+    task_pjon_chaincast_held();
+    return false;
+  }
+  if (pjon_chaincast_held_len_ == 0)
+  {
+    pjon_chaincast_held_since_ = millis();
+    pjon_send_statusrequest((pjonbus_.device_id() == 1) ? 2 : 1);
+  }
+  memcpy(&pjon_chaincast_held_, msg, length);
+  pjon_chaincast_held_dst_ = dst;
+  pjon_chaincast_held_len_ = length;
+  printf("chaincast held until we know the clock\r\n");
+  return true;
+}
+
+//start the held chaincast once we know the clock or gave up waiting
+void task_pjon_chaincast_held()
+{
+  if (pjon_chaincast_held_len_ == 0)
+    return;
+  if (!pjon_chaincast_clock_known_ && millis() - pjon_chaincast_held_since_ < PJON_CHAINCAST_CLOCK_WAIT_MS)
+    return;
+  pjon_chaincast_clock_known_ = true;
+  uint8_t length = pjon_chaincast_held_len_;
+  pjon_chaincast_held_len_ = 0;
+  pjon_inject_msg(pjon_chaincast_held_dst_, length, (uint8_t*) &pjon_chaincast_held_);
+}
+
+//return true if msg should be handled and forwarded for this pass
+//and remember that we did
+bool pjon_chaincast_accept(pjon_message_t *msg, bool didreachall)
+{
+  uint8_t pass = (didreachall) ? PJON_CHAINCAST_PASS_DOWN : PJON_CHAINCAST_PASS_UP;
+  chaincast_seen_t *entry = 0;
+  chaincast_seen_t *oldest = &pjon_chaincast_seen_[0];
+
+  pjon_chaincast_learn_clock(msg->chaincast.seq);
 
+  for (uint8_t ii=0; ii<PJON_CHAINCAST_SEEN_LEN; ii++)
+  {
+    chaincast_seen_t *e = &pjon_chaincast_seen_[ii];
+    if (e->type != 0xFF && millis() - e->last_seen > PJON_CHAINCAST_SEEN_TIMEOUT_MS)
+      e->type = 0xFF;
+    if (e->type == pjon_chaincast_seen_type(msg->type))
+      entry = e;
+    if (e->type == 0xFF || (oldest->type != 0xFF && (int32_t) (e->last_seen - oldest->last_seen) < 0))
+      oldest = e;
+  }
+
+  if (entry)
+  {
+    int8_t cmp = pjon_chaincast_compare(msg->chaincast.seq, msg->chaincast.origin, entry->seq, entry->origin);
+    if (cmp < 0)
+    {
+      printf("chaincast %d/%d superseded by %d/%d, dropped\r\n", msg->chaincast.origin, msg->chaincast.seq, entry->origin, entry->seq);
+      return false;
+    }
+    if (cmp == 0 && (entry->passes & pass))
+    {
+      printf("chaincast %d/%d pass %d seen before, dropped\r\n", msg->chaincast.origin, msg->chaincast.seq, pass);
+      return false;
+    }
+    if (cmp > 0)
+      entry->passes = 0;
+  } else {
+    entry = oldest;
+    entry->passes = 0;
+  }
+  entry->type = pjon_chaincast_seen_type(msg->type);
+  entry->origin = msg->chaincast.origin;
+  entry->seq = msg->chaincast.seq;
+  entry->passes |= pass;
+  entry->last_seen = millis();
+  return true;
+}
+
+//the reach bits a µC sets: its installed dampers.
+//A config delta or preset entry has to reach µC without dampers too (and a delta may change which ones
+//are installed), so it goes up to the pjon id it names as top
+uint8_t pjon_chaincast_reach_bits(pjon_message_t *msg)
+{
+  if (msg->type == MSG_CONFIGDELTA)
+    return (pjonbus_.device_id() >= msg->chaincast.configdelta.top) ? _BV(NUM_DAMPER) - 1 : 0;
+  if (msg->type == MSG_PRESETSET)
+    return (pjonbus_.device_id() >= msg->chaincast.presetset.top) ? _BV(NUM_DAMPER) - 1 : 0;
+  return getInstalledDampersAsBitfield();
+}
 
 //check bitfield if all damper bits are set
 bool pjon_chaincast_didreachall(uint8_t bitfield)
@@ -219,6 +714,18 @@ bool pjon_chaincast_didreachall(uint8_t bitfield)
   return ((bitfield & _BV(0)) > 0) && ((bitfield & _BV(1)) > 0) && ((bitfield & _BV(2)) > 0);
 }
 
+//check cmd against the room interlock (which may change it), tell the origin about dampers kept open
+//and apply it. Returns true if the interlock changed cmd
+static bool pjon_chaincast_damper_cmd(bool didreachall, pjon_message_t *msg, dampercmd_t *cmd)
+{
+  uint8_t rejected = interlock_check_dampercmd(cmd);
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+    if (rejected & _BV(d))
+      pjon_senderror_interlock(msg->chaincast.origin, d);
+  handle_damper_cmd(didreachall, cmd);
+  return rejected != 0;
+}
+
 //handle recieved message of type pjon_chaincast_t
 //
 //1. see if message already reached everyone (second pass, didreachall==true)
@@ -227,20 +734,56 @@ bool pjon_chaincast_didreachall(uint8_t bitfield)
 //3. forward message to other µC on pjon-bus
 void pjon_chaincast_recv_handler(uint8_t toid, pjon_message_t *msg)
 {
+  if (toid != 0)
+    pjon_chaincast_send_ack(msg);
+
   //update reach field
-  msg->chaincast.reach |= getInstalledDampersAsBitfield();
+  bool firstvisit = !pjon_chaincast_didreachall(msg->chaincast.reach);
+  msg->chaincast.reach |= pjon_chaincast_reach_bits(msg);
   bool didreachall = pjon_chaincast_didreachall(msg->chaincast.reach);
 
+  if (!pjon_chaincast_accept(msg, didreachall))
+    return;
+
   switch(msg->type)
   {
     case MSG_DAMPERCMD:
       printf("MSG_DAMPERCMD to %d\r\n",toid);
-      handle_damper_cmd(didreachall, &(msg->chaincast.dampercmd));
+      pjon_chaincast_damper_cmd(didreachall, msg, &(msg->chaincast.dampercmd));
+      break;
+    case MSG_PRESETCMD:
+      printf("MSG_PRESETCMD %d to %d\r\n", msg->chaincast.presetcmd.preset, toid);
+      {
+        dampercmd_t cmd;
+        if (!preset_resolve(&msg->chaincast.presetcmd, &cmd))
+        {
+          printf("preset %d unknown, ignored\r\n", msg->chaincast.presetcmd.preset);
+          break;
+        }
+        //the µC after us have to do what we did, not what the preset says
+        if (pjon_chaincast_damper_cmd(didreachall, msg, &cmd))
+        {
+          msg->type = MSG_DAMPERCMD;
+          msg->chaincast.dampercmd = cmd;
+        }
+      }
+      break;
+    case MSG_PRESETSET:
+      printf("MSG_PRESETSET %d to %d\r\n", msg->chaincast.presetset.preset, toid);
+      preset_handle_set(&msg->chaincast.presetset);
       break;
     case MSG_UPDATESETTINGS:
       printf("MSG_UPDATESETTINGS to %d\r\n",toid);
       updateSettingsFromPacket(&(msg->chaincast.updatesettings));
       break;
+    case MSG_CONFIGDELTA:
+      //on the way up, the top µC turns it around on its first visit
+      if (firstvisit)
+      {
+        printf("MSG_CONFIGDELTA v%u to %d\r\n", msg->chaincast.configdelta.version, toid);
+        pjon_send_configreport(msg->chaincast.origin, applyConfigDelta(pjonbus_.device_id(), &msg->chaincast.configdelta));
+      }
+      break;
     default:
       printf("Unknown MSG type %d\r\n", msg->type);
       break;
@@ -271,11 +814,216 @@ void pjon_chaincast_forward(uint8_t toid, bool didreachall, pjon_message_t* msg)
   {
     // pjonbus_.send(next_id, (char*) msg, pjon_type_to_msg_length(msg->type));
     pjon_debug_send_msg(next_id, (char*) msg, pjon_type_to_msg_length(msg->type));
+    pjon_chaincast_add_pending(next_id, msg);
+  }
+}
+
+//the µC a received chaincast frame came from, 0 if we injected it ourselves:
+//the first pass comes from below (or from the origin, if we are the bottom),
+//the second pass from above
+uint8_t pjon_chaincast_from(pjon_message_t *msg)
+{
+  bool down = pjon_chaincast_didreachall(msg->chaincast.reach);
+  uint8_t myid = pjonbus_.device_id();
+  uint8_t fromid = (down) ? myid + 1 : myid - 1;
+  if (!down && myid == 1)
+    fromid = msg->chaincast.origin;
+  return (fromid == myid) ? 0 : fromid;
+}
+
+//which way msg goes on the hop from the µC from to the µC to (as in chaincastack_t.down):
+//the second pass goes down, the first one up, except for the hop from an origin above to the bottom µC
+static uint8_t pjon_chaincast_hop_dir(uint8_t from, uint8_t to, pjon_message_t *msg)
+{
+  if (pjon_chaincast_didreachall(msg->chaincast.reach))
+    return 1;
+  return (to < from) ? 2 : 0;
+}
+
+//ack a received chaincast frame to the µC it came from
+void pjon_chaincast_send_ack(pjon_message_t *msg)
+{
+  uint8_t fromid = pjon_chaincast_from(msg);
+  if (fromid == 0)
+    return; //injected by ourselves
+  pjon_message_t ack;
+  ack.type = MSG_CHAINCAST_ACK;
+  ack.chaincastack.type = msg->type;
+  ack.chaincastack.origin = msg->chaincast.origin;
+  ack.chaincastack.seq = msg->chaincast.seq;
+  ack.chaincastack.down = pjon_chaincast_hop_dir(fromid, pjonbus_.device_id(), msg);
+  pjon_debug_send_msg(fromid, (char*) &ack, pjon_type_to_msg_length(ack.type));
+}
+
+//the round trip estimate of peer, a peer we have none for yet (a new neighbour after an id change) starts over
+static chaincast_rtt_t *pjon_chaincast_rtt(uint8_t peer)
+{
+  chaincast_rtt_t *e = 0;
+  for (uint8_t ii=0; ii<PJON_CHAINCAST_RTT_PEERS; ii++)
+  {
+    if (pjon_chaincast_rtt_[ii].peer == peer)
+      return &pjon_chaincast_rtt_[ii];
+    if (!e && pjon_chaincast_rtt_[ii].peer == 0)
+      e = &pjon_chaincast_rtt_[ii];
+  }
+  if (!e)
+  {
+    e = &pjon_chaincast_rtt_[pjon_chaincast_rtt_next_];
+    pjon_chaincast_rtt_next_ = (pjon_chaincast_rtt_next_ + 1) % PJON_CHAINCAST_RTT_PEERS;
+  }
+  e->peer = peer;
+  e->srtt_x8 = 0;
+  e->rttvar_x4 = 0;
+  e->rto = PJON_CHAINCAST_RTO_INIT_MS;
+  return e;
+}
+
+void pjon_chaincast_add_pending(uint8_t to, pjon_message_t *msg)
+{
+  uint8_t myid = pjonbus_.device_id();
+  uint8_t dir = pjon_chaincast_hop_dir(myid, to, msg);
+  chaincast_pending_t *slot = &pjon_chaincast_pending_[0];
+  for (uint8_t ii=0; ii<PJON_CHAINCAST_PENDING_LEN; ii++)
+  {
+    chaincast_pending_t *p = &pjon_chaincast_pending_[ii];
+    //a newer command of the same type in the same direction supersedes the pending one
+    if (p->to == 0 || (p->msg.type == msg->type && pjon_chaincast_hop_dir(myid, p->to, &p->msg) == dir))
+    {
+      slot = p;
+      break;
+    }
+    if ((int32_t) (p->sent_ms - slot->sent_ms) < 0)
+      slot = p;
+  }
+  slot->to = to;
+  slot->tries = 1;
+  slot->sent_ms = millis();
+  slot->due = slot->sent_ms + pjon_chaincast_rtt(to)->rto;
+  memcpy(&slot->msg, msg, pjon_type_to_msg_length(msg->type));
+}
+
+//Jacobson/Karels: srtt += (rtt - srtt)/8, rttvar += (|rtt - srtt| - rttvar)/4, rto = srtt + 4*rttvar
+void pjon_chaincast_rtt_sample(uint8_t peer, uint32_t rtt)
+{
+  chaincast_rtt_t *e = pjon_chaincast_rtt(peer);
+  if (e->srtt_x8 == 0)
+  {
+    e->srtt_x8 = (rtt << 3) | 1; //never 0 again
+    e->rttvar_x4 = rtt << 1;
+  } else {
+    int32_t delta = (int32_t) rtt - (int32_t) (e->srtt_x8 >> 3);
+    e->srtt_x8 += delta;
+    if (delta < 0)
+      delta = -delta;
+    e->rttvar_x4 += delta - (e->rttvar_x4 >> 2);
+  }
+  e->rto = (e->srtt_x8 >> 3) + e->rttvar_x4;
+  if (e->rto < PJON_CHAINCAST_RTO_MIN_MS)
+    e->rto = PJON_CHAINCAST_RTO_MIN_MS;
+  if (e->rto > PJON_CHAINCAST_RTO_MAX_MS)
+    e->rto = PJON_CHAINCAST_RTO_MAX_MS;
+}
+
+void pjon_chaincast_handle_ack(chaincastack_t *ack)
+{
+  for (uint8_t ii=0; ii<PJON_CHAINCAST_PENDING_LEN; ii++)
+  {
+    chaincast_pending_t *p = &pjon_chaincast_pending_[ii];
+    if (p->to == 0 || p->msg.type != ack->type || p->msg.chaincast.origin != ack->origin
+        || p->msg.chaincast.seq != ack->seq || pjon_chaincast_hop_dir(pjonbus_.device_id(), p->to, &p->msg) != ack->down)
+      continue;
+    //Karn: a retransmitted frame does not tell which try got acked
+    if (p->tries == 1)
+    {
+      pjon_chaincast_rtt_sample(p->to, millis() - p->sent_ms);
+      linkstats_note_rtt(p->to, millis() - p->sent_ms);
+    }
+    p->to = 0;
+  }
+}
+
+//PJON gave up on id, no need to wait for the RTO
+void pjon_chaincast_hop_lost(uint8_t id)
+{
+  for (uint8_t ii=0; ii<PJON_CHAINCAST_PENDING_LEN; ii++)
+    if (pjon_chaincast_pending_[ii].to == id)
+      pjon_chaincast_pending_[ii].due = millis();
+}
+
+void task_pjon_chaincast_retry()
+{
+  for (uint8_t ii=0; ii<PJON_CHAINCAST_PENDING_LEN; ii++)
+  {
+    chaincast_pending_t *p = &pjon_chaincast_pending_[ii];
+    if (p->to == 0 || !pjon_time_reached(p->due))
+      continue;
+    if (p->tries >= PJON_CHAINCAST_MAX_TRIES)
+    {
+      printf("chaincast %d/%d to %d failed after %d tries\r\n", p->msg.chaincast.origin, p->msg.chaincast.seq, p->to, p->tries);
+      pjon_message_t msg;
+      msg.type = MSG_ERROR;
+      msg.errorinfo.damperid = p->to;
+      msg.errorinfo.errortype = CHAINCAST_HOP_FAILED;
+      msg.errorinfo.bus_us = timesync_bus_us(micros());
+      p->to = 0;
+      pjon_reply_msg(p->msg.chaincast.origin, &msg);
+      continue;
+    }
+    pjon_debug_send_msg(p->to, (char*) &p->msg, pjon_type_to_msg_length(p->msg.type));
+    linkstats_note_retry(p->to);
+    p->due = millis() + (pjon_chaincast_rtt(p->to)->rto << p->tries);
+    p->tries++;
   }
 }
 
 ///////// Message Handler ///////////////
 
+//PJON does not tell us who sent a frame, most msgs name their sender or the one who wants the answer,
+//returns 0 if msg does not
+uint8_t pjon_msg_sender(pjon_message_t *msg)
+{
+  switch(msg->type)
+  {
+    case MSG_DAMPERCMD:
+    case MSG_UPDATESETTINGS:
+    case MSG_CONFIGDELTA:
+    case MSG_PRESETCMD:
+    case MSG_PRESETSET:
+      return pjon_chaincast_from(msg);
+    case MSG_CHAINCAST_ACK:
+      //acks the frame we sent down (to id-1), up (to id+1) or to the bottom µC
+      if (msg->chaincastack.down == 2)
+        return 1;
+      return (msg->chaincastack.down) ? pjonbus_.device_id() - 1 : pjonbus_.device_id() + 1;
+    case MSG_PJONID_INFO:
+      return msg->pjonidsetting.pjon_id;
+    case MSG_STATUSREQUEST:
+      return msg->statusrequest.reply_to;
+    case MSG_STATUS:
+      return msg->statusinfo.pjon_id;
+    case MSG_EVENT:
+      return msg->eventinfo.pjon_id;
+    case MSG_FWUPDATE_BEGIN:
+      return msg->fwupdatebegin.reply_to;
+    case MSG_FWUPDATE_ACK:
+      return msg->fwupdateack.pjon_id;
+    case MSG_CONFIGREPORT:
+      return msg->configreport.pjon_id;
+    case MSG_HISTORY_REQUEST:
+      return msg->historyrequest.reply_to;
+    case MSG_HISTORY_BLOCK:
+      return msg->historyblock.pjon_id;
+    case MSG_TIMESYNC:
+      return TIMESYNC_MASTER_ID;
+    case MSG_LINKSTATS_REQUEST:
+      return msg->linkstatsrequest.reply_to;
+    case MSG_LINKSTATS:
+      return msg->linkstats.pjon_id;
+    default:
+      return 0;
+  }
+}
+
 //Handle already received messages saved in roundbuffer
 //go through every slot in the roundbuffer and see if
 //the msg is new (length > 0)
@@ -290,7 +1038,8 @@ void pjon_postrecv_handle_msg()
     if (pjon_msgbuf_[c].length == 0)
       continue; //not a message but empty slot: ignore
 
-    pjon_printf_msg(&pjon_msgbuf_[c]);
+    if (pjon_msgbuf_[c].msg.type != MSG_FWUPDATE_CHUNK && pjon_msgbuf_[c].msg.type != MSG_TIMESYNC)
+      pjon_printf_msg(&pjon_msgbuf_[c]);
 
     uint8_t id = pjon_msgbuf_[c].id;
     uint8_t length = pjon_msgbuf_[c].length;
@@ -306,11 +1055,15 @@ void pjon_postrecv_handle_msg()
       printf("got msg with invalid length %d of type %d to id %d which should have had length %d)\r\n", length, msg->type,id,typelen);
       continue; //do not accept msg with wrong length
     }
+    linkstats_note_heard(pjon_msg_sender(msg));
 
     switch(msg->type)
     {
       case MSG_DAMPERCMD:
       case MSG_UPDATESETTINGS:
+      case MSG_CONFIGDELTA:
+      case MSG_PRESETCMD:
+      case MSG_PRESETSET:
         pjon_chaincast_recv_handler(id, msg);
         break;
       case MSG_PRESSUREINFO:
@@ -319,6 +1072,42 @@ void pjon_postrecv_handle_msg()
       case MSG_ERROR:
         printf("MSG_ERROR to %d\r\n",id);
         break;
+      case MSG_STATUSREQUEST:
+        printf("MSG_STATUSREQUEST(%d) to %d\r\n",msg->statusrequest.reply_to,id);
+        pjon_send_status(msg->statusrequest.reply_to);
+        break;
+      case MSG_CHAINCAST_ACK:
+        pjon_chaincast_handle_ack(&msg->chaincastack);
+        break;
+      case MSG_FWUPDATE_BEGIN:
+        fwupdate_handle_begin(&msg->fwupdatebegin);
+        break;
+      case MSG_FWUPDATE_CHUNK:
+        fwupdate_handle_chunk(&msg->fwupdatechunk);
+        break;
+      case MSG_FWUPDATE_ACK:
+        fwupdate_handle_ack(&msg->fwupdateack);
+        break;
+      case MSG_HISTORY_REQUEST:
+        printf("MSG_HISTORY_REQUEST(%d) to %d\r\n",msg->historyrequest.reply_to,id);
+        history_handle_request(&msg->historyrequest);
+        break;
+      case MSG_TIMESYNC:
+        timesync_handle_beacon(&msg->timesync);
+        break;
+      case MSG_LINKSTATS_REQUEST:
+        printf("MSG_LINKSTATS_REQUEST(%d) to %d\r\n",msg->linkstatsrequest.reply_to,id);
+        linkstats_handle_request(&msg->linkstatsrequest);
+        break;
+      case MSG_STATUS:
+        pjon_chaincast_learn_clock(msg->statusinfo.chaincast_clock);
+        break;
+      case MSG_EVENT:
+      case MSG_CONFIGREPORT:
+      case MSG_HISTORY_BLOCK:
+      case MSG_LINKSTATS:
+        //already printed by pjon_printf_msg above, that's all the host needs
+        break;
       case MSG_PJONID_DOAUTO:
         printf("MSG_PJONID_DOAUTO to %d\r\n",id);
         pjon_startautoiddiscover();
@@ -329,12 +1118,15 @@ void pjon_postrecv_handle_msg()
         pjon_identify_myself(1); //send answer to 1 since device 1 is always the one asking this question
         break;
       case MSG_PJONID_INFO:
-        printf("MSG_PJONID_INFO to %d\r\n",id);
-        //save pjon info somewhere
-        pjoinidlist_add(id);
+        printf("MSG_PJONID_INFO(%d, nonce %u) to %d\r\n",msg->pjonidsetting.pjon_id,msg->pjonidsetting.nonce,id);
+        //id is the receiver, the sender tells us its id in the msg
+        pjon_idassign_handle_info(msg->pjonidsetting.pjon_id, msg->pjonidsetting.nonce);
         break;
       case MSG_PJONID_SET:
-        printf("MSG_PJONID_SET(%d) to %d\r\n",msg->pjonidsetting.pjon_id,id);
+        printf("MSG_PJONID_SET(%d, nonce %u) to %d\r\n",msg->pjonidsetting.pjon_id,msg->pjonidsetting.nonce,id);
+        //another µC with our id got the same msg, only one of us is meant
+        if (msg->pjonidsetting.nonce != 0 && msg->pjonidsetting.nonce != pjon_idnonce_)
+          break;
         pjon_change_deviceid(msg->pjonidsetting.pjon_id);
         break;
       case ACQUIRE_ID:
@@ -349,32 +1141,72 @@ void pjon_postrecv_handle_msg()
 
 ///////// Sending and Handling various types of messages ///////////////
 
-//reply to a MSG_PJONID_QUESTION broadcast msg with our msgid
+//the ids id assignment hands out (2..PJON_ID_LIST_LEN+1) each have a slot of their own.
+//Any other id (a fresh µC still at NOT_ASSIGNED, an id set by hand) gets one of the slots after them,
+//picked by our nonce. µC that end up in the same slot just queue behind each other on the bus,
+//the nonce in the reply tells them apart.
+uint8_t pjon_idreply_slot()
+{
+  uint8_t id = pjonbus_.device_id();
+  if (id >= 2 && id < 2 + PJON_ID_LIST_LEN)
+    return id - 2;
+  return PJON_ID_LIST_LEN + pjon_idnonce_ % (PJON_IDASSIGN_SLOTS - PJON_ID_LIST_LEN);
+}
+
+//reply to a MSG_PJONID_QUESTION msg with our msgid
+//the reply is not sent right away but after a slot delay (see pjon_idreply_slot),
+//so that µC answering the same broadcast question do not all talk at once.
+//task_pjon_idassign() sends the reply once the slot is due.
 //@arg toid should usually be 1 since this is the id of the new master
 void pjon_identify_myself(uint8_t toid)
+{
+  pjon_idreply_to_ = toid;
+  pjon_idreply_due_ = millis() + pjon_idreply_slot() * PJON_IDASSIGN_SLOT_MS;
+}
+
+void pjon_send_identify_reply(uint8_t toid)
 {
   pjon_message_t msg;
   msg.type = MSG_PJONID_INFO;
   msg.pjonidsetting.pjon_id = pjonbus_.device_id();
+  msg.pjonidsetting.nonce = pjon_idnonce_;
   // pjonbus_.send(toid, (char*) &msg, pjon_type_to_msg_length(msg.type));
   pjon_debug_send_msg(toid, (char*) &msg, pjon_type_to_msg_length(msg.type));
 }
 
 //act on a MSG_PJONID_DOAUTO msg
-//start acquire_id until we heave an id that is != NOT_ASSIGNEd and != 1
+//schedule acquire_id until we have an id that is != NOT_ASSIGNED and != 1
+//acquire_id is run by task_pjon_idassign() once the bus has had time to settle,
+//failed attempts are retried with exponential backoff (plus some jitter, since everybody got the same broadcast)
 //note that this currently does not actually work, since acquire_id seems to be broken in avr-tools pjon v3
 void pjon_startautoiddiscover()
 {
-  _delay_ms(200); // let the bus settle after receiving the broadcast
+  pjon_autoid_attempt_ = 0;
+  pjon_autoid_due_ = millis() + PJON_AUTOID_SETTLE_MS + random(PJON_AUTOID_BACKOFF_MS);
+  pjon_autoid_pending_ = true;
+}
+
+void pjon_autoid_try_acquire()
+{
   pjonbus_.set_id(NOT_ASSIGNED);
   pjonbus_.acquire_id();
   if (pjonbus_.device_id() == NOT_ASSIGNED || pjonbus_.device_id() == 1)
   {
-    printf("try again acquire_id()\r\n");
-    _delay_ms(100);
-    pjonbus_.acquire_id();
+    pjon_autoid_attempt_++;
+    if (pjon_autoid_attempt_ < PJON_AUTOID_MAX_ATTEMPTS)
+    {
+      uint32_t backoff = (uint32_t) PJON_AUTOID_BACKOFF_MS << pjon_autoid_attempt_;
+      printf("try again acquire_id() in %lu ms\r\n", (unsigned long) backoff);
+      pjon_autoid_due_ = millis() + backoff + random(PJON_AUTOID_BACKOFF_MS);
+      return;
+    }
+    printf("giving up on acquire_id() after %d attempts\r\n", pjon_autoid_attempt_);
+    pjonbus_.set_id(pjon_device_id_); //keep our old id
+    pjon_autoid_pending_ = false;
+    return;
   }
-  pjon_device_id_ = pjonbus_.device_id();
+  pjon_autoid_pending_ = false;
+  pjon_change_deviceid(pjonbus_.device_id());
   printf("finished pjon acquire_id(), new id: %d\r\n",pjon_device_id_);
 }
 
@@ -388,51 +1220,203 @@ void pjon_broadcast_get_autoid()
   pjon_debug_send_msg(BROADCAST, (char*) &msg, pjon_type_to_msg_length(msg.type));
 }
 
+///////// ID Assignment ///////////////
+
+//pjon_become_master_of_ids() does not block, it just starts the following state machine,
+//which is then advanced by task_pjon_idassign() every time task_pjon() runs:
+//
+//IDASSIGN_DISCOVER: broadcast MSG_PJONID_QUESTION, collect MSG_PJONID_INFO replies in pjon_id_list_
+//                   every µC replies in its own slot (see pjon_identify_myself).
+//                   Replies carry the random nonce of the µC, so µC sharing an id (two fresh ones at
+//                   NOT_ASSIGNED, another one at 1 like us) are listed twice and get an id each.
+//                   The question is repeated with doubled timeout until a round yields no new µC.
+//IDASSIGN_VERIFY:   send MSG_PJONID_SET to every µC whose id is not yet sequential, with its nonce,
+//                   then ask each new id directly with MSG_PJONID_QUESTION.
+//                   Only a MSG_PJONID_INFO from the new id with the same nonce counts as verified.
+//                   Unverified ids are asked again with doubled timeout.
+//IDASSIGN_IDLE:     done, pjon_idassign_done_cb_ has been called
+//
+//The whole thing is bounded by PJON_IDASSIGN_MAX_ROUNDS. It takes about the same time for 1 or 10 µC:
+//mostly the two discovery timeouts (the second one only shows that nobody new answers),
+//(PJON_IDASSIGN_SLOTS+2)*PJON_IDASSIGN_SLOT_MS and twice that, some 530ms, plus one more timeout
+//per verify round in which a µC did not answer.
+
+enum idassign_state_t {IDASSIGN_IDLE, IDASSIGN_DISCOVER, IDASSIGN_VERIFY};
+
+idassign_state_t pjon_idassign_state_ = IDASSIGN_IDLE;
+uint8_t pjon_idassign_round_ = 0;
+uint8_t pjon_idassign_new_ids_ = 0;
+uint16_t pjon_idassign_verified_ = 0; //bitfield, one bit per entry in pjon_id_list_
+uint32_t pjon_idassign_deadline_ = 0;
+uint32_t pjon_idassign_started_ = 0;
+pjon_idassign_cb_t pjon_idassign_done_cb_ = 0;
+
+void pjon_set_idassign_callback(pjon_idassign_cb_t cb)
+{
+  pjon_idassign_done_cb_ = cb;
+}
+
+//the id a µC at position ii of the sorted pjon_id_list_ gets. #1 is the master.
+uint8_t pjon_idassign_target_id(uint8_t ii)
+{
+  return ii+2;
+}
+
+//broadcast a question or ask a single id, every µC that hears it will reply with MSG_PJONID_INFO
+void pjon_send_idquestion(uint8_t toid)
+{
+  pjon_message_t msg;
+  msg.type = MSG_PJONID_QUESTION;
+  pjon_debug_send_msg(toid, (char*) &msg, pjon_type_to_msg_length(msg.type));
+}
+
+void pjon_send_idset(uint8_t toid, uint16_t nonce, uint8_t newid)
+{
+  pjon_message_t msg;
+  msg.type = MSG_PJONID_SET;
+  msg.pjonidsetting.pjon_id = newid;
+  msg.pjonidsetting.nonce = nonce;
+  pjon_debug_send_msg(toid, (char*) &msg, pjon_type_to_msg_length(msg.type));
+}
+
+//timeout of round r, doubles each round
+uint32_t pjon_idassign_timeout(uint8_t round)
+{
+  return ((uint32_t) PJON_IDASSIGN_SLOT_MS * (PJON_IDASSIGN_SLOTS + 2)) << round;
+}
+
+//send MSG_PJONID_SET so that ids become 2,3,4,.. without gap
+//µC that move down are renamed in ascending order, µC that move up in descending order,
+//this way no µC is ever renamed to an id still in use by another µC.
+void pjon_idassign_send_sets()
+{
+  for (uint8_t ii=0; ii<pjon_id_list_idx_; ii++)
+    if (pjon_id_list_[ii] > pjon_idassign_target_id(ii))
+      pjon_send_idset(pjon_id_list_[ii], pjon_id_nonce_[ii], pjon_idassign_target_id(ii));
+  for (uint8_t ii=pjon_id_list_idx_; ii>0; ii--)
+    if (pjon_id_list_[ii-1] < pjon_idassign_target_id(ii-1))
+      pjon_send_idset(pjon_id_list_[ii-1], pjon_id_nonce_[ii-1], pjon_idassign_target_id(ii-1));
+}
+
+void pjon_idassign_ask_unverified()
+{
+  for (uint8_t ii=0; ii<pjon_id_list_idx_; ii++)
+    if (!(pjon_idassign_verified_ & _BV(ii)))
+      pjon_send_idquestion(pjon_idassign_target_id(ii));
+}
+
+void pjon_idassign_finish(bool success)
+{
+  pjon_idassign_state_ = IDASSIGN_IDLE;
+  printf("id assignment of %d uC %s after %lu ms\r\n", pjon_id_list_idx_, (success)?"verified":"FAILED", (unsigned long) (millis() - pjon_idassign_started_));
+  if (pjon_idassign_done_cb_)
+    pjon_idassign_done_cb_(pjon_id_list_idx_, success);
+}
+
+//called on every MSG_PJONID_INFO we receive
+void pjon_idassign_handle_info(uint8_t id, uint16_t nonce)
+{
+  switch (pjon_idassign_state_)
+  {
+    case IDASSIGN_DISCOVER:
+      //a µC that has id 1 like us (a second master, a board set to 1 by hand) is listed and moved too
+      if (id != BROADCAST && (id != pjonbus_.device_id() || nonce != pjon_idnonce_) && pjoinidlist_add(id, nonce))
+        pjon_idassign_new_ids_++;
+      break;
+    case IDASSIGN_VERIFY:
+      for (uint8_t ii=0; ii<pjon_id_list_idx_; ii++)
+        if (pjon_idassign_target_id(ii) == id && pjon_id_nonce_[ii] == nonce)
+          pjon_idassign_verified_ |= _BV(ii);
+      if (pjon_idassign_verified_ == (uint16_t) (_BV(pjon_id_list_idx_) - 1))
+        pjon_idassign_finish(true);
+      break;
+    default:
+      break;
+  }
+}
+
 //become device id 1 and assign every other µC a sequentialy incremential id
+//returns right away, progress is made in task_pjon_idassign()
 void pjon_become_master_of_ids()
 {
-  pjon_message_t msg;
-  msg.type = MSG_PJONID_DOAUTO;
   //become #1
   pjon_change_deviceid(1);
-  //tell everybody else to get an autoid
-  // pjonbus_.send(BROADCAST, (char*) &msg, pjon_type_to_msg_length(msg.type));
-  pjon_debug_send_msg(BROADCAST, (char*) &msg, pjon_type_to_msg_length(msg.type));
-  uint16_t w;
-  for (w=0; w<UINT16_MAX; w++)
-    task_pjon();
   //discover id's of everybody else:
   pjoinidlist_clear();
-  msg.type = MSG_PJONID_QUESTION;
-  // pjonbus_.send(BROADCAST, (char*) &msg, pjon_type_to_msg_length(msg.type));
-  pjon_debug_send_msg(BROADCAST, (char*) &msg, pjon_type_to_msg_length(msg.type));
-  for (w=0; w<UINT16_MAX; w++)
-    task_pjon();  // wait till all µC replied
-  // sort id's numerically
-  pjoinidlist_sort();
-  // for ids
-  // first id with gap of >0 to previous id .. tell it to decrease id by gapsize
-  // continue until all id's linear 0,1,2,3,4 without gap
-  for (uint8_t ii=0; ii<pjon_id_list_idx_; ii++)
+  pjon_idassign_started_ = millis();
+  pjon_idassign_state_ = IDASSIGN_DISCOVER;
+  pjon_idassign_round_ = 0;
+  pjon_idassign_new_ids_ = 0;
+  pjon_idassign_deadline_ = millis() + pjon_idassign_timeout(0);
+  pjon_send_idquestion(BROADCAST);
+}
+
+void task_pjon_idassign()
+{
+  //slave side: send delayed reply to MSG_PJONID_QUESTION
+  if (pjon_idreply_to_ != 0 && pjon_time_reached(pjon_idreply_due_))
   {
-    if (pjon_id_list_[ii] != ii+1)
-    {
-      msg.type = MSG_PJONID_SET;
-      msg.pjonidsetting.pjon_id = ii+1;
-      if (pjon_id_list_[ii] != msg.pjonidsetting.pjon_id)
-        // pjonbus_.send(pjon_id_list_[ii], (const char*) &msg, pjon_type_to_msg_length(msg.type));
-        pjon_debug_send_msg(pjon_id_list_[ii], (const char*) &msg, pjon_type_to_msg_length(msg.type));
-    }
+    pjon_send_identify_reply(pjon_idreply_to_);
+    pjon_idreply_to_ = 0;
+  }
+
+  //slave side: scheduled acquire_id after MSG_PJONID_DOAUTO
+  if (pjon_autoid_pending_ && pjon_time_reached(pjon_autoid_due_))
+    pjon_autoid_try_acquire();
+
+  //master side
+  if (pjon_idassign_state_ == IDASSIGN_IDLE || !pjon_time_reached(pjon_idassign_deadline_))
+    return;
+
+  pjon_idassign_round_++;
+  switch (pjon_idassign_state_)
+  {
+    case IDASSIGN_DISCOVER:
+      if (pjon_idassign_new_ids_ > 0 && pjon_idassign_round_ < PJON_IDASSIGN_MAX_ROUNDS && pjon_id_list_idx_ < PJON_ID_LIST_LEN)
+      {
+        //somebody new answered, maybe there are more we did not hear
+        pjon_idassign_new_ids_ = 0;
+        pjon_idassign_deadline_ = millis() + pjon_idassign_timeout(pjon_idassign_round_);
+        pjon_send_idquestion(BROADCAST);
+        break;
+      }
+      if (pjon_id_list_idx_ == 0)
+      {
+        pjon_idassign_finish(true); //we are alone on the bus
+        break;
+      }
+      // sort id's numerically
+      pjoinidlist_sort();
+      pjon_idassign_send_sets();
+      pjon_idassign_state_ = IDASSIGN_VERIFY;
+      pjon_idassign_verified_ = 0;
+      pjon_idassign_round_ = 0;
+      pjon_idassign_deadline_ = millis() + pjon_idassign_timeout(0);
+      pjon_idassign_ask_unverified();
+      break;
+    case IDASSIGN_VERIFY:
+      if (pjon_idassign_round_ >= PJON_IDASSIGN_MAX_ROUNDS)
+      {
+        pjon_idassign_finish(false);
+        break;
+      }
+      pjon_idassign_deadline_ = millis() + pjon_idassign_timeout(pjon_idassign_round_);
+      pjon_idassign_ask_unverified();
+      break;
+    default:
+      break;
   }
 }
 
-void pjon_send_pressure_infomsg(uint8_t sensorid, float pressure, float temperature)
+//read_us: micros() when the sensor was read
+void pjon_send_pressure_infomsg(uint8_t sensorid, float pressure, float temperature, uint32_t read_us)
 {
   pjon_message_t msg;
   msg.type = MSG_PRESSUREINFO;
   msg.pressureinfo.sensorid = sensorid;
   msg.pressureinfo.celsius = temperature;
   msg.pressureinfo.pascal = pressure;
+  msg.pressureinfo.bus_us = timesync_bus_us(read_us);
   pjon_debug_send_msg(pjon_sensor_destination_id_, (char*) &msg, pjon_type_to_msg_length(msg.type));
 }
 
@@ -443,20 +1427,130 @@ void pjon_senderror_dampertimeout(uint8_t damperid)
   msg.type = MSG_ERROR;
   msg.errorinfo.damperid = damperid;
   msg.errorinfo.errortype = DAMPER_CONTROL_TIMEOUT;
+  msg.errorinfo.bus_us = timesync_bus_us(micros());
   pjon_debug_send_msg(pjon_sensor_destination_id_, (char*) &msg, pjon_type_to_msg_length(msg.type));
 }
 
+//damperid does not get the airflow its target should give, see pressuresig.cpp
+void pjon_senderror_pressuresig(uint8_t damperid)
+{
+  pjon_message_t msg;
+  msg.type = MSG_ERROR;
+  msg.errorinfo.damperid = damperid;
+  msg.errorinfo.errortype = DAMPER_PRESSURE_MISMATCH;
+  msg.errorinfo.bus_us = timesync_bus_us(micros());
+  pjon_debug_send_msg(pjon_sensor_destination_id_, (char*) &msg, pjon_type_to_msg_length(msg.type));
+}
+
+//sent to the origin of a damper command that would have closed damperid, which another room opened
+void pjon_senderror_interlock(uint8_t toid, uint8_t damperid)
+{
+  printf("interlock: damper %d stays open, room %d opened it\r\n", damperid, damper_room_[damperid]);
+  pjon_message_t msg;
+  msg.type = MSG_ERROR;
+  msg.errorinfo.damperid = damperid;
+  msg.errorinfo.errortype = INTERLOCK_REJECTED;
+  msg.errorinfo.bus_us = timesync_bus_us(micros());
+  pjon_reply_msg(toid, &msg);
+}
+
+//send a snapshot of our state to toid (or print it, if toid is us)
+void pjon_send_status(uint8_t toid)
+{
+  pjon_message_t msg;
+  msg.type = MSG_STATUS;
+  fillStatusInfo(&msg.statusinfo);
+  pjon_reply_msg(toid, &msg);
+}
+
+//ask toid for a MSG_STATUS
+void pjon_send_statusrequest(uint8_t toid)
+{
+  pjon_message_t msg;
+  msg.type = MSG_STATUSREQUEST;
+  msg.statusrequest.reply_to = pjonbus_.device_id();
+  pjon_inject_msg(toid, pjon_type_to_msg_length(msg.type), (uint8_t*) &msg);
+}
+
+//queue a MSG_EVENT for task_pjon_events to send
+//a still queued event about the same thing gets replaced, the newer value is the one that counts
+void pjon_queue_event(uint8_t event, uint8_t subject, uint8_t value)
+{
+  for (uint8_t ii=0; ii<pjon_event_queue_len_; ii++)
+  {
+    if (pjon_event_queue_[ii].event == event && pjon_event_queue_[ii].subject == subject)
+    {
+      pjon_event_queue_len_--;
+      memmove(&pjon_event_queue_[ii], &pjon_event_queue_[ii+1], (pjon_event_queue_len_-ii)*sizeof(eventinfo_t));
+      break;
+    }
+  }
+  if (pjon_event_queue_len_ >= PJON_EVENT_QUEUE_LEN)
+  {
+    printf("event queue full, dropped event %d for %d\r\n", event, subject);
+    pjon_event_seq_++; //leave a gap in seq, so the receiver knows
+    return;
+  }
+  eventinfo_t *ev = &pjon_event_queue_[pjon_event_queue_len_++];
+  ev->seq = pjon_event_seq_++;
+  ev->event = event;
+  ev->subject = subject;
+  ev->value = value;
+  ev->bus_us = timesync_bus_us(micros()); //when it happened, not when it got its turn on the bus
+}
+
+void task_pjon_events()
+{
+  if (pjon_event_queue_len_ == 0 || !pjon_time_reached(pjon_event_next_send_))
+    return;
+  pjon_message_t msg;
+  msg.type = MSG_EVENT;
+  msg.eventinfo = pjon_event_queue_[0];
+  msg.eventinfo.pjon_id = pjon_device_id_;
+  pjon_event_queue_len_--;
+  memmove(&pjon_event_queue_[0], &pjon_event_queue_[1], pjon_event_queue_len_*sizeof(eventinfo_t));
+  pjon_event_next_send_ = millis() + PJON_EVENT_MIN_INTERVAL_MS;
+  pjon_reply_msg(pjon_sensor_destination_id_, &msg);
+}
+
 //for testing, simulation and maybe actual work
 void pjon_send_dampercmd(dampercmd_t dcmd)
 {
   pjon_message_t msg;
   memcpy(&msg.chaincast.dampercmd.damper,&dcmd.damper,NUM_DAMPER);
   msg.chaincast.dampercmd.fan = dcmd.fan;
+  msg.chaincast.dampercmd.room = dcmd.room;
   msg.chaincast.reach = 0; //empty bitfield
+  msg.chaincast.origin = 0; //stamped by pjon_inject_msg
   msg.type = MSG_DAMPERCMD;
   pjon_inject_msg(1, pjon_type_to_msg_length(msg.type), (uint8_t*) &msg);
 }
 
+//a damper command from the preset table, see presets.cpp
+void pjon_send_presetcmd(uint8_t preset, uint8_t room)
+{
+  pjon_message_t msg;
+  msg.chaincast.presetcmd.preset = preset;
+  msg.chaincast.presetcmd.room = room;
+  msg.chaincast.reach = 0; //empty bitfield
+  msg.chaincast.origin = 0; //stamped by pjon_inject_msg
+  msg.type = MSG_PRESETCMD;
+  pjon_inject_msg(1, pjon_type_to_msg_length(msg.type), (uint8_t*) &msg);
+}
+
+//tell toid (or the host, if toid is us) which site config we are on after a MSG_CONFIGDELTA,
+//and what our settings and presets really are
+void pjon_send_configreport(uint8_t toid, uint8_t status)
+{
+  pjon_message_t msg;
+  msg.type = MSG_CONFIGREPORT;
+  msg.configreport.pjon_id = pjon_device_id_;
+  msg.configreport.status = status;
+  msg.configreport.version = config_version_;
+  msg.configreport.hash = getConfigNodeHash();
+  pjon_reply_msg(toid, &msg);
+}
+
 ///////// Initialize PJON bus and data structures ///////////////
 
 void pjon_init()
@@ -464,8 +1558,15 @@ void pjon_init()
   arduino_init();
   pjonbus_.set_error(pjon_error_handler);
   pjonbus_.set_receiver(pjon_recv_handler);
+#if PJON_STRATEGY == PJON_STRATEGY_UART
+  Serial2.begin(PJON_UART_BAUD, SERIAL_8N1, PIN_PJON_UART_RX, PIN_PJON_UART_TX);
+  pjonbus_.strategy.set_serial(&Serial2);
+  pjonbus_.strategy.set_enable_RS485_pin(PIN_PJON_RS485_DE);
+#else
   pjonbus_.set_pin(PIN_PJON);
+#endif
   pjonbus_.begin();
+  pjon_idnonce_ = random(1, 0x10000); //esp_random(), differs between µC with the same firmware
   if (pjon_device_id_ != NOT_ASSIGNED)
   {
     pjonbus_.set_id(pjon_device_id_);
@@ -487,11 +1588,134 @@ void pjon_init()
   pjon_msgbuf_idx_ = 0;
 }
 
+//nothing to send, resend or hand over, so we may go to sleep (see task_idle_sleep)
+bool pjon_is_idle()
+{
+  if (pjonbus_.get_packets_count() > 0 || pjon_event_queue_len_ > 0)
+    return false;
+  for (uint8_t c=0; c<PJON_PRIO_CLASSES; c++)
+    if (pjon_outbox_len_[c] > 0)
+      return false;
+  if (pjon_idassign_state_ != IDASSIGN_IDLE || pjon_autoid_pending_ || pjon_idreply_to_ != 0)
+    return false;
+  for (uint8_t i=0; i<PJON_CHAINCAST_PENDING_LEN; i++)
+    if (pjon_chaincast_pending_[i].to != 0)
+      return false;
+  if (pjon_chaincast_held_len_ > 0)
+    return false;
+  for (uint8_t c=0; c<PJON_MSGBUF_LEN; c++)
+    if (pjon_msgbuf_[c].length != 0)
+      return false;
+  return true;
+}
+
+///////// Receive Window ///////////////
+//PJON only gets a frame whose start it sees while we are inside receive(), a frame that starts while the loop
+//does something else is lost and its sender tries again after a backoff. So we listen long while the bus is busy:
+//after a frame came in, while we wait for a chaincast ack, an id assignment or firmware update runs, or we have frames
+//to send (their answers will follow). Every window that hears nothing is an eighth shorter than the one before,
+//down to as long as the rest of the loop takes (at least PJON_RX_WINDOW_MIN_US) on a quiet bus: we still hear
+//every other try of a sender, and a busy loop gets half of the time instead of most of it.
+//That costs some latency: a command whose first frame is missed waits for the retry, so it takes a bit longer
+//than with a fixed PJON_RX_WINDOW_MAX_US window (see bench -b rx_window).
+//Frames come in bunches (a chaincast and its ack, pressure info of all sensors), so after one we listen again,
+//up to PJON_RX_MAX_FRAMES per loop, and let PJON send what the last frame made us queue in between.
+//PJON acks a frame as soon as pjon_recv_handler returns, and the buffer only holds PJON_MSGBUF_LEN of them,
+//so every frame gets handled before we listen for the next one (see bench -b rx_burst).
+//With PJON_STRATEGY_UART none of this is needed: the uart receives the frame while the loop does something else,
+//and receive() only has to pick it up.
+
+#if PJON_STRATEGY == PJON_STRATEGY_UART
+static void pjon_receive()
+{
+  for (uint8_t f=0; f<PJON_RX_MAX_FRAMES; f++)
+  {
+    uint32_t start = micros();
+    uint16_t rv = pjonbus_.receive(PJON_UART_RX_WINDOW_US);
+    pjon_rx_ended_us_ = micros();
+    pjon_rx_listen_us_ += pjon_rx_ended_us_ - start;
+    pjon_rx_windows_++;
+    if (rv != ACK)
+      return;
+    pjon_rx_frames_++;
+    pjon_postrecv_handle_msg();
+    pjon_outbox_flush();
+    pjonbus_.update();
+  }
+}
+#else
+static bool pjon_rx_expect_traffic()
+{
+  if (pjonbus_.get_packets_count() > 0 || pjon_idassign_state_ != IDASSIGN_IDLE || !fwupdate_is_idle())
+    return true;
+  for (uint8_t c=0; c<PJON_PRIO_CLASSES; c++)
+    if (pjon_outbox_len_[c] > 0)
+      return true;
+  for (uint8_t i=0; i<PJON_CHAINCAST_PENDING_LEN; i++)
+    if (pjon_chaincast_pending_[i].to != 0)
+      return true;
+  return false;
+}
+
+static void pjon_receive()
+{
+  uint32_t away = micros() - pjon_rx_ended_us_;
+  if (away > PJON_RX_WINDOW_MAX_US)
+    away = PJON_RX_WINDOW_MAX_US;
+  pjon_rx_away_us_ = (int32_t) pjon_rx_away_us_ + ((int32_t) away - (int32_t) pjon_rx_away_us_) / 8;
+  uint32_t window_min = (pjon_rx_away_us_ > PJON_RX_WINDOW_MIN_US) ? pjon_rx_away_us_ : PJON_RX_WINDOW_MIN_US;
+  if (pjon_rx_expect_traffic())
+    pjon_rx_window_us_ = PJON_RX_WINDOW_MAX_US;
+  else if (pjon_rx_window_us_ < window_min)
+    pjon_rx_window_us_ = window_min;
+  uint32_t window = (pjon_rx_fixed_us_) ? pjon_rx_fixed_us_ : pjon_rx_window_us_;
+  for (uint8_t f=0; f<PJON_RX_MAX_FRAMES; f++)
+  {
+    uint32_t start = micros();
+    uint16_t rv = pjonbus_.receive(window); //PJON sends ACK in receive after callback
+    pjon_rx_ended_us_ = micros();
+    pjon_rx_listen_us_ += pjon_rx_ended_us_ - start;
+    pjon_rx_windows_++;
+    if (rv != ACK)
+    {
+      pjon_rx_window_us_ -= pjon_rx_window_us_ / 8;
+      if (pjon_rx_window_us_ < window_min)
+        pjon_rx_window_us_ = window_min;
+      return;
+    }
+    pjon_rx_frames_++;
+    pjon_postrecv_handle_msg();
+    if (pjon_rx_fixed_us_)
+      return;
+    pjon_rx_window_us_ = window = PJON_RX_WINDOW_MAX_US;
+    pjon_outbox_flush();
+    pjonbus_.update();
+  }
+}
+#endif
+
+void pjon_rx_print_info()
+{
+#if PJON_STRATEGY == PJON_STRATEGY_UART
+  uint32_t window = PJON_UART_RX_WINDOW_US;
+#else
+  uint32_t window = (pjon_rx_fixed_us_) ? pjon_rx_fixed_us_ : pjon_rx_window_us_;
+#endif
+  printf("PJON receive: window %lu us, %lu windows, %lu with a frame, listened %lu ms, %lu dropped for a full buffer\r\n",
+    (unsigned long) window, (unsigned long) pjon_rx_windows_,
+    (unsigned long) pjon_rx_frames_, (unsigned long) (pjon_rx_listen_us_ / 1000), (unsigned long) pjon_msgbuf_dropped_);
+}
+
 ///////// PJON task, called periodically by main() ///////////////
 
 void task_pjon()
 {
+    pjon_outbox_flush();
     pjonbus_.update();
-    pjonbus_.receive(64); //PJON sends ACK in receive after callback
+    pjon_receive();
     pjon_postrecv_handle_msg();
+    task_pjon_idassign();
+    task_pjon_events();
+    task_pjon_chaincast_retry();
+    task_pjon_chaincast_held();
 }
\ No newline at end of file
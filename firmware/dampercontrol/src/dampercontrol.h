@@ -34,6 +34,7 @@
  * IO1.... TXD0
  * IO2.... Onobard LED
  * IO3.... RXD0
+ * IO4.... RS485 DE/RE (PJON_STRATEGY_UART only)
  *
  * IO12... MISO
  * IO13... MOSI
@@ -48,12 +49,13 @@
  * IO22... Damper Motor 1
  * IO23... Damper Motor 2
  *
- * IO25... PJON
+ * IO25... PJON (TXD2 with PJON_STRATEGY_UART)
  * IO26... SPI Sensor0 CS
  * IO27... SPI Sensor1 CS
  *
  * IO32... SPI Sensor2 CS
  * IO33... Main Ventilation Fan
+ * IO34... RXD2 (PJON_STRATEGY_UART only)
 
 */
 
@@ -72,6 +74,31 @@
 // see ../contrib/avr-utils/lib/arduino-leonardo/pins_arduino.h
 #define PIN_PJON GPIO25
 
+//the PJON strategy, chosen at compile time (-DPJON_STRATEGY=PJON_STRATEGY_UART in build_flags of platformio.ini):
+//SoftwareBitBang on PIN_PJON, one wire between all µC, the cpu clocks every bit in and out.
+//Or ThroughSerial on UART2 with an RS485 transceiver: the uart does the bits, at PJON_UART_BAUD,
+//the transceiver sends while PIN_PJON_RS485_DE is high. All µC of a ladder have to use the same one.
+#define PJON_STRATEGY_SWBB 0
+#define PJON_STRATEGY_UART 1
+#ifndef PJON_STRATEGY
+#define PJON_STRATEGY PJON_STRATEGY_SWBB
+#endif
+#ifndef PJON_UART_BAUD
+#define PJON_UART_BAUD 250000
+#endif
+#define PIN_PJON_UART_TX PIN_PJON
+#define PIN_PJON_UART_RX GPIO34
+#define PIN_PJON_RS485_DE GPIO4
+//a frame on the line wakes us from light sleep: SoftwareBitBang pulls the idle low line high,
+//the start bit pulls the idle high RS485 receiver output low
+#if PJON_STRATEGY == PJON_STRATEGY_UART
+#define PIN_PJON_WAKE PIN_PJON_UART_RX
+#define PJON_WAKE_LEVEL GPIO_INTR_LOW_LEVEL
+#else
+#define PIN_PJON_WAKE PIN_PJON
+#define PJON_WAKE_LEVEL GPIO_INTR_HIGH_LEVEL
+#endif
+
 
 #define PIN_HIGH(REG, PIN) digitalWrite(PIN,HIGH)
 #define PIN_LOW(REG, PIN)  digitalWrite(PIN,LOW)
@@ -98,19 +125,65 @@
 
 ///// HARDWARE CONTROL DEFINES /////
 
-#define ENDSTOP_0_ISHIGH digitalRead(PIN_ENDSTOP_0) == HIGH
-#define ENDSTOP_1_ISHIGH digitalRead(PIN_ENDSTOP_1) == HIGH
-#define ENDSTOP_2_ISHIGH digitalRead(PIN_ENDSTOP_2) == HIGH
-#define ENDSTOP_ISHIGH(x) digitalRead(PIN_ENDSTOP_0 + x) == HIGH
-
-#define DAMPER_MOTOR_RUN(x) digitalWrite(PIN_DAMPER_0 + x, HIGH)
-#define DAMPER_MOTOR_STOP(x) digitalWrite(PIN_DAMPER_0 + x, LOW)
-#define DAMPER_ISRUNNING(x) digitalRead(PIN_DAMPER_0 + x) == HIGH
-
-#define FAN_RUN  digitalWrite(PIN_FAN,LOW)
-#define FAN_STOP digitalWrite(PIN_FAN,HIGH)
-#define FAN_ISRUNNING digitalRead(PIN_FAN) == LOW
-
+#define ENDSTOP_0_ISHIGH (digitalRead(PIN_ENDSTOP_0) == HIGH)
+#define ENDSTOP_1_ISHIGH (digitalRead(PIN_ENDSTOP_1) == HIGH)
+#define ENDSTOP_2_ISHIGH (digitalRead(PIN_ENDSTOP_2) == HIGH)
+#define ENDSTOP_ISHIGH(x) (digitalRead(PIN_ENDSTOP_0 + x) == HIGH)
+
+//motor and fan outputs are switched with the esp32 set/clear registers, one write for all pins that change.
+//what they are set to is kept in damper_outputs_ and fan_output_, so reading them back costs nothing
+//pins 0..31 are in GPIO_OUT, 32..39 in GPIO_OUT1
+#define OUTPUT_PINMASK(pin) (1UL << ((pin) & 31))
+#define OUTPUT_SET(pin, mask) REG_WRITE(((pin) < 32) ? GPIO_OUT_W1TS_REG : GPIO_OUT1_W1TS_REG, mask)
+#define OUTPUT_CLEAR(pin, mask) REG_WRITE(((pin) < 32) ? GPIO_OUT_W1TC_REG : GPIO_OUT1_W1TC_REG, mask)
+
+//motors run on HIGH, see damper_outputs_write
+#define DAMPER_ISRUNNING(x) ((damper_outputs_ & _BV(x)) != 0)
+
+//the fan SSR switches on LOW
+#define FAN_RUN  fan_output_write(true)
+#define FAN_STOP fan_output_write(false)
+#define FAN_ISRUNNING (fan_output_)
+
+//count endstop edges with the esp32 pulse counter (PCNT unit d for damper d) instead of a pinchange interrupt,
+//the tick only reads the counters, see task_check_endstops_pcnt
+#ifndef ENDSTOP_PCNT
+#define ENDSTOP_PCNT 1
+#endif
+//hardware glitch filter: pulses shorter than this many APB cycles (80MHz) are not counted, 1023 (12.8us) is the maximum
+#define ENDSTOP_PCNT_FILTER 1023
+//ticks in a row the lightbeam has to pass through the slot after a falling edge, with no edge in between,
+//before we take it as endstop: 2 rejects light flashes shorter than a tick (8ms), the slot takes 3 to pass by
+#define ENDSTOP_PASS_TICKS 2
+
+
+//light sleep while no motor or fan runs and nothing is pending, see task_idle_sleep,
+//on the µC that were told to with 'Z1' (idle_sleep_enabled_)
+#ifndef IDLE_SLEEP
+#define IDLE_SLEEP 1
+#endif
+//stay awake this long after the last frame, console byte or motor/fan activity
+#define IDLE_AWAKE_MS 500
+//wake up at least this often anyway, for the pressure sensors and pending timeouts
+#define IDLE_SLEEP_MAX_MS 250
+//rising edges on RXD0 that wake us up, '\n' has 3 (the byte itself is lost)
+#define IDLE_UART_WAKE_THRESHOLD 3
+//after a uart wakeup the console drops what comes in until it has been quiet this long
+#define IDLE_CONSOLE_QUIET_MS 5
+//console line that tells the host we are awake and it may send its frame
+#define CONSOLE_AWAKE_LINE "awake"
+
+//the pressure sensors are read and reported in these intervals
+#define PRESSURE_CHECK_INTERVAL_MS 200
+#define PRESSURE_INFO_INTERVAL_MS 3000
+
+//console and host interface on UART0, the host may stream at this speed
+//(set a different speed with -DSERIAL_BAUD=... in build_flags of platformio.ini)
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD 921600
+#endif
+#define SERIAL_RX_BUFFER_LEN 1024
+#define SERIAL_MAX_BYTES_PER_LOOP 128
 
 /// GLOBALS ///
 
@@ -118,98 +191,496 @@
 
 #define LAMINA_DAMPER_ID 1
 
-enum pjon_msg_type_t {MSG_DAMPERCMD, MSG_PRESSUREINFO, MSG_ERROR, MSG_UPDATESETTINGS, MSG_PJONID_DOAUTO, MSG_PJONID_QUESTION, MSG_PJONID_INFO, MSG_PJONID_SET};
+//PJON.h is only included by comm.cpp, these are its ids the other files need
+#define PJON_ID_BROADCAST 0
+#define PJON_ID_NOT_ASSIGNED 255
+
+enum pjon_msg_type_t {MSG_DAMPERCMD, MSG_PRESSUREINFO, MSG_ERROR, MSG_UPDATESETTINGS, MSG_PJONID_DOAUTO, MSG_PJONID_QUESTION, MSG_PJONID_INFO, MSG_PJONID_SET, MSG_STATUSREQUEST, MSG_STATUS, MSG_EVENT, MSG_CHAINCAST_ACK, MSG_FWUPDATE_BEGIN, MSG_FWUPDATE_CHUNK, MSG_FWUPDATE_ACK, MSG_CONFIGDELTA, MSG_CONFIGREPORT, MSG_HISTORY_REQUEST, MSG_HISTORY_BLOCK, MSG_TIMESYNC, MSG_LINKSTATS_REQUEST, MSG_LINKSTATS, MSG_PRESETCMD, MSG_PRESETSET};
 enum damper_cmds_t {DAMPER_CLOSED, DAMPER_OPEN, DAMPER_HALFOPEN};
 enum fan_cmds_t {FAN_OFF=0, FAN_ON=1};
-enum error_type_t {NO_ERROR, DAMPER_CONTROL_TIMEOUT};
-
-
-typedef struct {
+enum error_type_t {NO_ERROR, DAMPER_CONTROL_TIMEOUT, CHAINCAST_HOP_FAILED, INTERLOCK_REJECTED, DAMPER_PRESSURE_MISMATCH};
+enum event_type_t {EVENT_TARGET_REACHED, EVENT_FAN, EVENT_ENDSTOP_RESYNC, EVENT_SENSOR_LOST};
+//record kinds of the serial capture, see capture.cpp
+enum capture_record_t {CAPTURE_START, CAPTURE_TARGETS, CAPTURE_FRAME, CAPTURE_ENDSTOPS, CAPTURE_OUTPUTS, CAPTURE_OVERFLOW};
+//CAPTURE_OUTPUTS bits, bit 0..2 are the damper motors
+#define CAPTURE_OUTPUT_FAN _BV(4)
+#define CAPTURE_OUTPUT_FANLAMINA _BV(5)
+//fwupdateack_t status
+enum fwupdate_status_t {FWUPDATE_RECEIVING, FWUPDATE_GAP, FWUPDATE_DONE, FWUPDATE_HASH_MISMATCH, FWUPDATE_FLASH_ERROR, FWUPDATE_TOO_BIG};
+//configreport_t status
+enum config_status_t {CONFIG_APPLIED, CONFIG_UNCHANGED, CONFIG_BASE_MISMATCH, CONFIG_INVALID};
+//byte offsets in nodeconfig_t, the fields a configchange_t can set
+enum config_field_t {CONFIG_INSTALLED, CONFIG_OPEN_POS_0, CONFIG_OPEN_POS_1, CONFIG_OPEN_POS_2, CONFIG_SENSOR_DESTINATION};
+//resolutions of the pressure history, see history.cpp
+enum history_tier_t {HISTORY_RAW, HISTORY_MINUTE, HISTORY_QUARTER, HISTORY_NUM_TIERS};
+enum damperstate_marker_t {DAMPERSTATE_MOVING=0x5A, DAMPERSTATE_SETTLED=0xA5};
+
+
+//all msg structs are packed, so the wire format does not depend on the alignment rules of the µC
+//(the esp32 would otherwise pad the union in pjon_message_t to 4 bytes)
+typedef struct __attribute__((packed)) {
   uint8_t damper[NUM_DAMPER];
   uint8_t fan : 1;
   uint8_t fanlamina : 1;
+  uint8_t room : 3; // the room the command comes from, 0: none, see Room Interlock in main.cpp
 } dampercmd_t;
 
-typedef struct {
+//a damper command kept in the preset table, see presets.cpp
+#define PRESETS_NUM 16
+#define PRESET_OFF 0
+#define PRESET_UNUSED 0xFF
+typedef struct __attribute__((packed)) {
+  uint8_t damper[NUM_DAMPER]; // damper_cmds_t, PRESET_UNUSED in damper[0]: no such preset
+  uint8_t fan : 1;
+  uint8_t fanlamina : 1;
+  uint16_t duration_s; // 0: until the next command, else preset 0 follows
+} preset_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t preset : 5;
+  uint8_t room : 3; // as in dampercmd_t
+} presetcmd_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t preset;
+  uint8_t top; // highest pjon id the entry travels up to, every µC needs it, not only those with dampers
+  preset_t entry;
+} presetset_t;
+
+typedef struct __attribute__((packed)) {
   uint8_t sensorid;
   float celsius;
   float pascal;
+  uint32_t bus_us; // bus time of the reading, see timesync.cpp
 } pressureinfo_t;
 
-typedef struct {
-  uint8_t damperid;
+typedef struct __attribute__((packed)) {
+  uint8_t damperid; // for CHAINCAST_HOP_FAILED: the pjon id we could not reach, else the damper
   uint8_t errortype;
+  uint32_t bus_us;
 } errorinfo_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
   uint8_t damper_open_pos[NUM_DAMPER];
 } updatesettings_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
   uint8_t pjon_id;
+  uint16_t nonce; // random per boot, tells µC with the same pjon_id apart. In MSG_PJONID_SET: 0 for any µC with the id
 } pjonidsetting_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
+  uint8_t reply_to; // pjon id that wants the MSG_STATUS
+} statusrequest_t;
+
+//snapshot of everything printSettings() would tell us, in one frame
+typedef struct __attribute__((packed)) {
+  uint8_t pjon_id; // sender, the receive callback only tells the receiver its own id
+  uint8_t damper_pos[NUM_DAMPER];
+  uint8_t damper_target[NUM_DAMPER];
+  uint8_t installed; // bit d: damper d installed, bit 4+d: pressure sensor d installed
+  uint8_t endstops; // bit d: endstop d lightbeam interrupted (high)
+  uint8_t fan; // STATUS_FAN_* bits
+  uint8_t errors; // bit d: damper d timed out without reaching the endstop, bit 4+d: its pressure does not fit its target
+  float pascal[NUM_DAMPER];
+  uint32_t uptime_s;
+  uint8_t chaincast_clock; // highest chaincast seq the sender has seen or sent, see pjon_chaincast_learn_clock
+} statusinfo_t;
+
+#define STATUS_FAN_TARGET _BV(0)
+#define STATUS_FAN_RUNNING _BV(1)
+#define STATUS_FANLAMINA_TARGET _BV(2)
+#define STATUS_FANLAMINA_RUNNING _BV(3)
+
+//a state transition that actually happened, pushed unasked to pjon_sensor_destination_id_
+typedef struct __attribute__((packed)) {
+  uint8_t pjon_id; // sender
+  uint8_t seq; // +1 for every event, a gap means events got dropped or merged: ask for a MSG_STATUS
+  uint8_t event; // event_type_t
+  uint8_t subject; // damper or sensor id, for EVENT_FAN: 0 fan, 1 laminafan
+  uint8_t value; // EVENT_TARGET_REACHED: position, EVENT_FAN: 1 on/0 off, EVENT_ENDSTOP_RESYNC: position counter before resync
+  uint32_t bus_us; // when it happened
+} eventinfo_t;
+
+//beacon of the time sync master, see timesync.cpp
+#define TIMESYNC_MASTER_ID 1
+typedef struct __attribute__((packed)) {
+  uint8_t epoch; // picked by the master at boot
+  uint8_t seq;
+  uint32_t prev_end_us; // bus time at which beacon seq-1 was on the wire
+} timesync_t;
+
+//ask for the link stats of one peer (0: all we know), answered with one MSG_LINKSTATS per peer
+typedef struct __attribute__((packed)) {
+  uint8_t reply_to;
+  uint8_t peer;
+} linkstatsrequest_t;
+
+//what the sender knows about its link to peer, see linkstats.cpp
+//counters are running totals that wrap around, the receiver looks at the differences
+#define LINKSTATS_RTT_BUCKETS 8
+typedef struct __attribute__((packed)) {
+  uint8_t pjon_id; // sender
+  uint8_t peer;
+  uint16_t sent; // frames queued for peer
+  uint16_t full; // frames not queued or dropped, our outbox or the PJON buffer was full
+  uint16_t lost; // frames PJON gave up on (CONNECTION_LOST)
+  uint16_t retries; // chaincast hops sent again for lack of an ack
+  uint16_t heard; // frames from peer
+  uint16_t last_heard_s; // seconds since the last one, 0xFFFF: never or long ago
+  uint16_t rtt_hist[LINKSTATS_RTT_BUCKETS]; // chaincast hop acks by round trip time: <16ms, <32ms, .. <1024ms, more
+} linkstats_t;
+
+//firmware update, see fwupdate.cpp. A chunk frame has to fit into a PJON packet (PJON_PACKET_MAX_LENGTH 50, minus header and crc32)
+#define FWUPDATE_CHUNK_LEN 32
+#define FWUPDATE_HASH_LEN 32
+//a 'u' chunk on the console, after the 'u': length(1, of index and data) index(2) data(FWUPDATE_CHUNK_LEN)
+//and the crc32 of length, index and data (4, little endian)
+#define FWUPDATE_CHUNK_FRAME_LEN (1 + 2 + FWUPDATE_CHUNK_LEN + 4)
+//the host aborts an update with this many CAN in a row on the console, as few chunk bytes look like that as possible
+#define FWUPDATE_ABORT_CHAR 0x18
+#define FWUPDATE_ABORT_LEN 4
+
+//crc32 of a console chunk frame (the common one, as in zlib), host and µC compute the same
+inline uint32_t fwupdate_crc32(const uint8_t *data, uint8_t len)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  while (len--)
+  {
+    crc ^= *data++;
+    for (uint8_t i=8; i; i--)
+      crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+  }
+  return ~crc;
+}
+
+typedef struct __attribute__((packed)) {
+  uint8_t session; // picked by the sender, frames of an older session are ignored
+  uint8_t reply_to; // pjon id of the sender, gets the MSG_FWUPDATE_ACK
+  uint32_t size; // of the image in bytes
+  uint8_t sha256[FWUPDATE_HASH_LEN]; // of the image
+} fwupdatebegin_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t session;
+  uint16_t index; // the chunk starts at index * FWUPDATE_CHUNK_LEN
+  uint8_t data[FWUPDATE_CHUNK_LEN]; // the last chunk is padded with 0xFF
+} fwupdatechunk_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t pjon_id; // sender
+  uint8_t session;
+  uint16_t next; // all chunks below next are written to flash
+  uint8_t status; // fwupdate_status_t
+} fwupdateack_t;
+
+//ask for the pressure history of one sensor, answered with MSG_HISTORY_BLOCK frames
+typedef struct __attribute__((packed)) {
+  uint8_t reply_to; // pjon id that wants the blocks
+  uint8_t sensorid;
+  uint8_t tier; // history_tier_t
+  uint32_t from; // first slot, slot i covers uptime i*period .. (i+1)*period, older ones are left out
+  uint16_t count; // slots from there, 0: all up to now
+} historyrequest_t;
+
+//a block of history slots, values in 0.1Pa, coded as in history_encode_slot. A block with count 0 ends the answer
+#define HISTORY_BLOCK_DATA_LEN 28
+typedef struct __attribute__((packed)) {
+  uint8_t pjon_id; // sender
+  uint8_t sensorid;
+  uint8_t tier;
+  uint32_t first; // slot of the first value in data
+  uint8_t count; // slots in data
+  uint8_t len; // bytes used in data
+  uint8_t data[HISTORY_BLOCK_DATA_LEN];
+} historyblock_t;
+
+//everything a site config sets on one µC, see Site Config in settings.cpp
+typedef struct __attribute__((packed)) {
+  uint8_t installed; // bit d: damper d installed
+  uint8_t damper_open_pos[NUM_DAMPER];
+  uint8_t sensor_destination_id;
+} nodeconfig_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t pjon_id; // the µC that changes
+  uint8_t field; // config_field_t
+  uint8_t value;
+} configchange_t;
+
+//a chaincast frame has to fit into a PJON packet as well
+#define CONFIGDELTA_MAX_CHANGES 7
+//base_hash of a delta that applies whatever a µC has now, it has to set every field of the µC it names
+#define CONFIG_HASH_ANY 0
+
+typedef struct __attribute__((packed)) {
+  uint16_t version; // of the site config after this delta
+  uint32_t base_hash; // site config the delta applies to, CONFIG_HASH_ANY: see above
+  uint32_t hash; // site config after this delta
+  uint8_t top; // highest pjon id the delta travels up to
+  uint8_t count; // changes used
+  configchange_t changes[CONFIGDELTA_MAX_CHANGES];
+} configdelta_t;
+
+//every µC a MSG_CONFIGDELTA reaches sends this to its origin
+typedef struct __attribute__((packed)) {
+  uint8_t pjon_id; // sender
+  uint8_t status; // config_status_t
+  uint16_t version; // site config the sender has now
+  uint32_t hash; // config_node_hash of the settings and presets the sender has now
+} configreport_t;
+
+inline uint32_t config_hash_byte(uint32_t h, uint8_t b)
+{
+  return (h ^ b) * 16777619u;
+}
+
+//FNV-1a over the nodeconfig_t and the preset table of one µC, host and µC compute the same.
+//Presets go field by field, the bits next to fan and fanlamina are not part of the hash
+inline uint32_t config_node_hash(const nodeconfig_t *c, const preset_t *presets)
+{
+  uint32_t h = 2166136261u;
+  for (uint8_t i=0; i<sizeof(nodeconfig_t); i++)
+    h = config_hash_byte(h, ((const uint8_t*) c)[i]);
+  for (uint8_t p=0; p<PRESETS_NUM; p++)
+  {
+    const preset_t *e = &presets[p];
+    for (uint8_t d=0; d<NUM_DAMPER; d++)
+      h = config_hash_byte(h, e->damper[d]);
+    h = config_hash_byte(h, e->fan);
+    h = config_hash_byte(h, e->fanlamina);
+    h = config_hash_byte(h, e->duration_s & 0xFF);
+    h = config_hash_byte(h, e->duration_s >> 8);
+  }
+  return h;
+}
+
+//the preset table of a µC that never got one: the console keys '0'..'7' as they used to be, the rest unused
+inline void presets_fill_defaults(preset_t *table)
+{
+  const uint8_t open[8] = {0, _BV(0), _BV(1), _BV(2), _BV(0)|_BV(1), _BV(0)|_BV(2), _BV(1)|_BV(2), _BV(0)|_BV(1)|_BV(2)};
+  for (uint8_t p=0; p<PRESETS_NUM; p++)
+  {
+    preset_t *e = &table[p];
+    for (uint8_t d=0; d<NUM_DAMPER; d++)
+      e->damper[d] = (p < 8 && (open[p] & _BV(d))) ? DAMPER_OPEN : DAMPER_CLOSED;
+    e->fan = (p != PRESET_OFF) ? FAN_ON : FAN_OFF;
+    e->fanlamina = FAN_OFF;
+    e->duration_s = 0;
+    if (p >= 8)
+      e->damper[0] = PRESET_UNUSED;
+  }
+}
+
+typedef struct __attribute__((packed)) {
   uint8_t reach; // bitfield to indicate which hardware saw this packet: damper0, damper1, damper2, fan
-  union {
+  uint8_t origin; // pjon id of the µC that started the chaincast, 0: stamp me (see pjon_inject_msg)
+  uint8_t seq; // lamport clock of origin, together with origin it tells which of two commands is newer
+  union __attribute__((packed)) {
     dampercmd_t dampercmd;
     updatesettings_t updatesettings;
+    configdelta_t configdelta;
+    presetcmd_t presetcmd;
+    presetset_t presetset;
   };
 } pjon_chaincast_t;
 
-typedef struct {
+//sent back one hop for every chaincast frame received, see pjon_chaincast_forward
+typedef struct __attribute__((packed)) {
+  uint8_t type; // of the chaincast
+  uint8_t origin;
+  uint8_t seq;
+  uint8_t down; // 1: second pass, 0: first pass, 2: first pass from the origin to the bottom µC (id 1)
+} chaincastack_t;
+
+typedef struct __attribute__((packed)) {
   uint8_t type;
-  union {
+  union __attribute__((packed)) {
     pjon_chaincast_t chaincast;
+    chaincastack_t chaincastack;
     pressureinfo_t pressureinfo;
     errorinfo_t errorinfo;
     pjonidsetting_t pjonidsetting;
+    statusrequest_t statusrequest;
+    statusinfo_t statusinfo;
+    eventinfo_t eventinfo;
+    fwupdatebegin_t fwupdatebegin;
+    fwupdatechunk_t fwupdatechunk;
+    fwupdateack_t fwupdateack;
+    configreport_t configreport;
+    historyrequest_t historyrequest;
+    historyblock_t historyblock;
+    timesync_t timesync;
+    linkstatsrequest_t linkstatsrequest;
+    linkstats_t linkstats;
   };
 } pjon_message_t;
 
-typedef struct {
+typedef struct __attribute__((packed)) {
   uint8_t id;
   uint8_t length;
   pjon_message_t msg;
 } pjon_message_with_sender_t;
 
+//called once pjon_become_master_of_ids() is done, with the number of other µC found
+//and whether all of them confirmed their new id
+typedef void (*pjon_idassign_cb_t)(uint8_t num_nodes, bool success);
+
 extern bool damper_installed_[NUM_DAMPER];
 extern bool sensor_installed_[NUM_DAMPER];
 extern uint8_t damper_open_pos_[NUM_DAMPER];
 extern uint8_t pjon_device_id_;
+extern uint8_t pjon_chaincast_clock_;
 extern uint8_t pjon_sensor_destination_id_;
+extern uint16_t config_version_;
+extern uint32_t config_hash_;
+extern bool idle_sleep_enabled_;
+extern preset_t preset_table_[PRESETS_NUM];
+extern uint8_t damper_states_[NUM_DAMPER];
+extern uint8_t damper_target_states_[NUM_DAMPER];
+extern uint8_t damper_room_[NUM_DAMPER];
+extern uint8_t pressuresig_fault_flags_;
+extern uint8_t fan_target_state_;
+extern uint8_t fanlamina_target_state_;
+extern volatile uint8_t damper_outputs_;
+extern bool fan_output_;
+extern bool capture_enabled_;
 
 bool are_all_dampers_closed(void);
 bool have_dampers_reached_target(void);
 inline void task_control_dampers(void);
+void damper_outputs_write(uint8_t run);
+void fan_output_write(bool on);
+void task_check_endstops_pcnt(void);
 void task_control_fan(void);
 void task_check_pressure(void);
 void task_pjon(void);
+void usbserial_init(void);
 void task_usbserial(void);
+void handle_serialdata(char c);
+void handle_serial_fw_badchunk();
+void handle_serialdata_bulk(const uint8_t *buf, uint16_t len);
 void handle_damper_cmd(bool didreachall, dampercmd_t *rxmsg);
+uint8_t interlock_check_dampercmd(dampercmd_t *cmd);
+void fillStatusInfo(statusinfo_t *s);
+void task_detect_events(void);
+void idle_note_activity(void);
+bool idle_console_resync(void);
+void task_idle_sleep(void);
 
 void saveSettings2EEPROM();
 void loadSettingsFromEEPROM();
+void saveDamperStates2EEPROM(uint8_t marker, uint8_t *states);
+uint8_t loadDamperStatesFromEEPROM(uint8_t *states);
+void savePresets2EEPROM(preset_t *table);
+bool loadPresetsFromEEPROM(preset_t *table);
 void updateSettingsFromPacket(updatesettings_t *s);
 void updateInstalledDampersFromChar(uint8_t damper_installed);
 uint8_t getInstalledDampersAsBitfield();
+void fillNodeConfig(nodeconfig_t *c);
+uint32_t getConfigNodeHash();
+uint8_t applyConfigDelta(uint8_t pjon_id, configdelta_t *delta);
 
 void pjon_init();
 void pjon_change_deviceid(uint8_t id);
+bool pjon_time_reached(uint32_t t);
+void pjon_print_msg(uint8_t toid, pjon_message_t *msg);
+void pjon_reply_msg(uint8_t toid, pjon_message_t *msg);
+bool pjon_send_bulk(uint8_t toid, pjon_message_t *msg);
+void pjon_outbox_print_info();
+void pjon_rx_print_info();
+bool pjon_broadcast_now(pjon_message_t *msg);
 void pjon_inject_msg(uint8_t dst, uint8_t length, uint8_t *payload);
 void pjon_inject_broadcast_msg(uint8_t length, uint8_t *payload);
-void pjon_send_pressure_infomsg(uint8_t sensorid, float temperature, float pressure);
+void pjon_send_pressure_infomsg(uint8_t sensorid, float pressure, float temperature, uint32_t read_us);
 void pjon_senderror_dampertimeout(uint8_t damperid);
+void pjon_senderror_interlock(uint8_t toid, uint8_t damperid);
+void pjon_senderror_pressuresig(uint8_t damperid);
 void pjon_send_dampercmd(dampercmd_t dcmd);
+void pjon_send_presetcmd(uint8_t preset, uint8_t room);
+void pjon_send_configreport(uint8_t toid, uint8_t status);
+void pjon_send_status(uint8_t toid);
+void pjon_send_statusrequest(uint8_t toid);
+uint8_t pjon_msg_sender(pjon_message_t *msg);
+void pjon_queue_event(uint8_t event, uint8_t subject, uint8_t value);
+void task_pjon_events();
+bool pjon_is_chaincast_type(uint8_t type);
 void pjon_chaincast_forward(uint8_t fromid, bool didreachall, pjon_message_t* msg);
+uint8_t pjon_chaincast_from(pjon_message_t *msg);
+void pjon_chaincast_send_ack(pjon_message_t *msg);
+void pjon_chaincast_add_pending(uint8_t to, pjon_message_t *msg);
+void pjon_chaincast_handle_ack(chaincastack_t *ack);
+void pjon_chaincast_hop_lost(uint8_t id);
+void pjon_chaincast_learn_clock(uint8_t seq);
+bool pjon_chaincast_hold(uint8_t dst, uint8_t length, pjon_message_t *msg);
+void task_pjon_chaincast_held();
+void task_pjon_chaincast_retry();
 void pjon_identify_myself(uint8_t toid);
 void pjon_startautoiddiscover();
 void pjon_become_master_of_ids();
+void pjon_set_idassign_callback(pjon_idassign_cb_t cb);
+void pjon_idassign_handle_info(uint8_t id, uint16_t nonce);
+void task_pjon_idassign();
 void pjon_broadcast_get_autoid();
+bool pjon_is_idle();
 
 void pressure_sensors_init();
 void task_check_pressure();
 float get_latest_pressure(uint8_t sensorid);
 float get_latest_temperature(uint8_t sensorid);
 
+void fwupdate_start(uint8_t to, uint32_t size, const uint8_t *sha256);
+void fwupdate_host_chunk(uint16_t index, const uint8_t *data);
+void fwupdate_handle_begin(fwupdatebegin_t *begin);
+void fwupdate_handle_chunk(fwupdatechunk_t *chunk);
+void fwupdate_handle_ack(fwupdateack_t *ack);
+void fwupdate_abort();
+bool fwupdate_is_idle();
+bool fwupdate_is_sending();
+void task_fwupdate();
+
+void timesync_init();
+void timesync_note_rx();
+void timesync_handle_beacon(timesync_t *beacon);
+void task_timesync();
+uint32_t timesync_bus_us(uint32_t local_us);
+uint32_t timesync_sleep_ms(uint32_t max_ms);
+void timesync_print_info();
+
+void linkstats_note_send(uint8_t peer, bool queued);
+void linkstats_note_lost(uint8_t peer);
+void linkstats_note_retry(uint8_t peer);
+void linkstats_note_heard(uint8_t peer);
+void linkstats_note_rtt(uint8_t peer, uint32_t rtt_ms);
+void linkstats_note_memory_full();
+void linkstats_handle_request(linkstatsrequest_t *req);
+bool linkstats_is_idle();
+void task_linkstats();
+void linkstats_print_info();
+
+void presets_init();
+bool preset_resolve(presetcmd_t *pcmd, dampercmd_t *cmd);
+void preset_handle_set(presetset_t *set);
+void preset_note_sent(pjon_message_t *msg);
+void task_presets();
+uint32_t presets_sleep_ms(uint32_t max_ms);
+void presets_print_info();
+void pressuresig_check();
+uint32_t pressuresig_check_interval_ms(uint32_t interval_ms);
+void pressuresig_print_info();
+
+void history_init();
+void history_record();
+void history_handle_request(historyrequest_t *req);
+bool history_is_idle();
+void task_history();
+void history_print_info();
+
+void capture_toggle();
+void capture_targets();
+void capture_frame(uint8_t toid, const uint8_t *payload, uint8_t length);
+void capture_endstops();
+void capture_outputs();
+void task_capture();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,441 @@
+/*
+ *  Damper Control Firmware - Firmware Update
+ *
+ *  Streams a firmware image through the µC on the usb port to another µC on the bus.
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "Arduino.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "mbedtls/sha256.h"
+#include "dampercontrol.h"
+
+///////// Firmware Update over PJON ///////////////
+//The µC on the usb port (the bridge) streams a firmware image to another µC on the bus, no need to climb a ladder.
+//
+//host -> bridge, on the serial console:
+//  'U' to size(4, little endian) sha256(32)    start an update of pjon id to
+//  'u' 34 index(2) data(32) crc32(4)            chunk index of the image, the last one padded with 0xFF, the crc
+//                                              covers 34, index and data. A chunk with a wrong length or crc is dropped
+//                                              and asked for again
+//  CAN(0x18) x FWUPDATE_ABORT_LEN              abort the update
+//The console takes nothing else until the update ends, not even the '>' frames of ventilationinterface: they are dropped.
+//bridge -> host:
+//  U<index as 4 hex digits>                    send me chunk index (the host only ever has to seek on a resume)
+//
+//bridge -> target: MSG_FWUPDATE_BEGIN, then MSG_FWUPDATE_CHUNK in order.
+//The target writes the chunks to the inactive ota partition as they come and hashes them,
+//every FWUPDATE_ACK_EVERY chunks it tells the bridge how far it got with a MSG_FWUPDATE_ACK.
+//The bridge keeps up to FWUPDATE_WINDOW chunks not acked yet, so it can send them again without asking the host.
+//A chunk out of order makes the target ask for the one it misses (FWUPDATE_GAP), the bridge goes back to it.
+//No ack for FWUPDATE_ACK_TIMEOUT_MS: the bridge goes back to the oldest chunk not acked.
+//After FWUPDATE_MAX_TIMEOUTS of those it sends MSG_FWUPDATE_BEGIN again until the target answers,
+//and a target still holding a partial image of the same size and hash says where to continue.
+//FWUPDATE_MAX_STALLS ack timeouts in a row without a chunk from the host or an ack that gets further and the bridge
+//gives up, so a host that went away does not leave the console deaf for good.
+//Once the hash matches, the target boots the new partition as soon as no motor runs.
+
+#define FWUPDATE_WINDOW 8
+#define FWUPDATE_ACK_EVERY 4
+#define FWUPDATE_ACK_TIMEOUT_MS 500
+#define FWUPDATE_MAX_TIMEOUTS 6
+#define FWUPDATE_BEGIN_RETRY_MS 1000
+#define FWUPDATE_MAX_BEGINS 60
+#define FWUPDATE_MAX_STALLS 20
+//a target repeats a gap or duplicate ack for the same chunk no sooner than this
+#define FWUPDATE_NACK_INTERVAL_MS 200
+#define FWUPDATE_RESTART_DELAY_MS 1000
+
+// --- bridge side ---
+
+enum fwupdate_tx_state_t {FWTX_IDLE, FWTX_BEGIN, FWTX_SENDING};
+
+uint8_t fwupdate_tx_state_ = FWTX_IDLE;
+uint8_t fwupdate_tx_to_ = 0;
+uint8_t fwupdate_tx_session_ = 0;
+uint32_t fwupdate_tx_size_ = 0;
+uint8_t fwupdate_tx_sha256_[FWUPDATE_HASH_LEN];
+uint16_t fwupdate_tx_chunks_ = 0;
+uint16_t fwupdate_tx_base_ = 0; //oldest chunk not acked
+uint16_t fwupdate_tx_next_ = 0; //next chunk to send
+uint16_t fwupdate_tx_fetched_ = 0; //chunks below this are in fwupdate_tx_buf_ (or acked)
+uint16_t fwupdate_tx_requested_ = 0; //chunks below this were asked for from the host
+uint8_t fwupdate_tx_buf_[FWUPDATE_WINDOW][FWUPDATE_CHUNK_LEN]; //chunk i is in slot i % FWUPDATE_WINDOW
+uint32_t fwupdate_tx_due_ = 0;
+uint8_t fwupdate_tx_timeouts_ = 0;
+uint8_t fwupdate_tx_begins_ = 0;
+uint8_t fwupdate_tx_stalls_ = 0; //ack timeouts since the last progress
+uint32_t fwupdate_tx_started_ms_ = 0;
+uint32_t fwupdate_tx_resent_ = 0;
+
+// --- target side ---
+
+enum fwupdate_rx_state_t {FWRX_IDLE, FWRX_RECEIVING, FWRX_DONE};
+
+uint8_t fwupdate_rx_state_ = FWRX_IDLE;
+uint8_t fwupdate_rx_session_ = 0;
+uint8_t fwupdate_rx_reply_to_ = 0;
+uint32_t fwupdate_rx_size_ = 0;
+uint8_t fwupdate_rx_sha256_[FWUPDATE_HASH_LEN];
+uint16_t fwupdate_rx_next_ = 0;
+uint16_t fwupdate_rx_nacked_ = 0xFFFF; //fwupdate_rx_next_ at the last gap or duplicate ack
+uint32_t fwupdate_rx_nacked_ms_ = 0;
+uint32_t fwupdate_rx_done_ms_ = 0;
+esp_ota_handle_t fwupdate_rx_handle_ = 0;
+const esp_partition_t *fwupdate_rx_partition_ = 0;
+mbedtls_sha256_context fwupdate_rx_sha_;
+
+static uint16_t fwupdate_num_chunks(uint32_t size)
+{
+  return (size + FWUPDATE_CHUNK_LEN - 1) / FWUPDATE_CHUNK_LEN;
+}
+
+///////// bridge ///////////
+
+static void fwupdate_send_begin()
+{
+  pjon_message_t msg;
+  msg.type = MSG_FWUPDATE_BEGIN;
+  msg.fwupdatebegin.session = fwupdate_tx_session_;
+  msg.fwupdatebegin.reply_to = pjon_device_id_;
+  msg.fwupdatebegin.size = fwupdate_tx_size_;
+  memcpy(msg.fwupdatebegin.sha256, fwupdate_tx_sha256_, FWUPDATE_HASH_LEN);
+  pjon_reply_msg(fwupdate_tx_to_, &msg);
+  fwupdate_tx_due_ = millis() + FWUPDATE_BEGIN_RETRY_MS;
+  fwupdate_tx_begins_++;
+}
+
+//continue (or start) sending at chunk from, what the host sent before is of no use any more
+static void fwupdate_tx_restart_at(uint16_t from)
+{
+  fwupdate_tx_state_ = FWTX_SENDING;
+  fwupdate_tx_base_ = from;
+  fwupdate_tx_next_ = from;
+  fwupdate_tx_fetched_ = from;
+  fwupdate_tx_requested_ = from;
+  fwupdate_tx_timeouts_ = 0;
+  fwupdate_tx_due_ = millis() + FWUPDATE_ACK_TIMEOUT_MS;
+}
+
+void fwupdate_start(uint8_t to, uint32_t size, const uint8_t *sha256)
+{
+  if (to == pjon_device_id_ || to == 0) //0 is the PJON broadcast id
+  {
+    printf("fwupdate: can not update id %d over the bus\r\n", to);
+    return;
+  }
+  if (size == 0 || size >= 0xFFFFUL * FWUPDATE_CHUNK_LEN)
+  {
+    printf("fwupdate: image size %lu not supported\r\n", (unsigned long) size);
+    return;
+  }
+  fwupdate_tx_to_ = to;
+  fwupdate_tx_session_++;
+  if (fwupdate_tx_session_ == 0)
+    fwupdate_tx_session_ = 1;
+  fwupdate_tx_size_ = size;
+  memcpy(fwupdate_tx_sha256_, sha256, FWUPDATE_HASH_LEN);
+  fwupdate_tx_chunks_ = fwupdate_num_chunks(size);
+  fwupdate_tx_started_ms_ = millis();
+  fwupdate_tx_resent_ = 0;
+  fwupdate_tx_begins_ = 0;
+  fwupdate_tx_stalls_ = 0;
+  fwupdate_tx_state_ = FWTX_BEGIN;
+  printf("fwupdate: %lu bytes to %d\r\n", (unsigned long) size, to);
+  fwupdate_send_begin();
+}
+
+void fwupdate_host_chunk(uint16_t index, const uint8_t *data)
+{
+  //the host answers requests in order, anything else is a leftover of a request from before a go-back
+  if (fwupdate_tx_state_ != FWTX_SENDING || index != fwupdate_tx_fetched_ || index >= fwupdate_tx_requested_)
+    return;
+  memcpy(fwupdate_tx_buf_[index % FWUPDATE_WINDOW], data, FWUPDATE_CHUNK_LEN);
+  fwupdate_tx_fetched_++;
+  fwupdate_tx_stalls_ = 0;
+}
+
+//the target keeps what it got, an update of the same image later continues there
+void fwupdate_abort()
+{
+  if (fwupdate_tx_state_ == FWTX_IDLE)
+    return;
+  printf("fwupdate: %d aborted at chunk %u\r\n", fwupdate_tx_to_, fwupdate_tx_base_);
+  fwupdate_tx_state_ = FWTX_IDLE;
+}
+
+void fwupdate_handle_ack(fwupdateack_t *ack)
+{
+  if (fwupdate_tx_state_ == FWTX_IDLE || ack->pjon_id != fwupdate_tx_to_ || ack->session != fwupdate_tx_session_)
+    return;
+  switch (ack->status)
+  {
+    case FWUPDATE_DONE:
+    {
+      uint32_t ms = millis() - fwupdate_tx_started_ms_;
+      printf("fwupdate: %d done, %lu bytes in %lu ms, %lu chunks sent again\r\n", fwupdate_tx_to_,
+        (unsigned long) fwupdate_tx_size_, (unsigned long) ms, (unsigned long) fwupdate_tx_resent_);
+      fwupdate_tx_state_ = FWTX_IDLE;
+      return;
+    }
+    case FWUPDATE_RECEIVING:
+    case FWUPDATE_GAP:
+      break;
+    default:
+      printf("fwupdate: %d failed with status %d\r\n", fwupdate_tx_to_, ack->status);
+      fwupdate_tx_state_ = FWTX_IDLE;
+      return;
+  }
+  if (ack->next > fwupdate_tx_chunks_)
+    return;
+  if (fwupdate_tx_state_ == FWTX_BEGIN)
+  {
+    if (ack->next > 0)
+      printf("fwupdate: %d resumes at chunk %u\r\n", fwupdate_tx_to_, ack->next);
+    fwupdate_tx_restart_at(ack->next);
+    return;
+  }
+  if (ack->next < fwupdate_tx_base_)
+    return; //an old ack that got overtaken
+  if (ack->next > fwupdate_tx_next_)
+  {
+    //the target has more than we sent, it must have kept it from an earlier session
+    fwupdate_tx_restart_at(ack->next);
+    return;
+  }
+  if (ack->next > fwupdate_tx_base_)
+  {
+    fwupdate_tx_base_ = ack->next;
+    fwupdate_tx_timeouts_ = 0;
+    fwupdate_tx_stalls_ = 0;
+    fwupdate_tx_due_ = millis() + FWUPDATE_ACK_TIMEOUT_MS;
+  }
+  if (ack->status == FWUPDATE_GAP && ack->next < fwupdate_tx_next_)
+  {
+    fwupdate_tx_resent_ += fwupdate_tx_next_ - ack->next;
+    fwupdate_tx_next_ = ack->next;
+  }
+}
+
+static void task_fwupdate_send()
+{
+  if (fwupdate_tx_state_ == FWTX_BEGIN)
+  {
+    if (!pjon_time_reached(fwupdate_tx_due_))
+      return;
+    if (fwupdate_tx_begins_ >= FWUPDATE_MAX_BEGINS)
+    {
+      printf("fwupdate: %d does not answer, giving up\r\n", fwupdate_tx_to_);
+      fwupdate_tx_state_ = FWTX_IDLE;
+      return;
+    }
+    fwupdate_send_begin();
+    return;
+  }
+
+  //ask the host for what fits into the window
+  while (fwupdate_tx_requested_ < fwupdate_tx_chunks_ && fwupdate_tx_requested_ < fwupdate_tx_base_ + FWUPDATE_WINDOW)
+  {
+    printf("U%04X\r\n", fwupdate_tx_requested_);
+    fwupdate_tx_requested_++;
+  }
+
+  //the whole window goes out back to back, PJON queues at most a few of it, so other frames do not wait long
+  while (fwupdate_tx_next_ < fwupdate_tx_fetched_ && fwupdate_tx_next_ < fwupdate_tx_base_ + FWUPDATE_WINDOW)
+  {
+    pjon_message_t msg;
+    msg.type = MSG_FWUPDATE_CHUNK;
+    msg.fwupdatechunk.session = fwupdate_tx_session_;
+    msg.fwupdatechunk.index = fwupdate_tx_next_;
+    memcpy(msg.fwupdatechunk.data, fwupdate_tx_buf_[fwupdate_tx_next_ % FWUPDATE_WINDOW], FWUPDATE_CHUNK_LEN);
+    if (!pjon_send_bulk(fwupdate_tx_to_, &msg))
+      break;
+    fwupdate_tx_next_++;
+  }
+
+  if (!pjon_time_reached(fwupdate_tx_due_))
+    return;
+  if (++fwupdate_tx_stalls_ >= FWUPDATE_MAX_STALLS)
+  {
+    printf("fwupdate: %d stuck at chunk %u, giving up\r\n", fwupdate_tx_to_, fwupdate_tx_base_);
+    fwupdate_tx_state_ = FWTX_IDLE;
+    return;
+  }
+  if (++fwupdate_tx_timeouts_ >= FWUPDATE_MAX_TIMEOUTS)
+  {
+    printf("fwupdate: no ack from %d, asking where to continue\r\n", fwupdate_tx_to_);
+    fwupdate_tx_begins_ = 0;
+    fwupdate_tx_state_ = FWTX_BEGIN;
+    fwupdate_send_begin();
+    return;
+  }
+  //go back to the oldest chunk not acked, and ask the host again for what it did not send
+  fwupdate_tx_resent_ += fwupdate_tx_next_ - fwupdate_tx_base_;
+  fwupdate_tx_next_ = fwupdate_tx_base_;
+  fwupdate_tx_requested_ = fwupdate_tx_fetched_;
+  fwupdate_tx_due_ = millis() + FWUPDATE_ACK_TIMEOUT_MS;
+}
+
+///////// target ///////////
+
+static void fwupdate_send_ack(uint8_t status)
+{
+  pjon_message_t msg;
+  msg.type = MSG_FWUPDATE_ACK;
+  msg.fwupdateack.pjon_id = pjon_device_id_;
+  msg.fwupdateack.session = fwupdate_rx_session_;
+  msg.fwupdateack.next = fwupdate_rx_next_;
+  msg.fwupdateack.status = status;
+  pjon_reply_msg(fwupdate_rx_reply_to_, &msg);
+}
+
+static void fwupdate_rx_fail(uint8_t status)
+{
+  printf("fwupdate: failed with status %d\r\n", status);
+  if (fwupdate_rx_state_ == FWRX_RECEIVING)
+  {
+    esp_ota_abort(fwupdate_rx_handle_);
+    mbedtls_sha256_free(&fwupdate_rx_sha_);
+  }
+  fwupdate_rx_state_ = FWRX_IDLE;
+  fwupdate_send_ack(status);
+}
+
+void fwupdate_handle_begin(fwupdatebegin_t *begin)
+{
+  bool same_image = fwupdate_rx_state_ != FWRX_IDLE && begin->size == fwupdate_rx_size_
+    && memcmp(begin->sha256, fwupdate_rx_sha256_, FWUPDATE_HASH_LEN) == 0;
+  fwupdate_rx_session_ = begin->session;
+  fwupdate_rx_reply_to_ = begin->reply_to;
+  fwupdate_rx_nacked_ = 0xFFFF;
+  if (same_image)
+  {
+    //resume where we are, or tell again that we are done
+    fwupdate_send_ack((fwupdate_rx_state_ == FWRX_DONE) ? FWUPDATE_DONE : FWUPDATE_RECEIVING);
+    return;
+  }
+  if (fwupdate_rx_state_ == FWRX_RECEIVING)
+  {
+    esp_ota_abort(fwupdate_rx_handle_);
+    mbedtls_sha256_free(&fwupdate_rx_sha_);
+  }
+  fwupdate_rx_state_ = FWRX_IDLE;
+  fwupdate_rx_next_ = 0;
+  fwupdate_rx_size_ = begin->size;
+  memcpy(fwupdate_rx_sha256_, begin->sha256, FWUPDATE_HASH_LEN);
+  fwupdate_rx_partition_ = esp_ota_get_next_update_partition(NULL);
+  if (!fwupdate_rx_partition_ || begin->size > fwupdate_rx_partition_->size)
+  {
+    fwupdate_rx_fail(FWUPDATE_TOO_BIG);
+    return;
+  }
+  //sequential writes: each flash sector is erased when the first chunk reaches it, instead of all of them now
+  if (esp_ota_begin(fwupdate_rx_partition_, OTA_WITH_SEQUENTIAL_WRITES, &fwupdate_rx_handle_) != ESP_OK)
+  {
+    fwupdate_rx_fail(FWUPDATE_FLASH_ERROR);
+    return;
+  }
+  mbedtls_sha256_init(&fwupdate_rx_sha_);
+  mbedtls_sha256_starts(&fwupdate_rx_sha_, 0);
+  fwupdate_rx_state_ = FWRX_RECEIVING;
+  printf("fwupdate: receiving %lu bytes from %d\r\n", (unsigned long) begin->size, begin->reply_to);
+  fwupdate_send_ack(FWUPDATE_RECEIVING);
+}
+
+static void fwupdate_rx_finish()
+{
+  uint8_t sha256[FWUPDATE_HASH_LEN];
+  mbedtls_sha256_finish(&fwupdate_rx_sha_, sha256);
+  mbedtls_sha256_free(&fwupdate_rx_sha_);
+  if (memcmp(sha256, fwupdate_rx_sha256_, FWUPDATE_HASH_LEN) != 0)
+  {
+    esp_ota_abort(fwupdate_rx_handle_);
+    fwupdate_rx_state_ = FWRX_IDLE;
+    printf("fwupdate: hash mismatch\r\n");
+    fwupdate_send_ack(FWUPDATE_HASH_MISMATCH);
+    return;
+  }
+  //esp_ota_end checks the image header and the checksum of the image itself
+  if (esp_ota_end(fwupdate_rx_handle_) != ESP_OK || esp_ota_set_boot_partition(fwupdate_rx_partition_) != ESP_OK)
+  {
+    fwupdate_rx_state_ = FWRX_IDLE;
+    printf("fwupdate: image rejected\r\n");
+    fwupdate_send_ack(FWUPDATE_FLASH_ERROR);
+    return;
+  }
+  fwupdate_rx_state_ = FWRX_DONE;
+  fwupdate_rx_done_ms_ = millis();
+  printf("fwupdate: done, booting the new image\r\n");
+  fwupdate_send_ack(FWUPDATE_DONE);
+}
+
+void fwupdate_handle_chunk(fwupdatechunk_t *chunk)
+{
+  if (fwupdate_rx_state_ == FWRX_IDLE || chunk->session != fwupdate_rx_session_)
+    return;
+  if (fwupdate_rx_state_ == FWRX_DONE || chunk->index != fwupdate_rx_next_)
+  {
+    //a gap: ask for the chunk we miss. A duplicate: our ack got lost, repeat it. Once per chunk is enough.
+    if (fwupdate_rx_nacked_ == fwupdate_rx_next_ && millis() - fwupdate_rx_nacked_ms_ < FWUPDATE_NACK_INTERVAL_MS)
+      return;
+    fwupdate_rx_nacked_ = fwupdate_rx_next_;
+    fwupdate_rx_nacked_ms_ = millis();
+    if (fwupdate_rx_state_ == FWRX_DONE)
+      fwupdate_send_ack(FWUPDATE_DONE);
+    else
+      fwupdate_send_ack((chunk->index > fwupdate_rx_next_) ? FWUPDATE_GAP : FWUPDATE_RECEIVING);
+    return;
+  }
+  uint32_t offset = (uint32_t) chunk->index * FWUPDATE_CHUNK_LEN;
+  uint32_t len = fwupdate_rx_size_ - offset;
+  if (len > FWUPDATE_CHUNK_LEN)
+    len = FWUPDATE_CHUNK_LEN;
+  if (esp_ota_write(fwupdate_rx_handle_, chunk->data, len) != ESP_OK)
+  {
+    fwupdate_rx_fail(FWUPDATE_FLASH_ERROR);
+    return;
+  }
+  mbedtls_sha256_update(&fwupdate_rx_sha_, chunk->data, len);
+  fwupdate_rx_next_++;
+  if (fwupdate_rx_next_ == fwupdate_num_chunks(fwupdate_rx_size_))
+    fwupdate_rx_finish();
+  else if (fwupdate_rx_next_ % FWUPDATE_ACK_EVERY == 0)
+    fwupdate_send_ack(FWUPDATE_RECEIVING);
+}
+
+bool fwupdate_is_idle()
+{
+  return fwupdate_tx_state_ == FWTX_IDLE && fwupdate_rx_state_ != FWRX_RECEIVING;
+}
+
+//as the bridge, the console only takes chunks meanwhile
+bool fwupdate_is_sending()
+{
+  return fwupdate_tx_state_ != FWTX_IDLE;
+}
+
+void task_fwupdate()
+{
+  if (fwupdate_tx_state_ != FWTX_IDLE)
+    task_fwupdate_send();
+  //give the DONE ack time to leave, and do not cut off a damper on its way
+  if (fwupdate_rx_state_ == FWRX_DONE && millis() - fwupdate_rx_done_ms_ > FWUPDATE_RESTART_DELAY_MS
+      && !damper_outputs_ && pjon_is_idle())
+    esp_restart();
+}
@@ -0,0 +1,298 @@
+/*
+ *  Damper Control Firmware - Pressure History
+ *
+ *  Keeps a tiered history of the pressure readings and hands it out over PJON.
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "Arduino.h"
+#include "dampercontrol.h"
+
+///////// Pressure History ///////////////
+//Every pressure reading (PRESSURE_CHECK_INTERVAL_MS) goes into three rings in PSRAM, one per resolution:
+//  HISTORY_RAW      1s slots, average of the readings            30 minutes
+//  HISTORY_MINUTE   1min slots, min/avg/max                      48 hours
+//  HISTORY_QUARTER  15min slots, min/avg/max                     30 days
+//Slots are numbered by uptime (slot i covers i*period .. (i+1)*period), so no timestamps are stored.
+//A slot without readings (sensor missing) is kept as HISTORY_NO_DATA.
+//
+//The host fills the gaps in its telemetry with MSG_HISTORY_REQUEST (over PJON or injected with '>'),
+//we answer with MSG_HISTORY_BLOCK frames, paced so they do not crowd out commands (pjon_send_bulk).
+//Values in a block are coded as varints (7 bits per byte, low bits first, bit 7: more to come):
+//  raw:        zigzag(avg - previous avg) << 1
+//  min/avg/max: the same for avg, then avg - min, then max - avg
+//  no data:    0x01
+//the previous avg of the first slot in a block is 0, so every block can be decoded on its own.
+
+#define HISTORY_NO_DATA INT32_MIN
+//a varint of an int32 takes up to 5 bytes
+#define HISTORY_MAX_SLOT_LEN 15
+
+typedef struct {
+  uint32_t period_ms;
+  uint16_t len; // slots kept per sensor
+  uint8_t fields; // 1: avg, 3: min, avg, max
+  int32_t *buf; // [sensor][slot % len][field]
+  uint32_t next; // slot that is being filled, all below are done
+  //readings of slot next
+  int64_t sum[NUM_DAMPER];
+  uint16_t num[NUM_DAMPER];
+  int32_t min[NUM_DAMPER];
+  int32_t max[NUM_DAMPER];
+} historytier_t;
+
+historytier_t history_tiers_[HISTORY_NUM_TIERS] = {
+  {1000, 1800, 1, 0, 0, {0}, {0}, {0}, {0}},
+  {60000, 2880, 3, 0, 0, {0}, {0}, {0}, {0}},
+  {900000, 2880, 3, 0, 0, {0}, {0}, {0}, {0}},
+};
+bool history_enabled_ = false;
+
+//the range query being answered
+bool history_q_active_ = false;
+uint8_t history_q_reply_to_ = 0;
+uint8_t history_q_sensorid_ = 0;
+uint8_t history_q_tier_ = 0;
+uint32_t history_q_next_ = 0;
+uint32_t history_q_end_ = 0;
+
+static int32_t *history_slot(historytier_t *t, uint8_t sensorid, uint32_t slot)
+{
+  return t->buf + ((uint32_t) sensorid * t->len + slot % t->len) * t->fields;
+}
+
+static void history_clear_readings(historytier_t *t)
+{
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    t->sum[d] = 0;
+    t->num[d] = 0;
+  }
+}
+
+void history_init()
+{
+  //nodes of the host simulator are booted again and again, they keep their rings
+  for (uint8_t ti=0; ti<HISTORY_NUM_TIERS; ti++)
+  {
+    historytier_t *t = &history_tiers_[ti];
+    size_t size = (size_t) NUM_DAMPER * t->len * t->fields * sizeof(int32_t);
+    if (!t->buf)
+      t->buf = (int32_t*) ps_malloc(size);
+    if (!t->buf)
+    {
+      printf("history: no PSRAM for %u bytes, disabled\r\n", (unsigned) size);
+      return;
+    }
+    for (uint32_t i=0; i<(uint32_t) NUM_DAMPER * t->len * t->fields; i++)
+      t->buf[i] = HISTORY_NO_DATA;
+    t->next = millis() / t->period_ms;
+    history_clear_readings(t);
+  }
+  history_enabled_ = true;
+}
+
+//close slot t->next and the empty ones up to now
+static void history_close_slots(historytier_t *t, uint32_t now_slot)
+{
+  //millis() wrapped after 49 days, start over
+  if (now_slot < t->next)
+  {
+    for (uint32_t i=0; i<(uint32_t) NUM_DAMPER * t->len * t->fields; i++)
+      t->buf[i] = HISTORY_NO_DATA;
+    t->next = now_slot;
+    history_clear_readings(t);
+    return;
+  }
+  //a slot is only ever closed once, skipped ones of a long gap are written NO_DATA at most t->len times
+  if (now_slot - t->next > t->len)
+    t->next = now_slot - t->len;
+  for (; t->next < now_slot; t->next++)
+  {
+    for (uint8_t d=0; d<NUM_DAMPER; d++)
+    {
+      int32_t *s = history_slot(t, d, t->next);
+      if (t->num[d] == 0)
+      {
+        for (uint8_t f=0; f<t->fields; f++)
+          s[f] = HISTORY_NO_DATA;
+        continue;
+      }
+      int32_t avg = (int32_t) (t->sum[d] / t->num[d]);
+      if (t->fields == 1)
+      {
+        s[0] = avg;
+      } else {
+        s[0] = t->min[d];
+        s[1] = avg;
+        s[2] = t->max[d];
+      }
+    }
+    history_clear_readings(t);
+  }
+}
+
+//called after every task_check_pressure
+void history_record()
+{
+  if (!history_enabled_)
+    return;
+  uint32_t now = millis();
+  for (uint8_t ti=0; ti<HISTORY_NUM_TIERS; ti++)
+  {
+    historytier_t *t = &history_tiers_[ti];
+    history_close_slots(t, now / t->period_ms);
+    for (uint8_t d=0; d<NUM_DAMPER; d++)
+    {
+      if (!sensor_installed_[d])
+        continue;
+      int32_t v = (int32_t) (get_latest_pressure(d) * 10.0f + 0.5f);
+      if (t->num[d] == 0 || v < t->min[d])
+        t->min[d] = v;
+      if (t->num[d] == 0 || v > t->max[d])
+        t->max[d] = v;
+      //sum and num stop together, or the average of the slot would drift off
+      if (t->num[d] < 0xFFFF)
+      {
+        t->sum[d] += v;
+        t->num[d]++;
+      }
+    }
+  }
+}
+
+static uint8_t history_put_varint(uint8_t *buf, uint32_t v)
+{
+  uint8_t len = 0;
+  do {
+    buf[len] = v & 0x7F;
+    v >>= 7;
+    if (v)
+      buf[len] |= 0x80;
+    len++;
+  } while (v);
+  return len;
+}
+
+static uint32_t history_zigzag(int32_t v)
+{
+  return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+//code one slot after the one with average *prev into buf, returns the length
+static uint8_t history_encode_slot(uint8_t *buf, const int32_t *s, uint8_t fields, int32_t *prev)
+{
+  const int32_t avg = s[(fields == 1) ? 0 : 1];
+  if (avg == HISTORY_NO_DATA)
+  {
+    buf[0] = 0x01;
+    return 1;
+  }
+  uint8_t len = history_put_varint(buf, history_zigzag(avg - *prev) << 1);
+  *prev = avg;
+  if (fields == 3)
+  {
+    len += history_put_varint(buf + len, (uint32_t) (avg - s[0]));
+    len += history_put_varint(buf + len, (uint32_t) (s[2] - avg));
+  }
+  return len;
+}
+
+void history_handle_request(historyrequest_t *req)
+{
+  if (!history_enabled_ || req->sensorid >= NUM_DAMPER || req->tier >= HISTORY_NUM_TIERS)
+  {
+    printf("history: can not answer sensor %d tier %d\r\n", req->sensorid, req->tier);
+    return;
+  }
+  historytier_t *t = &history_tiers_[req->tier];
+  uint32_t oldest = (t->next > t->len) ? t->next - t->len : 0;
+  //a newer request replaces the one we are still answering, the host asks again for what it misses
+  history_q_active_ = true;
+  history_q_reply_to_ = req->reply_to;
+  history_q_sensorid_ = req->sensorid;
+  history_q_tier_ = req->tier;
+  history_q_next_ = (req->from < oldest) ? oldest : req->from;
+  //from + count may not fit into 32 bits, so compare count with what is left after from
+  history_q_end_ = (req->count == 0 || req->from >= t->next || req->count > t->next - req->from) ? t->next : req->from + req->count;
+  if (history_q_next_ > history_q_end_)
+    history_q_next_ = history_q_end_;
+}
+
+bool history_is_idle()
+{
+  return !history_q_active_;
+}
+
+//send the next block of the range query, once PJON has room for it
+void task_history()
+{
+  if (!history_q_active_)
+    return;
+  historytier_t *t = &history_tiers_[history_q_tier_];
+  pjon_message_t msg;
+  msg.type = MSG_HISTORY_BLOCK;
+  msg.historyblock.pjon_id = pjon_device_id_;
+  msg.historyblock.sensorid = history_q_sensorid_;
+  msg.historyblock.tier = history_q_tier_;
+  msg.historyblock.first = history_q_next_;
+  msg.historyblock.count = 0;
+  msg.historyblock.len = 0;
+  int32_t prev = 0;
+  uint32_t slot = history_q_next_;
+  //slots that fell out of the ring while we were sending are gone
+  if (t->next > t->len && slot < t->next - t->len)
+    slot = msg.historyblock.first = t->next - t->len;
+  while (slot < history_q_end_ && msg.historyblock.count < 0xFF)
+  {
+    uint8_t coded[HISTORY_MAX_SLOT_LEN];
+    int32_t p = prev;
+    uint8_t len = history_encode_slot(coded, history_slot(t, history_q_sensorid_, slot), t->fields, &p);
+    if (msg.historyblock.len + len > HISTORY_BLOCK_DATA_LEN)
+      break;
+    memcpy(msg.historyblock.data + msg.historyblock.len, coded, len);
+    msg.historyblock.len += len;
+    msg.historyblock.count++;
+    prev = p;
+    slot++;
+  }
+  memset(msg.historyblock.data + msg.historyblock.len, 0, HISTORY_BLOCK_DATA_LEN - msg.historyblock.len);
+
+  if (history_q_reply_to_ == pjon_device_id_)
+    pjon_reply_msg(history_q_reply_to_, &msg);
+  else if (!pjon_send_bulk(history_q_reply_to_, &msg))
+    return; //try again next loop
+  history_q_next_ = slot;
+  //the empty block at the end tells the host it has everything
+  if (msg.historyblock.count == 0)
+    history_q_active_ = false;
+}
+
+void history_print_info()
+{
+  if (!history_enabled_)
+  {
+    printf("History: disabled\r\n");
+    return;
+  }
+  for (uint8_t ti=0; ti<HISTORY_NUM_TIERS; ti++)
+  {
+    historytier_t *t = &history_tiers_[ti];
+    printf("History tier %d: %lus slots, next %lu, keeps %u\r\n", ti, (unsigned long) (t->period_ms / 1000), (unsigned long) t->next, t->len);
+  }
+}
@@ -0,0 +1,227 @@
+/*
+ *  Damper Control Firmware - Link Stats
+ *
+ *  Counts what happens on the link to every PJON peer.
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "Arduino.h"
+#include "dampercontrol.h"
+
+///////// Link Stats ///////////////
+//For every peer we talk to or hear from, count what happens on the link, so the host sees
+//which cable segment or µC degrades before commands start failing:
+//  sent, full     frames queued for the peer / refused or dropped, our outbox or the PJON buffer was full
+//  lost           frames PJON gave up on after its retries (CONNECTION_LOST)
+//  retries, rtt   chaincast hops sent again / round trip times of the hop acks (Karn: first tries only).
+//                 PJON does not tell us about its own retries or acks, the hop acks are the round trips we see.
+//  heard          frames from the peer, as far as the msg tells us its sender (pjon_msg_sender)
+//
+//MSG_LINKSTATS_REQUEST is answered with one MSG_LINKSTATS per peer, paced like the history (pjon_send_bulk).
+//Every LINKSTATS_PUSH_INTERVAL_MS the peers that changed are pushed to pjon_sensor_destination_id_ unasked.
+
+#define LINKSTATS_PEERS 8
+#define LINKSTATS_PUSH_INTERVAL_MS 300000
+#define LINKSTATS_NEVER 0xFFFF
+
+typedef struct {
+  uint8_t id; // 0: unused
+  bool changed; // since the last push
+  bool heard;
+  uint32_t last_heard_ms;
+  uint32_t last_active_ms; // the quietest peer makes room when the table is full
+  linkstats_t stats;
+} linkpeer_t;
+
+linkpeer_t linkstats_peers_[LINKSTATS_PEERS];
+uint32_t linkstats_memory_full_ = 0;
+uint32_t linkstats_push_due_ = LINKSTATS_PUSH_INTERVAL_MS;
+
+//peers still to be sent, bit i: linkstats_peers_[i]
+uint8_t linkstats_q_slots_ = 0;
+uint8_t linkstats_q_reply_to_ = 0;
+bool linkstats_q_push_ = false;
+
+static linkpeer_t *linkstats_peer(uint8_t id)
+{
+  if (id == PJON_ID_BROADCAST || id == PJON_ID_NOT_ASSIGNED || id == pjon_device_id_)
+    return 0;
+  linkpeer_t *slot = &linkstats_peers_[0];
+  for (uint8_t i=0; i<LINKSTATS_PEERS; i++)
+  {
+    linkpeer_t *p = &linkstats_peers_[i];
+    if (p->id == id)
+    {
+      p->changed = true;
+      p->last_active_ms = millis();
+      return p;
+    }
+    if (slot->id != 0 && (p->id == 0 || (int32_t) (p->last_active_ms - slot->last_active_ms) < 0))
+      slot = p;
+  }
+  linkstats_q_slots_ &= ~_BV((uint8_t) (slot - linkstats_peers_));
+  memset(slot, 0, sizeof(linkpeer_t));
+  slot->id = id;
+  slot->changed = true;
+  slot->last_active_ms = millis();
+  return slot;
+}
+
+void linkstats_note_send(uint8_t peer, bool queued)
+{
+  linkpeer_t *p = linkstats_peer(peer);
+  if (!p)
+    return;
+  if (queued)
+    p->stats.sent++;
+  else
+    p->stats.full++;
+}
+
+void linkstats_note_lost(uint8_t peer)
+{
+  linkpeer_t *p = linkstats_peer(peer);
+  if (p)
+    p->stats.lost++;
+}
+
+void linkstats_note_retry(uint8_t peer)
+{
+  linkpeer_t *p = linkstats_peer(peer);
+  if (p)
+    p->stats.retries++;
+}
+
+void linkstats_note_heard(uint8_t peer)
+{
+  linkpeer_t *p = linkstats_peer(peer);
+  if (!p)
+    return;
+  p->stats.heard++;
+  p->heard = true;
+  p->last_heard_ms = millis();
+}
+
+//bucket b counts round trips below 16ms << b, the last one everything longer
+void linkstats_note_rtt(uint8_t peer, uint32_t rtt_ms)
+{
+  linkpeer_t *p = linkstats_peer(peer);
+  if (!p)
+    return;
+  uint8_t b = 0;
+  for (uint32_t t = rtt_ms >> 4; t > 0 && b < LINKSTATS_RTT_BUCKETS - 1; t >>= 1)
+    b++;
+  p->stats.rtt_hist[b]++;
+}
+
+void linkstats_note_memory_full()
+{
+  linkstats_memory_full_++;
+}
+
+static uint16_t linkstats_last_heard_s(linkpeer_t *p)
+{
+  if (!p->heard)
+    return LINKSTATS_NEVER;
+  uint32_t s = (millis() - p->last_heard_ms) / 1000;
+  return (s < LINKSTATS_NEVER) ? s : LINKSTATS_NEVER;
+}
+
+void linkstats_handle_request(linkstatsrequest_t *req)
+{
+  uint8_t slots = 0;
+  for (uint8_t i=0; i<LINKSTATS_PEERS; i++)
+    if (linkstats_peers_[i].id != 0 && (req->peer == 0 || linkstats_peers_[i].id == req->peer))
+      slots |= _BV(i);
+  if (!slots)
+  {
+    printf("linkstats: nothing known about %d\r\n", req->peer);
+    return;
+  }
+  //an unfinished push goes out again with the next one
+  if (linkstats_q_push_)
+    for (uint8_t i=0; i<LINKSTATS_PEERS; i++)
+      if (linkstats_q_slots_ & _BV(i))
+        linkstats_peers_[i].changed = true;
+  linkstats_q_slots_ = slots;
+  linkstats_q_reply_to_ = req->reply_to;
+  linkstats_q_push_ = false;
+}
+
+bool linkstats_is_idle()
+{
+  return linkstats_q_slots_ == 0;
+}
+
+void task_linkstats()
+{
+  if (!linkstats_q_slots_ && pjon_time_reached(linkstats_push_due_))
+  {
+    linkstats_push_due_ = millis() + LINKSTATS_PUSH_INTERVAL_MS;
+    for (uint8_t i=0; i<LINKSTATS_PEERS; i++)
+    {
+      if (linkstats_peers_[i].id != 0 && linkstats_peers_[i].changed)
+      {
+        linkstats_q_slots_ |= _BV(i);
+        linkstats_peers_[i].changed = false;
+      }
+    }
+    linkstats_q_reply_to_ = pjon_sensor_destination_id_;
+    linkstats_q_push_ = true;
+  }
+  if (!linkstats_q_slots_)
+    return;
+  uint8_t i = 0;
+  while (!(linkstats_q_slots_ & _BV(i)))
+    i++;
+  linkpeer_t *p = &linkstats_peers_[i];
+  pjon_message_t msg;
+  msg.type = MSG_LINKSTATS;
+  msg.linkstats = p->stats;
+  msg.linkstats.pjon_id = pjon_device_id_;
+  msg.linkstats.peer = p->id;
+  msg.linkstats.last_heard_s = linkstats_last_heard_s(p);
+
+  if (linkstats_q_reply_to_ == pjon_device_id_)
+    pjon_print_msg(linkstats_q_reply_to_, &msg);
+  else if (!pjon_send_bulk(linkstats_q_reply_to_, &msg))
+    return; //try again next loop
+  else if (linkstats_q_reply_to_ == PJON_ID_BROADCAST)
+    pjon_print_msg(PJON_ID_BROADCAST, &msg); //for the host on our console too
+  linkstats_q_slots_ &= ~_BV(i);
+}
+
+void linkstats_print_info()
+{
+  for (uint8_t i=0; i<LINKSTATS_PEERS; i++)
+  {
+    linkpeer_t *p = &linkstats_peers_[i];
+    if (p->id == 0)
+      continue;
+    printf("Link to %d: sent %u, full %u, lost %u, retries %u, heard %u", p->id,
+      p->stats.sent, p->stats.full, p->stats.lost, p->stats.retries, p->stats.heard);
+    if (p->heard)
+      printf(" %lus ago", (unsigned long) ((millis() - p->last_heard_ms) / 1000));
+    printf(", rtt");
+    for (uint8_t b=0; b<LINKSTATS_RTT_BUCKETS; b++)
+      printf(" %u", p->stats.rtt_hist[b]);
+    printf("\r\n");
+  }
+  if (linkstats_memory_full_)
+    printf("PJON out of memory: %lu\r\n", (unsigned long) linkstats_memory_full_);
+}
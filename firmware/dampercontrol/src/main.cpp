@@ -21,10 +21,21 @@
 */
 
 #include <stdint.h>
+#include "Arduino.h"
 #include "dampercontrol.h"
 #include <math.h>
 #include <EEPROM.h>
 #include <vector>
+#include "soc/soc.h"
+#include "soc/gpio_reg.h"
+#if IDLE_SLEEP
+#include "esp_sleep.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+#endif
+#if ENDSTOP_PCNT
+#include "driver/pcnt.h"
+#endif
 
 
 
@@ -33,6 +44,7 @@
 //               100 should be open
 //               if we go over 110 without the photoelectric fork sensor signaling us, we raise an error
 //   we start at 1 in order to seek the 0 position at startup via the endstop
+//   unless initDamperStatesFromEEPROM() finds a trustworthy saved position
 uint8_t damper_states_[NUM_DAMPER] = {1,1,1};
 
 //damper target states: the state that damper states is supposed to reach
@@ -40,12 +52,78 @@ uint8_t damper_target_states_[NUM_DAMPER] = {0,0,0};
 
 bool damper_state_overflowed_[NUM_DAMPER] = {false,false,false};
 
+//bit d set if damper d timed out, cleared once it passes its endstop again
+uint8_t damper_error_flags_ = 0;
+
 uint8_t fan_target_state_ = FAN_OFF;
 uint8_t fanlamina_target_state_ = FAN_OFF;
 
+//bit d set while motor d runs, only written by damper_outputs_write from the tick
+volatile uint8_t damper_outputs_ = 0;
+//pins of the damper motors, for every combination of motors (bit d of the index: motor d)
+#if NUM_DAMPER != 3
+  #error "Code assumes NUM_DAMPER == 3. Extend damper_pinmask_"
+#endif
+#define DAMPER_PINMASK(run) ((((run) & _BV(0)) ? OUTPUT_PINMASK(PIN_DAMPER_0) : 0) \
+  | (((run) & _BV(1)) ? OUTPUT_PINMASK(PIN_DAMPER_1) : 0) | (((run) & _BV(2)) ? OUTPUT_PINMASK(PIN_DAMPER_2) : 0))
+static const uint32_t damper_pinmask_[1 << NUM_DAMPER] = {DAMPER_PINMASK(0), DAMPER_PINMASK(1), DAMPER_PINMASK(2),
+  DAMPER_PINMASK(3), DAMPER_PINMASK(4), DAMPER_PINMASK(5), DAMPER_PINMASK(6), DAMPER_PINMASK(7)};
+//only written by fan_output_write from the loop
+bool fan_output_ = false;
+
 // ISR sets true if photoelectric fork x went low
 bool damper_endstop_reached_[NUM_DAMPER];
 
+#if ENDSTOP_PCNT
+//PCNT counter values seen by the last tick
+int16_t endstop_pcnt_count_[NUM_DAMPER] = {0,0,0};
+//ticks the lightbeam has passed through the slot since the last falling edge, 0: no edge waiting for ENDSTOP_PASS_TICKS
+uint8_t endstop_pass_ticks_[NUM_DAMPER] = {0,0,0};
+//endstop pulses that were over before ENDSTOP_PASS_TICKS, e.g. the ceiling light flashing into the lightbeam
+uint16_t endstop_glitches_[NUM_DAMPER] = {0,0,0};
+#endif
+
+//what we last wrote to EEPROM, so we only write if something changed
+uint8_t damper_persisted_marker_ = 0;
+uint8_t damper_persisted_states_[NUM_DAMPER] = {0,0,0};
+//whether all dampers stand still, and since when (millis())
+bool damper_still_ = false;
+uint32_t damper_still_since_ms_ = 0;
+//damper positions are saved once all dampers stood still this long, see task_persist_damper_states
+#define DAMPER_PERSIST_STILL_MS 10000
+
+//millis() at which all dampers first reached their target after boot, 0 while not yet ready
+uint32_t boot_ready_ms_ = 0;
+
+//set by task_control_dampers to the position counter a damper had when it passed its endstop
+//picked up and reset to 0 by task_detect_events
+uint8_t damper_resync_from_[NUM_DAMPER] = {0,0,0};
+//counters below this just mean the damper started moving inside the endstop slot
+#define EVENT_RESYNC_MIN_COUNT 8
+
+#if IDLE_SLEEP
+//millis() of the last frame, console byte or moving damper/fan
+uint32_t idle_last_activity_ms_ = 0;
+//set before going to sleep, so the next loop knows it just woke up
+bool idle_slept_ = false;
+uint32_t idle_sleeps_ = 0;
+//after a uart wakeup: console bytes are dropped until none came for IDLE_CONSOLE_QUIET_MS since idle_console_quiet_ms_
+bool idle_console_resync_ = false;
+uint32_t idle_console_quiet_ms_ = 0;
+uint32_t idle_console_dropped_ = 0;
+#endif
+
+//millis() of the last pressure sensor check and report
+uint32_t pressure_checked_ms_ = 0;
+uint32_t pressure_checked_us_ = 0; //micros() of the last reading, for its bus time
+uint32_t pressure_reported_ms_ = 0;
+
+//what task_detect_events saw last time, so it only reports transitions
+bool event_damper_reached_[NUM_DAMPER] = {false,false,false};
+bool event_fan_running_ = false;
+bool event_fanlamina_running_ = false;
+bool event_sensor_installed_[NUM_DAMPER] = {false,false,false};
+
 ////// HELPER FUNCTIONS //////
 
 void initSysClkTimer3(void)
@@ -64,10 +142,36 @@ void initSysClkTimer3(void)
 
 void initPCInterrupt(void)
 {
+#if ENDSTOP_PCNT
+  //the falling edges (lightbeam passes through the disk slot) are counted in hardware, no cpu time per edge
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    pcnt_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.pulse_gpio_num = PIN_ENDSTOP_0 + d;
+    cfg.ctrl_gpio_num = PCNT_PIN_NOT_USED;
+    cfg.lctrl_mode = PCNT_MODE_KEEP;
+    cfg.hctrl_mode = PCNT_MODE_KEEP;
+    cfg.pos_mode = PCNT_COUNT_DIS;
+    cfg.neg_mode = PCNT_COUNT_INC;
+    cfg.counter_h_lim = 0x7FFF;
+    cfg.counter_l_lim = 0;
+    cfg.unit = (pcnt_unit_t) (PCNT_UNIT_0 + d);
+    cfg.channel = PCNT_CHANNEL_0;
+    pcnt_unit_config(&cfg);
+    pcnt_set_filter_value(cfg.unit, ENDSTOP_PCNT_FILTER);
+    pcnt_filter_enable(cfg.unit);
+    pcnt_counter_pause(cfg.unit);
+    pcnt_counter_clear(cfg.unit);
+    pcnt_counter_resume(cfg.unit);
+    endstop_pcnt_count_[d] = 0;
+  }
+#else
   // //enable PinChange Interrupt
   // PCICR = _BV(PCIE0);
   // //set up Endstop PinChange Interrupts toggle interrupt
   // PCMSK0 = (1<<PCINT4) | (1<<PCINT5) | (1<<PCINT6);
+#endif
 }
 
 void initPINs()
@@ -86,32 +190,43 @@ void initPINs()
   PINMODE_OUTPUT(REG_DAMPER_2,PIN_DAMPER_1);
   PINMODE_OUTPUT(REG_DAMPER_2,PIN_DAMPER_2);
   //PD3 is pjon, maybe it can use the INT4 someday
-  DAMPER_MOTOR_STOP(0);
-  DAMPER_MOTOR_STOP(1);
-  DAMPER_MOTOR_STOP(2);
+  OUTPUT_CLEAR(PIN_DAMPER_0, damper_pinmask_[(1 << NUM_DAMPER) - 1]);
+  damper_outputs_ = 0;
   PINMODE_OUTPUT(REG_FAN,PIN_FAN); //FAN
-  FAN_STOP;
+  OUTPUT_SET(PIN_FAN, OUTPUT_PINMASK(PIN_FAN));
+  fan_output_ = false;
 }
 
-/*
-//Bad Idea
-void initGuessPositionFromEndstop()
+//Restore damper positions saved by task_persist_damper_states()
+//
+//Guessing the position from the endstop alone was a bad idea, since we never really stop exactly at the endstop.
+//But if we know we stood still at a saved position when we lost power, the endstop can tell us whether that still holds:
+// saved position 0 -> lightbeam must pass through the disk slot (endstop low)
+// saved position >0 -> lightbeam must be interrupted by the disk (endstop high)
+//Dampers that fail this check are homed as before.
+//Note that there is a short window between a new target being set by the ISR and task_persist_damper_states() noting it.
+//A reset in that window restores a position a few ticks off, which gets corrected the next time we pass the endstop.
+void initDamperStatesFromEEPROM()
 {
-  _delay_ms(50); // give Endstop Pins time to settle
+  uint8_t saved_states[NUM_DAMPER];
+  uint8_t marker = loadDamperStatesFromEEPROM(saved_states);
+  delay(5); // give Endstop Pins time to settle
   for (uint8_t d=0; d<NUM_DAMPER; d++)
   {
     damper_endstop_reached_[d] = false;
-    if (ENDSTOP_ISHIGH(d))
+    if (marker != DAMPERSTATE_SETTLED || !damper_installed_[d])
+      continue;
+    if ((saved_states[d] == 0) == (ENDSTOP_ISHIGH(d)))
     {
-      //if not at endstop on boot, assume we are open
-      damper_states_[d] = damper_open_pos_[d];
-      damper_target_states_[d] = damper_open_pos_[d];
-    } else {
-      damper_states_[d] = 0;
-      damper_target_states_[d] = 0;
+      printf("Damper%d: saved pos %d does not match endstop, homing\r\n", d, saved_states[d]);
+      continue;
     }
+    damper_states_[d] = saved_states[d];
+    damper_target_states_[d] = saved_states[d];
   }
-}*/
+  damper_persisted_marker_ = marker;
+  memcpy(damper_persisted_states_, saved_states, NUM_DAMPER);
+}
 
 //note includes simulated not-installed dampers
 bool are_all_dampers_closed()
@@ -195,6 +310,56 @@ void handle_damper_cmd(bool didreachall, dampercmd_t *rxmsg)
   }
 }
 
+///////// Room Interlock ///////////
+//A damper that was opened in one room can only be closed from that room. Every damper command says
+//which room it comes from (dampercmd_t.room), and the µC of a damper remembers the room that opened it
+//in damper_room_ until it is closed again. A command from another room that would close the damper
+//(or open it less) is rejected right here, on the µC, whatever the host made of it:
+//the damper keeps its target, and we write that back into the command, so the µC after us and the
+//way back down do the same. A rejected command also keeps the fan on, the fan is only switched
+//once all dampers have seen the command (didreachall). The origin gets a MSG_ERROR INTERLOCK_REJECTED.
+//A damper opened without a room (0, the console) can be closed by anyone. Rooms are not kept over a reboot.
+uint8_t damper_room_[NUM_DAMPER] = {0};
+uint16_t interlock_rejects_ = 0;
+
+static uint8_t damper_target_for_cmd(uint8_t d, uint8_t cmd)
+{
+  switch(cmd)
+  {
+    case DAMPER_OPEN: return damper_open_pos_[d];
+    case DAMPER_HALFOPEN: return damper_open_pos_[d] / 2;
+    default: return 0;
+  }
+}
+
+//called before handle_damper_cmd, on both passes. Returns a bitfield of the dampers it kept open
+uint8_t interlock_check_dampercmd(dampercmd_t *cmd)
+{
+  uint8_t rejected = 0;
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    if (!damper_installed_[d])
+      continue;
+    uint8_t target = damper_target_for_cmd(d, cmd->damper[d]);
+    if (target < damper_target_states_[d] && damper_room_[d] != 0 && cmd->room != damper_room_[d])
+    {
+      cmd->damper[d] = (damper_target_states_[d] == damper_target_for_cmd(d, DAMPER_HALFOPEN)) ? DAMPER_HALFOPEN : DAMPER_OPEN;
+      rejected |= _BV(d);
+      continue;
+    }
+    if (target == 0)
+      damper_room_[d] = 0;
+    else if (damper_room_[d] == 0)
+      damper_room_[d] = cmd->room;
+  }
+  if (rejected)
+  {
+    cmd->fan = FAN_ON;
+    interlock_rejects_++;
+  }
+  return rejected;
+}
+
 
 ///////////////// Serial Interface and Debugging Code ////////////////////
 
@@ -203,122 +368,295 @@ void printSettings()
   printf("=== State ===\r\n");
   printf("PJON device id: %d\r\n", pjon_device_id_);
   printf("PJON sensor destid: %d\r\n", pjon_sensor_destination_id_);
+  printf("Site config: v%u, hash %08lx\r\n", config_version_, (unsigned long) config_hash_);
   printf("#Dampers: %d\r\n", NUM_DAMPER);
   for (uint8_t d=0; d<NUM_DAMPER; d++) {
     printf("Damper%d: %s installed\r\n", d, (damper_installed_[d])?"is":"NOT");
-    printf("\t pos: consid. open at: %d, current: %d, target: %d\r\n", damper_open_pos_[d],damper_states_[d],damper_target_states_[d]);
+    printf("\t pos: consid. open at: %d, current: %d, target: %d, room: %d\r\n", damper_open_pos_[d],damper_states_[d],damper_target_states_[d],damper_room_[d]);
     printf("\t endstop lightbeam: %s\r\n", (ENDSTOP_ISHIGH(d))?"interrupted":"uninterrupted");
+#if ENDSTOP_PCNT
+    printf("\t endstop flashes ignored: %u\r\n", endstop_glitches_[d]);
+#endif
     printf("Pressure Sensor%d: %s installed\r\n", d, (sensor_installed_[d])?"is":"NOT");
     if (sensor_installed_[d])
     {
       printf("\t Pressure: %.2f Pa @ %.2f degC\r\n", (double) get_latest_pressure(d), (double) get_latest_temperature(d));
     }
   }
+  printf("Boot to ready: %lu ms\r\n", (unsigned long) boot_ready_ms_);
+  pjon_outbox_print_info();
+  pjon_rx_print_info();
+  presets_print_info();
+  pressuresig_print_info();
+  history_print_info();
+  timesync_print_info();
+  linkstats_print_info();
+#if IDLE_SLEEP
+  printf("Idle sleep: %s, %lu sleeps, %lu console bytes dropped on wakeup\r\n", (idle_sleep_enabled_)?"on":"off",
+    (unsigned long) idle_sleeps_, (unsigned long) idle_console_dropped_);
+#endif
   printf("Fan Main is %s and set to %d\r\n", (FAN_ISRUNNING)?"on":"off", fan_target_state_);
   printf("Fan Laminaflow is %s and set to %d\r\n", (FAN_ISRUNNING)?"on":"off", fanlamina_target_state_);
+  printf("Interlock: %u closes rejected\r\n", interlock_rejects_);
+}
+
+//binary counterpart of printSettings(), sent as MSG_STATUS
+void fillStatusInfo(statusinfo_t *s)
+{
+  s->pjon_id = pjon_device_id_;
+  s->installed = 0;
+  s->endstops = 0;
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    s->damper_pos[d] = damper_states_[d];
+    s->damper_target[d] = damper_target_states_[d];
+    if (damper_installed_[d])
+      s->installed |= _BV(d);
+    if (sensor_installed_[d])
+      s->installed |= _BV(d) << 4;
+    if (ENDSTOP_ISHIGH(d))
+      s->endstops |= _BV(d);
+    s->pascal[d] = (sensor_installed_[d]) ? get_latest_pressure(d) : 0.0;
+  }
+  s->fan = 0;
+  if (fan_target_state_ != FAN_OFF)
+    s->fan |= STATUS_FAN_TARGET;
+  if (FAN_ISRUNNING)
+    s->fan |= STATUS_FAN_RUNNING;
+  if (fanlamina_target_state_ != FAN_OFF)
+    s->fan |= STATUS_FANLAMINA_TARGET;
+  if (FANLAMINA_ISRUNNING)
+    s->fan |= STATUS_FANLAMINA_RUNNING;
+  s->errors = damper_error_flags_ | (pressuresig_fault_flags_ << 4);
+  s->uptime_s = millis() / 1000;
+  s->chaincast_clock = pjon_chaincast_clock_;
 }
 
-enum next_char_state_t {CCMD, CDEVID, CINSTALLEDDAMPERS, CPKTDST, CPKTLEN, CPKTDATA};
+enum next_char_state_t {CCMD, CDEVID, CINSTALLEDDAMPERS, CIDLESLEEP, CPKTDST, CPKTLEN, CPKTDATA, CFWBEGIN, CFWCHUNK};
+
+//parser state of handle_serialdata and handle_serial2pjon,
+//global so handle_serialdata_bulk can copy packet data without going through the parser char by char
+next_char_state_t serial_next_char_ = CCMD;
+next_char_state_t serial_pkt_next_char_ = CPKTDST;
+uint8_t serial_pkt_read_num_chars_ = 0;
+uint8_t serial_pkt_dst_ = 0;
+uint8_t serial_pkt_len_ = 0;
+uint8_t serial_pkt_buf_[0xff];
+//'U' and 'u' of the firmware update (see fwupdate.cpp) are collected here
+#if FWUPDATE_CHUNK_FRAME_LEN < 1 + 4 + FWUPDATE_HASH_LEN
+#error serial_fw_buf_ has to fit 'U' too
+#endif
+uint8_t serial_fw_buf_[FWUPDATE_CHUNK_FRAME_LEN]; //also fits 'U': to, size and sha256
+uint8_t serial_fw_len_ = 0;
+uint8_t serial_fw_cans_ = 0; //FWUPDATE_ABORT_CHAR in a row
 
 //handle chars from second serial interface, or from first after prompt
 next_char_state_t handle_serial2pjon(char c)
 {
-  static next_char_state_t next_char = CPKTDST;
-  static uint8_t read_num_chars = 0;
-  static uint8_t msg_dst = 0;
-  static uint8_t msg_len = 0;
-  static uint8_t msg_buf[0xff];
-
-  switch (next_char) {
+  switch (serial_pkt_next_char_) {
     default:
     case CCMD:
     case CPKTDST:
-      msg_dst = c;
-      next_char = CPKTLEN;
+      serial_pkt_dst_ = c;
+      serial_pkt_next_char_ = CPKTLEN;
     break;
     case CPKTLEN:
       if (c == 0) {
-        next_char = CPKTDST;
+        serial_pkt_next_char_ = CPKTDST;
         break;
       }
-      read_num_chars = c;
-      msg_len = 0;
-      next_char = CPKTDATA;
+      serial_pkt_read_num_chars_ = c;
+      serial_pkt_len_ = 0;
+      serial_pkt_next_char_ = CPKTDATA;
       break;
     case CPKTDATA:
-      msg_buf[msg_len++] = c;
-      read_num_chars--;
-      if (read_num_chars == 0)
+      serial_pkt_buf_[serial_pkt_len_++] = c;
+      serial_pkt_read_num_chars_--;
+      if (serial_pkt_read_num_chars_ == 0)
       {
-        pjon_inject_msg(msg_dst, msg_len, msg_buf);
-        next_char = CCMD; //CPKTDST;
+        pjon_inject_msg(serial_pkt_dst_, serial_pkt_len_, serial_pkt_buf_);
+        serial_pkt_next_char_ = CCMD; //CPKTDST;
       }
       break;
   }
-  return next_char;
+  return serial_pkt_next_char_;
 }
 
 //handle serial byte from first ttyACM
 void handle_serialdata(char c)
 {
-  static next_char_state_t next_char = CCMD;
-
-  switch (next_char) {
+  switch (serial_next_char_) {
     default:
     case CCMD:
+      if (fwupdate_is_sending())
+      {
+        serial_fw_cans_ = (c == FWUPDATE_ABORT_CHAR) ? serial_fw_cans_ + 1 : 0;
+        if (serial_fw_cans_ >= FWUPDATE_ABORT_LEN)
+          fwupdate_abort();
+        //a chunk that lost its 'u' must not turn into commands, '\n' still gets its answer
+        if (c != 'u' && c != '\n')
+          break;
+      }
       switch(c) {
-        case '>': next_char = CPKTDST; break; //inject PJON msg
-        case 'P': next_char = CDEVID; break; //set PJON ID
-        case 'I': next_char = CINSTALLEDDAMPERS; break; //set installed dampers
+        case '>': serial_next_char_ = CPKTDST; break; //inject PJON msg
+        case 'P': serial_next_char_ = CDEVID; break; //set PJON ID
+        case 'I': serial_next_char_ = CINSTALLEDDAMPERS; break; //set installed dampers
+        case 'Z': serial_next_char_ = CIDLESLEEP; break; //'Z1': light sleep while idle, 'Z0': stay awake
         case 'A': pjon_broadcast_get_autoid(); break;
-        case '1': pjon_send_dampercmd(dampercmd_t{{DAMPER_OPEN,DAMPER_CLOSED,DAMPER_CLOSED},FAN_ON}); break;
-        case '2': pjon_send_dampercmd(dampercmd_t{{DAMPER_CLOSED,DAMPER_OPEN,DAMPER_CLOSED},FAN_ON}); break;
-        case '3': pjon_send_dampercmd(dampercmd_t{{DAMPER_CLOSED,DAMPER_CLOSED,DAMPER_OPEN},FAN_ON}); break;
-        case '4': pjon_send_dampercmd(dampercmd_t{{DAMPER_OPEN,DAMPER_OPEN,DAMPER_CLOSED},FAN_ON}); break;
-        case '5': pjon_send_dampercmd(dampercmd_t{{DAMPER_OPEN,DAMPER_CLOSED,DAMPER_OPEN},FAN_ON}); break;
-        case '6': pjon_send_dampercmd(dampercmd_t{{DAMPER_CLOSED,DAMPER_OPEN,DAMPER_OPEN},FAN_ON}); break;
-        case '7': pjon_send_dampercmd(dampercmd_t{{DAMPER_OPEN,DAMPER_OPEN,DAMPER_OPEN},FAN_ON}); break;
-        case '0': pjon_send_dampercmd(dampercmd_t{{DAMPER_CLOSED,DAMPER_CLOSED,DAMPER_CLOSED},FAN_OFF}); break;
+        case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+          pjon_send_presetcmd(c - '0', 0); //see presets.cpp
+          break;
         case 'o':
           damper_target_states_[0] = damper_open_pos_[0];
           damper_target_states_[1] = damper_open_pos_[1];
           damper_target_states_[2] = damper_open_pos_[2];
           printf("opening Damper0..3\r\n");
+          capture_targets();
           break;
         case 'c':
           damper_target_states_[0] = 0;
           damper_target_states_[1] = 0;
           damper_target_states_[2] = 0;
           printf("closing Damper0..3\r\n");
+          capture_targets();
           break;
         case 'h':
           damper_target_states_[0] = damper_open_pos_[0]/2;
           damper_target_states_[1] = damper_open_pos_[1]/2;
           damper_target_states_[2] = damper_open_pos_[2]/2;
           printf("half-open Damper0..3\r\n");
+          capture_targets();
           break;
         case 'm': pjon_become_master_of_ids(); break;
         case 's': printSettings(); break;
+        case 'S': pjon_send_status(pjon_device_id_); break; //our own MSG_STATUS, printed like a received msg
+        case 'L': //our MSG_LINKSTATS of every peer, printed the same way
+        {
+          linkstatsrequest_t req = {pjon_device_id_, 0};
+          linkstats_handle_request(&req);
+          break;
+        }
+        case 'C': capture_toggle(); break; //record frames, endstops and outputs for ../hostsim/replay
+        case 'U': serial_fw_len_ = 0; serial_next_char_ = CFWBEGIN; break; //update another µC, see fwupdate.cpp
+        case 'u': serial_fw_len_ = 0; serial_next_char_ = CFWCHUNK; break; //image data for that update
         case '!': reset2bootloader(); break;
+        case '\n': printf(CONSOLE_AWAKE_LINE "\r\n"); break; //hosts wait for this before they send a frame, see task_idle_sleep
       }
     break;
     case CDEVID:
       pjon_change_deviceid(c - '0');
       printf("device id is now: %d\r\n", c - '0');
-      next_char = CCMD;
+      serial_next_char_ = CCMD;
     break;
     case CINSTALLEDDAMPERS:
       updateInstalledDampersFromChar(c - '0');
       printf("installed dampers updated\r\n");
-      next_char = CCMD;
+      serial_next_char_ = CCMD;
+    break;
+    case CIDLESLEEP:
+      idle_sleep_enabled_ = (c == '1');
+      saveSettings2EEPROM();
+      printf("idle sleep is now: %s\r\n", (idle_sleep_enabled_)?"on":"off");
+      serial_next_char_ = CCMD;
     break;
     case CPKTDST:
     case CPKTLEN:
     case CPKTDATA:
-      next_char = handle_serial2pjon(c); break;
+      serial_next_char_ = handle_serial2pjon(c); break;
+    case CFWBEGIN:
+      serial_fw_buf_[serial_fw_len_++] = c;
+      if (serial_fw_len_ == 1 + 4 + FWUPDATE_HASH_LEN)
+      {
+        uint32_t size;
+        memcpy(&size, serial_fw_buf_ + 1, 4);
+        fwupdate_start(serial_fw_buf_[0], size, serial_fw_buf_ + 5);
+        serial_next_char_ = CCMD;
+      }
+      break;
+    case CFWCHUNK:
+      serial_fw_buf_[serial_fw_len_++] = c;
+      if (serial_fw_buf_[0] != 2 + FWUPDATE_CHUNK_LEN)
+        handle_serial_fw_badchunk();
+      else if (serial_fw_len_ == FWUPDATE_CHUNK_FRAME_LEN)
+      {
+        uint32_t crc;
+        memcpy(&crc, serial_fw_buf_ + FWUPDATE_CHUNK_FRAME_LEN - 4, 4);
+        if (crc != fwupdate_crc32(serial_fw_buf_, FWUPDATE_CHUNK_FRAME_LEN - 4))
+        {
+          handle_serial_fw_badchunk();
+          break;
+        }
+        uint16_t index;
+        memcpy(&index, serial_fw_buf_ + 1, 2);
+        fwupdate_host_chunk(index, serial_fw_buf_ + 3);
+        serial_next_char_ = CCMD;
+      }
+      break;
   }
 }
 
+//A chunk frame with a wrong length or crc lost or garbled a byte and may hold the start of the next one:
+//look for a 'u' again right after the one that started it. While we send an update the console takes
+//nothing but chunks (see CCMD), so the rest never turns into commands. The bridge asks for the chunk again.
+void handle_serial_fw_badchunk()
+{
+  uint8_t len = serial_fw_len_;
+  uint8_t rescan[sizeof(serial_fw_buf_)];
+  memcpy(rescan, serial_fw_buf_, len);
+  serial_next_char_ = CCMD;
+  if (!fwupdate_is_sending())
+    return;
+  for (uint8_t i=0; i<len; i++)
+    handle_serialdata(rescan[i]);
+}
+
+
+//handle a chunk of serial bytes
+//the payload of an injected PJON msg is copied in one go, everything else goes through handle_serialdata
+void handle_serialdata_bulk(const uint8_t *buf, uint16_t len)
+{
+  while (len > 0)
+  {
+    //all but the last payload byte, that one goes through handle_serial2pjon to send the msg
+    if (serial_next_char_ == CPKTDATA && serial_pkt_read_num_chars_ > 1)
+    {
+      uint16_t n = serial_pkt_read_num_chars_ - 1;
+      if (n > len)
+        n = len;
+      memcpy(serial_pkt_buf_ + serial_pkt_len_, buf, n);
+      serial_pkt_len_ += n;
+      serial_pkt_read_num_chars_ -= n;
+      buf += n;
+      len -= n;
+      continue;
+    }
+    handle_serialdata(*buf);
+    buf++;
+    len--;
+  }
+}
+
+void usbserial_init()
+{
+  Serial.setRxBufferSize(SERIAL_RX_BUFFER_LEN);
+  Serial.begin(SERIAL_BAUD);
+}
+
+//read what the uart driver has buffered (its ISR fills the rx ring buffer)
+//but at most SERIAL_MAX_BYTES_PER_LOOP, so a host sending at full speed can not starve task_pjon
+void task_usbserial()
+{
+  uint8_t buf[SERIAL_MAX_BYTES_PER_LOOP];
+  if (idle_console_resync())
+    return;
+  int available = Serial.available();
+  if (available <= 0)
+    return;
+  size_t n = Serial.readBytes(buf, (available < SERIAL_MAX_BYTES_PER_LOOP) ? available : SERIAL_MAX_BYTES_PER_LOOP);
+  handle_serialdata_bulk(buf, n);
+  idle_note_activity();
+}
+
 
 /////////////// TASKS ////////////////////
 ////// repeatedly called from main ///////
@@ -350,6 +688,7 @@ void task_check_endstops()
       damper_endstop_reached_[d] = true;
     }
   }
+  capture_endstops();
 }
 
 //instead of calling task_check_endstops in an interrupt routine
@@ -372,6 +711,45 @@ void task_simulate_pinchange_interrupt()
     task_check_endstops();
 }
 
+#if ENDSTOP_PCNT
+//called by timer TIMER3_COMPA_vect before task_control_dampers, instead of task_check_endstops by the pinchange interrupt.
+//The PCNT units counted the falling endstop edges since the last tick, we only look at the counters.
+//An edge is taken as endstop only once the lightbeam has passed through the slot at ENDSTOP_PASS_TICKS ticks
+//in a row without another edge, so it did for a tick at least: the slot takes several ticks to pass by,
+//a flash of external light of some ms is gone by then. The glitch filter of the PCNT unit only takes out
+//pulses below 12.8us. Takes the endstop a tick later than the edge, but always so.
+void task_check_endstops_pcnt()
+{
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    int16_t count;
+    pcnt_get_counter_value((pcnt_unit_t) (PCNT_UNIT_0 + d), &count);
+    bool edge = count != endstop_pcnt_count_[d];
+    endstop_pcnt_count_[d] = count;
+    //ignore input if motor is not actually turning
+    if (!DAMPER_ISRUNNING(d))
+    {
+      endstop_pass_ticks_[d] = 0;
+      continue;
+    }
+    if (edge)
+      endstop_pass_ticks_[d] = 0;
+    else if (endstop_pass_ticks_[d] == 0)
+      continue;
+    if (ENDSTOP_ISHIGH(d))
+    {
+      endstop_pass_ticks_[d] = 0;
+      endstop_glitches_[d]++;
+      continue;
+    }
+    if (++endstop_pass_ticks_[d] < ENDSTOP_PASS_TICKS)
+      continue;
+    endstop_pass_ticks_[d] = 0;
+    damper_endstop_reached_[d] = true;
+  }
+}
+#endif
+
 //called by timer TIMER3_COMPA_vect
 //for each damper whose position != target_position:
 // - let motor move
@@ -381,6 +759,7 @@ void task_simulate_pinchange_interrupt()
 //self-synchronize position (which is guessed from time elapsed) each time we pass endstop
 void task_control_dampers()
 {
+  uint8_t run = 0;
   for (uint8_t d=0; d<NUM_DAMPER; d++)
   {
     if (!damper_installed_[d])
@@ -388,7 +767,11 @@ void task_control_dampers()
 
     //here we self-synchronize the position time counter
     if (did_damper_pass_endstop(d))
+    {
+      damper_resync_from_[d] = damper_states_[d];
       damper_states_[d] = 0;
+      damper_error_flags_ &= ~_BV(d);
+    }
 
     //send warning, since we timed out and that might mean the endstop does not work
     //(0x80 << sizeof(damper_states_[0]))-1 is the max-value of uint8_t aka 0xFF
@@ -398,16 +781,41 @@ void task_control_dampers()
     if (damper_states_[d] != damper_target_states_[d])
     {
       //move motor
-      DAMPER_MOTOR_RUN(d);
+      run |= _BV(d);
       //increment position time counter if we are moving
       damper_states_[d]++;
       // printf("Motor %d Run @%d\r\n", d, damper_states_[d]);
-    } else {
-      //stop motor
-      DAMPER_MOTOR_STOP(d);
-      // printf("Motor %d Stop @%d\r\n", d, damper_states_[d]);
     }
+    //else the motor stops
   }
+  damper_outputs_write(run);
+  capture_outputs();
+}
+
+//switch the damper motors: bit d of run set -> motor d runs
+//only pins that change get written, with at most one set and one clear register write
+//(all damper motors have to be on the same GPIO_OUT register as PIN_DAMPER_0)
+void damper_outputs_write(uint8_t run)
+{
+  uint8_t changed = run ^ damper_outputs_;
+  if (!changed)
+    return;
+  if (changed & run)
+    OUTPUT_SET(PIN_DAMPER_0, damper_pinmask_[changed & run]);
+  if (changed & ~run)
+    OUTPUT_CLEAR(PIN_DAMPER_0, damper_pinmask_[changed & ~run]);
+  damper_outputs_ = run;
+}
+
+void fan_output_write(bool on)
+{
+  if (on == fan_output_)
+    return;
+  if (on)
+    OUTPUT_CLEAR(PIN_FAN, OUTPUT_PINMASK(PIN_FAN));
+  else
+    OUTPUT_SET(PIN_FAN, OUTPUT_PINMASK(PIN_FAN));
+  fan_output_ = on;
 }
 
 //enable/disable the fan SSR
@@ -447,6 +855,84 @@ void task_control_fan()
   }
 }
 
+//save damper positions once all dampers stood still for DAMPER_PERSIST_STILL_MS
+//and mark them as untrustworthy as soon as one starts moving
+//also note the time it took after boot until all dampers were ready
+//Each save is an EEPROM.commit, a flash write that blocks the loop for some 40ms (see PJON_CHAINCAST_RTO_MIN_MS),
+//so moves that follow each other within DAMPER_PERSIST_STILL_MS share one DAMPERSTATE_MOVING and one settled save.
+//A reset before the settled save homes the dampers, as it would in the middle of a move.
+void task_persist_damper_states()
+{
+  if (!have_dampers_reached_target())
+  {
+    damper_still_ = false;
+    if (damper_persisted_marker_ != DAMPERSTATE_MOVING)
+    {
+      damper_persisted_marker_ = DAMPERSTATE_MOVING;
+      saveDamperStates2EEPROM(damper_persisted_marker_, damper_persisted_states_);
+    }
+    return;
+  }
+
+  if (boot_ready_ms_ == 0)
+  {
+    boot_ready_ms_ = millis() | 1; //never 0, that means not ready yet
+    printf("boot to ready: %lu ms\r\n", (unsigned long) boot_ready_ms_);
+  }
+  if (!damper_still_)
+  {
+    damper_still_ = true;
+    damper_still_since_ms_ = millis();
+  }
+
+  if (damper_persisted_marker_ == DAMPERSTATE_SETTLED && memcmp(damper_persisted_states_, damper_states_, NUM_DAMPER) == 0)
+    return;
+  if (damper_persisted_marker_ == DAMPERSTATE_MOVING && millis() - damper_still_since_ms_ < DAMPER_PERSIST_STILL_MS)
+    return;
+  damper_persisted_marker_ = DAMPERSTATE_SETTLED;
+  memcpy(damper_persisted_states_, damper_states_, NUM_DAMPER);
+  saveDamperStates2EEPROM(damper_persisted_marker_, damper_persisted_states_);
+}
+
+//queue a MSG_EVENT for every transition since the last call
+//the host then learns what actually happened, instead of only what it asked for
+void task_detect_events()
+{
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    if (damper_installed_[d])
+    {
+      bool reached = (damper_states_[d] == damper_target_states_[d]);
+      if (reached && !event_damper_reached_[d])
+        pjon_queue_event(EVENT_TARGET_REACHED, d, damper_target_states_[d]);
+      event_damper_reached_[d] = reached;
+
+      uint8_t resync_from = damper_resync_from_[d];
+      if (resync_from > 0)
+      {
+        damper_resync_from_[d] = 0;
+        if (resync_from >= EVENT_RESYNC_MIN_COUNT)
+          pjon_queue_event(EVENT_ENDSTOP_RESYNC, d, resync_from);
+      }
+    }
+
+    if (event_sensor_installed_[d] && !sensor_installed_[d])
+      pjon_queue_event(EVENT_SENSOR_LOST, d, 0);
+    event_sensor_installed_[d] = sensor_installed_[d];
+  }
+
+  if (FAN_ISRUNNING != event_fan_running_)
+  {
+    event_fan_running_ = FAN_ISRUNNING;
+    pjon_queue_event(EVENT_FAN, 0, event_fan_running_);
+  }
+  if (FANLAMINA_ISRUNNING != event_fanlamina_running_)
+  {
+    event_fanlamina_running_ = FANLAMINA_ISRUNNING;
+    pjon_queue_event(EVENT_FAN, 1, event_fanlamina_running_);
+  }
+}
+
 void task_check_damper_state_overflow()
 {
   for (uint8_t d=0; d<NUM_DAMPER; d++)
@@ -454,17 +940,108 @@ void task_check_damper_state_overflow()
     if (damper_state_overflowed_[d])
     {
       damper_state_overflowed_[d] = false;
+      damper_error_flags_ |= _BV(d);
       pjon_senderror_dampertimeout(d);
     }
   }
 }
 
 
+void idle_note_activity()
+{
+#if IDLE_SLEEP
+  idle_last_activity_ms_ = millis();
+#endif
+}
+
+//A uart wakeup loses the first bytes of whatever woke us. Had the host not waited for CONSOLE_AWAKE_LINE,
+//the rest of a '>' frame would turn into commands, so the console drops everything until the host
+//has been quiet for IDLE_CONSOLE_QUIET_MS, starts over with a new command and prints CONSOLE_AWAKE_LINE.
+//Returns true while it drops.
+bool idle_console_resync()
+{
+#if IDLE_SLEEP
+  if (!idle_console_resync_)
+    return false;
+  uint8_t buf[SERIAL_MAX_BYTES_PER_LOOP];
+  int available = Serial.available();
+  if (available > 0)
+  {
+    idle_console_dropped_ += Serial.readBytes(buf, (available < SERIAL_MAX_BYTES_PER_LOOP) ? available : SERIAL_MAX_BYTES_PER_LOOP);
+    idle_console_quiet_ms_ = millis();
+    idle_note_activity();
+    return true;
+  }
+  if (millis() - idle_console_quiet_ms_ < IDLE_CONSOLE_QUIET_MS)
+    return true;
+  idle_console_resync_ = false;
+  serial_next_char_ = CCMD;
+  serial_pkt_next_char_ = CPKTDST;
+  printf(CONSOLE_AWAKE_LINE "\r\n");
+#endif
+  return false;
+}
+
+//light sleep while nothing moves and nothing is pending on the bus or the console, for IDLE_SLEEP_MAX_MS at most,
+//and not while the next time sync beacon is due (timesync_sleep_ms). Only with idle_sleep_enabled_ ('Z1'):
+//the µC the host talks to stays awake, so its console never loses a byte.
+//We wake up when a frame starts on the PJON line, the frame that does it is lost, but the sender repeats it while we listen,
+//which costs the sender a retry per wakeup.
+//The console uart wakes us too, the bytes until we are awake are lost, see idle_console_resync: hosts send '\n' first
+//and wait for CONSOLE_AWAKE_LINE, which we print once the console is quiet after a uart wakeup and in answer to every '\n'.
+//The control tick does not run while we sleep, with all motors stopped it has nothing to do.
+void task_idle_sleep()
+{
+#if IDLE_SLEEP
+  if (idle_slept_)
+  {
+    idle_slept_ = false;
+    gpio_wakeup_disable((gpio_num_t) PIN_PJON_WAKE);
+    esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+    if (cause != ESP_SLEEP_WAKEUP_TIMER)
+      idle_note_activity();
+    if (cause == ESP_SLEEP_WAKEUP_UART)
+    {
+      idle_console_resync_ = true;
+      idle_console_quiet_ms_ = millis();
+    }
+  }
+  if (!idle_sleep_enabled_ || idle_console_resync_)
+    return;
+  if (damper_outputs_ || FAN_ISRUNNING || FANLAMINA_ISRUNNING || !have_dampers_reached_target())
+  {
+    idle_note_activity();
+    return;
+  }
+  if (!pjon_is_idle() || !fwupdate_is_idle() || !history_is_idle() || !linkstats_is_idle() || capture_enabled_ || Serial.available() > 0)
+    return;
+  if (millis() - idle_last_activity_ms_ < IDLE_AWAKE_MS)
+    return;
+  uint32_t sleep_ms = presets_sleep_ms(timesync_sleep_ms(IDLE_SLEEP_MAX_MS));
+  if (sleep_ms == 0)
+    return;
+  esp_sleep_enable_timer_wakeup((uint64_t) sleep_ms * 1000);
+  gpio_wakeup_enable((gpio_num_t) PIN_PJON_WAKE, PJON_WAKE_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+  uart_set_wakeup_threshold(UART_NUM_0, IDLE_UART_WAKE_THRESHOLD);
+  esp_sleep_enable_uart_wakeup(0);
+  Serial.flush(); //console output has to leave before the uart clock stops
+  idle_slept_ = true;
+  idle_sleeps_++;
+  esp_light_sleep_start();
+#endif
+}
+
 ///////////////// Interrupt Handlers ////////////////////
 
 ISR(TIMER3_COMPA_vect)
 {
   //called every TIME_TICK (aka 8ms)
+  //endstop levels are captured here too, with ENDSTOP_PCNT there is no pinchange interrupt
+  capture_endstops();
+#if ENDSTOP_PCNT
+  task_check_endstops_pcnt();
+#endif
   task_control_dampers();
   //set up "clock" comparator for next tick
   OCR3A = (OCR3A + TICK_TIME) & 0xFFFF;
@@ -474,67 +1051,76 @@ ISR(TIMER3_COMPA_vect)
 }
 
 //https://sites.google.com/site/qeewiki/books/avr-guide/external-interrupts-on-the-atmega328
+#if !ENDSTOP_PCNT
 ISR(PCINT0_vect)
 {
   task_check_endstops();
 }
+#endif
 
 
 ///////////////// MAIN ////////////////////
-int main()
+//setup() and loop() are called by the arduino framework
+//(and by the host simulator in ../hostsim, which steps loop() under a virtual clock)
+
+void setup()
 {
   MCUSR &= ~(1 << WDRF);
   wdt_disable();
 
   cpu_init();
   led_init();
-  usbio_init();
+  usbserial_init();
 
   // init
   loadSettingsFromEEPROM();
   pjon_init(); //PJON first since it calls arduino init which might do who knows what
   initPINs();
-  // initGuessPositionFromEndstop(); //does not work well, since we never really stop exactly at the endstop
+  initDamperStatesFromEEPROM();
   initSysClkTimer3();
   initPCInterrupt();
   sei();
   pressure_sensors_init();
+  history_init();
+  timesync_init();
+  presets_init();
+}
 
-  uint16_t loop_count = 0;
-
-  // loop
-  for (;;)
+void loop()
+{
+  task_usbserial();
+  if (millis() - pressure_checked_ms_ >= pressuresig_check_interval_ms(PRESSURE_CHECK_INTERVAL_MS))
   {
-    int16_t BytesReceived = usbio_bytes_received();
-    while(BytesReceived > 0)
-    {
-      int ReceivedByte = fgetc(stdin);
-      if(ReceivedByte != EOF)
-      {
-        handle_serialdata(ReceivedByte);
-      }
-      BytesReceived--;
-    }
-
-    usbio_task();
-    if ((loop_count & 0xFFF) == 0)
-      task_check_pressure();
-    if ((loop_count & 0xFFFF) == 0)
+    pressure_checked_ms_ = millis();
+    pressure_checked_us_ = micros();
+    task_check_pressure();
+    history_record();
+    pressuresig_check();
+  }
+  if (millis() - pressure_reported_ms_ >= PRESSURE_INFO_INTERVAL_MS)
+  {
+    pressure_reported_ms_ = millis();
+    for (uint8_t d=0; d<NUM_DAMPER; d++)
     {
-      for (uint8_t d=0; d<NUM_DAMPER; d++)
+      if (sensor_installed_[d])
       {
-        if (sensor_installed_[d])
-        {
-          pjon_send_pressure_infomsg(d, get_latest_pressure(d), get_latest_temperature(d));
-        }
+        pjon_send_pressure_infomsg(d, get_latest_pressure(d), get_latest_temperature(d), pressure_checked_us_);
       }
     }
-    task_pjon();
-    //task_control_dampers(); // called by timer in precise intervals, do not call from loop
-    //task_simulate_pinchange_interrupt();
-    task_control_fan();
-    task_check_damper_state_overflow();
-    loop_count++;
   }
+  task_pjon();
+  task_timesync();
+  task_fwupdate();
+  task_history();
+  task_linkstats();
+  task_presets();
+  //task_control_dampers(); // called by timer in precise intervals, do not call from loop
+  //task_simulate_pinchange_interrupt();
+  task_control_fan();
+  capture_outputs();
+  task_detect_events();
+  task_check_damper_state_overflow();
+  task_persist_damper_states();
+  task_capture();
+  task_idle_sleep();
 }
-
@@ -0,0 +1,142 @@
+/*
+ *  Damper Control Firmware - Presets
+ *
+ *  Resolves preset commands into damper and fan states on every µC.
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include "Arduino.h"
+#include "dampercontrol.h"
+
+///////// Presets ///////////////
+//Every µC keeps the same table of damper commands (in EEPROM), so a command that is used all the time
+//only has to be named: MSG_PRESETCMD is a chaincast of one byte, preset id and room.
+//Each µC looks the preset up on the way (preset_resolve) and handles it like the MSG_DAMPERCMD it stands for.
+//Should the room interlock keep one of its dampers open, that µC forwards a MSG_DAMPERCMD with what it did
+//instead (same origin and seq, so it still counts as the same command), see pjon_chaincast_recv_handler.
+//
+//MSG_PRESETSET chaincasts a new entry to all µC. A µC that missed it would resolve the preset differently,
+//so the host sends the table again after a µC rebooted or a chaincast failed.
+//Unused entries have PRESET_UNUSED in damper[0], a command naming one changes nothing.
+//
+//A preset with a duration ends with PRESET_OFF from the same room, sent by the µC that sent the preset,
+//unless it sent another damper command in the meantime. The console keys '0'..'7' send presets 0..7.
+
+preset_t preset_table_[PRESETS_NUM];
+
+//the preset that ends by itself
+bool preset_end_pending_ = false;
+uint32_t preset_end_ms_ = 0;
+uint8_t preset_end_room_ = 0;
+
+void presets_init()
+{
+  if (!loadPresetsFromEEPROM(preset_table_))
+    presets_fill_defaults(preset_table_);
+  preset_end_pending_ = false;
+}
+
+//fill cmd with what preset pcmd names, returns false if there is no such preset
+bool preset_resolve(presetcmd_t *pcmd, dampercmd_t *cmd)
+{
+  if (pcmd->preset >= PRESETS_NUM || preset_table_[pcmd->preset].damper[0] == PRESET_UNUSED)
+    return false;
+  preset_t *e = &preset_table_[pcmd->preset];
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+    cmd->damper[d] = e->damper[d];
+  cmd->fan = e->fan;
+  cmd->fanlamina = e->fanlamina;
+  cmd->room = pcmd->room;
+  return true;
+}
+
+void preset_handle_set(presetset_t *set)
+{
+  if (set->preset >= PRESETS_NUM)
+  {
+    printf("preset %d does not exist\r\n", set->preset);
+    return;
+  }
+  if (set->preset == PRESET_OFF)
+  {
+    printf("preset %d ends the presets with a duration, it can not be changed\r\n", set->preset);
+    return;
+  }
+  preset_t *e = &set->entry;
+  //fan and fanlamina are the lowest bits of the byte after the dampers, the rest has to be 0
+  bool valid = (((uint8_t*) e)[NUM_DAMPER] & ~(_BV(0)|_BV(1))) == 0;
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    if (e->damper[d] > DAMPER_HALFOPEN && !(d == 0 && e->damper[0] == PRESET_UNUSED))
+      valid = false;
+  }
+  if (!valid)
+  {
+    printf("preset %d: invalid damper or fan value, ignored\r\n", set->preset);
+    return;
+  }
+  preset_table_[set->preset] = set->entry;
+  savePresets2EEPROM(preset_table_);
+}
+
+//called by pjon_inject_msg for every damper command that starts here
+void preset_note_sent(pjon_message_t *msg)
+{
+  preset_end_pending_ = false;
+  if (msg->type != MSG_PRESETCMD)
+    return;
+  presetcmd_t *pcmd = &msg->chaincast.presetcmd;
+  if (pcmd->preset >= PRESETS_NUM || preset_table_[pcmd->preset].damper[0] == PRESET_UNUSED
+      || preset_table_[pcmd->preset].duration_s == 0)
+    return;
+  preset_end_pending_ = true;
+  preset_end_ms_ = millis() + (uint32_t) preset_table_[pcmd->preset].duration_s * 1000;
+  preset_end_room_ = pcmd->room;
+}
+
+void task_presets()
+{
+  if (!preset_end_pending_ || !pjon_time_reached(preset_end_ms_))
+    return;
+  printf("preset ended after its duration\r\n");
+  pjon_send_presetcmd(PRESET_OFF, preset_end_room_);
+}
+
+//how long task_idle_sleep may sleep without missing the end of a preset, max_ms at most
+uint32_t presets_sleep_ms(uint32_t max_ms)
+{
+  if (!preset_end_pending_)
+    return max_ms;
+  int32_t until_ms = (int32_t) (preset_end_ms_ - millis());
+  if (until_ms <= 0)
+    return 0;
+  return ((uint32_t) until_ms < max_ms) ? (uint32_t) until_ms : max_ms;
+}
+
+void presets_print_info()
+{
+  for (uint8_t p=0; p<PRESETS_NUM; p++)
+  {
+    preset_t *e = &preset_table_[p];
+    if (e->damper[0] == PRESET_UNUSED)
+      continue;
+    printf("Preset %d: dampers %d %d %d, fan %d, laminafan %d, duration %us\r\n", p,
+      e->damper[0], e->damper[1], e->damper[2], e->fan, e->fanlamina, e->duration_s);
+  }
+  if (preset_end_pending_)
+    printf("Preset ends in %ld ms\r\n", (long) (int32_t) (preset_end_ms_ - millis()));
+}
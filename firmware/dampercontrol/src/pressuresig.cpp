@@ -0,0 +1,235 @@
+/*
+ *  Damper Control Firmware - Pressure Signatures
+ *
+ *  Learns what the pressure sensor reads for every damper target and flags dampers that do not get there.
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include "Arduino.h"
+#include "dampercontrol.h"
+
+///////// Pressure Signatures ///////////////
+//A stuck damper is only noticed by the endstop timeout (task_check_damper_state_overflow), which takes seconds,
+//and never for a damper that got blocked while opening: the motor runs its count and the damper says it is open.
+//So every damper with a pressure sensor learns what its sensor reads with the fan running, as the difference
+//to the last steady reading while the ladder was quiet (told to keep the fan off), for each kind of target:
+//closed, half open and open.
+//
+//While the fan runs and a damper is at its target, its sensor is read every PRESSURESIG_CHECK_INTERVAL_MS.
+//Once the reading is steady, it is compared with the signatures: closest to its own kind is learned (moving average,
+//so signatures follow dirty filters), closest to another kind PRESSURESIG_CONFIRM times in a row is a fault:
+//MSG_ERROR DAMPER_PRESSURE_MISMATCH to the sensor destid and bit 4+d in the status errors, until a reading fits again.
+//A reading close to the fan-off baseline means the fan (maybe on another µC) does not push yet, that waits,
+//for PRESSURESIG_GIVEUP_MS at most, then no airflow is a fault as well.
+//Two kinds are only told apart if their signatures are PRESSURESIG_MIN_SEPARATION_PA apart, nothing is judged before
+//a kind has been learned once. The fan does not run while dampers move (task_control_fan), so a fault shows up
+//a few hundred ms after the fan started. Signatures are kept in RAM only and learned again after a reboot.
+
+#define PRESSURESIG_CHECK_INTERVAL_MS 50
+//after the fan started or the damper reached its target, before the first reading counts
+#define PRESSURESIG_SETTLE_MS 150
+//fan off and all dampers still for this long, before a reading counts as the fan-off baseline
+#define PRESSURESIG_QUIET_MS 1500
+//a reading is steady if it moved at most this much since the previous one
+#define PRESSURESIG_STEADY_PA 2.0f
+#define PRESSURESIG_MIN_SEPARATION_PA 10.0f
+#define PRESSURESIG_CONFIRM 3
+#define PRESSURESIG_GIVEUP_MS 3000
+//a baseline older than this may have drifted with the weather more than the fan moves the reading
+#define PRESSURESIG_BASELINE_MAX_MS 600000
+//a new reading counts 1/PRESSURESIG_LEARN_WEIGHT
+#define PRESSURESIG_LEARN_WEIGHT 4
+
+enum pressuresig_kind_t {PRESSURESIG_CLOSED, PRESSURESIG_HALFOPEN, PRESSURESIG_OPEN, PRESSURESIG_KINDS};
+static const char *pressuresig_kind_names_[PRESSURESIG_KINDS] = {"closed", "half open", "open"};
+
+float pressuresig_learned_[NUM_DAMPER][PRESSURESIG_KINDS];
+uint8_t pressuresig_runs_[NUM_DAMPER][PRESSURESIG_KINDS]; //how often learned, 0: not yet
+float pressuresig_baseline_[NUM_DAMPER];
+uint32_t pressuresig_baseline_ms_[NUM_DAMPER] = {0,0,0}; //0: none yet
+float pressuresig_last_[NUM_DAMPER];
+//millis() since when the fan runs and the damper is at its target, 0: not
+uint32_t pressuresig_since_ms_[NUM_DAMPER] = {0,0,0};
+//millis() since when the fan is off and nothing moves, 0: not
+uint32_t pressuresig_quiet_ms_ = 0;
+bool pressuresig_done_[NUM_DAMPER] = {false,false,false}; //judged or learned since then
+uint8_t pressuresig_mismatches_[NUM_DAMPER] = {0,0,0};
+//bit d: damper d does not look like its target
+uint8_t pressuresig_fault_flags_ = 0;
+uint16_t pressuresig_faults_ = 0;
+
+static uint8_t pressuresig_kind(uint8_t d)
+{
+  if (damper_target_states_[d] == 0)
+    return PRESSURESIG_CLOSED;
+  return (damper_target_states_[d] >= damper_open_pos_[d]) ? PRESSURESIG_OPEN : PRESSURESIG_HALFOPEN;
+}
+
+static void pressuresig_learn(uint8_t d, uint8_t kind, float delta)
+{
+  if (pressuresig_runs_[d][kind] == 0)
+    pressuresig_learned_[d][kind] = delta;
+  else
+    pressuresig_learned_[d][kind] += (delta - pressuresig_learned_[d][kind]) / PRESSURESIG_LEARN_WEIGHT;
+  if (pressuresig_runs_[d][kind] < 0xFF)
+    pressuresig_runs_[d][kind]++;
+  pressuresig_fault_flags_ &= ~_BV(d);
+  pressuresig_done_[d] = true;
+}
+
+static void pressuresig_fault(uint8_t d, uint8_t kind, int8_t looks_like, float delta)
+{
+  printf("damper %d: %.1f Pa with the fan on, should be %s (%.1f Pa), looks %s\r\n", d, (double) delta,
+    pressuresig_kind_names_[kind], (double) pressuresig_learned_[d][kind],
+    (looks_like < 0) ? "like no airflow" : pressuresig_kind_names_[looks_like]);
+  pressuresig_done_[d] = true;
+  if (pressuresig_fault_flags_ & _BV(d))
+    return; //told them already
+  pressuresig_fault_flags_ |= _BV(d);
+  pressuresig_faults_++;
+  pjon_senderror_pressuresig(d);
+}
+
+//delta: steady reading minus the fan-off baseline, giveup: the fan has been running for PRESSURESIG_GIVEUP_MS
+static void pressuresig_judge(uint8_t d, float delta, bool giveup)
+{
+  uint8_t kind = pressuresig_kind(d);
+  //closest learned signature, -1: the fan-off baseline
+  int8_t nearest = -1;
+  float nearest_pa = 0.0f;
+  for (uint8_t k=0; k<PRESSURESIG_KINDS; k++)
+  {
+    if (pressuresig_runs_[d][k] && fabsf(delta - pressuresig_learned_[d][k]) < fabsf(delta - nearest_pa))
+    {
+      nearest = k;
+      nearest_pa = pressuresig_learned_[d][k];
+    }
+  }
+  if (nearest == kind)
+  {
+    pressuresig_learn(d, kind, delta);
+    return;
+  }
+  if (pressuresig_runs_[d][kind] == 0)
+  {
+    //nothing to compare with yet, learn it unless it looks like something we know
+    if (fabsf(delta - nearest_pa) >= PRESSURESIG_MIN_SEPARATION_PA / 2)
+      pressuresig_learn(d, kind, delta);
+    else if (giveup)
+      pressuresig_done_[d] = true;
+    return;
+  }
+  if (fabsf(pressuresig_learned_[d][kind] - nearest_pa) < PRESSURESIG_MIN_SEPARATION_PA)
+  {
+    //the two look alike, so this is as good a fit as we can tell
+    pressuresig_learn(d, kind, delta);
+    return;
+  }
+  if (nearest < 0 && !giveup)
+    return; //the fan does not push yet
+  if (++pressuresig_mismatches_[d] >= PRESSURESIG_CONFIRM || giveup)
+    pressuresig_fault(d, kind, nearest, delta);
+}
+
+//after every pressure reading
+void pressuresig_check()
+{
+  uint32_t now = millis();
+  //the fan may be on another µC and run for another room's damper, only a ladder told to switch it off is quiet,
+  //once the fan had time to spin down and nothing moves any more
+  if (fan_target_state_ != FAN_OFF || FAN_ISRUNNING || !have_dampers_reached_target())
+    pressuresig_quiet_ms_ = 0;
+  else if (pressuresig_quiet_ms_ == 0)
+    pressuresig_quiet_ms_ = now | 1;
+  bool quiet = pressuresig_quiet_ms_ && now - pressuresig_quiet_ms_ >= PRESSURESIG_QUIET_MS;
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    if (!damper_installed_[d] || !sensor_installed_[d])
+    {
+      pressuresig_since_ms_[d] = 0;
+      continue;
+    }
+    float p = get_latest_pressure(d);
+    float last = pressuresig_last_[d];
+    pressuresig_last_[d] = p;
+    if (!FAN_ISRUNNING)
+    {
+      if (quiet && fabsf(p - last) <= PRESSURESIG_STEADY_PA)
+      {
+        pressuresig_baseline_[d] = p;
+        pressuresig_baseline_ms_[d] = now | 1;
+      }
+      pressuresig_since_ms_[d] = 0;
+      continue;
+    }
+    if (damper_states_[d] != damper_target_states_[d])
+    {
+      pressuresig_since_ms_[d] = 0;
+      continue;
+    }
+    if (pressuresig_since_ms_[d] == 0)
+    {
+      pressuresig_since_ms_[d] = now | 1;
+      pressuresig_done_[d] = false;
+      pressuresig_mismatches_[d] = 0;
+      continue;
+    }
+    uint32_t running_ms = now - pressuresig_since_ms_[d];
+    if (pressuresig_done_[d] || running_ms < PRESSURESIG_SETTLE_MS)
+      continue;
+    if (pressuresig_baseline_ms_[d] == 0 || now - pressuresig_baseline_ms_[d] > PRESSURESIG_BASELINE_MAX_MS)
+    {
+      pressuresig_done_[d] = true; //nothing to tell the fan's part from the weather
+      continue;
+    }
+    bool giveup = running_ms >= PRESSURESIG_GIVEUP_MS;
+    if (fabsf(p - last) > PRESSURESIG_STEADY_PA && !giveup)
+      continue; //the fan is still spinning up
+    pressuresig_judge(d, p - pressuresig_baseline_[d], giveup);
+  }
+}
+
+//how often the loop reads the sensors: faster while a damper waits for its verdict
+uint32_t pressuresig_check_interval_ms(uint32_t interval_ms)
+{
+  if (!FAN_ISRUNNING)
+    return interval_ms;
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+    if (damper_installed_[d] && sensor_installed_[d] && !pressuresig_done_[d])
+      return PRESSURESIG_CHECK_INTERVAL_MS;
+  return interval_ms;
+}
+
+void pressuresig_print_info()
+{
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    if (!damper_installed_[d] || !sensor_installed_[d])
+      continue;
+    printf("Damper%d pressure signature:", d);
+    for (uint8_t k=0; k<PRESSURESIG_KINDS; k++)
+    {
+      if (pressuresig_runs_[d][k])
+        printf(" %s %.1f Pa (%u runs)", pressuresig_kind_names_[k], (double) pressuresig_learned_[d][k], pressuresig_runs_[d][k]);
+      else
+        printf(" %s -", pressuresig_kind_names_[k]);
+    }
+    printf("%s\r\n", (pressuresig_fault_flags_ & _BV(d)) ? ", MISMATCH" : "");
+  }
+  printf("Pressure signature faults: %u\r\n", pressuresig_faults_);
+}
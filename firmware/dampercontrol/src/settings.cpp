@@ -21,9 +21,19 @@
 */
 
 #include <stdio.h>
+#include <EEPROM.h>
 #include "dampercontrol.h"
 
-#define EEPROM_DATA_VERSION 1
+#define EEPROM_DATA_VERSION 2
+#define EEPROM_SIZE 128
+//damper positions live behind the settings, so they can be written without touching the settings
+#define EEPROM_DAMPERSTATE_POS 16
+//options behind those, a version byte and idle_sleep_enabled_
+#define EEPROM_OPTIONS_POS 20
+#define EEPROM_OPTIONS_VERSION 1
+//the preset table behind those, a marker byte and PRESETS_NUM entries
+#define EEPROM_PRESETS_POS 24
+#define EEPROM_PRESETS_VERSION 1
 
 
 //read this from eeprom on start
@@ -48,42 +58,126 @@ uint8_t damper_open_pos_[NUM_DAMPER] = {80,80,80};
 uint8_t pjon_device_id_ = 255; //not assigned
 uint8_t pjon_sensor_destination_id_ = 0; //BROADCAST
 
+//site config this µC is on, see Site Config below
+uint16_t config_version_ = 0;
+uint32_t config_hash_ = CONFIG_HASH_ANY; //none, set by hand
+
+//light sleep while idle ('Z1'), off on the µC the host talks to: see task_idle_sleep
+bool idle_sleep_enabled_ = false;
 
 void saveSettings2EEPROM()
 {
-  // uint8_t *eeprom_pos=0;
-  // uint8_t damper_installed=0;
-
-  // eeprom_write_byte(eeprom_pos++, EEPROM_DATA_VERSION);
-  // eeprom_write_byte(eeprom_pos++, pjon_device_id_);
-  // eeprom_write_byte(eeprom_pos++, NUM_DAMPER);
-  // for (uint8_t d=0; d<NUM_DAMPER; d++)
-  // {
-  //   eeprom_write_byte(eeprom_pos++, damper_open_pos_[d]);
-  //   if (damper_installed_[d])
-  //     damper_installed |= _BV(d);
-  // }
-  // eeprom_write_byte(eeprom_pos++, damper_installed);
+  int eeprom_pos=0;
+
+  EEPROM.write(eeprom_pos++, EEPROM_DATA_VERSION);
+  EEPROM.write(eeprom_pos++, pjon_device_id_);
+  EEPROM.write(eeprom_pos++, NUM_DAMPER);
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    EEPROM.write(eeprom_pos++, damper_open_pos_[d]);
+  }
+  EEPROM.write(eeprom_pos++, getInstalledDampersAsBitfield());
+  EEPROM.write(eeprom_pos++, pjon_sensor_destination_id_);
+  EEPROM.write(eeprom_pos++, config_version_ & 0xFF);
+  EEPROM.write(eeprom_pos++, config_version_ >> 8);
+  for (uint8_t b=0; b<4; b++)
+  {
+    EEPROM.write(eeprom_pos++, (config_hash_ >> (8*b)) & 0xFF);
+  }
+  EEPROM.write(EEPROM_OPTIONS_POS, EEPROM_OPTIONS_VERSION);
+  EEPROM.write(EEPROM_OPTIONS_POS + 1, idle_sleep_enabled_);
+  EEPROM.commit();
 }
 
 void loadSettingsFromEEPROM()
 {
-  // uint8_t *eeprom_pos=0;
-
-  // if (eeprom_read_byte(eeprom_pos++) != EEPROM_DATA_VERSION)
-  //   return;
-  // pjon_device_id_ = eeprom_read_byte(eeprom_pos++);
-  // if (eeprom_read_byte(eeprom_pos++) != NUM_DAMPER)
-  //   return;
-  // for (uint8_t d=0; d<NUM_DAMPER; d++)
-  // {
-  //   damper_open_pos_[d] = eeprom_read_byte(eeprom_pos++);
-  // }
-  // uint8_t damper_installed = eeprom_read_byte(eeprom_pos++);
-  // for (uint8_t d=0; d<NUM_DAMPER; d++)
-  // {
-  //   damper_installed_[d] = 0 < (_BV(d) & damper_installed);
-  // }
+  int eeprom_pos=0;
+
+  EEPROM.begin(EEPROM_SIZE);
+  if (EEPROM.read(EEPROM_OPTIONS_POS) == EEPROM_OPTIONS_VERSION)
+    idle_sleep_enabled_ = EEPROM.read(EEPROM_OPTIONS_POS + 1) == 1;
+  //version 1 ends after the installed dampers, the rest keeps its defaults
+  uint8_t data_version = EEPROM.read(eeprom_pos++);
+  if (data_version != EEPROM_DATA_VERSION && data_version != 1)
+    return;
+  pjon_device_id_ = EEPROM.read(eeprom_pos++);
+  if (EEPROM.read(eeprom_pos++) != NUM_DAMPER)
+    return;
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    damper_open_pos_[d] = EEPROM.read(eeprom_pos++);
+  }
+  uint8_t damper_installed = EEPROM.read(eeprom_pos++);
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    damper_installed_[d] = 0 < (_BV(d) & damper_installed);
+  }
+  if (data_version < 2)
+    return;
+  pjon_sensor_destination_id_ = EEPROM.read(eeprom_pos++);
+  config_version_ = EEPROM.read(eeprom_pos++);
+  config_version_ |= EEPROM.read(eeprom_pos++) << 8;
+  config_hash_ = 0;
+  for (uint8_t b=0; b<4; b++)
+  {
+    config_hash_ |= (uint32_t) EEPROM.read(eeprom_pos++) << (8*b);
+  }
+}
+
+//persist damper positions together with a marker
+//DAMPERSTATE_SETTLED: all dampers stood still at the saved positions
+//DAMPERSTATE_MOVING: a damper started moving, the saved positions can not be trusted on next boot
+void saveDamperStates2EEPROM(uint8_t marker, uint8_t *states)
+{
+  int eeprom_pos=EEPROM_DAMPERSTATE_POS;
+
+  EEPROM.write(eeprom_pos++, marker);
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    EEPROM.write(eeprom_pos++, states[d]);
+  }
+  EEPROM.commit();
+}
+
+//returns saved marker and fills states, which need to be NUM_DAMPER long
+uint8_t loadDamperStatesFromEEPROM(uint8_t *states)
+{
+  int eeprom_pos=EEPROM_DAMPERSTATE_POS;
+
+  uint8_t marker = EEPROM.read(eeprom_pos++);
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    states[d] = EEPROM.read(eeprom_pos++);
+  }
+  return marker;
+}
+
+void savePresets2EEPROM(preset_t *table)
+{
+  int eeprom_pos=EEPROM_PRESETS_POS;
+
+  EEPROM.write(eeprom_pos++, EEPROM_PRESETS_VERSION);
+  for (uint8_t p=0; p<PRESETS_NUM; p++)
+  {
+    for (uint8_t b=0; b<sizeof(preset_t); b++)
+      EEPROM.write(eeprom_pos++, ((uint8_t*) &table[p])[b]);
+  }
+  EEPROM.commit();
+}
+
+//returns false and leaves table alone if no preset table was saved
+bool loadPresetsFromEEPROM(preset_t *table)
+{
+  int eeprom_pos=EEPROM_PRESETS_POS;
+
+  if (EEPROM.read(eeprom_pos++) != EEPROM_PRESETS_VERSION)
+    return false;
+  for (uint8_t p=0; p<PRESETS_NUM; p++)
+  {
+    for (uint8_t b=0; b<sizeof(preset_t); b++)
+      ((uint8_t*) &table[p])[b] = EEPROM.read(eeprom_pos++);
+  }
+  return true;
 }
 
 void updateSettingsFromPacket(updatesettings_t *s)
@@ -92,6 +186,7 @@ void updateSettingsFromPacket(updatesettings_t *s)
   {
     damper_open_pos_[d] =  s->damper_open_pos[d];
   }
+  config_hash_ = CONFIG_HASH_ANY; //no longer what the site config says
   saveSettings2EEPROM();
 }
 
@@ -101,6 +196,7 @@ void updateInstalledDampersFromChar(uint8_t damper_installed)
   {
     damper_installed_[d] = 0 < (_BV(d) & damper_installed);
   }
+  config_hash_ = CONFIG_HASH_ANY; //no longer what the site config says
   saveSettings2EEPROM();
 }
 
@@ -113,4 +209,79 @@ uint8_t getInstalledDampersAsBitfield()
       rv |= _BV(d);
   }
   return rv;
-}
\ No newline at end of file
+}
+
+///////// Site Config ///////////
+//The host keeps the settings of all µC in one site config. Every change of it gets a new version
+//and a new 32bit hash (whatever the host likes, but never CONFIG_HASH_ANY), and the host chaincasts
+//the difference to the previous version as MSG_CONFIGDELTA. Each µC takes the changes with its
+//pjon id, but only if it is on the site config the delta starts from (base_hash). A µC the delta
+//does not change moves on to the new version all the same, its settings are the same in both.
+//Every µC reports the version it ends up with (configreport_t) to the origin of the chaincast,
+//together with a hash of its own settings and presets (config_node_hash), not the hash of the site config:
+//the host computes the same from its site config and so also finds a µC whose settings changed without
+//a new version (lost EEPROM, a missed MSG_PRESETSET). Those, and the µC that missed a delta or were
+//changed by hand ('I', MSG_UPDATESETTINGS), get a delta with base_hash CONFIG_HASH_ANY that sets all their fields.
+
+void fillNodeConfig(nodeconfig_t *c)
+{
+  c->installed = getInstalledDampersAsBitfield();
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    c->damper_open_pos[d] = damper_open_pos_[d];
+  }
+  c->sensor_destination_id = pjon_sensor_destination_id_;
+}
+
+uint32_t getConfigNodeHash()
+{
+  nodeconfig_t c;
+  fillNodeConfig(&c);
+  return config_node_hash(&c, preset_table_);
+}
+
+//returns config_status_t
+uint8_t applyConfigDelta(uint8_t pjon_id, configdelta_t *delta)
+{
+  if (delta->base_hash != CONFIG_HASH_ANY && delta->hash == config_hash_ && delta->version == config_version_)
+    return CONFIG_UNCHANGED; //seen it before, a resync of a µC on this version sets its fields all the same
+  if (delta->count > CONFIGDELTA_MAX_CHANGES || delta->hash == CONFIG_HASH_ANY)
+    return CONFIG_INVALID;
+
+  nodeconfig_t c;
+  uint8_t num_changes = 0;
+  fillNodeConfig(&c);
+  for (uint8_t ii=0; ii<delta->count; ii++)
+  {
+    configchange_t *change = &delta->changes[ii];
+    if (change->pjon_id != pjon_id)
+      continue;
+    if (change->field >= sizeof(nodeconfig_t))
+      return CONFIG_INVALID;
+    ((uint8_t*) &c)[change->field] = change->value;
+    num_changes++;
+  }
+  if (delta->base_hash == CONFIG_HASH_ANY && num_changes == 0)
+    return CONFIG_UNCHANGED; //meant for other µC
+  if (delta->base_hash != CONFIG_HASH_ANY && delta->base_hash != config_hash_)
+    return CONFIG_BASE_MISMATCH;
+  if (c.installed >= _BV(NUM_DAMPER))
+    return CONFIG_INVALID;
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    //see damper_open_pos_ above
+    if (c.damper_open_pos[d] == 0 || c.damper_open_pos[d] >= 128)
+      return CONFIG_INVALID;
+  }
+
+  for (uint8_t d=0; d<NUM_DAMPER; d++)
+  {
+    damper_installed_[d] = 0 < (_BV(d) & c.installed);
+    damper_open_pos_[d] = c.damper_open_pos[d];
+  }
+  pjon_sensor_destination_id_ = c.sensor_destination_id;
+  config_version_ = delta->version;
+  config_hash_ = delta->hash;
+  saveSettings2EEPROM();
+  return CONFIG_APPLIED;
+}
@@ -0,0 +1,231 @@
+/*
+ *  Damper Control Firmware - Time Sync
+ *
+ *  Keeps a bus time on every µC from the beacons of PJON id 1.
+ *
+ *  Damper Control Firmware is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This firmware is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with these files. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "Arduino.h"
+#include "dampercontrol.h"
+
+///////// Time Sync ///////////////
+//Bus time is the micros() clock of the master (pjon id 1, the head of the chaincast).
+//Every TIMESYNC_INTERVAL_MS the master broadcasts a MSG_TIMESYNC beacon with pjon_broadcast_now, which returns
+//once the frame is on the wire. The master can't know that moment before it sends, so beacon seq carries
+//the bus time at which beacon seq-1 ended, and everybody else stamps micros() when a beacon arrives.
+//A pair (our stamp of beacon seq-1, its bus time from beacon seq) is one sample of the offset bus - local.
+//
+//Offset and drift are tracked by a small PI loop: a sample that does not match the prediction moves the
+//offset half way and the drift by a quarter of what the error suggests. The second sample after a start
+//gives the first drift estimate, which is taken as is. A sample that is off by more than
+//TIMESYNC_RESET_US (the master rebooted, or we had not heard from it for TIMESYNC_STALE_MS) starts over.
+//
+//MSG_PRESSUREINFO, MSG_ERROR and MSG_EVENT carry the bus time of the reading or of what happened,
+//0 while we are not synced. Idle sleep stays awake around the beacons we expect (timesync_sleep_ms),
+//the frame that wakes a sleeping node is lost. Without beacons to expect (just booted, or we missed
+//them for TIMESYNC_TRACK_MS) we stay awake for a whole interval every TIMESYNC_SEARCH_MS to find them.
+
+#define TIMESYNC_INTERVAL_MS 5000
+//stay awake this long before a beacon is due,
+#define TIMESYNC_GUARD_MS 20
+//and wait this long for one that is late (the bus was busy)
+#define TIMESYNC_LATE_MS 40
+#define TIMESYNC_TRACK_MS 20000
+#define TIMESYNC_SEARCH_MS 120000
+#define TIMESYNC_RESET_US 5000
+#define TIMESYNC_STALE_MS 300000
+#define TIMESYNC_OFFSET_GAIN 2
+#define TIMESYNC_DRIFT_GAIN 4
+
+//master
+uint8_t timesync_epoch_ = 0;
+uint8_t timesync_seq_ = 0;
+uint32_t timesync_prev_end_us_ = 0;
+uint32_t timesync_due_ms_ = 0;
+
+//everybody else
+volatile uint32_t timesync_rx_stamp_us_ = 0; //set by pjon_recv_handler
+bool timesync_heard_ = false;
+uint8_t timesync_rx_epoch_ = 0;
+uint8_t timesync_rx_seq_ = 0;
+uint32_t timesync_rx_us_ = 0; //our stamp of the last beacon
+uint32_t timesync_search_ms_ = 0; //the last time we started listening for beacons
+bool timesync_synced_ = false;
+bool timesync_have_drift_ = false;
+uint32_t timesync_ref_local_us_ = 0; //local time of the last sample
+int32_t timesync_ref_offset_us_ = 0; //bus - local at timesync_ref_local_us_
+int32_t timesync_drift_ppb_ = 0; //how much faster the bus clock runs than ours
+int32_t timesync_last_err_us_ = 0;
+uint32_t timesync_samples_ = 0;
+uint32_t timesync_resets_ = 0;
+
+static bool timesync_is_master()
+{
+  return pjon_device_id_ == TIMESYNC_MASTER_ID;
+}
+
+static int32_t timesync_offset_at(uint32_t local_us)
+{
+  int32_t dt = (int32_t) (local_us - timesync_ref_local_us_);
+  return timesync_ref_offset_us_ + (int32_t) ((int64_t) dt * timesync_drift_ppb_ / 1000000000LL);
+}
+
+static bool timesync_fresh(uint32_t local_us)
+{
+  return (uint32_t) (local_us - timesync_ref_local_us_) < (uint32_t) TIMESYNC_STALE_MS * 1000;
+}
+
+void timesync_init()
+{
+  timesync_epoch_ = random(1, 256);
+  timesync_seq_ = 0;
+  timesync_due_ms_ = millis();
+  timesync_heard_ = false;
+  timesync_search_ms_ = millis() - TIMESYNC_SEARCH_MS; //start listening right away
+  timesync_synced_ = false;
+  timesync_samples_ = 0;
+  timesync_resets_ = 0;
+}
+
+//called from pjon_recv_handler
+void timesync_note_rx()
+{
+  timesync_rx_stamp_us_ = micros();
+}
+
+static void timesync_sample(uint32_t local_us, uint32_t bus_us)
+{
+  int32_t measured = (int32_t) (bus_us - local_us);
+  timesync_samples_++;
+  if (timesync_synced_)
+  {
+    int32_t dt = (int32_t) (local_us - timesync_ref_local_us_);
+    int32_t predicted = timesync_offset_at(local_us);
+    int32_t err = measured - predicted;
+    timesync_last_err_us_ = err;
+    if (dt > 0 && abs(err) < TIMESYNC_RESET_US && timesync_fresh(local_us))
+    {
+      int32_t drift_err_ppb = (int32_t) ((int64_t) err * 1000000000LL / dt);
+      if (timesync_have_drift_)
+      {
+        timesync_drift_ppb_ += drift_err_ppb / TIMESYNC_DRIFT_GAIN;
+        timesync_ref_offset_us_ = predicted + err / TIMESYNC_OFFSET_GAIN;
+      } else {
+        timesync_drift_ppb_ += drift_err_ppb;
+        timesync_ref_offset_us_ = measured;
+        timesync_have_drift_ = true;
+      }
+      timesync_ref_local_us_ = local_us;
+      return;
+    }
+    timesync_resets_++;
+  }
+  timesync_ref_local_us_ = local_us;
+  timesync_ref_offset_us_ = measured;
+  timesync_drift_ppb_ = 0;
+  timesync_have_drift_ = false;
+  timesync_synced_ = true;
+}
+
+void timesync_handle_beacon(timesync_t *beacon)
+{
+  if (timesync_is_master())
+    return;
+  uint32_t rx_us = timesync_rx_stamp_us_;
+  //a lost beacon leaves us without the end time of the one before, we wait for the next pair
+  if (timesync_heard_ && beacon->epoch == timesync_rx_epoch_ && beacon->seq == (uint8_t) (timesync_rx_seq_ + 1))
+    timesync_sample(timesync_rx_us_, beacon->prev_end_us);
+  timesync_heard_ = true;
+  timesync_rx_epoch_ = beacon->epoch;
+  timesync_rx_seq_ = beacon->seq;
+  timesync_rx_us_ = rx_us;
+}
+
+void task_timesync()
+{
+  if (!timesync_is_master() || !pjon_time_reached(timesync_due_ms_))
+    return;
+  pjon_message_t msg;
+  msg.type = MSG_TIMESYNC;
+  msg.timesync.epoch = timesync_epoch_;
+  msg.timesync.seq = timesync_seq_;
+  msg.timesync.prev_end_us = timesync_prev_end_us_;
+  if (!pjon_broadcast_now(&msg))
+    return; //bus busy, try again next loop
+  timesync_prev_end_us_ = micros();
+  timesync_seq_++;
+  timesync_due_ms_ = millis() + TIMESYNC_INTERVAL_MS;
+}
+
+//bus time of our local micros() local_us, 0 if we don't know it
+uint32_t timesync_bus_us(uint32_t local_us)
+{
+  uint32_t bus_us;
+  if (timesync_is_master())
+    bus_us = local_us;
+  else if (timesync_synced_ && timesync_fresh(local_us))
+    bus_us = local_us + timesync_offset_at(local_us);
+  else
+    return 0;
+  return (bus_us == 0) ? 1 : bus_us;
+}
+
+//how long task_idle_sleep may sleep without missing a beacon, max_ms at most
+uint32_t timesync_sleep_ms(uint32_t max_ms)
+{
+  int32_t until_us;
+  if (timesync_is_master())
+  {
+    until_us = (int32_t) (timesync_due_ms_ - millis()) * 1000;
+  } else {
+    uint32_t now = micros();
+    if (timesync_heard_ && (uint32_t) (now - timesync_rx_us_) < (uint32_t) TIMESYNC_TRACK_MS * 1000)
+    {
+      uint32_t expect = timesync_rx_us_ + (uint32_t) TIMESYNC_INTERVAL_MS * 1000;
+      //missed some, the next one is due an interval after that
+      while ((int32_t) (now - (expect + (uint32_t) TIMESYNC_LATE_MS * 1000)) > 0)
+        expect += (uint32_t) TIMESYNC_INTERVAL_MS * 1000;
+      until_us = (int32_t) (expect - (uint32_t) TIMESYNC_GUARD_MS * 1000 - now);
+    } else {
+      uint32_t since = millis() - timesync_search_ms_;
+      if (since >= TIMESYNC_SEARCH_MS)
+      {
+        timesync_search_ms_ = millis();
+        since = 0;
+      }
+      if (since < TIMESYNC_INTERVAL_MS + TIMESYNC_LATE_MS)
+        return 0;
+      until_us = (int32_t) (TIMESYNC_SEARCH_MS - since) * 1000;
+    }
+  }
+  if (until_us <= 0)
+    return 0;
+  return ((uint32_t) until_us / 1000 < max_ms) ? (uint32_t) until_us / 1000 : max_ms;
+}
+
+void timesync_print_info()
+{
+  if (timesync_is_master())
+    printf("Time sync: master, epoch %u, next beacon %u\r\n", timesync_epoch_, timesync_seq_);
+  else if (!timesync_synced_)
+    printf("Time sync: not synced\r\n");
+  else
+    printf("Time sync: offset %ld us, drift %ld ppb, last error %ld us, %lu samples, %lu resets\r\n",
+      (long) timesync_offset_at(micros()), (long) timesync_drift_ppb_, (long) timesync_last_err_us_,
+      (unsigned long) timesync_samples_, (unsigned long) timesync_resets_);
+}
@@ -1,6 +1,9 @@
 package main
 
 import (
+  "bytes"
+  "encoding/binary"
+  "encoding/hex"
   "time"
 
   "github.com/btittelbach/pubsub"
@@ -9,16 +12,75 @@ import (
 type SerialLine []byte
 
 const (
+	damperteensy_wake               byte  = '\n' // wakes the µC from light sleep and is lost then, ignored otherwise
 	damperteensy_start_tx           byte  = '>'
 	damperteensy_pjonid_1           uint8 = 1
 	damperteensy_type_dampercmd     uint8 = 0
+	damperteensy_type_error         uint8 = 2
 	damperteensy_cmd_damperclosed   uint8 = 0
 	damperteensy_cmd_damperopen     uint8 = 1
 	damperteensy_cmd_damperhalfopen uint8 = 2
 	damperteensy_cmd_fanon          uint8 = 1
 	damperteensy_cmd_fanoff         uint8 = 0
+	damperteensy_cmd_room_shift     uint8 = 2 // the room goes into bits 2..4 of the fan byte
+	damperteensy_room_none          uint8 = 0 // any room can close what this opens
+	damperteensy_room_main          uint8 = 1 // the web interface
+	damperteensy_room_laser         uint8 = 2 // the touchscreen and laser card next to the cutter
+	damperteensy_type_statusrequest uint8 = 8
+	damperteensy_type_status        uint8 = 9
+	damperteensy_type_event         uint8 = 10
+	damperteensy_type_configreport  uint8 = 16
+	damperteensy_error_interlock    uint8 = 3 // INTERLOCK_REJECTED: another room opened the damper, it stays open
+	damperteensy_rx_msg             byte  = '<'
 )
 
+const (
+	damperteensy_awake      = "awake"                // the µC is up and reads the console, CONSOLE_AWAKE_LINE in firmware/dampercontrol/src/dampercontrol.h
+	damperteensy_wake_wait  = 20 * time.Millisecond  // bytes arriving until the µC is awake and its console was quiet for IDLE_CONSOLE_QUIET_MS are dropped, so wait for damperteensy_awake
+	damperteensy_wake_tries = 3                      // then the msg goes anyway
+	damperteensy_awake_for  = 400 * time.Millisecond // the µC does not sleep for IDLE_AWAKE_MS after console bytes
+)
+
+// binary snapshot of one µC, PJONID is the sender, see statusinfo_t in firmware/dampercontrol/src/dampercontrol.h
+type DamperTeensyStatus struct {
+	PJONID         uint8      `json:"pjonid"`
+	DamperPos      [3]uint8   `json:"damper_pos"`
+	DamperTarget   [3]uint8   `json:"damper_target"`
+	Installed      uint8      `json:"installed"`
+	Endstops       uint8      `json:"endstops"`
+	Fan            uint8      `json:"fan"`
+	Errors         uint8      `json:"errors"`
+	Pascal         [3]float32 `json:"pascal"`
+	UptimeS        uint32     `json:"uptime_s"`
+	ChaincastClock uint8      `json:"chaincast_clock"`
+}
+
+// state transition pushed by a µC, see eventinfo_t in firmware/dampercontrol/src/dampercontrol.h
+type DamperTeensyEvent struct {
+	PJONID  uint8  `json:"pjonid"`
+	Seq     uint8  `json:"seq"`
+	Event   uint8  `json:"event"`
+	Subject uint8  `json:"subject"`
+	Value   uint8  `json:"value"`
+	BusUs   uint32 `json:"bus_us"` // master clock when it happened, 0 if the µC was not synced
+}
+
+// see errorinfo_t in firmware/dampercontrol/src/dampercontrol.h, DamperID is 0..2 on the µC that sent it
+type DamperTeensyError struct {
+	DamperID  uint8
+	ErrorType uint8
+	BusUs     uint32
+}
+
+// answer of one µC to a site config delta, see configreport_t in firmware/dampercontrol/src/dampercontrol.h.
+// Hash is over the settings and presets the µC has now (config_node_hash), not the hash of the site config
+type DamperTeensyConfigReport struct {
+	PJONID  uint8  `json:"pjonid"`
+	Status  uint8  `json:"status"`
+	Version uint16 `json:"version"`
+	Hash    uint32 `json:"hash"`
+}
+
 var damperteensy_cmdmap map[string]uint8 = map[string]uint8{ws_damper_state_closed: damperteensy_cmd_damperclosed, ws_damper_state_open: damperteensy_cmd_damperopen, ws_damper_state_half: damperteensy_cmd_damperhalfopen, ws_fan_state_off: damperteensy_cmd_fanoff, ws_fan_state_on: damperteensy_cmd_fanon}
 
 func mkDamperCmdMsg(newstate wsChangeVent) []byte {
@@ -35,6 +97,10 @@ func mkDamperCmdMsg(newstate wsChangeVent) []byte {
 	i++
 	buf[i] = 0 //reach
 	i++
+	buf[i] = 0 //origin, 0 means the µC stamps it with its own id and seq
+	i++
+	buf[i] = 0 //seq
+	i++
 	buf[i], inmap = damperteensy_cmdmap[newstate.Damper1] //Damper[0]
 	if inmap == false {
 		return nil
@@ -54,11 +120,110 @@ func mkDamperCmdMsg(newstate wsChangeVent) []byte {
 	if inmap == false {
 		return nil
 	}
+	buf[i] |= newstate.Room << damperteensy_cmd_room_shift // the µC keeps what one room opened from being closed by another
 	i++
 	buf[insert_length_here] = byte(i - insert_length_here - 1)
 	return buf[0:i]
 }
 
+// ask pjonid for a MSG_STATUS, which the µC on our serial port will print for us
+func mkStatusRequestMsg(pjonid uint8) []byte {
+	return []byte{damperteensy_start_tx, pjonid, 2, damperteensy_type_statusrequest, damperteensy_pjonid_1}
+}
+
+// write msgs to the µC on our serial port, waking it up first unless it was awake moments ago:
+// damperteensy_wake, then wait for the damperteensy_awake line, which goChangeDampers passes on through awake_c
+func goWriteToTeensy(msgs_c <-chan SerialLine, awake_c <-chan time.Time, teensytty_wr chan<- SerialLine) {
+	var last_awake time.Time
+	for msg := range msgs_c {
+		for try := 0; time.Since(last_awake) >= damperteensy_awake_for && try < damperteensy_wake_tries; try++ {
+			teensytty_wr <- SerialLine{damperteensy_wake}
+			select {
+			case last_awake = <-awake_c: // may be an old one, then we try again
+			case <-time.After(damperteensy_wake_wait):
+			}
+		}
+		teensytty_wr <- msg
+		last_awake = time.Now()
+	}
+}
+
+// decode a "<" line, which the µC prints for every msg it received: <IDLENPAYLOAD in hex
+func decodePJONLine(line SerialLine) (id uint8, payload []byte, ok bool) {
+	if len(line) < 5 || line[0] != damperteensy_rx_msg {
+		return 0, nil, false
+	}
+	raw, err := hex.DecodeString(string(line[1:]))
+	if err != nil || len(raw) < 2 || int(raw[1]) != len(raw)-2 {
+		return 0, nil, false
+	}
+	return raw[0], raw[2:], true
+}
+
+// returns nil if line is not a MSG_STATUS
+func decodeStatusLine(line SerialLine) *DamperTeensyStatus {
+	_, payload, ok := decodePJONLine(line)
+	if !ok || len(payload) < 1 || payload[0] != damperteensy_type_status {
+		return nil
+	}
+	var status DamperTeensyStatus
+	if binary.Size(status) != len(payload)-1 {
+		return nil
+	}
+	if err := binary.Read(bytes.NewReader(payload[1:]), binary.LittleEndian, &status); err != nil {
+		return nil
+	}
+	return &status
+}
+
+// returns nil if line is not a MSG_EVENT
+func decodeEventLine(line SerialLine) *DamperTeensyEvent {
+	_, payload, ok := decodePJONLine(line)
+	if !ok || len(payload) != 10 || payload[0] != damperteensy_type_event {
+		return nil
+	}
+	return &DamperTeensyEvent{PJONID: payload[1], Seq: payload[2], Event: payload[3], Subject: payload[4], Value: payload[5],
+		BusUs: binary.LittleEndian.Uint32(payload[6:10])}
+}
+
+// returns nil if line is not a MSG_ERROR
+func decodeErrorLine(line SerialLine) *DamperTeensyError {
+	_, payload, ok := decodePJONLine(line)
+	if !ok || len(payload) != 7 || payload[0] != damperteensy_type_error {
+		return nil
+	}
+	return &DamperTeensyError{DamperID: payload[1], ErrorType: payload[2], BusUs: binary.LittleEndian.Uint32(payload[3:7])}
+}
+
+// the field of s that holds damper d as the µC number them, nil if there is none
+func ventDamperState(s *wsChangeVent, d uint8) *string {
+	switch d {
+	case 0:
+		return &s.Damper1
+	case 1:
+		return &s.Damper2
+	case 2:
+		return &s.Damper3
+	}
+	return nil
+}
+
+// returns nil if line is not a MSG_CONFIGREPORT
+func decodeConfigReportLine(line SerialLine) *DamperTeensyConfigReport {
+	_, payload, ok := decodePJONLine(line)
+	if !ok || len(payload) < 1 || payload[0] != damperteensy_type_configreport {
+		return nil
+	}
+	var report DamperTeensyConfigReport
+	if binary.Size(report) != len(payload)-1 {
+		return nil
+	}
+	if err := binary.Read(bytes.NewReader(payload[1:]), binary.LittleEndian, &report); err != nil {
+		return nil
+	}
+	return &report
+}
+
 //TODO: decode and handle error msg if damper did not reach endstop in time
 //      --> repeat cmd for that damper
 
@@ -68,16 +233,30 @@ func didVentPositionChange(a, b wsChangeVent) bool {
 	return a.Damper1 != b.Damper1 || a.Damper2 != b.Damper2 || a.Damper3 != b.Damper3
 }
 
-func goChangeDampers(ps *pubsub.PubSub, min_cmd_send_interval time.Duration) {
+func goChangeDampers(ps *pubsub.PubSub, min_cmd_send_interval time.Duration, status_poll_interval time.Duration, num_uc uint8) {
 	newstate_c := ps.Sub(PS_DAMPERSCHANGED)
 	shutdown_c := ps.SubOnce("shutdown")
 	defer ps.Unsub(newstate_c, PS_DAMPERSCHANGED)
-	teensytty_wr, teensytty_rd, teensytty_err := OpenAndHandleSerial(TeensyTTY_, 9600)
+	teensytty_wr, teensytty_rd, teensytty_err := OpenAndHandleSerial(TeensyTTY_, TeensyTTYBaud_)
 	if teensytty_err != nil {
 		panic(teensytty_err)
 	}
+	towrite_c := make(chan SerialLine, 8)
+	defer close(towrite_c)
+	awake_c := make(chan time.Time, 1)
+	go goWriteToTeensy(towrite_c, awake_c, teensytty_wr)
 	var last_cmd_time time.Time
 	var last_state wsChangeVent
+	// the state before last_state, a damper keeps it if a µC rejects closing it
+	var prev_state wsChangeVent
+	var statuspoll_c <-chan time.Time // nil and thus never ready if polling is disabled
+	if status_poll_interval > 0 && num_uc > 0 {
+		statuspoll := time.NewTicker(status_poll_interval)
+		defer statuspoll.Stop()
+		statuspoll_c = statuspoll.C
+	}
+	var statuspoll_next uint8 = 0
+	last_event_seq := make(map[uint8]uint8)
 
 	for {
 		select {
@@ -89,6 +268,7 @@ func goChangeDampers(ps *pubsub.PubSub, min_cmd_send_interval time.Duration) {
 			if newstate.(wsChangeVent) == last_state {
 				continue
 			}
+			prev_state = last_state
 			last_state = newstate.(wsChangeVent)
 			cmdbytes := mkDamperCmdMsg(last_state)
 			if cmdbytes != nil && len(cmdbytes) > 0 {
@@ -97,10 +277,54 @@ func goChangeDampers(ps *pubsub.PubSub, min_cmd_send_interval time.Duration) {
 					time.Sleep(min_cmd_send_interval - time.Now().Sub(last_cmd_time))
 				}
 				LogVent_.Print("goChangeDampers", "ToPJON:", cmdbytes)
-				teensytty_wr <- cmdbytes
+				towrite_c <- cmdbytes
 				last_cmd_time = time.Now()
 			}
+		case <-statuspoll_c:
+			// one µC per tick, so polling never takes up the bus for long
+			towrite_c <- mkStatusRequestMsg(damperteensy_pjonid_1 + statuspoll_next)
+			statuspoll_next = (statuspoll_next + 1) % num_uc
 		case line := <-teensytty_rd:
+			if string(line) == damperteensy_awake {
+				select {
+				case awake_c <- time.Now():
+				default:
+				}
+				continue
+			}
+			if status := decodeStatusLine(line); status != nil {
+				LogVent_.Print("goChangeDampers", "Status:", *status)
+				ps.Pub(*status, PS_DAMPERSTATUS)
+				continue
+			}
+			if event := decodeEventLine(line); event != nil {
+				LogVent_.Print("goChangeDampers", "Event:", *event)
+				ps.Pub(*event, PS_DAMPEREVENT)
+				// we missed something, ask for the full picture
+				if last_seq, known := last_event_seq[event.PJONID]; known && event.Seq != last_seq+1 {
+					towrite_c <- mkStatusRequestMsg(event.PJONID)
+				}
+				last_event_seq[event.PJONID] = event.Seq
+				continue
+			}
+			if errinfo := decodeErrorLine(line); errinfo != nil {
+				LogVent_.Print("goChangeDampers", "Error:", *errinfo)
+				// the damper kept its target and the fan stays on, see Room Interlock in firmware/dampercontrol/src/main.cpp
+				if damper := ventDamperState(&last_state, errinfo.DamperID); errinfo.ErrorType == damperteensy_error_interlock && damper != nil {
+					*damper = *ventDamperState(&prev_state, errinfo.DamperID)
+					if *damper == ws_damper_state_closed {
+						*damper = ws_damper_state_open
+					}
+					last_state.Fan = ws_fan_state_on
+					ps.Pub(last_state, PS_DAMPERREJECTED)
+				}
+				continue
+			}
+			if report := decodeConfigReportLine(line); report != nil {
+				LogVent_.Print("goChangeDampers", "ConfigReport:", *report)
+				ps.Pub(*report, PS_DAMPERCONFIGREPORT)
+				continue
+			}
 			LogVent_.Print("goChangeDampers", "FromPJON:", line)
 		}
 	}
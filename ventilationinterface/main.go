@@ -24,17 +24,24 @@ const (
 	PS_GETSTATEFORNEWCLIENT = "initalbytes"
 	PS_JSONTOALL            = "jsontoall"
 	PS_SHUTDOWN             = "shutdown"
+	PS_DAMPERSTATUS         = "damperstatus"
+	PS_DAMPEREVENT          = "damperevent"
+	PS_DAMPERCONFIGREPORT   = "damperconfigreport"
+	PS_DAMPERREJECTED       = "damperrejected" // what the dampers really do after a µC rejected part of a command
 )
 
 var (
 	LocalAuthToken_               string
 	DebugFlags_                   string
 	TeensyTTY_                    string
+	TeensyTTYBaud_                uint
 	MinVentChangeInterval_        time.Duration
 	MQTTBroker_                   string
 	MQTTClientID_                 string
 	LockTimeout_                  time.Duration
 	OffAfterEverybodyLeftTimeout_ time.Duration
+	StatusPollInterval_           time.Duration
+	NumMicroControllers_          uint
 )
 
 func init() {
@@ -44,13 +51,21 @@ func init() {
 	flag.StringVar(&LocalAuthToken_, "localtoken", "", "Token provided by website so we know its from the local touch display")
 	flag.StringVar(&DebugFlags_, "debug", "", "List of debug flags separated by , or ALL")
 	flag.StringVar(&TeensyTTY_, "tty", "/dev/ttyACM0", "µC serial device")
+	flag.UintVar(&TeensyTTYBaud_, "ttybaud", 921600, "µC serial baudrate, see SERIAL_BAUD in firmware/dampercontrol/src/dampercontrol.h")
 	flag.DurationVar(&MinVentChangeInterval_, "mininterval", 1500*time.Millisecond, "Min Invervall between sending cmds to µC")
 	flag.DurationVar(&LockTimeout_, "locktimeout", 30*time.Minute, "Timeout for OLGA/Lasercutter Lock")
 	flag.DurationVar(&OffAfterEverybodyLeftTimeout_, "autoofftimeout", 2*time.Minute, "Timeout for automatic Off after everybody left")
+	flag.DurationVar(&StatusPollInterval_, "statuspoll", 0, "Interval for polling MSG_STATUS from one µC after the other, 0 disables polling")
+	flag.UintVar(&NumMicroControllers_, "numuc", 2, "Number of µC on the PJON bus, with ids 1..numuc")
 }
 
 func main() {
 	flag.Parse()
+	// µC ids are uint8 and the status poll goes round them modulo numuc
+	if NumMicroControllers_ < 1 || NumMicroControllers_ > 255 {
+		fmt.Fprintln(os.Stderr, "-numuc must be between 1 and 255")
+		os.Exit(2)
+	}
 	if len(DebugFlags_) > 0 {
 		LogEnable(strings.Split(DebugFlags_, ",")...)
 	}
@@ -68,7 +83,7 @@ func MainThatReallyIsTheRealMain() {
 
 	go RunMartini(ps)
 	go goSanityCheckDamperRequests(ps, LockTimeout_)
-	go goChangeDampers(ps, MinVentChangeInterval_)
+	go goChangeDampers(ps, MinVentChangeInterval_, StatusPollInterval_, uint8(NumMicroControllers_))
 	go goConnectToMQTTBrokerAndFunctionWithoutInTheMeantime(ps)
 
 	// wait on Ctrl-C or sigInt or sigKill
@@ -32,6 +32,10 @@ func openTTY(name string, speed uint) (port *sio.Port, err error) {
 		port, err = sio.Open(name, syscall.B115200)
 	case 230400:
 		port, err = sio.Open(name, syscall.B230400)
+	case 460800:
+		port, err = sio.Open(name, syscall.B460800)
+	case 921600:
+		port, err = sio.Open(name, syscall.B921600)
 	default:
 		err = errors.New("Unsupported Baudrate, use 0 to disable setting a baudrate")
 	}
@@ -85,6 +85,8 @@ func goSanityCheckDamperRequests(ps *pubsub.PubSub, locktimeout time.Duration) {
 	newreq_c := ps.Sub(PS_DAMPERREQUEST)
 	shutdown_c := ps.SubOnce("shutdown")
 	defer ps.Unsub(newreq_c, PS_DAMPERREQUEST)
+	rejected_c := ps.Sub(PS_DAMPERREJECTED)
+	defer ps.Unsub(rejected_c, PS_DAMPERREJECTED)
 	var last_state wsChangeVent = wsChangeVent{Damper1: ws_damper_state_closed, Damper2: ws_damper_state_closed, Damper3: ws_damper_state_closed, Fan: ws_fan_state_off}
 	var OLGALock bool = false
 	var LaserLock bool = false
@@ -126,6 +128,14 @@ func goSanityCheckDamperRequests(ps *pubsub.PubSub, locktimeout time.Duration) {
 			LaserLock = false
 			OLGALock = false
 			publishDamperUpdate()
+		case rejected_i := <-rejected_c:
+			// the room interlock kept a damper open, tell everyone instead of what we asked for
+			rejected := rejected_i.(wsChangeVent)
+			last_state.Damper1 = rejected.Damper1
+			last_state.Damper2 = rejected.Damper2
+			last_state.Damper3 = rejected.Damper3
+			last_state.Fan = rejected.Fan
+			publishDamperUpdate()
 		case newreq_i := <-newreq_c:
 			var wserr *wsError = nil
 			newreq := newreq_i.(DamperRequest)
@@ -134,6 +144,10 @@ func goSanityCheckDamperRequests(ps *pubsub.PubSub, locktimeout time.Duration) {
 			case wsChangeVent:
 				wserr = sanityCheckVentilationStateChange(&last_state, &statereq, newreq.islocal, LaserLock, OLGALock)
 				if wserr == nil {
+					statereq.Room = damperteensy_room_main
+					if newreq.islocal {
+						statereq.Room = damperteensy_room_laser
+					}
 					last_state = statereq
 					publishDamperUpdate()
 				} else {
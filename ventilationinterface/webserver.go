@@ -17,6 +17,9 @@ const (
 	ws_ctx_error           = "error"
 	ws_ctx_lock_laser      = "locklaser"
 	ws_ctx_lock_olga       = "lockolga"
+	ws_ctx_damperevent     = "damperevent"      //pushed by the µC once a damper or fan actually changed
+	ws_ctx_damperstatus    = "damperstatus"     //snapshot of one µC, answer to a status poll
+	ws_ctx_configreport    = "configreport"     //version and settings hash of one µC after a site config delta
 	ws_error_none          = "none"             //info msg only not an error
 	ws_error_prohibited    = "prohibited"       //requested dangerous or generally prohibited state
 	ws_error_notauth       = "notauthenticated" //state that can only be activated with local auth token
@@ -63,6 +66,7 @@ type wsChangeVent struct {
 	Fan       string
 	OLGALock  bool
 	LaserLock bool
+	Room      uint8 `json:"-"` // where the change came from, see damperteensy_room_*
 }
 
 const (
@@ -91,6 +95,12 @@ func goMarshalJsonForAllClients(ps *pubsub.PubSub) {
 	defer ps.Unsub(udpate_c, PS_DAMPERSCHANGED)
 	init_c := ps.Sub(PS_GETSTATEFORNEWCLIENT)
 	defer ps.Unsub(init_c, PS_GETSTATEFORNEWCLIENT)
+	event_c := ps.Sub(PS_DAMPEREVENT)
+	defer ps.Unsub(event_c, PS_DAMPEREVENT)
+	status_c := ps.Sub(PS_DAMPERSTATUS)
+	defer ps.Unsub(status_c, PS_DAMPERSTATUS)
+	configreport_c := ps.Sub(PS_DAMPERCONFIGREPORT)
+	defer ps.Unsub(configreport_c, PS_DAMPERCONFIGREPORT)
 	var initial_info []byte = []byte("{\"ctx\":\"" + ws_ctx_ventchange + "\",\"data\":{}}")
 	for {
 		select {
@@ -106,6 +116,27 @@ func goMarshalJsonForAllClients(ps *pubsub.PubSub) {
 			}
 			initial_info = replydata
 			ps.Pub(replydata, PS_JSONTOALL)
+		case event := <-event_c:
+			replydata, err := json.Marshal(wsMessageOut{Ctx: ws_ctx_damperevent, Data: event})
+			if err != nil {
+				LogWS_.Print(err)
+				continue
+			}
+			ps.Pub(replydata, PS_JSONTOALL)
+		case status := <-status_c:
+			replydata, err := json.Marshal(wsMessageOut{Ctx: ws_ctx_damperstatus, Data: status})
+			if err != nil {
+				LogWS_.Print(err)
+				continue
+			}
+			ps.Pub(replydata, PS_JSONTOALL)
+		case report := <-configreport_c:
+			replydata, err := json.Marshal(wsMessageOut{Ctx: ws_ctx_configreport, Data: report})
+			if err != nil {
+				LogWS_.Print(err)
+				continue
+			}
+			ps.Pub(replydata, PS_JSONTOALL)
 		}
 	}
 }